@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+#
+# As-of read latency against long version chains.
+#
+# Builds an update chain of LENGTH versions for each variant (see setup.sql),
+# then times electric_exec_as_of() point lookups and full scans at snapshots
+# 0%, 1%, 10%, 50%, 90% and 100% of the way down the chain. One JSON line per
+# (variant, depth, query) is appended to OUT:
+#
+#   {"variant":"hot","length":10000,"depth":5000,"query":"lookup",
+#    "mean_ms":0.41,"p50_ms":0.39,"p90_ms":0.45,"p99_ms":0.70,
+#    "heap_pages":63,"tuples_examined":5001,"hot_hops":4987,"correct":true,
+#    "commit":"abc1234","server_version":"16.4"}
+#
+# While the chains are built and read, a session holding an xid keeps the
+# horizon back, so neither pruning nor VACUUM removes the old versions.
+# Needs a superuser (electric.track_scans). Connection settings come from the
+# usual PG* environment variables.
+#
+#   LENGTH      10000
+#   VARIANTS    hot samekey newkey
+#   ITERATIONS  200          (timed calls per depth and query)
+#   OUT         bench/results/chains.jsonl
+
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+LENGTH=${LENGTH:-10000}
+VARIANTS=${VARIANTS:-"hot samekey newkey"}
+ITERATIONS=${ITERATIONS:-200}
+OUT=${OUT:-"$here/../results/chains.jsonl"}
+
+commit=$(git -C "$here" rev-parse --short HEAD 2>/dev/null || echo unknown)
+server_version=$(psql -XAtc 'SHOW server_version')
+pin_app=electric_chain_pin
+
+unpin() {
+    psql -XAtqc "SELECT pg_terminate_backend(pid) FROM pg_stat_activity
+                 WHERE application_name = '$pin_app'" >/dev/null
+}
+trap unpin EXIT
+
+mkdir -p "$(dirname "$OUT")"
+psql -X -q -v ON_ERROR_STOP=1 -f "$here/setup.sql"
+
+# Hold the horizon: an open transaction with an xid, older than every version
+PGAPPNAME=$pin_app psql -XAtqc 'SELECT pg_current_xact_id(), pg_sleep(86400)' >/dev/null 2>&1 &
+until [ "$(psql -XAtc "SELECT count(*) FROM pg_stat_activity
+                       WHERE application_name = '$pin_app' AND backend_xid IS NOT NULL")" = 1 ]; do
+    sleep 0.1
+done
+
+for variant in $VARIANTS; do
+    echo "Building $variant chain of $LENGTH versions..." >&2
+    PGOPTIONS='-c synchronous_commit=off' \
+        psql -X -q -v ON_ERROR_STOP=1 -c "CALL electric_chain_build('$variant', $LENGTH)"
+
+    echo "Measuring $variant..." >&2
+    psql -XAt -v ON_ERROR_STOP=1 -c "
+        SELECT (jsonb_build_object('variant', '$variant', 'length', $LENGTH)
+                || to_jsonb(m)
+                || jsonb_build_object('commit', '$commit', 'server_version', '$server_version'))::text
+        FROM electric_chain_measure('$variant', $ITERATIONS) m" | tee -a "$OUT"
+done
+
+echo "Results appended to $OUT" >&2
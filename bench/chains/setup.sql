@@ -0,0 +1,144 @@
+-- Version-chain benchmark schema for bench/chains/run.sh
+--
+-- Each variant is a table whose row id = 1 is updated over and over, next to
+-- 1000 rows that never change. Snapshots taken at chosen depths of the chain
+-- are kept in electric_chain_snapshots, so as-of reads can be timed against
+-- versions near the head and deep down the chain.
+--
+--   hot      only the unindexed counter n changes and pages have room, so
+--            versions stay HOT until the page fills up
+--   samekey  the same update, but a row fills a page: every version moves
+--            to another page (non-HOT, index keys unchanged)
+--   newkey   the update also changes the indexed column k (non-HOT, new
+--            index entries every time)
+
+CREATE EXTENSION IF NOT EXISTS electric_poc;
+
+DROP TABLE IF EXISTS electric_chain_hot, electric_chain_samekey,
+    electric_chain_newkey, electric_chain_snapshots;
+
+CREATE TABLE electric_chain_hot (
+    id int PRIMARY KEY,
+    k int NOT NULL,
+    n int NOT NULL,
+    payload text NOT NULL
+) WITH (fillfactor = 10, autovacuum_enabled = false);
+
+CREATE TABLE electric_chain_samekey (LIKE electric_chain_hot INCLUDING ALL)
+    WITH (autovacuum_enabled = false);
+ALTER TABLE electric_chain_samekey ALTER payload SET STORAGE PLAIN;
+
+CREATE TABLE electric_chain_newkey (LIKE electric_chain_hot INCLUDING ALL)
+    WITH (fillfactor = 10, autovacuum_enabled = false);
+
+CREATE INDEX ON electric_chain_hot (k);
+CREATE INDEX ON electric_chain_samekey (k);
+CREATE INDEX ON electric_chain_newkey (k);
+
+INSERT INTO electric_chain_hot SELECT i, i, 0, repeat('x', 50) FROM generate_series(1, 1001) i;
+INSERT INTO electric_chain_samekey SELECT i, i, 0, repeat('x', 5000) FROM generate_series(1, 1001) i;
+INSERT INTO electric_chain_newkey SELECT i, i, 0, repeat('x', 50) FROM generate_series(1, 1001) i;
+
+ANALYZE electric_chain_hot, electric_chain_samekey, electric_chain_newkey;
+
+CREATE TABLE electric_chain_snapshots (
+    variant text NOT NULL,
+    depth int NOT NULL,
+    snapshot text NOT NULL,
+    PRIMARY KEY (variant, depth)
+);
+
+-- Update row 1 of a variant length times, one transaction per version, and
+-- record the snapshot at depths 0, 1%, 10%, 50%, 90% and 100%
+CREATE OR REPLACE PROCEDURE electric_chain_build(variant text, length int)
+LANGUAGE plpgsql AS $$
+DECLARE
+    tbl regclass := format('electric_chain_%s', variant)::regclass;
+    upd text := CASE variant
+        WHEN 'newkey' THEN 'UPDATE %s SET n = n + 1, k = k + 1 WHERE id = 1'
+        ELSE 'UPDATE %s SET n = n + 1 WHERE id = 1'
+    END;
+    depths int[] := ARRAY[0, length / 100, length / 10, length / 2,
+                          length - length / 10, length];
+BEGIN
+    FOR i IN 0..length LOOP
+        IF i > 0 THEN
+            EXECUTE format(upd, tbl);
+            COMMIT;
+        END IF;
+        IF i = ANY (depths) THEN
+            INSERT INTO electric_chain_snapshots
+            VALUES (variant, i, pg_current_snapshot()::text)
+            ON CONFLICT DO NOTHING;
+            COMMIT;
+        END IF;
+    END LOOP;
+END $$;
+
+-- Time as-of point lookups of row 1 and full scans at every recorded depth.
+-- Latencies are measured in the server, so they exclude the network. The
+-- traversal counters come from one extra call with electric.track_scans on.
+CREATE OR REPLACE FUNCTION electric_chain_measure(variant text, iterations int DEFAULT 200)
+RETURNS TABLE (
+    depth int,
+    query text,
+    mean_ms float8,
+    p50_ms float8,
+    p90_ms float8,
+    p99_ms float8,
+    heap_pages bigint,
+    tuples_examined bigint,
+    hot_hops bigint,
+    correct boolean
+)
+LANGUAGE plpgsql AS $$
+DECLARE
+    tbl text := format('electric_chain_%s', electric_chain_measure.variant)::regclass::text;
+    s record;
+    q record;
+    t0 timestamptz;
+    times float8[];
+    res jsonb;
+BEGIN
+    FOR s IN
+        SELECT cs.depth, cs.snapshot FROM electric_chain_snapshots cs
+        WHERE cs.variant = electric_chain_measure.variant ORDER BY cs.depth
+    LOOP
+        FOR q IN
+            SELECT * FROM (VALUES
+                ('lookup', format('SELECT n FROM %s WHERE id = 1', tbl)),
+                ('scan', format('SELECT max(n) FILTER (WHERE id = 1) AS n, count(*) AS c FROM %s', tbl))
+            ) v(name, sql)
+        LOOP
+            -- warm up, and check the read sees the version at this depth
+            res := electric_exec_as_of(s.snapshot::pg_snapshot, q.sql, '[]');
+            correct := (res -> 0 ->> 'n')::int = s.depth;
+
+            times := '{}';
+            FOR i IN 1..iterations LOOP
+                t0 := clock_timestamp();
+                PERFORM electric_exec_as_of(s.snapshot::pg_snapshot, q.sql, '[]');
+                times := times || extract(epoch FROM clock_timestamp() - t0) * 1000;
+            END LOOP;
+
+            PERFORM set_config('electric.track_scans', 'on', true);
+            res := electric_exec_as_of(s.snapshot::pg_snapshot, q.sql, '[]', '{"verbose": true}');
+            PERFORM set_config('electric.track_scans', 'off', true);
+
+            depth := s.depth;
+            query := q.name;
+            SELECT avg(x),
+                   percentile_cont(0.5) WITHIN GROUP (ORDER BY x),
+                   percentile_cont(0.9) WITHIN GROUP (ORDER BY x),
+                   percentile_cont(0.99) WITHIN GROUP (ORDER BY x)
+            INTO mean_ms, p50_ms, p90_ms, p99_ms
+            FROM unnest(times) x;
+            SELECT sum((sc ->> 'heap_pages')::bigint),
+                   sum((sc ->> 'tuples_examined')::bigint),
+                   sum((sc ->> 'hot_hops')::bigint)
+            INTO heap_pages, tuples_examined, hot_hops
+            FROM jsonb_array_elements(res -> 'scans') sc;
+            RETURN NEXT;
+        END LOOP;
+    END LOOP;
+END $$;
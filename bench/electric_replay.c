@@ -0,0 +1,552 @@
+/*
+ * electric_replay - re-execute an electric.capture_file log
+ *
+ * Reads the records electric_poc appended to its capture file (see
+ * ext/electric_poc/electric_capture.c for the layout), replays them through
+ * electric_exec_as_of() on a restored database and prints the latency
+ * distribution of the replay next to the one that was captured.
+ *
+ *   electric_replay [-d conninfo] [-c clients] [-s speed] [-n max] [-j] FILE
+ *
+ *   -d  libpq connection string (default: environment / PG* variables)
+ *   -c  concurrent connections (default 1)
+ *   -s  speed relative to capture: 1 replays at the original pace, 2 at
+ *       twice the pace, 0 as fast as the clients go (default 0)
+ *   -n  replay at most this many records
+ *   -j  print the report as one JSON object
+ *
+ * Captured durations are measured inside the server, replayed ones at the
+ * client, so they include a round trip. Calls the server answered without
+ * executing (flagged in the record) are replayed like the others and counted
+ * as "served" in the report. Compare replays of the same log
+ * against two builds rather than a replay against its capture.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define CAPTURE_MAGIC		0x454C4352
+#define CAPTURE_HEADER_LEN	48
+#define TOP_STATEMENTS		10
+
+#define REPLAY_SQL \
+	"SELECT jsonb_array_length(electric_exec_as_of($1::pg_snapshot, $2, $3::jsonb))"
+
+typedef struct Record
+{
+	int64_t		start_us;
+	int64_t		captured_ns;
+	int64_t		captured_rows;
+	uint32_t	flags;			/* non-zero: served without executing */
+	char	   *snapshot;
+	char	   *sql;
+	char	   *args;
+
+	/* filled in by the replay */
+	int64_t		replayed_ns;
+	int64_t		lag_ns;			/* how late it started vs. its schedule */
+	int64_t		replayed_rows;
+	bool		failed;
+} Record;
+
+typedef struct Summary
+{
+	size_t		count;
+	double		mean;
+	int64_t		p50;
+	int64_t		p90;
+	int64_t		p99;
+	int64_t		max;
+} Summary;
+
+static Record *records;
+static size_t nrecords;
+static const char *conninfo = "";
+static double speed = 0;
+
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_record = 0;
+static struct timespec replay_start;
+
+static void
+fatal(const char *fmt,...)
+{
+	va_list		ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		((uint32_t) p[2] << 8) | p[3];
+}
+
+static int64_t
+get_i64(const unsigned char *p)
+{
+	return (int64_t) (((uint64_t) get_u32(p) << 32) | get_u32(p + 4));
+}
+
+static char *
+get_str(const unsigned char *p, uint32_t len)
+{
+	char	   *s = malloc(len + 1);
+
+	if (s == NULL)
+		fatal("out of memory");
+	memcpy(s, p, len);
+	s[len] = '\0';
+	return s;
+}
+
+/* Load every complete record; a torn tail (crash, full disk) is dropped */
+static void
+load_capture(const char *path)
+{
+	FILE	   *f = fopen(path, "rb");
+	unsigned char *buf = NULL;
+	size_t		size = 0;
+	size_t		cap = 0;
+	size_t		n;
+	size_t		off = 0;
+	size_t		maxrecords = 0;
+
+	if (f == NULL)
+		fatal("could not open \"%s\": %s", path, strerror(errno));
+	do
+	{
+		if (size == cap)
+		{
+			cap = cap ? cap * 2 : 1 << 20;
+			buf = realloc(buf, cap);
+			if (buf == NULL)
+				fatal("out of memory");
+		}
+		n = fread(buf + size, 1, cap - size, f);
+		size += n;
+	} while (n > 0);
+	if (ferror(f))
+		fatal("could not read \"%s\": %s", path, strerror(errno));
+	fclose(f);
+
+	while (off + CAPTURE_HEADER_LEN <= size)
+	{
+		const unsigned char *p = buf + off;
+		uint32_t	length = get_u32(p + 4);
+		uint32_t	snapshot_len = get_u32(p + 32);
+		uint32_t	sql_len = get_u32(p + 36);
+		uint32_t	args_len = get_u32(p + 40);
+		Record	   *r;
+
+		if (get_u32(p) != CAPTURE_MAGIC ||
+			length != (uint64_t) CAPTURE_HEADER_LEN + snapshot_len + sql_len + args_len)
+			fatal("\"%s\": bad record at offset %zu", path, off);
+		if (off + length > size)
+		{
+			fprintf(stderr, "\"%s\": ignoring torn record at offset %zu\n", path, off);
+			break;
+		}
+
+		if (nrecords == maxrecords)
+		{
+			maxrecords = maxrecords ? maxrecords * 2 : 1024;
+			records = realloc(records, maxrecords * sizeof(Record));
+			if (records == NULL)
+				fatal("out of memory");
+		}
+		r = &records[nrecords++];
+		memset(r, 0, sizeof(Record));
+		r->start_us = get_i64(p + 8);
+		r->captured_ns = get_i64(p + 16);
+		r->captured_rows = get_i64(p + 24);
+		r->flags = get_u32(p + 44);
+		p += CAPTURE_HEADER_LEN;
+		r->snapshot = get_str(p, snapshot_len);
+		r->sql = get_str(p + snapshot_len, sql_len);
+		r->args = get_str(p + snapshot_len + sql_len, args_len);
+
+		off += length;
+	}
+	free(buf);
+}
+
+static int
+cmp_start(const void *a, const void *b)
+{
+	const Record *ra = a;
+	const Record *rb = b;
+
+	if (ra->start_us != rb->start_us)
+		return ra->start_us < rb->start_us ? -1 : 1;
+	return 0;
+}
+
+static void
+sleep_until(int64_t deadline_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = replay_start.tv_sec + deadline_ns / 1000000000;
+	ts.tv_nsec = replay_start.tv_nsec + deadline_ns % 1000000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void *
+replay_client(void *arg)
+{
+	PGconn	   *conn = PQconnectdb(conninfo);
+	PGresult   *res;
+	int64_t		base_ns = (int64_t) replay_start.tv_sec * 1000000000 + replay_start.tv_nsec;
+	bool		reported = false;
+
+	if (PQstatus(conn) != CONNECTION_OK)
+		fatal("connection failed: %s", PQerrorMessage(conn));
+	res = PQprepare(conn, "replay", REPLAY_SQL, 3, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		fatal("could not prepare replay statement: %s", PQerrorMessage(conn));
+	PQclear(res);
+
+	for (;;)
+	{
+		Record	   *r;
+		const char *values[3];
+		int64_t		due_ns = 0;
+		int64_t		t0;
+
+		pthread_mutex_lock(&next_lock);
+		r = next_record < nrecords ? &records[next_record++] : NULL;
+		pthread_mutex_unlock(&next_lock);
+		if (r == NULL)
+			break;
+
+		if (speed > 0)
+		{
+			due_ns = (int64_t) ((r->start_us - records[0].start_us) * 1000.0 / speed);
+			sleep_until(due_ns);
+		}
+
+		values[0] = r->snapshot;
+		values[1] = r->sql;
+		values[2] = r->args;
+		t0 = now_ns();
+		res = PQexecPrepared(conn, "replay", 3, values, NULL, NULL, 0);
+		r->replayed_ns = now_ns() - t0;
+		r->lag_ns = speed > 0 ? t0 - base_ns - due_ns : 0;
+
+		if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+			r->replayed_rows = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+		else
+		{
+			r->failed = true;
+			if (!reported)
+			{
+				fprintf(stderr, "replay error: %s", PQerrorMessage(conn));
+				reported = true;
+			}
+		}
+		PQclear(res);
+	}
+
+	PQfinish(conn);
+	return NULL;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+	int64_t		x = *(const int64_t *) a;
+	int64_t		y = *(const int64_t *) b;
+
+	return x < y ? -1 : (x > y);
+}
+
+static int64_t
+percentile(const int64_t *sorted, size_t n, double p)
+{
+	size_t		i = (size_t) (p * n + 0.999999);
+
+	return sorted[i > 0 ? i - 1 : 0];
+}
+
+/* Summarize one field of recs[0..n); failed replays are skipped */
+static Summary
+summarize(Record **recs, size_t n, int field)
+{
+	Summary		s = {0};
+	int64_t    *v = malloc((n ? n : 1) * sizeof(int64_t));
+	double		sum = 0;
+	size_t		i;
+
+	if (v == NULL)
+		fatal("out of memory");
+	for (i = 0; i < n; i++)
+	{
+		if (recs[i]->failed)
+			continue;
+		v[s.count] = field == 0 ? recs[i]->captured_ns :
+			field == 1 ? recs[i]->replayed_ns : recs[i]->lag_ns;
+		sum += v[s.count];
+		s.count++;
+	}
+	if (s.count > 0)
+	{
+		qsort(v, s.count, sizeof(int64_t), cmp_int64);
+		s.mean = sum / s.count;
+		s.p50 = percentile(v, s.count, 0.50);
+		s.p90 = percentile(v, s.count, 0.90);
+		s.p99 = percentile(v, s.count, 0.99);
+		s.max = v[s.count - 1];
+	}
+	free(v);
+	return s;
+}
+
+static void
+print_summary(bool json, const char *name, Summary s)
+{
+	if (json)
+		printf("\"%s\":{\"count\":%zu,\"mean_ms\":%.3f,\"p50_ms\":%.3f,"
+			   "\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+			   name, s.count, s.mean / 1e6, s.p50 / 1e6, s.p90 / 1e6,
+			   s.p99 / 1e6, s.max / 1e6);
+	else
+		printf("%-12s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+			   name, s.count, s.mean / 1e6, s.p50 / 1e6, s.p90 / 1e6,
+			   s.p99 / 1e6, s.max / 1e6);
+}
+
+static int
+cmp_sql(const void *a, const void *b)
+{
+	return strcmp((*(Record *const *) a)->sql, (*(Record *const *) b)->sql);
+}
+
+static void
+print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/* Per-statement captured vs. replayed latency, most frequent first */
+static void
+report_statements(bool json, Record **by_sql)
+{
+	typedef struct Group
+	{
+		size_t		first;
+		size_t		n;
+	} Group;
+	Group	   *groups = malloc(nrecords * sizeof(Group));
+	size_t		ngroups = 0;
+	size_t		i;
+	size_t		j;
+
+	if (groups == NULL)
+		fatal("out of memory");
+	qsort(by_sql, nrecords, sizeof(Record *), cmp_sql);
+	for (i = 0; i < nrecords; i = j)
+	{
+		for (j = i + 1; j < nrecords && strcmp(by_sql[i]->sql, by_sql[j]->sql) == 0; j++)
+			;
+		groups[ngroups].first = i;
+		groups[ngroups].n = j - i;
+		ngroups++;
+	}
+	/* selection sort of the top few by count is plenty */
+	for (i = 0; i < ngroups && i < TOP_STATEMENTS; i++)
+	{
+		size_t		best = i;
+		Group		tmp;
+
+		for (j = i + 1; j < ngroups; j++)
+			if (groups[j].n > groups[best].n)
+				best = j;
+		tmp = groups[i];
+		groups[i] = groups[best];
+		groups[best] = tmp;
+	}
+
+	if (json)
+		printf(",\"statements\":[");
+	for (i = 0; i < ngroups && i < TOP_STATEMENTS; i++)
+	{
+		Record	  **recs = &by_sql[groups[i].first];
+
+		if (json)
+		{
+			printf("%s{\"sql\":", i ? "," : "");
+			print_json_string(recs[0]->sql);
+			putchar(',');
+			print_summary(true, "captured", summarize(recs, groups[i].n, 0));
+			putchar(',');
+			print_summary(true, "replayed", summarize(recs, groups[i].n, 1));
+			putchar('}');
+		}
+		else
+		{
+			printf("\n%.100s\n", recs[0]->sql);
+			print_summary(false, "  captured", summarize(recs, groups[i].n, 0));
+			print_summary(false, "  replayed", summarize(recs, groups[i].n, 1));
+		}
+	}
+	if (json)
+		putchar(']');
+	free(groups);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"usage: electric_replay [-d conninfo] [-c clients] [-s speed] [-n max] [-j] FILE\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	int			clients = 1;
+	long		max = -1;
+	bool		json = false;
+	pthread_t  *threads;
+	Record	  **all;
+	int64_t		t0;
+	double		elapsed;
+	size_t		errors = 0;
+	size_t		mismatches = 0;
+	size_t		served = 0;
+	size_t		i;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:c:s:n:j")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				conninfo = optarg;
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'n':
+				max = atol(optarg);
+				break;
+			case 'j':
+				json = true;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || clients < 1 || speed < 0)
+		usage();
+
+	load_capture(argv[optind]);
+	if (nrecords == 0)
+		fatal("\"%s\": no records", argv[optind]);
+	qsort(records, nrecords, sizeof(Record), cmp_start);
+	if (max >= 0 && (size_t) max < nrecords)
+		nrecords = max;
+
+	threads = malloc(clients * sizeof(pthread_t));
+	if (threads == NULL)
+		fatal("out of memory");
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	t0 = now_ns();
+	for (i = 0; i < (size_t) clients; i++)
+		pthread_create(&threads[i], NULL, replay_client, NULL);
+	for (i = 0; i < (size_t) clients; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = (now_ns() - t0) / 1e9;
+
+	all = malloc(nrecords * sizeof(Record *));
+	if (all == NULL)
+		fatal("out of memory");
+	for (i = 0; i < nrecords; i++)
+	{
+		all[i] = &records[i];
+		if (records[i].flags != 0)
+			served++;
+		if (records[i].failed)
+			errors++;
+		else if (records[i].replayed_rows != records[i].captured_rows)
+			mismatches++;
+	}
+
+	if (json)
+	{
+		printf("{\"records\":%zu,\"clients\":%d,\"speed\":%g,\"elapsed_s\":%.3f,"
+			   "\"calls_per_s\":%.1f,\"served\":%zu,\"errors\":%zu,\"row_mismatches\":%zu,",
+			   nrecords, clients, speed, elapsed, nrecords / elapsed, served, errors, mismatches);
+		print_summary(true, "captured", summarize(all, nrecords, 0));
+		putchar(',');
+		print_summary(true, "replayed", summarize(all, nrecords, 1));
+		if (speed > 0)
+		{
+			putchar(',');
+			print_summary(true, "lag", summarize(all, nrecords, 2));
+		}
+		report_statements(true, all);
+		printf("}\n");
+	}
+	else
+	{
+		printf("records: %zu  clients: %d  speed: %g  elapsed: %.3f s  throughput: %.1f calls/s\n",
+			   nrecords, clients, speed, elapsed, nrecords / elapsed);
+		printf("served: %zu  errors: %zu  row mismatches: %zu\n\n", served, errors, mismatches);
+		printf("%-12s %8s %10s %10s %10s %10s %10s\n",
+			   "", "count", "mean_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+		print_summary(false, "captured", summarize(all, nrecords, 0));
+		print_summary(false, "replayed", summarize(all, nrecords, 1));
+		if (speed > 0)
+			print_summary(false, "lag", summarize(all, nrecords, 2));
+		report_statements(false, all);
+	}
+
+	return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * electric_server_bench - latency and throughput of the as-of query server
+ *
+ * Opens connections to an electric.server_socket, registers one snapshot and
+ * prepares one query on each, then executes it as fast as the server answers
+ * with up to DEPTH requests in flight per connection (see
+ * ext/electric_poc/electric_server.c for the protocol).
+ *
+ *   electric_server_bench -S socket [-d conninfo] [-s snapshot] [-q sql]
+ *                         [-a int4]... [-c clients] [-p depth] [-n requests] [-j]
+ *
+ *   -S  server socket path (the worker's, <path>.<n> with several workers)
+ *   -d  libpq connection string used to read pg_current_snapshot() when no
+ *       -s is given (default: environment / PG* variables)
+ *   -s  snapshot text to execute at
+ *   -q  query (default SELECT 1); its parameters are int4
+ *   -a  value of the next int4 parameter
+ *   -c  concurrent connections (default 1)
+ *   -p  requests in flight per connection (default 1)
+ *   -n  requests per connection (default 100000)
+ *   -j  print the report as one JSON object
+ *
+ * Latency is from writing a request to reading its answer, so with -p > 1 it
+ * includes queueing behind the requests sent before it.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define MAX_ARGS	16
+#define QUERY_ID	1
+
+static const char *socket_path = NULL;
+static const char *snapshot = NULL;
+static const char *sql = "SELECT 1";
+static int32_t args[MAX_ARGS];
+static int	nargs = 0;
+static int	depth = 1;
+static long requests = 100000;
+
+typedef struct Client
+{
+	pthread_t	thread;
+	int64_t    *latency_ns;		/* per request */
+	long		errors;
+	long		rows;
+} Client;
+
+static void
+fatal(const char *fmt,...)
+{
+	va_list		ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static void
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t		n = write(fd, buf, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			fatal("write to server failed: %s", strerror(errno));
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Frame header plus payload; returns the frame length */
+static size_t
+build_frame(unsigned char *buf, uint32_t request, char type, const void *payload, size_t len)
+{
+	put_u32(buf, (uint32_t) (5 + len));
+	put_u32(buf + 4, request);
+	buf[8] = (unsigned char) type;
+	memcpy(buf + 9, payload, len);
+	return 9 + len;
+}
+
+typedef struct Reader
+{
+	int			fd;
+	unsigned char *data;
+	size_t		size;
+	size_t		start;			/* first unconsumed byte */
+	size_t		end;			/* end of the data read */
+} Reader;
+
+/*
+ * Read the next response frame; returns its type. *payload points at the
+ * payload (valid until the next call), *len is its length.
+ */
+static char
+read_frame(Reader *r, const unsigned char **payload, uint32_t *len)
+{
+	for (;;)
+	{
+		size_t		avail = r->end - r->start;
+
+		if (avail >= 4)
+		{
+			uint32_t	flen = get_u32(r->data + r->start);
+
+			if (avail >= 4 + (size_t) flen)
+			{
+				char		type = (char) r->data[r->start + 8];
+
+				*payload = r->data + r->start + 9;
+				*len = flen - 5;
+				r->start += 4 + flen;
+				return type;
+			}
+			if (4 + (size_t) flen > r->size)
+			{
+				r->size = 4 + (size_t) flen;
+				r->data = realloc(r->data, r->size);
+				if (r->data == NULL)
+					fatal("out of memory");
+			}
+		}
+		if (r->start > 0)
+		{
+			memmove(r->data, r->data + r->start, avail);
+			r->start = 0;
+			r->end = avail;
+		}
+		{
+			ssize_t		n = read(r->fd, r->data + r->end, r->size - r->end);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				fatal("read from server failed: %s", n == 0 ? "connection closed" : strerror(errno));
+			r->end += n;
+		}
+	}
+}
+
+/* A request the setup can't do without */
+static void
+expect_ok(Reader *r, const char *what, uint32_t *handle)
+{
+	const unsigned char *payload;
+	uint32_t	len;
+	char		type = read_frame(r, &payload, &len);
+
+	if (type == 'E')
+		fatal("%s failed: %.5s %.*s", what, payload, (int) len - 5, payload + 5);
+	if (type != 'K')
+		fatal("%s: unexpected response '%c'", what, type);
+	if (handle != NULL)
+		*handle = get_u32(payload);
+}
+
+static int
+connect_server(void)
+{
+	struct sockaddr_un addr;
+	int			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		fatal("socket path too long");
+	strcpy(addr.sun_path, socket_path);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		fatal("could not connect to \"%s\": %s", socket_path, strerror(errno));
+	return fd;
+}
+
+static void *
+bench_client(void *arg)
+{
+	Client	   *c = (Client *) arg;
+	int			fd = connect_server();
+	Reader		r = {fd, malloc(65536), 65536, 0, 0};
+	unsigned char *buf;
+	unsigned char *prepare;
+	unsigned char exec[9 + 10 + 8 * MAX_ARGS];
+	size_t		buflen = 32 + strlen(snapshot) + 4 * MAX_ARGS + strlen(sql) + depth * sizeof(exec);
+	size_t		exec_len;
+	uint32_t	handle;
+	int64_t    *sent_ns;
+	long		sent = 0;
+	long		done = 0;
+	size_t		len;
+	int			i;
+
+	buf = malloc(buflen);
+	prepare = malloc(6 + 4 * MAX_ARGS + strlen(sql));
+	sent_ns = malloc(requests * sizeof(int64_t));
+	if (r.data == NULL || buf == NULL || prepare == NULL || sent_ns == NULL)
+		fatal("out of memory");
+
+	/* Register the snapshot and prepare the query, pipelined */
+	len = build_frame(buf, 0, 'S', snapshot, strlen(snapshot));
+	put_u32(prepare, QUERY_ID);
+	prepare[4] = (unsigned char) (nargs >> 8);
+	prepare[5] = (unsigned char) nargs;
+	for (i = 0; i < nargs; i++)
+		put_u32(prepare + 6 + 4 * i, 23);	/* int4 */
+	memcpy(prepare + 6 + 4 * nargs, sql, strlen(sql));
+	len += build_frame(buf + len, 0, 'P', prepare, 6 + 4 * nargs + strlen(sql));
+	write_all(fd, buf, len);
+	expect_ok(&r, "snapshot", &handle);
+	expect_ok(&r, "prepare", NULL);
+
+	/* Every execute request is the same apart from its number */
+	{
+		unsigned char payload[10 + 8 * MAX_ARGS];
+
+		put_u32(payload, handle);
+		put_u32(payload + 4, QUERY_ID);
+		payload[8] = (unsigned char) (nargs >> 8);
+		payload[9] = (unsigned char) nargs;
+		for (i = 0; i < nargs; i++)
+		{
+			put_u32(payload + 10 + 8 * i, 4);
+			put_u32(payload + 14 + 8 * i, (uint32_t) args[i]);
+		}
+		exec_len = build_frame(exec, 0, 'X', payload, 10 + 8 * nargs);
+	}
+
+	while (done < requests)
+	{
+		const unsigned char *payload;
+		uint32_t	plen;
+		char		type;
+
+		/* Top up the pipeline in one write */
+		len = 0;
+		while (sent < requests && sent - done < depth && len + exec_len <= buflen)
+		{
+			memcpy(buf + len, exec, exec_len);
+			put_u32(buf + len + 4, (uint32_t) sent);
+			len += exec_len;
+			sent_ns[sent++] = now_ns();
+		}
+		if (len > 0)
+			write_all(fd, buf, len);
+
+		type = read_frame(&r, &payload, &plen);
+		c->latency_ns[done] = now_ns() - sent_ns[get_u32(payload - 5)];
+		if (type == 'R')
+			c->rows += get_u32(payload + 2);
+		else if (c->errors++ == 0)
+			fprintf(stderr, "execute error: %.5s %.*s\n", payload, (int) plen - 5, payload + 5);
+		done++;
+	}
+
+	close(fd);
+	free(buf);
+	free(prepare);
+	free(sent_ns);
+	free(r.data);
+	return NULL;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+	int64_t		x = *(const int64_t *) a;
+	int64_t		y = *(const int64_t *) b;
+
+	return x < y ? -1 : (x > y);
+}
+
+static int64_t
+percentile(const int64_t *sorted, size_t n, double p)
+{
+	size_t		i = (size_t) (p * n + 0.999999);
+
+	return sorted[i > 0 ? i - 1 : 0];
+}
+
+/* Snapshot text from pg_current_snapshot(), xmax moved past the last commit */
+static char *
+current_snapshot(const char *conninfo)
+{
+	PGconn	   *conn = PQconnectdb(conninfo);
+	PGresult   *res;
+	unsigned long xmin;
+	unsigned long xmax;
+	char	   *text;
+
+	if (PQstatus(conn) != CONNECTION_OK)
+		fatal("connection failed: %s", PQerrorMessage(conn));
+	res = PQexec(conn, "SELECT pg_current_snapshot()::text");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		fatal("could not read the current snapshot: %s", PQerrorMessage(conn));
+	if (sscanf(PQgetvalue(res, 0, 0), "%lu:%lu:", &xmin, &xmax) != 2)
+		fatal("unexpected snapshot \"%s\"", PQgetvalue(res, 0, 0));
+	text = malloc(64);
+	if (text == NULL)
+		fatal("out of memory");
+	snprintf(text, 64, "%lu:%lu:", xmin, xmax);
+	PQclear(res);
+	PQfinish(conn);
+	return text;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+			"usage: electric_server_bench -S socket [-d conninfo] [-s snapshot] [-q sql]\n"
+			"                             [-a int4]... [-c clients] [-p depth] [-n requests] [-j]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *conninfo = "";
+	int			clients = 1;
+	bool		json = false;
+	Client	   *cs;
+	int64_t    *all;
+	size_t		total;
+	long		errors = 0;
+	long		rows = 0;
+	int64_t		t0;
+	double		elapsed;
+	double		sum = 0;
+	size_t		i;
+	int			c;
+
+	while ((c = getopt(argc, argv, "S:d:s:q:a:c:p:n:j")) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'd':
+				conninfo = optarg;
+				break;
+			case 's':
+				snapshot = optarg;
+				break;
+			case 'q':
+				sql = optarg;
+				break;
+			case 'a':
+				if (nargs == MAX_ARGS)
+					fatal("at most %d arguments", MAX_ARGS);
+				args[nargs++] = (int32_t) atol(optarg);
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'p':
+				depth = atoi(optarg);
+				break;
+			case 'n':
+				requests = atol(optarg);
+				break;
+			case 'j':
+				json = true;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc || socket_path == NULL || clients < 1 || depth < 1 || requests < 1)
+		usage();
+	if (snapshot == NULL)
+		snapshot = current_snapshot(conninfo);
+
+	cs = calloc(clients, sizeof(Client));
+	if (cs == NULL)
+		fatal("out of memory");
+	for (i = 0; i < (size_t) clients; i++)
+	{
+		cs[i].latency_ns = malloc(requests * sizeof(int64_t));
+		if (cs[i].latency_ns == NULL)
+			fatal("out of memory");
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < (size_t) clients; i++)
+		pthread_create(&cs[i].thread, NULL, bench_client, &cs[i]);
+	for (i = 0; i < (size_t) clients; i++)
+		pthread_join(cs[i].thread, NULL);
+	elapsed = (now_ns() - t0) / 1e9;
+
+	total = (size_t) clients * requests;
+	all = malloc(total * sizeof(int64_t));
+	if (all == NULL)
+		fatal("out of memory");
+	for (i = 0; i < (size_t) clients; i++)
+	{
+		memcpy(all + i * requests, cs[i].latency_ns, requests * sizeof(int64_t));
+		errors += cs[i].errors;
+		rows += cs[i].rows;
+	}
+	qsort(all, total, sizeof(int64_t), cmp_int64);
+	for (i = 0; i < total; i++)
+		sum += all[i];
+
+	if (json)
+		printf("{\"requests\":%zu,\"clients\":%d,\"depth\":%d,\"elapsed_s\":%.3f,"
+			   "\"requests_per_s\":%.1f,\"errors\":%ld,\"rows\":%ld,\"mean_us\":%.2f,"
+			   "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+			   total, clients, depth, elapsed, total / elapsed, errors, rows, sum / total / 1e3,
+			   percentile(all, total, 0.5) / 1e3, percentile(all, total, 0.9) / 1e3,
+			   percentile(all, total, 0.99) / 1e3, all[total - 1] / 1e3);
+	else
+	{
+		printf("requests: %zu  clients: %d  depth: %d  elapsed: %.3f s  throughput: %.1f requests/s\n",
+			   total, clients, depth, elapsed, total / elapsed);
+		printf("errors: %ld  rows: %ld\n\n", errors, rows);
+		printf("%10s %10s %10s %10s %10s\n", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+		printf("%10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			   sum / total / 1e3, percentile(all, total, 0.5) / 1e3,
+			   percentile(all, total, 0.9) / 1e3, percentile(all, total, 0.99) / 1e3,
+			   all[total - 1] / 1e3);
+	}
+
+	return errors > 0 ? 1 : 0;
+}
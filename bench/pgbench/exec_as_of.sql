@@ -0,0 +1,5 @@
+-- electric_exec_as_of() under the snapshot passed as -D snapshot=...
+\set id random(1, 100000 - :rows)
+SELECT electric_exec_as_of(:snapshot::pg_snapshot,
+    'SELECT id, user_id, payload FROM electric_bench WHERE id >= $1::int ORDER BY id LIMIT $2::int',
+    jsonb_build_array(:id, :rows));
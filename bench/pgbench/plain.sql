@@ -0,0 +1,3 @@
+-- Baseline: the same read without a synthetic snapshot
+\set id random(1, 100000 - :rows)
+SELECT id, user_id, payload FROM electric_bench WHERE id >= :id ORDER BY id LIMIT :rows;
@@ -0,0 +1,112 @@
+#!/usr/bin/env bash
+#
+# Throughput and latency of electric_exec_as_of() and SET LOCAL
+# electric.snapshot against the same plain SELECT, with pgbench.
+#
+# Every combination of workload x clients x xip list size x result rows runs
+# for DURATION seconds and appends one JSON line to OUT:
+#
+#   {"workload":"exec_as_of","clients":8,"xcnt":100,"rows":10,"duration_s":10,
+#    "tps":12345.6,"transactions":123456,"failed":0,"p50_ms":0.61,
+#    "p90_ms":0.80,"p99_ms":1.42,"max_ms":9.1,"commit":"abc1234",
+#    "server_version":"16.4","started_at":"2024-01-01T00:00:00Z"}
+#
+# Connection settings come from the usual PG* environment variables.
+#
+#   WORKLOADS  plain exec_as_of set_local
+#   CLIENTS    1 8 32 128
+#   XCNTS      0 100 10000     (plain always runs once, with xcnt 0)
+#   ROWS       1 100 1000
+#   DURATION   10
+#   OUT        bench/results/pgbench.jsonl
+#   SETUP      1               (0 reuses the tables from a previous run)
+
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+WORKLOADS=${WORKLOADS:-"plain exec_as_of set_local"}
+CLIENTS=${CLIENTS:-"1 8 32 128"}
+XCNTS=${XCNTS:-"0 100 10000"}
+ROWS=${ROWS:-"1 100 1000"}
+DURATION=${DURATION:-10}
+OUT=${OUT:-"$here/../results/pgbench.jsonl"}
+SETUP=${SETUP:-1}
+
+threads_max=$(nproc 2>/dev/null || echo 4)
+commit=$(git -C "$here" rev-parse --short HEAD 2>/dev/null || echo unknown)
+server_version=$(psql -XAtc 'SHOW server_version')
+logdir=$(mktemp -d)
+trap 'rm -rf "$logdir"' EXIT
+
+mkdir -p "$(dirname "$OUT")"
+
+if [ "$SETUP" = 1 ]; then
+    echo "Loading benchmark tables..." >&2
+    psql -X -q -v ON_ERROR_STOP=1 -f "$here/setup.sql"
+fi
+
+# Latency percentiles (ms) from pgbench per-transaction logs (3rd field, us)
+percentiles() {
+    cat "$logdir"/pgbench_log* | awk '{ print $3 }' | sort -n | awk '
+        { v[NR] = $1 }
+        END {
+            if (NR == 0) { printf "null,null,null,null"; exit }
+            split("0.50 0.90 0.99", p, " ")
+            for (i = 1; i <= 3; i++) {
+                k = int(p[i] * NR + 0.999999); if (k < 1) k = 1
+                printf "%.3f,", v[k] / 1000
+            }
+            printf "%.3f", v[NR] / 1000
+        }'
+}
+
+run() {
+    local workload=$1 clients=$2 xcnt=$3 rows=$4
+    local threads=$((clients < threads_max ? clients : threads_max))
+    local snapshot output tps xacts failed p50 p90 p99 max started_at
+
+    snapshot=$(psql -XAtc "SELECT snapshot FROM electric_bench_snapshots WHERE xcnt = $xcnt")
+    if [ -z "$snapshot" ]; then
+        echo "no benchmark snapshot with xcnt $xcnt (see setup.sql)" >&2
+        exit 1
+    fi
+
+    rm -f "$logdir"/pgbench_log*
+    started_at=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+    echo "$workload clients=$clients xcnt=$xcnt rows=$rows" >&2
+    output=$(pgbench -n -M prepared -c "$clients" -j "$threads" -T "$DURATION" \
+        -D rows="$rows" -D snapshot="$snapshot" \
+        -l --log-prefix="$logdir/pgbench_log" \
+        -f "$here/$workload.sql" 2>&1) || { echo "$output" >&2; exit 1; }
+
+    tps=$(sed -n 's/^tps = \([0-9.]*\) .*/\1/p' <<<"$output" | tail -1)
+    xacts=$(sed -n 's/^number of transactions actually processed: \([0-9]*\).*/\1/p' <<<"$output")
+    failed=$(sed -n 's/^number of failed transactions: \([0-9]*\).*/\1/p' <<<"$output")
+    IFS=, read -r p50 p90 p99 max <<<"$(percentiles)"
+
+    printf '{"workload":"%s","clients":%d,"xcnt":%d,"rows":%d,"duration_s":%d,' \
+        "$workload" "$clients" "$xcnt" "$rows" "$DURATION" >>"$OUT"
+    printf '"tps":%s,"transactions":%s,"failed":%s,' \
+        "${tps:-null}" "${xacts:-null}" "${failed:-0}" >>"$OUT"
+    printf '"p50_ms":%s,"p90_ms":%s,"p99_ms":%s,"max_ms":%s,' \
+        "$p50" "$p90" "$p99" "$max" >>"$OUT"
+    printf '"commit":"%s","server_version":"%s","started_at":"%s"}\n' \
+        "$commit" "$server_version" "$started_at" >>"$OUT"
+}
+
+for workload in $WORKLOADS; do
+    for clients in $CLIENTS; do
+        for rows in $ROWS; do
+            if [ "$workload" = plain ]; then
+                run "$workload" "$clients" 0 "$rows"
+                continue
+            fi
+            for xcnt in $XCNTS; do
+                run "$workload" "$clients" "$xcnt" "$rows"
+            done
+        done
+    done
+done
+
+echo "Results appended to $OUT" >&2
@@ -0,0 +1,6 @@
+-- SET LOCAL electric.snapshot, then the plain read in the same transaction
+\set id random(1, 100000 - :rows)
+BEGIN ISOLATION LEVEL REPEATABLE READ;
+SELECT set_config('electric.snapshot', :snapshot, true);
+SELECT id, user_id, payload FROM electric_bench WHERE id >= :id ORDER BY id LIMIT :rows;
+COMMIT;
@@ -0,0 +1,49 @@
+-- Benchmark schema for bench/pgbench/run.sh
+--
+--   electric_bench            100k rows of ~100 bytes, read by every workload
+--   electric_bench_snapshots  one synthetic snapshot per xip list size, whose
+--                             xip entries are xids burned after the data was
+--                             loaded, so every snapshot sees all of it
+
+CREATE EXTENSION IF NOT EXISTS electric_poc;
+
+DROP TABLE IF EXISTS electric_bench, electric_bench_snapshots;
+
+CREATE TABLE electric_bench (
+    id int PRIMARY KEY,
+    user_id text NOT NULL,
+    payload text NOT NULL
+);
+
+INSERT INTO electric_bench
+SELECT i, 'u' || (i % 1000), repeat(md5(i::text), 3)
+FROM generate_series(1, 100000) i;
+
+ANALYZE electric_bench;
+
+CREATE TABLE electric_bench_snapshots (
+    xcnt int PRIMARY KEY,
+    snapshot text NOT NULL
+);
+
+-- Burn 10k xids in separate transactions and build snapshots over them
+DO $$
+DECLARE
+    first_xid bigint;
+    last_xid bigint;
+BEGIN
+    FOR i IN 1..10000 LOOP
+        last_xid := pg_current_xact_id()::text::bigint;
+        IF i = 1 THEN
+            first_xid := last_xid;
+        END IF;
+        COMMIT;
+    END LOOP;
+
+    INSERT INTO electric_bench_snapshots
+    SELECT n,
+           format('%s:%s:%s', first_xid, last_xid + 1,
+                  (SELECT coalesce(string_agg(x::text, ',' ORDER BY x), '')
+                   FROM generate_series(first_xid, first_xid + n - 1) x))
+    FROM unnest(ARRAY[0, 10, 100, 1000, 10000]) n;
+END $$;
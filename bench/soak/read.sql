@@ -0,0 +1,5 @@
+-- An auth check as of the snapshot recorded :age seconds ago
+\set uid random(1, :users)
+SELECT electric_exec_as_of(electric_soak_snapshot(:age),
+    'SELECT doc_id, allowed FROM electric_soak_acl WHERE user_id = $1',
+    jsonb_build_array('user-' || :uid));
@@ -0,0 +1,2 @@
+-- Run at 1 tps: remember the current snapshot for readers of past states
+SELECT electric_soak_record();
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+#
+# Print a bench/soak/run.sh time series as a table, one row per sample:
+#
+#   bench/soak/report.sh bench/results/soak-20240101T000000Z.jsonl
+#
+# Sizes are in MB, writes/s is derived from the events table's insert
+# counter, and the last column is as-of p99 (ms) per snapshot age (s).
+# Parsing is done by psql, so the usual PG* variables must point at any
+# reachable server.
+
+set -euo pipefail
+
+if [ $# -ne 1 ] || [ ! -r "$1" ]; then
+    echo "usage: $0 <soak results .jsonl>" >&2
+    exit 1
+fi
+
+psql -X -q -v ON_ERROR_STOP=1 \
+    -c 'CREATE TEMP TABLE soak (s jsonb)' \
+    -c "\\copy soak FROM '$1'" \
+    -c "
+SELECT round((s->>'elapsed_s')::numeric / 60, 1) AS minutes,
+       round((s#>>'{tables,electric_soak_acl,total_bytes}')::numeric / 1048576, 1) AS acl_mb,
+       (s#>>'{tables,electric_soak_acl,dead_tup}')::bigint AS acl_dead,
+       round((s#>>'{tables,electric_soak_events,total_bytes}')::numeric / 1048576, 1) AS events_mb,
+       (s#>>'{tables,electric_soak_events,dead_tup}')::bigint AS events_dead,
+       (s#>>'{tables,electric_soak_acl,autovacuum_count}')::bigint
+           + (s#>>'{tables,electric_soak_events,autovacuum_count}')::bigint AS autovacuums,
+       (s->>'horizon_age_xids')::bigint AS horizon_age,
+       round(((s#>>'{tables,electric_soak_events,n_tup_ins}')::numeric
+              - lag((s#>>'{tables,electric_soak_events,n_tup_ins}')::numeric) OVER w)
+             / nullif((s->>'elapsed_s')::numeric - lag((s->>'elapsed_s')::numeric) OVER w, 0)) AS writes_s,
+       (SELECT string_agg(format('%s:%s', age, coalesce(v->>'p99_ms', '-')), ' ' ORDER BY age::int)
+        FROM jsonb_each(s->'asof') a(age, v)) AS \"p99 ms by age\"
+FROM soak
+WINDOW w AS (ORDER BY (s->>'elapsed_s')::int)
+ORDER BY (s->>'elapsed_s')::int"
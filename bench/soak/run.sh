@@ -0,0 +1,170 @@
+#!/usr/bin/env bash
+#
+# Hours-long soak: a mixed write workload and continuous as-of reads at
+# several snapshot ages, with the xmin horizon held back RETENTION seconds.
+# Every SAMPLE_INTERVAL seconds one JSON line is appended to OUT:
+#
+#   {"elapsed_s":3600,"retention_s":900,"at":"...",
+#    "tables":{"electric_soak_acl":{"total_bytes":...,"dead_tup":...,
+#              "autovacuum_count":3,...},"electric_soak_events":{...}},
+#    "autovacuum_running":1,"horizon_age_xids":451234,
+#    "asof":{"0":{"n":6000,"p50_ms":0.31,"p99_ms":0.92},"600":{...}},
+#    "commit":"abc1234","server_version":"16.4"}
+#
+# and report.sh prints the series as a table at the end. Run it once per
+# retention setting and compare the files: bloat and dead tuples against
+# as-of latency at each age. Reads older than RETENTION may see versions
+# VACUUM has already removed; their latency is still reported.
+#
+# Connection settings come from the usual PG* environment variables. Needs
+# a superuser to see every session's horizon.
+#
+#   HOURS            1           (or DURATION in seconds)
+#   RETENTION        900         seconds the horizon is held back (0 = none)
+#   RETENTION_STEP   RETENTION/10  (a new horizon pin starts this often)
+#   READ_AGES        0 60 600    snapshot ages in seconds, one reader per age
+#   READ_CLIENTS     2           per age
+#   READ_RATE        100         reads/s per age (0 = as fast as possible)
+#   WRITE_CLIENTS    4
+#   WRITE_RATE       500         write transactions/s (0 = as fast as possible)
+#   USERS            10000       ACL rows = USERS x 10
+#   EVENTS           100000      rows kept in the events window
+#   RELOPTIONS       ""          storage parameters for both tables, e.g.
+#                                "autovacuum_vacuum_scale_factor=0.01"
+#   SAMPLE_INTERVAL  60
+#   OUT              bench/results/soak-<start time>.jsonl
+
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+
+HOURS=${HOURS:-1}
+DURATION=${DURATION:-$(awk -v h="$HOURS" 'BEGIN { printf "%d", h * 3600 }')}
+RETENTION=${RETENTION:-900}
+RETENTION_STEP=${RETENTION_STEP:-$((RETENTION / 10 > 0 ? RETENTION / 10 : 1))}
+READ_AGES=${READ_AGES:-"0 60 600"}
+READ_CLIENTS=${READ_CLIENTS:-2}
+READ_RATE=${READ_RATE:-100}
+WRITE_CLIENTS=${WRITE_CLIENTS:-4}
+WRITE_RATE=${WRITE_RATE:-500}
+USERS=${USERS:-10000}
+EVENTS=${EVENTS:-100000}
+RELOPTIONS=${RELOPTIONS:-}
+SAMPLE_INTERVAL=${SAMPLE_INTERVAL:-60}
+OUT=${OUT:-"$here/../results/soak-$(date -u +%Y%m%dT%H%M%SZ).jsonl"}
+
+commit=$(git -C "$here" rev-parse --short HEAD 2>/dev/null || echo unknown)
+server_version=$(psql -XAtc 'SHOW server_version')
+pin_app=electric_soak_pin
+logdir=$(mktemp -d)
+pids=()
+
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    psql -XAtqc "SELECT pg_terminate_backend(pid) FROM pg_stat_activity
+                 WHERE application_name = '$pin_app'" >/dev/null || true
+    rm -rf "$logdir"
+}
+trap cleanup EXIT
+
+rate() {
+    [ "$1" -gt 0 ] && echo "-R $1" || true
+}
+
+mkdir -p "$(dirname "$OUT")"
+echo "Loading soak tables..." >&2
+psql -X -q -v ON_ERROR_STOP=1 -v users="$USERS" -v reloptions="$RELOPTIONS" -f "$here/setup.sql"
+
+# Horizon pins: a new xid-holding session every RETENTION_STEP seconds, each
+# living RETENTION seconds, so the horizon trails by about RETENTION
+if [ "$RETENTION" -gt 0 ]; then
+    (
+        while :; do
+            PGAPPNAME=$pin_app psql -XAtqc "SELECT pg_current_xact_id(), pg_sleep($RETENTION)" \
+                >/dev/null 2>&1 &
+            sleep "$RETENTION_STEP"
+        done
+    ) &
+    pids+=($!)
+fi
+
+pgbench -n -c 1 -R 1 -T "$DURATION" -f "$here/record.sql" >"$logdir/pgbench_record.out" 2>&1 &
+pids+=($!)
+sleep 2    # let the recorder store a first snapshot for the readers
+
+# shellcheck disable=SC2046
+pgbench -n -M prepared -c "$WRITE_CLIENTS" -j "$WRITE_CLIENTS" -T "$DURATION" $(rate "$WRITE_RATE") \
+    -D users="$USERS" -D events="$EVENTS" -f "$here/write.sql" >"$logdir/pgbench_write.out" 2>&1 &
+pids+=($!)
+
+for age in $READ_AGES; do
+    # shellcheck disable=SC2046
+    pgbench -n -M prepared -c "$READ_CLIENTS" -j "$READ_CLIENTS" -T "$DURATION" $(rate "$READ_RATE") \
+        -D users="$USERS" -D age="$age" -l --log-prefix="$logdir/read_$age" \
+        -f "$here/read.sql" >"$logdir/pgbench_read_$age.out" 2>&1 &
+    pids+=($!)
+done
+
+# Read latencies (ms) logged since the last sample, from pgbench's
+# per-transaction logs: 3rd field latency in us, 7th schedule lag under -R
+declare -A offsets
+new_latencies() {
+    local age=$1 f size off chunk
+    for f in "$logdir"/read_"$age".*; do
+        [ -e "$f" ] || continue
+        size=$(stat -c %s "$f")
+        off=${offsets[$f]:-0}
+        [ "$size" -gt "$off" ] || continue
+        chunk=$(tail -c +$((off + 1)) "$f" | head -c $((size - off)); echo .)
+        chunk=${chunk%.}    # $(...) would strip the trailing newline
+        # Only whole lines; a partly written one waits for the next sample
+        [[ $chunk == *$'\n'* ]] || continue
+        chunk=${chunk%$'\n'*}
+        offsets[$f]=$((off + ${#chunk} + 1))
+        awk '$3 ~ /^[0-9]+$/ { print ($3 - (NF >= 7 ? $7 : 0)) / 1000 }' <<<"$chunk"
+    done
+}
+
+# Sets asof to {"<age>":{"n":..,"p50_ms":..,"p99_ms":..,"max_ms":..},...}
+# (not run in a subshell, so the log offsets stick)
+asof_stats() {
+    local age sep= stats
+    asof='{'
+    for age in $READ_AGES; do
+        new_latencies "$age" >"$logdir/latencies"
+        stats=$(sort -n "$logdir/latencies" | awk '
+            { v[NR] = $1 }
+            END {
+                if (NR == 0) { printf "\"n\":0,\"p50_ms\":null,\"p99_ms\":null,\"max_ms\":null"; exit }
+                k50 = int(0.50 * NR + 0.999999); k99 = int(0.99 * NR + 0.999999)
+                printf "\"n\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f", NR, v[k50], v[k99], v[NR]
+            }')
+        asof+="$sep\"$age\":{$stats}"
+        sep=,
+    done
+    asof+='}'
+}
+
+echo "Soaking for ${DURATION}s, sampling every ${SAMPLE_INTERVAL}s into $OUT" >&2
+start=$(date +%s)
+while :; do
+    sleep "$SAMPLE_INTERVAL"
+    elapsed=$(($(date +%s) - start))
+    asof_stats
+    psql -XAt -v ON_ERROR_STOP=1 -c "
+        SELECT (jsonb_build_object('elapsed_s', $elapsed, 'retention_s', $RETENTION,
+                                   'asof', '$asof'::jsonb)
+                || electric_soak_sample()
+                || jsonb_build_object('commit', '$commit', 'server_version', '$server_version'))::text" >>"$OUT"
+    [ "$elapsed" -lt "$DURATION" ] || break
+done
+
+for f in "$logdir"/pgbench_*.out; do
+    grep -q '^tps = ' "$f" || { echo "$(basename "$f"):" >&2; cat "$f" >&2; }
+done
+
+"$here/report.sh" "$OUT"
+echo "Results written to $OUT" >&2
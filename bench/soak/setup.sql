@@ -0,0 +1,101 @@
+-- Soak benchmark schema for bench/soak/run.sh
+--
+--   electric_soak_acl        :users x 10 ACL rows, updated in place by the
+--                            write workload and read as of past snapshots
+--   electric_soak_events     append-mostly table whose oldest rows are
+--                            deleted as new ones arrive (a sliding window)
+--   electric_soak_snapshots  pg_current_snapshot() recorded once a second,
+--                            so readers can ask for "the snapshot N s ago"
+--
+-- psql variables: users, reloptions (table storage parameters, may be empty)
+
+CREATE EXTENSION IF NOT EXISTS electric_poc;
+
+DROP TABLE IF EXISTS electric_soak_acl, electric_soak_events, electric_soak_snapshots;
+
+CREATE TABLE electric_soak_acl (
+    user_id text NOT NULL,
+    doc_id text NOT NULL,
+    allowed boolean NOT NULL,
+    version int NOT NULL DEFAULT 0,
+    PRIMARY KEY (user_id, doc_id)
+);
+
+CREATE TABLE electric_soak_events (
+    id bigserial PRIMARY KEY,
+    user_id text NOT NULL,
+    payload text NOT NULL
+);
+
+INSERT INTO electric_soak_acl (user_id, doc_id, allowed)
+SELECT 'user-' || u, 'doc-' || d, (u + d) % 2 = 0
+FROM generate_series(1, :users) u, generate_series(1, 10) d;
+
+SELECT CASE WHEN :'reloptions' <> '' THEN
+    format('ALTER TABLE electric_soak_acl SET (%1$s); ALTER TABLE electric_soak_events SET (%1$s)',
+           :'reloptions')
+END AS set_reloptions \gset
+\if :{?set_reloptions}
+:set_reloptions
+\endif
+
+ANALYZE electric_soak_acl, electric_soak_events;
+
+CREATE TABLE electric_soak_snapshots (
+    taken_at timestamptz PRIMARY KEY,
+    snapshot text NOT NULL
+);
+
+-- Called once a second by the recorder; keeps a day of snapshots
+CREATE OR REPLACE FUNCTION electric_soak_record() RETURNS void
+LANGUAGE sql AS $$
+    INSERT INTO electric_soak_snapshots
+    VALUES (clock_timestamp(), pg_current_snapshot()::text)
+    ON CONFLICT DO NOTHING;
+    DELETE FROM electric_soak_snapshots WHERE taken_at < now() - interval '1 day';
+$$;
+
+-- The newest snapshot at least age_s seconds old, or the oldest one while
+-- the run is younger than age_s
+CREATE OR REPLACE FUNCTION electric_soak_snapshot(age_s int) RETURNS pg_snapshot
+LANGUAGE sql STABLE AS $$
+    SELECT coalesce(
+        (SELECT snapshot FROM electric_soak_snapshots
+         WHERE taken_at <= now() - make_interval(secs => age_s)
+         ORDER BY taken_at DESC LIMIT 1),
+        (SELECT snapshot FROM electric_soak_snapshots ORDER BY taken_at LIMIT 1)
+    )::pg_snapshot;
+$$;
+
+-- One time-series point: size, tuple and vacuum counters of both tables,
+-- running autovacuum workers, and how far back the xmin horizon is held
+CREATE OR REPLACE FUNCTION electric_soak_sample() RETURNS jsonb
+LANGUAGE sql AS $$
+    SELECT jsonb_build_object(
+        'at', clock_timestamp(),
+        'tables', (
+            SELECT jsonb_object_agg(relname, jsonb_build_object(
+                'total_bytes', pg_total_relation_size(relid),
+                'heap_bytes', pg_relation_size(relid),
+                'live_tup', n_live_tup,
+                'dead_tup', n_dead_tup,
+                'n_tup_ins', n_tup_ins,
+                'n_tup_upd', n_tup_upd,
+                'n_tup_del', n_tup_del,
+                'autovacuum_count', autovacuum_count,
+                'autoanalyze_count', autoanalyze_count,
+                'last_autovacuum', last_autovacuum))
+            FROM pg_stat_user_tables
+            WHERE relname IN ('electric_soak_acl', 'electric_soak_events')),
+        'autovacuum_running', (
+            SELECT count(*) FROM pg_stat_activity
+            WHERE backend_type = 'autovacuum worker' AND query LIKE '%electric_soak_%'),
+        'horizon_age_xids', (
+            SELECT max(a) FROM (
+                SELECT age(backend_xmin) AS a FROM pg_stat_activity WHERE backend_xmin IS NOT NULL
+                UNION ALL
+                SELECT age(backend_xid) FROM pg_stat_activity WHERE backend_xid IS NOT NULL
+                UNION ALL
+                SELECT age(xmin) FROM pg_replication_slots WHERE xmin IS NOT NULL) h)
+    );
+$$;
@@ -0,0 +1,10 @@
+-- Mixed writes: flip one ACL row, append an event, drop the event that fell
+-- out of the :events-row window
+\set uid random(1, :users)
+\set doc random(1, 10)
+BEGIN;
+UPDATE electric_soak_acl SET allowed = NOT allowed, version = version + 1
+WHERE user_id = 'user-' || :uid AND doc_id = 'doc-' || :doc;
+INSERT INTO electric_soak_events (user_id, payload) VALUES ('user-' || :uid, repeat('e', 200));
+DELETE FROM electric_soak_events WHERE id = currval('electric_soak_events_id_seq') - :events;
+COMMIT;
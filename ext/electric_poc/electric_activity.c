@@ -0,0 +1,318 @@
+/*
+ * electric_activity.c - per-backend synthetic snapshot status
+ *	(pg_stat_electric_activity)
+ *
+ * Each backend owns one slot, indexed by its pgprocno, holding the synthetic
+ * snapshot it currently runs under and what it is waiting for. Writers use
+ * the same changecount protocol as PgBackendStatus: bump to odd, write, bump
+ * to even. Readers copy the slot and retry until they see a stable even
+ * count, so neither side ever takes a lock.
+ *
+ * PG16 has a single WAIT_EVENT_EXTENSION for extensions, so waits also set
+ * our own wait_event here, which pg_stat_electric_activity reports next to
+ * pg_stat_activity's "Extension".
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_activity);
+
+typedef struct ElectricActivitySlot
+{
+	uint32		changecount;
+	int			pid;			/* 0 if the slot is unused */
+	Oid			dbid;
+	Oid			userid;
+	ElectricActivitySource source;
+	TransactionId xmin;
+	TransactionId xmax;
+	uint32		xcnt;
+	TimestampTz since;			/* when the snapshot was installed */
+	ElectricWaitEvent wait_event;
+	TimestampTz wait_start;
+} ElectricActivitySlot;
+
+static ElectricActivitySlot *electric_activity_slots = NULL;
+static int	electric_activity_nslots = 0;
+static ElectricActivitySlot *my_slot = NULL;
+
+static const char *const electric_source_names[] = {
+	NULL,
+	"exec_as_of",
+	"explain_as_of",
+	"snapshot_guc",
+	"server",
+};
+
+static const char *const electric_wait_names[] = {
+	NULL,
+	"SnapshotAvailability",
+	"Admission",
+	"Coalesce",
+};
+
+#define ACTIVITY_BEGIN_WRITE(slot) \
+	do { \
+		START_CRIT_SECTION(); \
+		(slot)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define ACTIVITY_END_WRITE(slot) \
+	do { \
+		pg_write_barrier(); \
+		(slot)->changecount++; \
+		Assert(((slot)->changecount & 1) == 0); \
+		END_CRIT_SECTION(); \
+	} while (0)
+
+Size
+electric_activity_shmem_size(void)
+{
+	/* Only regular backends and background workers run as-of reads */
+	return mul_size(MaxBackends, sizeof(ElectricActivitySlot));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_activity_shmem_init(void)
+{
+	bool		found;
+
+	electric_activity_nslots = MaxBackends;
+	electric_activity_slots = ShmemInitStruct("electric_poc activity",
+											  electric_activity_shmem_size(),
+											  &found);
+	if (!found)
+		memset(electric_activity_slots, 0, electric_activity_shmem_size());
+}
+
+static void
+electric_activity_shmem_exit(int code, Datum arg)
+{
+	ElectricActivitySlot *slot = my_slot;
+
+	ACTIVITY_BEGIN_WRITE(slot);
+	slot->pid = 0;
+	slot->source = ELECTRIC_ACTIVITY_NONE;
+	slot->wait_event = ELECTRIC_WAIT_NONE;
+	ACTIVITY_END_WRITE(slot);
+
+	my_slot = NULL;
+}
+
+/* This backend's slot, claimed on first use; NULL without shared memory */
+static ElectricActivitySlot *
+electric_activity_my_slot(void)
+{
+	if (my_slot != NULL)
+		return my_slot;
+	if (electric_activity_slots == NULL || MyProc == NULL ||
+		MyProc->pgprocno >= electric_activity_nslots)
+		return NULL;
+
+	my_slot = &electric_activity_slots[MyProc->pgprocno];
+
+	ACTIVITY_BEGIN_WRITE(my_slot);
+	my_slot->pid = MyProcPid;
+	my_slot->dbid = MyDatabaseId;
+	my_slot->source = ELECTRIC_ACTIVITY_NONE;
+	my_slot->wait_event = ELECTRIC_WAIT_NONE;
+	ACTIVITY_END_WRITE(my_slot);
+
+	before_shmem_exit(electric_activity_shmem_exit, (Datum) 0);
+	return my_slot;
+}
+
+/*
+ * Publish the synthetic snapshot this backend now runs under, or clear it
+ * (source ELECTRIC_ACTIVITY_NONE, snap NULL).
+ */
+void
+electric_activity_report(ElectricActivitySource source, Snapshot snap)
+{
+	ElectricActivitySlot *slot;
+
+	/* Nothing to clear if we never published anything */
+	if (source == ELECTRIC_ACTIVITY_NONE && my_slot == NULL)
+		return;
+
+	slot = electric_activity_my_slot();
+	if (slot == NULL)
+		return;
+
+	ACTIVITY_BEGIN_WRITE(slot);
+	slot->source = source;
+	slot->userid = GetUserId();
+	if (source != ELECTRIC_ACTIVITY_NONE && snap != NULL)
+	{
+		slot->xmin = snap->xmin;
+		slot->xmax = snap->xmax;
+		slot->xcnt = snap->xcnt;
+		slot->since = GetCurrentTimestamp();
+	}
+	else
+	{
+		slot->xmin = InvalidTransactionId;
+		slot->xmax = InvalidTransactionId;
+		slot->xcnt = 0;
+		slot->since = 0;
+	}
+	ACTIVITY_END_WRITE(slot);
+}
+
+/*
+ * Bracket a wait. Shows as wait_event_type "Extension" in pg_stat_activity
+ * and with our own name in pg_stat_electric_activity.
+ */
+void
+electric_activity_wait_start(ElectricWaitEvent event)
+{
+	ElectricActivitySlot *slot = electric_activity_my_slot();
+
+	if (slot != NULL)
+	{
+		ACTIVITY_BEGIN_WRITE(slot);
+		slot->wait_event = event;
+		slot->wait_start = GetCurrentTimestamp();
+		ACTIVITY_END_WRITE(slot);
+	}
+	pgstat_report_wait_start(WAIT_EVENT_EXTENSION);
+}
+
+void
+electric_activity_wait_end(void)
+{
+	pgstat_report_wait_end();
+
+	if (my_slot != NULL && my_slot->wait_event != ELECTRIC_WAIT_NONE)
+	{
+		ACTIVITY_BEGIN_WRITE(my_slot);
+		my_slot->wait_event = ELECTRIC_WAIT_NONE;
+		my_slot->wait_start = 0;
+		ACTIVITY_END_WRITE(my_slot);
+	}
+}
+
+/* Copy a slot consistently (see the changecount protocol above) */
+static void
+electric_activity_read_slot(volatile ElectricActivitySlot *slot, ElectricActivitySlot *copy)
+{
+	for (;;)
+	{
+		uint32		before = slot->changecount;
+		uint32		after;
+
+		pg_read_barrier();
+		memcpy(copy, (ElectricActivitySlot *) slot, sizeof(ElectricActivitySlot));
+		pg_read_barrier();
+		after = slot->changecount;
+
+		if (before == after && (before & 1) == 0)
+			break;
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Oldest xmin of the synthetic snapshots backends run under right now, or
+ * InvalidTransactionId if there are none (or no shared memory). The
+ * snapshots are not in the ProcArray, so electric_prune() asks here.
+ */
+TransactionId
+electric_activity_oldest_xmin(void)
+{
+	TransactionId oldest = InvalidTransactionId;
+	int			i;
+
+	if (electric_activity_slots == NULL)
+		return InvalidTransactionId;
+
+	for (i = 0; i < electric_activity_nslots; i++)
+	{
+		ElectricActivitySlot slot;
+
+		electric_activity_read_slot(&electric_activity_slots[i], &slot);
+		if (slot.pid == 0 || slot.source == ELECTRIC_ACTIVITY_NONE ||
+			!TransactionIdIsNormal(slot.xmin))
+			continue;
+		if (!TransactionIdIsValid(oldest) || TransactionIdPrecedes(slot.xmin, oldest))
+			oldest = slot.xmin;
+	}
+	return oldest;
+}
+
+/*
+ * SQL: pg_stat_electric_activity() -> one row per backend running under a
+ * synthetic snapshot or waiting in electric_poc
+ */
+Datum
+electric_activity(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int			i;
+
+	if (electric_activity_slots == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	for (i = 0; i < electric_activity_nslots; i++)
+	{
+		ElectricActivitySlot slot;
+		Datum		values[11];
+		bool		nulls[11];
+
+		electric_activity_read_slot(&electric_activity_slots[i], &slot);
+		if (slot.pid == 0 ||
+			(slot.source == ELECTRIC_ACTIVITY_NONE && slot.wait_event == ELECTRIC_WAIT_NONE))
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(slot.pid);
+		values[1] = ObjectIdGetDatum(slot.dbid);
+		values[2] = ObjectIdGetDatum(slot.userid);
+		if (slot.source != ELECTRIC_ACTIVITY_NONE)
+		{
+			values[3] = CStringGetTextDatum(electric_source_names[slot.source]);
+			values[4] = TransactionIdGetDatum(slot.xmin);
+			values[5] = TransactionIdGetDatum(slot.xmax);
+			values[6] = Int32GetDatum((int32) slot.xcnt);
+			values[7] = Int64GetDatum((int64) electric_snapshot_age(slot.xmax));
+			values[8] = TimestampTzGetDatum(slot.since);
+		}
+		else
+		{
+			nulls[3] = nulls[4] = nulls[5] = nulls[6] = nulls[7] = nulls[8] = true;
+		}
+		if (slot.wait_event != ELECTRIC_WAIT_NONE)
+		{
+			values[9] = CStringGetTextDatum(electric_wait_names[slot.wait_event]);
+			values[10] = TimestampTzGetDatum(slot.wait_start);
+		}
+		else
+		{
+			nulls[9] = nulls[10] = true;
+		}
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,514 @@
+/*
+ * electric_admission.c - admission control for electric_exec_as_of()
+ *	(electric.max_concurrent, pg_stat_electric_admission)
+ *
+ * A weighted semaphore in shared memory caps how much historical reading
+ * runs at once. Every call takes electric.admission_weight units (settable
+ * per role with ALTER ROLE ... SET) out of electric.max_concurrent; a call
+ * that doesn't fit queues until enough is released, or until
+ * electric.admission_timeout passes (SQLSTATE 53L01).
+ *
+ * The queue is fair between roles: when capacity frees up, the waiter whose
+ * role has the least weight running goes first, FIFO within a role. Only
+ * that waiter is considered, so a heavy call can't be starved by lighter ones
+ * slipping past it. Releasing backends grant admission and set the waiter's
+ * latch, so waiters never poll the lock.
+ *
+ * Per-role counters (queue depth, waits, timeouts, wait time) are kept for
+ * the first ELECTRIC_ADMISSION_ROLES roles seen; later roles share one entry.
+ * A nested call (electric_exec_as_of() inside an as-of query) runs under its
+ * caller's admission.
+ *
+ * A backend that exits while queued or admitted (FATAL, postmaster death)
+ * runs no PG_CATCH block, so an exit callback takes it out of the queue or
+ * gives its admission back; otherwise its pgprocno would stay linked.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_admission_stats);
+
+/* Roles with their own counters; the entry after them is shared by the rest */
+#define ELECTRIC_ADMISSION_ROLES 64
+
+typedef struct ElectricAdmissionRole
+{
+	Oid			roleid;			/* InvalidOid: unused, or the shared entry */
+	bool		used;
+	int			running;		/* calls admitted and not yet released */
+	int			running_weight;
+	int			queued;
+	uint64		admitted;		/* all admissions, immediate or after a wait */
+	uint64		waited;			/* admissions that had to queue */
+	uint64		timed_out;
+	double		wait_time;		/* ms, over waited */
+	double		max_wait_time;
+} ElectricAdmissionRole;
+
+/* One per backend, indexed by pgprocno */
+typedef struct ElectricAdmissionWaiter
+{
+	int			next;			/* next in the queue, -1 at the tail */
+	int			role;			/* index into roles[] */
+	int			weight;
+	bool		granted;		/* set by whoever admitted us */
+	TimestampTz enqueued;
+} ElectricAdmissionWaiter;
+
+typedef struct ElectricAdmissionShared
+{
+	LWLock	   *lock;
+	int			running_weight;
+	int			head;			/* oldest waiter, -1 if none */
+	int			tail;
+	ElectricAdmissionRole roles[ELECTRIC_ADMISSION_ROLES + 1];
+	ElectricAdmissionWaiter waiters[FLEXIBLE_ARRAY_MEMBER];
+} ElectricAdmissionShared;
+
+/* GUCs */
+int			electric_max_concurrent = 0;
+int			electric_admission_weight = 1;
+int			electric_admission_timeout = 0;
+
+static ElectricAdmissionShared *electric_admission = NULL;
+static int	electric_admission_nwaiters = 0;
+
+/* This backend's admission, if it holds one or is queued for one */
+static bool admission_held = false;
+static bool admission_queued = false;
+static int	admission_role;
+static int	admission_weight;
+static bool admission_exit_registered = false;
+
+Size
+electric_admission_shmem_size(void)
+{
+	return add_size(offsetof(ElectricAdmissionShared, waiters),
+					mul_size(MaxBackends, sizeof(ElectricAdmissionWaiter)));
+}
+
+void
+electric_admission_shmem_request(void)
+{
+	RequestAddinShmemSpace(electric_admission_shmem_size());
+	RequestNamedLWLockTranche("electric_poc admission", 1);
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_admission_shmem_init(void)
+{
+	bool		found;
+
+	electric_admission_nwaiters = MaxBackends;
+	electric_admission = ShmemInitStruct("electric_poc admission",
+										 electric_admission_shmem_size(),
+										 &found);
+	if (!found)
+	{
+		memset(electric_admission, 0, electric_admission_shmem_size());
+		electric_admission->lock = &(GetNamedLWLockTranche("electric_poc admission"))->lock;
+		electric_admission->head = -1;
+		electric_admission->tail = -1;
+	}
+}
+
+/* Counters for a role, claiming an entry on first use. Lock held exclusively. */
+static int
+electric_admission_role(Oid roleid)
+{
+	int			i;
+
+	for (i = 0; i < ELECTRIC_ADMISSION_ROLES; i++)
+	{
+		ElectricAdmissionRole *role = &electric_admission->roles[i];
+
+		if (role->used && role->roleid == roleid)
+			return i;
+		if (!role->used)
+		{
+			role->used = true;
+			role->roleid = roleid;
+			return i;
+		}
+	}
+	electric_admission->roles[ELECTRIC_ADMISSION_ROLES].used = true;
+	return ELECTRIC_ADMISSION_ROLES;
+}
+
+static void
+electric_admission_unlink(int procno)
+{
+	ElectricAdmissionShared *shared = electric_admission;
+	int			prev = -1;
+	int			cur;
+
+	for (cur = shared->head; cur != -1; prev = cur, cur = shared->waiters[cur].next)
+	{
+		if (cur != procno)
+			continue;
+		if (prev == -1)
+			shared->head = shared->waiters[cur].next;
+		else
+			shared->waiters[prev].next = shared->waiters[cur].next;
+		if (shared->tail == cur)
+			shared->tail = prev;
+		shared->waiters[cur].next = -1;
+		shared->roles[shared->waiters[cur].role].queued--;
+		return;
+	}
+}
+
+/*
+ * Admit waiters while the one to go next fits. Lock held exclusively.
+ */
+static void
+electric_admission_grant(int capacity)
+{
+	ElectricAdmissionShared *shared = electric_admission;
+	TimestampTz now = 0;
+
+	while (shared->head != -1)
+	{
+		int			best = -1;
+		int			cur;
+		ElectricAdmissionWaiter *w;
+		ElectricAdmissionRole *role;
+		double		waited_ms;
+
+		/* Least weight running for its role, oldest on ties */
+		for (cur = shared->head; cur != -1; cur = shared->waiters[cur].next)
+		{
+			if (best == -1 ||
+				shared->roles[shared->waiters[cur].role].running_weight <
+				shared->roles[shared->waiters[best].role].running_weight)
+				best = cur;
+		}
+
+		w = &shared->waiters[best];
+		if (capacity > 0 && shared->running_weight > 0 &&
+			shared->running_weight + w->weight > capacity)
+			break;
+
+		electric_admission_unlink(best);
+		role = &shared->roles[w->role];
+		shared->running_weight += w->weight;
+		role->running++;
+		role->running_weight += w->weight;
+		role->admitted++;
+		role->waited++;
+
+		if (now == 0)
+			now = GetCurrentTimestamp();
+		waited_ms = (double) (now - w->enqueued) / 1000.0;
+		role->wait_time += waited_ms;
+		role->max_wait_time = Max(role->max_wait_time, waited_ms);
+
+		w->granted = true;
+		SetLatch(&GetPGProcByNumber(best)->procLatch);
+	}
+}
+
+/*
+ * Give back this backend's admission. Lock held exclusively.
+ */
+static void
+electric_admission_release_locked(void)
+{
+	ElectricAdmissionRole *role = &electric_admission->roles[admission_role];
+
+	electric_admission->running_weight -= admission_weight;
+	role->running--;
+	role->running_weight -= admission_weight;
+	admission_held = false;
+	electric_admission_grant(electric_max_concurrent);
+}
+
+/*
+ * Leave the queue or give back the admission on backend exit
+ */
+static void
+electric_admission_shmem_exit(int code, Datum arg)
+{
+	ElectricAdmissionShared *shared = electric_admission;
+
+	if (!admission_queued && !admission_held)
+		return;
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	if (admission_queued)
+	{
+		ElectricAdmissionWaiter *me = &shared->waiters[MyProc->pgprocno];
+
+		if (me->granted)
+			admission_held = true;
+		else
+		{
+			electric_admission_unlink(MyProc->pgprocno);
+			electric_admission_grant(electric_max_concurrent);
+		}
+		admission_queued = false;
+	}
+	if (admission_held)
+		electric_admission_release_locked();
+	LWLockRelease(shared->lock);
+}
+
+/*
+ * Wait until this call may run. Returns true if it took an admission, which
+ * the caller must give back with electric_admission_release(); false if
+ * admission control is off or an enclosing call already holds one.
+ */
+bool
+electric_admission_acquire(void)
+{
+	ElectricAdmissionShared *shared = electric_admission;
+	int			capacity = electric_max_concurrent;
+	int			procno;
+	ElectricAdmissionWaiter *me;
+	volatile ElectricAdmissionWaiter *vme;
+	TimestampTz deadline = 0;
+	bool		granted;
+
+	if (capacity <= 0 || shared == NULL || admission_held || MyProc == NULL ||
+		MyProc->pgprocno >= electric_admission_nwaiters)
+		return false;
+
+	procno = MyProc->pgprocno;
+	me = &shared->waiters[procno];
+	vme = me;
+
+	if (!admission_exit_registered)
+	{
+		before_shmem_exit(electric_admission_shmem_exit, (Datum) 0);
+		admission_exit_registered = true;
+	}
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	admission_role = electric_admission_role(GetUserId());
+	/* A call heavier than the whole capacity runs alone */
+	admission_weight = Min(electric_admission_weight, capacity);
+
+	me->role = admission_role;
+	me->weight = admission_weight;
+	me->granted = false;
+	me->next = -1;
+
+	if (shared->head == -1 && shared->running_weight + admission_weight <= capacity)
+	{
+		ElectricAdmissionRole *role = &shared->roles[admission_role];
+
+		shared->running_weight += admission_weight;
+		role->running++;
+		role->running_weight += admission_weight;
+		role->admitted++;
+		admission_held = true;
+		LWLockRelease(shared->lock);
+		return true;
+	}
+
+	/* Queue up; the fair pick may still be us */
+	me->enqueued = GetCurrentTimestamp();
+	if (shared->tail == -1)
+		shared->head = procno;
+	else
+		shared->waiters[shared->tail].next = procno;
+	shared->tail = procno;
+	shared->roles[admission_role].queued++;
+	admission_queued = true;
+	electric_admission_grant(capacity);
+	granted = me->granted;
+	if (granted)
+		admission_queued = false;
+	LWLockRelease(shared->lock);
+
+	if (granted)
+	{
+		admission_held = true;
+		return true;
+	}
+
+	if (electric_admission_timeout > 0)
+		deadline = TimestampTzPlusMilliseconds(me->enqueued, electric_admission_timeout);
+
+	electric_activity_wait_start(ELECTRIC_WAIT_ADMISSION);
+	PG_TRY();
+	{
+		while (!vme->granted)
+		{
+			long		timeout_ms = -1;
+			int			flags = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+
+			if (deadline != 0)
+			{
+				timeout_ms = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+				if (timeout_ms <= 0)
+					break;
+				flags |= WL_TIMEOUT;
+			}
+
+			(void) WaitLatch(MyLatch, flags, timeout_ms, WAIT_EVENT_EXTENSION);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	PG_CATCH();
+	{
+		/* Cancelled while queued: leave the queue, or hand back a late grant */
+		LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+		if (me->granted)
+			electric_admission_release_locked();
+		else
+		{
+			electric_admission_unlink(procno);
+			electric_admission_grant(capacity);
+		}
+		admission_queued = false;
+		LWLockRelease(shared->lock);
+		electric_activity_wait_end();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	electric_activity_wait_end();
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	granted = me->granted;
+	admission_queued = false;
+	if (!granted)
+	{
+		electric_admission_unlink(procno);
+		shared->roles[admission_role].timed_out++;
+		/* The waiter behind us may fit where we didn't */
+		electric_admission_grant(capacity);
+	}
+	LWLockRelease(shared->lock);
+
+	if (!granted)
+		ereport(ERROR,
+				(errcode(ERRCODE_ELECTRIC_ADMISSION_TIMEOUT),
+				 errmsg("electric_exec_as_of was not admitted within electric.admission_timeout (%d ms)",
+						electric_admission_timeout),
+				 errdetail("electric.max_concurrent (%d) was in use by other calls.", capacity)));
+
+	admission_held = true;
+	return true;
+}
+
+void
+electric_admission_release(void)
+{
+	if (!admission_held)
+		return;
+
+	LWLockAcquire(electric_admission->lock, LW_EXCLUSIVE);
+	electric_admission_release_locked();
+	LWLockRelease(electric_admission->lock);
+}
+
+/* Transaction abort: a call that didn't clean up gives its admission back */
+void
+electric_admission_reset(void)
+{
+	electric_admission_release();
+}
+
+/* pg_stat_electric_reset(): counters only; running and queued stay */
+void
+electric_admission_stats_reset(void)
+{
+	int			i;
+
+	if (electric_admission == NULL)
+		return;
+
+	LWLockAcquire(electric_admission->lock, LW_EXCLUSIVE);
+	for (i = 0; i <= ELECTRIC_ADMISSION_ROLES; i++)
+	{
+		ElectricAdmissionRole *role = &electric_admission->roles[i];
+
+		role->admitted = 0;
+		role->waited = 0;
+		role->timed_out = 0;
+		role->wait_time = 0;
+		role->max_wait_time = 0;
+	}
+	LWLockRelease(electric_admission->lock);
+}
+
+/*
+ * SQL: pg_stat_electric_admission() -> one row per role that has run as-of
+ * calls under admission control
+ */
+Datum
+electric_admission_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ElectricAdmissionShared *shared = electric_admission;
+	TimestampTz oldest[ELECTRIC_ADMISSION_ROLES + 1];
+	int			i;
+
+	if (shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	memset(oldest, 0, sizeof(oldest));
+	LWLockAcquire(shared->lock, LW_SHARED);
+
+	/* The queue is in arrival order, so the first waiter seen is the oldest */
+	for (i = shared->head; i != -1; i = shared->waiters[i].next)
+	{
+		if (oldest[shared->waiters[i].role] == 0)
+			oldest[shared->waiters[i].role] = shared->waiters[i].enqueued;
+	}
+
+	for (i = 0; i <= ELECTRIC_ADMISSION_ROLES; i++)
+	{
+		ElectricAdmissionRole *role = &shared->roles[i];
+		Datum		values[10];
+		bool		nulls[10];
+
+		if (!role->used)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		if (i < ELECTRIC_ADMISSION_ROLES)
+			values[0] = ObjectIdGetDatum(role->roleid);
+		else
+			nulls[0] = true;
+		values[1] = Int32GetDatum(role->running);
+		values[2] = Int32GetDatum(role->running_weight);
+		values[3] = Int32GetDatum(role->queued);
+		if (oldest[i] != 0)
+			values[4] = TimestampTzGetDatum(oldest[i]);
+		else
+			nulls[4] = true;
+		values[5] = Int64GetDatum((int64) role->admitted);
+		values[6] = Int64GetDatum((int64) role->waited);
+		values[7] = Int64GetDatum((int64) role->timed_out);
+		values[8] = Float8GetDatum(role->wait_time);
+		values[9] = Float8GetDatum(role->max_wait_time);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	LWLockRelease(shared->lock);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * electric_bench.c - microbenchmarks of electric_exec_as_of()'s primitives
+ *
+ * Each SQL function runs one primitive in a tight loop on synthetic input
+ * and returns nanoseconds per operation, without network or executor noise:
+ *
+ *   electric_bench_parse_snapshot(xcnt, iterations)   electric_parse_snapshot_text()
+ *   electric_bench_create_snapshot(xcnt, iterations)  create_custom_snapshot()
+ *   electric_bench_parse_args(nargs, iterations)      build_text_params()
+ *   electric_bench_json_result(nrows, ncols, width, iterations)
+ *       nrows rows through the JSON receiver plus the final jsonb_in(),
+ *       i.e. everything electric_exec_as_of() does to wrap a result
+ *
+ * Only built with "make bench" (ELECTRIC_BENCH=1); the SQL definitions are in
+ * electric_poc_bench.sql.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/transam.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_bench_parse_snapshot);
+PG_FUNCTION_INFO_V1(electric_bench_create_snapshot);
+PG_FUNCTION_INFO_V1(electric_bench_parse_args);
+PG_FUNCTION_INFO_V1(electric_bench_json_result);
+
+/* Largest synthetic input sizes we accept */
+#define ELECTRIC_BENCH_MAX_XCNT		1000000
+#define ELECTRIC_BENCH_MAX_ARGS		65535
+#define ELECTRIC_BENCH_MAX_COLS		1600
+
+typedef void (*ElectricBenchFn) (void *arg);
+
+/*
+ * Run fn(arg) iterations times and return ns per call. Allocations go to a
+ * context that is reset every 1024 calls, which is also when we check for
+ * interrupts, so neither shows up in the per-call cost.
+ */
+static float8
+electric_bench_run(ElectricBenchFn fn, void *arg, int32 iterations)
+{
+	MemoryContext cxt;
+	MemoryContext oldcxt;
+	instr_time	start;
+	instr_time	end;
+	int32		i;
+
+	if (iterations < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("iterations must be at least 1")));
+
+	cxt = AllocSetContextCreate(CurrentMemoryContext,
+								"electric_bench",
+								ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(cxt);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++)
+	{
+		fn(arg);
+		if ((i & 1023) == 1023)
+		{
+			MemoryContextReset(cxt);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(cxt);
+
+	return (float8) INSTR_TIME_GET_NANOSEC(end) / iterations;
+}
+
+static void
+electric_bench_check_range(const char *name, int32 value, int32 max)
+{
+	if (value < 0 || value > max)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("%s must be between 0 and %d", name, max)));
+}
+
+/* "xmin:xmax:xip" with xcnt in-progress xids, every other xid from xmin */
+static char *
+electric_bench_snapshot_text(int32 xcnt)
+{
+	StringInfoData buf;
+	TransactionId xmin = FirstNormalTransactionId + 1000;
+	int32		i;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%u:%u:", xmin, xmin + 2 * xcnt + 1);
+	for (i = 0; i < xcnt; i++)
+		appendStringInfo(&buf, "%s%u", i > 0 ? "," : "", xmin + 2 * i);
+	return buf.data;
+}
+
+static void
+bench_parse_snapshot(void *arg)
+{
+	ElectricParsedSnapshot *parsed = electric_parse_snapshot_text((const char *) arg);
+
+	/* parsed lives in TopTransactionContext */
+	if (parsed->xip != NULL)
+		pfree(parsed->xip);
+	pfree(parsed);
+}
+
+Datum
+electric_bench_parse_snapshot(PG_FUNCTION_ARGS)
+{
+	int32		xcnt = PG_GETARG_INT32(0);
+	int32		iterations = PG_GETARG_INT32(1);
+
+	electric_bench_check_range("xcnt", xcnt, ELECTRIC_BENCH_MAX_XCNT);
+	PG_RETURN_FLOAT8(electric_bench_run(bench_parse_snapshot,
+										electric_bench_snapshot_text(xcnt),
+										iterations));
+}
+
+static void
+bench_create_snapshot(void *arg)
+{
+	/* a single TopTransactionContext chunk */
+	pfree(create_custom_snapshot((const char *) arg));
+}
+
+Datum
+electric_bench_create_snapshot(PG_FUNCTION_ARGS)
+{
+	int32		xcnt = PG_GETARG_INT32(0);
+	int32		iterations = PG_GETARG_INT32(1);
+
+	electric_bench_check_range("xcnt", xcnt, ELECTRIC_BENCH_MAX_XCNT);
+	PG_RETURN_FLOAT8(electric_bench_run(bench_create_snapshot,
+										electric_bench_snapshot_text(xcnt),
+										iterations));
+}
+
+static void
+bench_parse_args(void *arg)
+{
+	int			nargs;
+	Oid		   *argtypes;
+
+	(void) build_text_params((Jsonb *) arg, &nargs, &argtypes);
+}
+
+Datum
+electric_bench_parse_args(PG_FUNCTION_ARGS)
+{
+	int32		nargs = PG_GETARG_INT32(0);
+	int32		iterations = PG_GETARG_INT32(1);
+	StringInfoData buf;
+	int32		i;
+
+	electric_bench_check_range("nargs", nargs, ELECTRIC_BENCH_MAX_ARGS);
+
+	/* Alternate strings and numbers, as auth checks pass ids of both kinds */
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '[');
+	for (i = 0; i < nargs; i++)
+	{
+		if (i > 0)
+			appendStringInfoChar(&buf, ',');
+		if (i % 2 == 0)
+			appendStringInfo(&buf, "\"user-%d\"", i);
+		else
+			appendStringInfo(&buf, "%d", i * 1000);
+	}
+	appendStringInfoChar(&buf, ']');
+
+	PG_RETURN_FLOAT8(electric_bench_run(bench_parse_args,
+										DatumGetJsonbP(DirectFunctionCall1(jsonb_in,
+																		   CStringGetDatum(buf.data))),
+										iterations));
+}
+
+typedef struct BenchJsonArg
+{
+	ElectricJsonReceiver receiver;
+	StringInfoData buf;
+	TupleTableSlot *slot;
+	int32		nrows;
+} BenchJsonArg;
+
+static void
+bench_json_result(void *arg)
+{
+	BenchJsonArg *b = (BenchJsonArg *) arg;
+	DestReceiver *dest = (DestReceiver *) &b->receiver;
+	int32		i;
+
+	resetStringInfo(&b->buf);
+	appendStringInfoChar(&b->buf, '[');
+	b->receiver.nrows = 0;
+	for (i = 0; i < b->nrows; i++)
+		dest->receiveSlot(b->slot, dest);
+	appendStringInfoChar(&b->buf, ']');
+	(void) DirectFunctionCall1(jsonb_in, CStringGetDatum(b->buf.data));
+}
+
+Datum
+electric_bench_json_result(PG_FUNCTION_ARGS)
+{
+	int32		nrows = PG_GETARG_INT32(0);
+	int32		ncols = PG_GETARG_INT32(1);
+	int32		width = PG_GETARG_INT32(2);
+	int32		iterations = PG_GETARG_INT32(3);
+	BenchJsonArg b;
+	instr_time	serialize_time;
+	TupleDesc	tupdesc;
+	char	   *value;
+	float8		result;
+	int32		i;
+
+	electric_bench_check_range("nrows", nrows, INT_MAX);
+	electric_bench_check_range("ncols", ncols, ELECTRIC_BENCH_MAX_COLS);
+	electric_bench_check_range("width", width, (int32) (MaxAllocSize / 2));
+
+	/* ncols text columns of width characters each */
+	tupdesc = CreateTemplateTupleDesc(ncols);
+	for (i = 0; i < ncols; i++)
+	{
+		char		name[NAMEDATALEN];
+
+		snprintf(name, sizeof(name), "c%d", i + 1);
+		TupleDescInitEntry(tupdesc, (AttrNumber) (i + 1), name, TEXTOID, -1, 0);
+	}
+	value = palloc(width + 1);
+	memset(value, 'x', width);
+	value[width] = '\0';
+
+	b.slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsVirtual);
+	ExecClearTuple(b.slot);
+	for (i = 0; i < ncols; i++)
+	{
+		b.slot->tts_values[i] = CStringGetTextDatum(value);
+		b.slot->tts_isnull[i] = false;
+	}
+	ExecStoreVirtualTuple(b.slot);
+	b.nrows = nrows;
+
+	INSTR_TIME_SET_ZERO(serialize_time);
+	initStringInfo(&b.buf);
+	electric_json_receiver_init(&b.receiver, &b.buf, &serialize_time);
+	b.receiver.pub.rStartup((DestReceiver *) &b.receiver, CMD_SELECT, tupdesc);
+
+	result = electric_bench_run(bench_json_result, &b, iterations);
+
+	MemoryContextDelete(b.receiver.row_cxt);
+	ExecDropSingleTupleTableSlot(b.slot);
+
+	PG_RETURN_FLOAT8(result);
+}
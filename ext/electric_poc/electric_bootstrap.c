@@ -0,0 +1,464 @@
+/*
+ * electric_bootstrap.c - the snapshot a replication stream position stands for
+ *
+ * A shape bootstrapped at LSN L must see exactly the transactions whose
+ * commit records come before L; the stream from L delivers the rest. The
+ * usual way to get that snapshot is to create a slot with an exported
+ * snapshot per bootstrap. electric_snapshot_at_lsn() computes it from the WAL
+ * instead, so any number of shapes can start from positions of one slot's
+ * stream:
+ *
+ *   1. Read the WAL from a point known to be kept (the last checkpoint's redo
+ *      pointer, else the newest slot restart_lsn before L) up to L, noting
+ *      every commit and abort and the last running-xacts record R before L.
+ *      Without a target LSN, a running-xacts record is logged right away
+ *      and L is its end.
+ *   2. Xids below R's nextXid that R does not list had finished before R.
+ *      Every other xid assigned before L (R's list, and nextXid up to the
+ *      largest xid seen in a record before L) is running at L unless its
+ *      commit or abort record was read.
+ *   3. R is not atomic with the WAL: a transaction it lists may have written
+ *      its commit record before the reading started. So an xid that clog says
+ *      committed, though no record was read, is looked for past L; it was
+ *      running at L only if its commit record turns up there.
+ *
+ * The result is the same ElectricParsedSnapshot electric_parse_snapshot_text
+ * produces, xip holding subtransaction xids too where R lists them. R's
+ * subxids are missing if it overflowed; like the rest of the POC, such
+ * subtransactions are then not tracked.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "access/rmgr.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "access/xlogreader.h"
+#include "access/xlogutils.h"
+#include "catalog/pg_type_d.h"
+#include "lib/stringinfo.h"
+#include "replication/slot.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/spin.h"
+#include "storage/standby.h"
+#include "storage/standbydefs.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_snapshot_at_lsn);
+
+typedef struct ElectricXidStatus
+{
+	TransactionId xid;			/* hash key */
+	bool		committed;
+} ElectricXidStatus;
+
+typedef struct ElectricWalScan
+{
+	XLogReaderState *reader;
+	ReadLocalXLogPageNoWaitPrivate *private_data;
+	HTAB	   *finished;		/* commits and aborts read so far */
+	xl_running_xacts *running;	/* last running-xacts record, palloc'd */
+	TransactionId max_xid;		/* largest xid of a record read */
+} ElectricWalScan;
+
+typedef struct ElectricXipBuilder
+{
+	TransactionId *xids;
+	uint32		xcnt;
+	uint32		alloc;
+} ElectricXipBuilder;
+
+/* Newest position at or before target that WAL is known to be kept from */
+static XLogRecPtr
+electric_wal_kept_from(XLogRecPtr target)
+{
+	XLogRecPtr	redo = GetRedoRecPtr();
+	XLogRecPtr	best = InvalidXLogRecPtr;
+	int			i;
+
+	if (redo <= target)
+		return redo;
+
+	LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+	for (i = 0; i < max_replication_slots; i++)
+	{
+		ReplicationSlot *s = &ReplicationSlotCtl->replication_slots[i];
+		XLogRecPtr	restart_lsn;
+
+		if (!s->in_use)
+			continue;
+		SpinLockAcquire(&s->mutex);
+		restart_lsn = s->data.restart_lsn;
+		SpinLockRelease(&s->mutex);
+
+		if (!XLogRecPtrIsInvalid(restart_lsn) && restart_lsn <= target &&
+			restart_lsn > best)
+			best = restart_lsn;
+	}
+	LWLockRelease(ReplicationSlotControlLock);
+
+	if (XLogRecPtrIsInvalid(best))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no WAL is known to be kept from before %X/%X",
+						LSN_FORMAT_ARGS(target)),
+				 errhint("Use an LSN after the last checkpoint's redo pointer %X/%X, or keep a replication slot behind it.",
+						 LSN_FORMAT_ARGS(redo))));
+	return best;
+}
+
+static void
+electric_wal_note_finished(HTAB *finished, TransactionId xid, bool committed)
+{
+	ElectricXidStatus *entry;
+
+	if (!TransactionIdIsNormal(xid))
+		return;
+	entry = hash_search(finished, &xid, HASH_ENTER, NULL);
+	entry->committed = committed;
+}
+
+/* Note what one record tells about transactions */
+static void
+electric_wal_note_record(ElectricWalScan *scan, XLogReaderState *reader)
+{
+	TransactionId xid = XLogRecGetXid(reader);
+	uint8		info = XLogRecGetInfo(reader) & ~XLR_INFO_MASK;
+	int			i;
+
+	if (TransactionIdIsNormal(xid) &&
+		(!TransactionIdIsValid(scan->max_xid) ||
+		 TransactionIdFollows(xid, scan->max_xid)))
+		scan->max_xid = xid;
+
+	if (XLogRecGetRmid(reader) == RM_STANDBY_ID && info == XLOG_RUNNING_XACTS)
+	{
+		xl_running_xacts *running = (xl_running_xacts *) XLogRecGetData(reader);
+		Size		len = offsetof(xl_running_xacts, xids) +
+			(running->xcnt + running->subxcnt) * sizeof(TransactionId);
+
+		if (scan->running)
+			pfree(scan->running);
+		scan->running = palloc(len);
+		memcpy(scan->running, running, len);
+	}
+	else if (XLogRecGetRmid(reader) == RM_XACT_ID)
+	{
+		uint8		xact_info = info & XLOG_XACT_OPMASK;
+
+		if (xact_info == XLOG_XACT_COMMIT || xact_info == XLOG_XACT_COMMIT_PREPARED)
+		{
+			xl_xact_parsed_commit parsed;
+
+			ParseCommitRecord(XLogRecGetInfo(reader),
+							  (xl_xact_commit *) XLogRecGetData(reader), &parsed);
+			electric_wal_note_finished(scan->finished,
+									   xact_info == XLOG_XACT_COMMIT ? xid : parsed.twophase_xid,
+									   true);
+			for (i = 0; i < parsed.nsubxacts; i++)
+				electric_wal_note_finished(scan->finished, parsed.subxacts[i], true);
+		}
+		else if (xact_info == XLOG_XACT_ABORT || xact_info == XLOG_XACT_ABORT_PREPARED)
+		{
+			xl_xact_parsed_abort parsed;
+
+			ParseAbortRecord(XLogRecGetInfo(reader),
+							 (xl_xact_abort *) XLogRecGetData(reader), &parsed);
+			electric_wal_note_finished(scan->finished,
+									   xact_info == XLOG_XACT_ABORT ? xid : parsed.twophase_xid,
+									   false);
+			for (i = 0; i < parsed.nsubxacts; i++)
+				electric_wal_note_finished(scan->finished, parsed.subxacts[i], false);
+		}
+	}
+}
+
+/* Next record, or NULL at the end of the flushed WAL */
+static XLogRecord *
+electric_wal_next(ElectricWalScan *scan)
+{
+	XLogRecord *record;
+	char	   *errormsg;
+
+	CHECK_FOR_INTERRUPTS();
+
+	record = XLogReadRecord(scan->reader, &errormsg);
+	if (record == NULL)
+	{
+		if (scan->private_data->end_of_wal)
+			return NULL;
+		if (errormsg)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read WAL at %X/%X: %s",
+							LSN_FORMAT_ARGS(scan->reader->EndRecPtr), errormsg)));
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read WAL at %X/%X",
+						LSN_FORMAT_ARGS(scan->reader->EndRecPtr))));
+	}
+	return record;
+}
+
+static int
+electric_xid_cmp(const void *a, const void *b)
+{
+	TransactionId xa = *(const TransactionId *) a;
+	TransactionId xb = *(const TransactionId *) b;
+
+	return (xa > xb) - (xa < xb);
+}
+
+static void
+electric_xip_add(ElectricXipBuilder *xip, TransactionId xid)
+{
+	if (xip->xcnt == xip->alloc)
+	{
+		xip->alloc *= 2;
+		xip->xids = repalloc(xip->xids, xip->alloc * sizeof(TransactionId));
+	}
+	xip->xids[xip->xcnt++] = xid;
+}
+
+/*
+ * Decide whether xid, assigned before target, was running there. Committed
+ * xids whose commit record was not read go to ambiguous.
+ */
+static void
+electric_classify_xid(ElectricWalScan *scan, HTAB *ambiguous,
+					  ElectricXipBuilder *xip, TransactionId xid)
+{
+	if (!TransactionIdIsNormal(xid))
+		return;
+	if (hash_search(scan->finished, &xid, HASH_FIND, NULL) != NULL)
+		return;					/* finished before target */
+
+	/* Clog before the proc array: a commit is in clog first */
+	if (TransactionIdDidCommit(xid))
+		hash_search(ambiguous, &xid, HASH_ENTER, NULL);
+	else if (TransactionIdIsInProgress(xid))
+		electric_xip_add(xip, xid);
+	/* else aborted, invisible either way */
+}
+
+/*
+ * Snapshot of the transactions committed before target, or before a
+ * running-xacts record logged now if target is invalid. *lsn is set to the
+ * position used. The result is allocated in TopTransactionContext, like
+ * electric_parse_snapshot_text's.
+ */
+ElectricParsedSnapshot *
+electric_snapshot_at(XLogRecPtr target, XLogRecPtr *lsn)
+{
+	ElectricWalScan scan;
+	XLogRecPtr	start;
+	XLogRecPtr	first;
+	XLogRecord *record;
+	HASHCTL		ctl;
+	HTAB	   *ambiguous;
+	ElectricXipBuilder xip;
+	TransactionId xmax;
+	TransactionId xid;
+	long		nambiguous;
+	ElectricParsedSnapshot *parsed;
+	int			i;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("electric_snapshot_at_lsn() cannot be executed during recovery.")));
+	if (!XLogStandbyInfoActive())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_snapshot_at_lsn() requires wal_level \"replica\" or higher")));
+
+	if (XLogRecPtrIsInvalid(target))
+	{
+		start = GetXLogInsertRecPtr();
+		target = LogStandbySnapshot();
+	}
+	else
+	{
+		if (target > GetXLogInsertRecPtr())
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("LSN %X/%X is in the future", LSN_FORMAT_ARGS(target))));
+		start = electric_wal_kept_from(target);
+	}
+	XLogFlush(GetXLogInsertRecPtr());
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(TransactionId);
+	ctl.entrysize = sizeof(ElectricXidStatus);
+	ctl.hcxt = CurrentMemoryContext;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.finished = hash_create("electric finished xids", 256, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	ambiguous = hash_create("electric ambiguous xids", 64, &ctl,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	scan.private_data = palloc0(sizeof(ReadLocalXLogPageNoWaitPrivate));
+	scan.reader = XLogReaderAllocate(wal_segment_size, NULL,
+									 XL_ROUTINE(.page_read = &read_local_xlog_page_no_wait,
+												.segment_open = &wal_segment_open,
+												.segment_close = &wal_segment_close),
+									 scan.private_data);
+	if (scan.reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	first = XLogFindNextRecord(scan.reader, start);
+	if (XLogRecPtrIsInvalid(first))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not find a valid record after %X/%X",
+						LSN_FORMAT_ARGS(start))));
+	XLogBeginRead(scan.reader, first);
+
+	/* 1. Everything before target */
+	while ((record = electric_wal_next(&scan)) != NULL &&
+		   scan.reader->ReadRecPtr < target)
+		electric_wal_note_record(&scan, scan.reader);
+
+	if (scan.running == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("no running-transactions record between %X/%X and %X/%X",
+						LSN_FORMAT_ARGS(start), LSN_FORMAT_ARGS(target)),
+				 errhint("One is logged at every checkpoint and every 15 seconds of activity; retry with a later LSN.")));
+
+	xmax = scan.running->nextXid;
+	if (TransactionIdIsValid(scan.max_xid) &&
+		TransactionIdFollowsOrEquals(scan.max_xid, xmax))
+	{
+		xmax = scan.max_xid;
+		TransactionIdAdvance(xmax);
+	}
+
+	/* 2. Candidates: what R lists, and what was assigned after it */
+	xip.alloc = 64;
+	xip.xcnt = 0;
+	xip.xids = palloc(xip.alloc * sizeof(TransactionId));
+	for (i = 0; i < scan.running->xcnt + scan.running->subxcnt; i++)
+		electric_classify_xid(&scan, ambiguous, &xip, scan.running->xids[i]);
+	for (xid = scan.running->nextXid; TransactionIdPrecedes(xid, xmax);
+		 TransactionIdAdvance(xid))
+		electric_classify_xid(&scan, ambiguous, &xip, xid);
+
+	/* 3. Look for the ambiguous commits past target */
+	nambiguous = hash_get_num_entries(ambiguous);
+	if (nambiguous > 0)
+	{
+		/* Their commit records are in by now, maybe not yet flushed */
+		XLogFlush(GetXLogInsertRecPtr());
+		if (record == NULL)
+		{
+			scan.private_data->end_of_wal = false;
+			XLogBeginRead(scan.reader, scan.reader->EndRecPtr);
+			record = electric_wal_next(&scan);
+		}
+
+		/* From here it only holds the current record's xids */
+		hash_destroy(scan.finished);
+		scan.finished = hash_create("electric finished xids", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+	while (record != NULL && nambiguous > 0)
+	{
+		HASH_SEQ_STATUS seq;
+		ElectricXidStatus *status;
+
+		electric_wal_note_record(&scan, scan.reader);
+
+		hash_seq_init(&seq, scan.finished);
+		while ((status = hash_seq_search(&seq)) != NULL)
+		{
+			if (status->committed &&
+				hash_search(ambiguous, &status->xid, HASH_REMOVE, NULL) != NULL)
+			{
+				electric_xip_add(&xip, status->xid);
+				nambiguous--;
+			}
+			hash_search(scan.finished, &status->xid, HASH_REMOVE, NULL);
+		}
+		record = electric_wal_next(&scan);
+	}
+	/* whatever is still ambiguous committed before start */
+
+	XLogReaderFree(scan.reader);
+	hash_destroy(scan.finished);
+	hash_destroy(ambiguous);
+
+	parsed = MemoryContextAlloc(TopTransactionContext, sizeof(ElectricParsedSnapshot));
+	parsed->xmax = xmax;
+	parsed->xcnt = xip.xcnt;
+	parsed->xip = NULL;
+	if (xip.xcnt > 0)
+	{
+		qsort(xip.xids, xip.xcnt, sizeof(TransactionId), electric_xid_cmp);
+		parsed->xip = MemoryContextAlloc(TopTransactionContext,
+										 xip.xcnt * sizeof(TransactionId));
+		memcpy(parsed->xip, xip.xids, xip.xcnt * sizeof(TransactionId));
+	}
+	parsed->xmin = xip.xcnt > 0 ? parsed->xip[0] : xmax;
+	pfree(xip.xids);
+
+	*lsn = target;
+	return parsed;
+}
+
+/*
+ * SQL: electric_snapshot_at_lsn(target) -> (lsn, snapshot, xmin, xmax, xip),
+ * target NULL meaning now
+ */
+Datum
+electric_snapshot_at_lsn(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	target = PG_ARGISNULL(0) ? InvalidXLogRecPtr : PG_GETARG_LSN(0);
+	ElectricParsedSnapshot *parsed;
+	XLogRecPtr	lsn;
+	TupleDesc	tupdesc;
+	StringInfoData buf;
+	Datum	   *xids;
+	Datum		values[5];
+	bool		nulls[5];
+	uint32		i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	parsed = electric_snapshot_at(target, &lsn);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%u:%u:", parsed->xmin, parsed->xmax);
+	xids = palloc(Max(parsed->xcnt, 1) * sizeof(Datum));
+	for (i = 0; i < parsed->xcnt; i++)
+	{
+		appendStringInfo(&buf, i == 0 ? "%u" : ",%u", parsed->xip[i]);
+		xids[i] = TransactionIdGetDatum(parsed->xip[i]);
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = LSNGetDatum(lsn);
+	values[1] = CStringGetTextDatum(buf.data);
+	values[2] = TransactionIdGetDatum(parsed->xmin);
+	values[3] = TransactionIdGetDatum(parsed->xmax);
+	values[4] = PointerGetDatum(construct_array(xids, parsed->xcnt, XIDOID,
+												sizeof(TransactionId), true,
+												TYPALIGN_INT));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,161 @@
+/*
+ * electric_capture.c - workload capture for electric_exec_as_of()
+ *
+ * With electric.capture_file set, every successful electric_exec_as_of()
+ * call, executed or served from a precomputed result or a coalesced leader,
+ * appends one record to that file (relative paths are relative to the
+ * data directory). Each backend keeps its own O_APPEND descriptor and writes
+ * a record with a single write(), so records from concurrent backends never
+ * interleave and no lock is taken. Nothing is fsync'd: a crash may lose the
+ * tail of the log, which is fine for replay.
+ *
+ * Record layout, all integers in network byte order:
+ *
+ *   uint32  magic          ELECTRIC_CAPTURE_MAGIC ("ELCR")
+ *   uint32  length         of the whole record, header included
+ *   int64   start          call start, microseconds since the Unix epoch
+ *   int64   duration_ns
+ *   int64   rows
+ *   uint32  snapshot_len, sql_len, args_len
+ *   uint32  flags          ELECTRIC_CAPTURE_PRECOMPUTED/_COALESCED: not
+ *                          executed
+ *   bytes   snapshot, sql, args (jsonb text), not NUL-terminated
+ *
+ * bench/electric_replay re-executes such a log.
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "datatype/timestamp.h"
+#include "lib/stringinfo.h"
+#include "port/pg_bswap.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "utils/memutils.h"
+
+#include "electric_poc.h"
+
+#define ELECTRIC_CAPTURE_MAGIC	0x454C4352
+
+/* electric.capture_file */
+char	   *electric_capture_file = NULL;
+
+static int	capture_fd = -1;
+static char *capture_path = NULL;	/* file capture_fd is open on */
+
+static void
+electric_capture_close(int code, Datum arg)
+{
+	if (capture_fd >= 0)
+		close(capture_fd);
+	capture_fd = -1;
+}
+
+/*
+ * Make capture_fd point at electric.capture_file. After a failure the same
+ * path is not retried, so a bad setting costs one WARNING per backend.
+ */
+static bool
+electric_capture_open(void)
+{
+	static bool exit_registered = false;
+
+	if (capture_path != NULL && strcmp(capture_path, electric_capture_file) == 0)
+		return capture_fd >= 0;
+
+	electric_capture_close(0, (Datum) 0);
+	if (capture_path != NULL)
+		pfree(capture_path);
+	capture_path = MemoryContextStrdup(TopMemoryContext, electric_capture_file);
+
+	capture_fd = BasicOpenFilePerm(capture_path,
+								   O_WRONLY | O_APPEND | O_CREAT | PG_BINARY,
+								   pg_file_create_mode);
+	if (capture_fd < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open capture file \"%s\": %m", capture_path)));
+		return false;
+	}
+
+	if (!exit_registered)
+	{
+		on_proc_exit(electric_capture_close, (Datum) 0);
+		exit_registered = true;
+	}
+	return true;
+}
+
+static void
+append_uint32(StringInfo buf, uint32 v)
+{
+	v = pg_hton32(v);
+	appendBinaryStringInfo(buf, &v, sizeof(v));
+}
+
+static void
+append_int64(StringInfo buf, int64 v)
+{
+	uint64		n = pg_hton64((uint64) v);
+
+	appendBinaryStringInfo(buf, &n, sizeof(n));
+}
+
+/*
+ * Append one call to the capture file. Callers check that
+ * electric.capture_file is set.
+ */
+void
+electric_capture_record(TimestampTz start, const char *snapshot, const char *sql,
+						const char *args, int64 duration_ns, int64 rows,
+						uint32 flags)
+{
+	StringInfoData buf;
+	uint32		snapshot_len = strlen(snapshot);
+	uint32		sql_len = strlen(sql);
+	uint32		args_len = strlen(args);
+	uint32		length;
+	int64		start_unix;
+
+	if (!electric_capture_open())
+		return;
+
+	start_unix = start +
+		((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY);
+	length = 2 * sizeof(uint32) + 3 * sizeof(int64) + 4 * sizeof(uint32) +
+		snapshot_len + sql_len + args_len;
+
+	initStringInfo(&buf);
+	enlargeStringInfo(&buf, length);
+	append_uint32(&buf, ELECTRIC_CAPTURE_MAGIC);
+	append_uint32(&buf, length);
+	append_int64(&buf, start_unix);
+	append_int64(&buf, duration_ns);
+	append_int64(&buf, rows);
+	append_uint32(&buf, snapshot_len);
+	append_uint32(&buf, sql_len);
+	append_uint32(&buf, args_len);
+	append_uint32(&buf, flags);
+	appendBinaryStringInfo(&buf, snapshot, snapshot_len);
+	appendBinaryStringInfo(&buf, sql, sql_len);
+	appendBinaryStringInfo(&buf, args, args_len);
+	Assert(buf.len == length);
+
+	errno = 0;
+	if (write(capture_fd, buf.data, buf.len) != buf.len)
+	{
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write capture file \"%s\": %m", capture_path)));
+		/* Stop capturing here rather than leave a torn log */
+		electric_capture_close(0, (Datum) 0);
+	}
+
+	pfree(buf.data);
+}
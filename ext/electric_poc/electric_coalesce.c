@@ -0,0 +1,479 @@
+/*
+ * electric_coalesce.c - single-flight electric_exec_as_of() (electric.coalesce)
+ *
+ * An as-of result depends only on what is asked: the snapshot, the SQL, the
+ * args, and who asks (database, role, search_path, TimeZone). When many
+ * backends ask the same thing at the same moment, the first one becomes the
+ * leader and executes; the others find its entry in a shared flight table,
+ * sleep on the entry's condition variable, and copy the leader's result out
+ * of a DSM segment when it is done.
+ *
+ * Only calls still in flight are joined: this is not a result cache. The
+ * leader pins the segment and detaches; the last backend to let go of the
+ * entry (leader or follower) unpins it and frees the slot. If the leader
+ * fails, its followers run the query themselves, so they see their own
+ * error, if any. A full table or no DSM segment also just means running
+ * uncoalesced.
+ *
+ * Followers wait at most electric.coalesce_wait_timeout, then run the query
+ * themselves too: the leader may be blocked on a lock a follower's
+ * transaction holds, which no deadlock check sees. A follower that exits
+ * while waiting (FATAL) runs no PG_CATCH block, so an exit callback drops
+ * its reference; a leader's is dropped by the abort callback.
+ *
+ * Segment layout: ElectricFlightResult, then the key, then the jsonb result.
+ * Followers compare the key, so a hash collision is harmless.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "common/hashfn.h"
+#include "miscadmin.h"
+#include "storage/condition_variable.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_coalesce_stats);
+
+/* Distinct calls that can be in flight at once; more run uncoalesced */
+#define ELECTRIC_FLIGHTS 128
+
+typedef enum ElectricFlightState
+{
+	ELECTRIC_FLIGHT_FREE,
+	ELECTRIC_FLIGHT_RUNNING,	/* the leader is executing */
+	ELECTRIC_FLIGHT_DONE,		/* result in segment `handle` */
+	ELECTRIC_FLIGHT_FAILED		/* followers must run it themselves */
+} ElectricFlightState;
+
+typedef struct ElectricFlight
+{
+	ElectricFlightState state;
+	uint64		hash;
+	int			refcount;		/* leader (until it finishes) + followers */
+	dsm_handle	handle;
+	ConditionVariable cv;
+} ElectricFlight;
+
+typedef struct ElectricCoalesceShared
+{
+	LWLock	   *lock;
+	uint64		executions;		/* calls that led a flight */
+	uint64		coalesced;		/* calls served a leader's result */
+	uint64		fallbacks;		/* calls that found no slot or a failed leader */
+	ElectricFlight flights[ELECTRIC_FLIGHTS];
+} ElectricCoalesceShared;
+
+/* Header of a result segment */
+typedef struct ElectricFlightResult
+{
+	Size		key_len;
+	Size		result_len;		/* jsonb datum, varlena header included */
+	uint64		nrows;
+	uint64		json_len;		/* result as JSON text, for max_result_bytes */
+} ElectricFlightResult;
+
+/* electric.coalesce */
+bool		electric_coalesce = false;
+
+/* electric.coalesce_wait_timeout: longest a follower waits (ms) */
+int			electric_coalesce_wait_timeout = 1000;
+
+static ElectricCoalesceShared *electric_coalesce_shared = NULL;
+
+/* The flight this backend leads, or -1 */
+static int	my_flight = -1;
+
+/* The flight this backend follows, or -1 */
+static int	my_joined = -1;
+static bool coalesce_exit_registered = false;
+
+Size
+electric_coalesce_shmem_size(void)
+{
+	return sizeof(ElectricCoalesceShared);
+}
+
+void
+electric_coalesce_shmem_request(void)
+{
+	RequestAddinShmemSpace(electric_coalesce_shmem_size());
+	RequestNamedLWLockTranche("electric_poc coalesce", 1);
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_coalesce_shmem_init(void)
+{
+	bool		found;
+	int			i;
+
+	electric_coalesce_shared = ShmemInitStruct("electric_poc coalesce",
+											   electric_coalesce_shmem_size(),
+											   &found);
+	if (!found)
+	{
+		memset(electric_coalesce_shared, 0, electric_coalesce_shmem_size());
+		electric_coalesce_shared->lock = &(GetNamedLWLockTranche("electric_poc coalesce"))->lock;
+		for (i = 0; i < ELECTRIC_FLIGHTS; i++)
+			ConditionVariableInit(&electric_coalesce_shared->flights[i].cv);
+	}
+}
+
+/*
+ * Everything the result of a call depends on. NULL when the call can't be
+ * coalesced: the setting is off, there is no shared memory, or this backend
+ * already leads a flight (the call runs nested in the leader's query).
+ */
+ElectricFlightKey *
+electric_flight_key(const char *snapshot, const char *sql, const char *args)
+{
+	ElectricFlightKey *key;
+	StringInfoData buf;
+	Oid			ids[2];
+
+	if (!electric_coalesce || electric_coalesce_shared == NULL || my_flight >= 0)
+		return NULL;
+
+	ids[0] = MyDatabaseId;
+	ids[1] = GetUserId();
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (const char *) ids, sizeof(ids));
+	/* Settings that change what the SQL resolves to or how rows print */
+	appendStringInfoString(&buf, GetConfigOption("search_path", false, false));
+	appendStringInfoChar(&buf, '\0');
+	appendStringInfoString(&buf, GetConfigOption("TimeZone", false, false));
+	appendStringInfoChar(&buf, '\0');
+	appendStringInfoString(&buf, snapshot);
+	appendStringInfoChar(&buf, '\0');
+	appendStringInfoString(&buf, sql);
+	appendStringInfoChar(&buf, '\0');
+	appendStringInfoString(&buf, args);
+
+	key = palloc(sizeof(ElectricFlightKey));
+	key->data = buf.data;
+	key->len = buf.len;
+	key->hash = DatumGetUInt64(hash_bytes_extended((const unsigned char *) buf.data, buf.len, 0));
+	return key;
+}
+
+/* Drop a reference to a flight. Lock held exclusively. */
+static void
+electric_flight_unref(ElectricFlight *f)
+{
+	if (--f->refcount > 0)
+		return;
+	if (f->state == ELECTRIC_FLIGHT_DONE)
+		dsm_unpin_segment(f->handle);
+	f->state = ELECTRIC_FLIGHT_FREE;
+}
+
+/* Follower: drop our reference to the flight we joined */
+static void
+electric_flight_leave(void)
+{
+	LWLockAcquire(electric_coalesce_shared->lock, LW_EXCLUSIVE);
+	electric_flight_unref(&electric_coalesce_shared->flights[my_joined]);
+	my_joined = -1;
+	LWLockRelease(electric_coalesce_shared->lock);
+}
+
+/*
+ * Let go of a joined flight on backend exit
+ */
+static void
+electric_coalesce_shmem_exit(int code, Datum arg)
+{
+	if (my_joined < 0)
+		return;
+
+	ConditionVariableCancelSleep();
+	electric_flight_leave();
+}
+
+/* Copy the result out of a finished flight's segment; (Datum) 0 if not ours */
+static Datum
+electric_flight_read(dsm_handle handle, const ElectricFlightKey *key,
+					 const ElectricLimits *limits)
+{
+	dsm_segment *seg = dsm_attach(handle);
+	ElectricFlightResult *hdr;
+	char	   *p;
+	Datum		result = (Datum) 0;
+
+	if (seg == NULL)
+		return (Datum) 0;
+
+	hdr = (ElectricFlightResult *) dsm_segment_address(seg);
+	p = (char *) hdr + MAXALIGN(sizeof(ElectricFlightResult));
+	if (hdr->key_len == key->len && memcmp(p, key->data, key->len) == 0)
+	{
+		/* Our own limits still apply to a result someone else built */
+		if (limits->max_rows > 0 && hdr->nrows > limits->max_rows)
+		{
+			dsm_detach(seg);
+			electric_limit_exceeded(ELECTRIC_LIMIT_ROWS, limits->max_rows);
+		}
+		if (limits->max_result_bytes > 0 && hdr->json_len > limits->max_result_bytes)
+		{
+			dsm_detach(seg);
+			electric_limit_exceeded(ELECTRIC_LIMIT_RESULT_BYTES, limits->max_result_bytes);
+		}
+
+		result = PointerGetDatum(palloc(hdr->result_len));
+		memcpy(DatumGetPointer(result), p + MAXALIGN(key->len), hdr->result_len);
+	}
+	dsm_detach(seg);
+	return result;
+}
+
+/*
+ * Join an identical call in flight, or become the leader of a new one.
+ *
+ * Returns the leader's result if there was one to wait for; the caller then
+ * returns it as its own. Otherwise returns (Datum) 0 and the caller executes;
+ * if it leads, it must call electric_flight_finish() with its result or let
+ * its error reach electric_flight_abort().
+ */
+Datum
+electric_flight_join(const ElectricFlightKey *key, const ElectricLimits *limits)
+{
+	ElectricCoalesceShared *shared = electric_coalesce_shared;
+	ElectricFlight *f = NULL;
+	ElectricFlight *free_slot = NULL;
+	int			i;
+	dsm_handle	handle = 0;
+	TimestampTz deadline;
+	bool		done;
+	Datum		result;
+
+	if (!coalesce_exit_registered)
+	{
+		before_shmem_exit(electric_coalesce_shmem_exit, (Datum) 0);
+		coalesce_exit_registered = true;
+	}
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < ELECTRIC_FLIGHTS; i++)
+	{
+		ElectricFlight *cur = &shared->flights[i];
+
+		if (cur->state == ELECTRIC_FLIGHT_RUNNING && cur->hash == key->hash)
+		{
+			f = cur;
+			break;
+		}
+		if (cur->state == ELECTRIC_FLIGHT_FREE && free_slot == NULL)
+			free_slot = cur;
+	}
+
+	if (f == NULL)
+	{
+		if (free_slot == NULL)
+			shared->fallbacks++;
+		else
+		{
+			free_slot->state = ELECTRIC_FLIGHT_RUNNING;
+			free_slot->hash = key->hash;
+			free_slot->refcount = 1;
+			my_flight = free_slot - shared->flights;
+			shared->executions++;
+		}
+		LWLockRelease(shared->lock);
+		return (Datum) 0;
+	}
+
+	f->refcount++;
+	my_joined = f - shared->flights;
+	LWLockRelease(shared->lock);
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										   electric_coalesce_wait_timeout);
+
+	electric_activity_wait_start(ELECTRIC_WAIT_COALESCE);
+	PG_TRY();
+	{
+		ConditionVariablePrepareToSleep(&f->cv);
+		for (;;)
+		{
+			long		timeout_ms;
+
+			LWLockAcquire(shared->lock, LW_SHARED);
+			done = f->state != ELECTRIC_FLIGHT_RUNNING;
+			LWLockRelease(shared->lock);
+			if (done)
+				break;
+
+			/* Still running: execute it ourselves (see the top of the file) */
+			timeout_ms = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+			if (timeout_ms <= 0)
+				break;
+			(void) ConditionVariableTimedSleep(&f->cv, timeout_ms, WAIT_EVENT_EXTENSION);
+		}
+		ConditionVariableCancelSleep();
+	}
+	PG_CATCH();
+	{
+		ConditionVariableCancelSleep();
+		electric_flight_leave();
+		electric_activity_wait_end();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	electric_activity_wait_end();
+
+	/* Our reference keeps the segment pinned while we read it */
+	LWLockAcquire(shared->lock, LW_SHARED);
+	done = f->state == ELECTRIC_FLIGHT_DONE;
+	handle = f->handle;
+	LWLockRelease(shared->lock);
+
+	PG_TRY();
+	{
+		result = done ? electric_flight_read(handle, key, limits) : (Datum) 0;
+	}
+	PG_FINALLY();
+	{
+		electric_flight_leave();
+	}
+	PG_END_TRY();
+
+	LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+	if (result != (Datum) 0)
+		shared->coalesced++;
+	else
+		shared->fallbacks++;
+	LWLockRelease(shared->lock);
+
+	return result;
+}
+
+/* Leader: end the flight in state, waking every follower */
+static void
+electric_flight_end(ElectricFlightState state, dsm_handle handle)
+{
+	ElectricFlight *f = &electric_coalesce_shared->flights[my_flight];
+
+	my_flight = -1;
+
+	LWLockAcquire(electric_coalesce_shared->lock, LW_EXCLUSIVE);
+	f->state = state;
+	f->handle = handle;
+	electric_flight_unref(f);
+	LWLockRelease(electric_coalesce_shared->lock);
+
+	ConditionVariableBroadcast(&f->cv);
+}
+
+/*
+ * Leader: publish the result (a jsonb datum) to the flight's followers.
+ */
+void
+electric_flight_finish(const ElectricFlightKey *key, Datum result, uint64 nrows, uint64 json_len)
+{
+	Size		result_len = VARSIZE_ANY(DatumGetPointer(result));
+	Size		hdr_len = MAXALIGN(sizeof(ElectricFlightResult));
+	dsm_segment *seg;
+	ElectricFlightResult *hdr;
+	char	   *p;
+
+	if (my_flight < 0)
+		return;
+
+	seg = dsm_create(hdr_len + MAXALIGN(key->len) + result_len, DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+	{
+		electric_flight_end(ELECTRIC_FLIGHT_FAILED, 0);
+		return;
+	}
+
+	hdr = (ElectricFlightResult *) dsm_segment_address(seg);
+	hdr->key_len = key->len;
+	hdr->result_len = result_len;
+	hdr->nrows = nrows;
+	hdr->json_len = json_len;
+	p = (char *) hdr + hdr_len;
+	memcpy(p, key->data, key->len);
+	memcpy(p + MAXALIGN(key->len), DatumGetPointer(result), result_len);
+
+	/* Outlives our mapping until the last follower unpins it */
+	dsm_pin_segment(seg);
+	electric_flight_end(ELECTRIC_FLIGHT_DONE, dsm_segment_handle(seg));
+	dsm_detach(seg);
+}
+
+/* Leader failed: followers run the query themselves */
+void
+electric_flight_abort(void)
+{
+	if (my_flight >= 0)
+		electric_flight_end(ELECTRIC_FLIGHT_FAILED, 0);
+}
+
+/* pg_stat_electric_reset() */
+void
+electric_coalesce_stats_reset(void)
+{
+	if (electric_coalesce_shared == NULL)
+		return;
+
+	LWLockAcquire(electric_coalesce_shared->lock, LW_EXCLUSIVE);
+	electric_coalesce_shared->executions = 0;
+	electric_coalesce_shared->coalesced = 0;
+	electric_coalesce_shared->fallbacks = 0;
+	LWLockRelease(electric_coalesce_shared->lock);
+}
+
+/*
+ * SQL: pg_stat_electric_coalesce() -> flights in progress and counters
+ */
+Datum
+electric_coalesce_stats(PG_FUNCTION_ARGS)
+{
+	ElectricCoalesceShared *shared = electric_coalesce_shared;
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5];
+	int			in_flight = 0;
+	int			waiting = 0;
+	int			i;
+
+	if (shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	for (i = 0; i < ELECTRIC_FLIGHTS; i++)
+	{
+		if (shared->flights[i].state != ELECTRIC_FLIGHT_RUNNING)
+			continue;
+		in_flight++;
+		waiting += shared->flights[i].refcount - 1;
+	}
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(in_flight);
+	values[1] = Int32GetDatum(waiting);
+	values[2] = Int64GetDatum((int64) shared->executions);
+	values[3] = Int64GetDatum((int64) shared->coalesced);
+	values[4] = Int64GetDatum((int64) shared->fallbacks);
+	LWLockRelease(shared->lock);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
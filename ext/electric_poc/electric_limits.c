@@ -0,0 +1,265 @@
+/*
+ * electric_limits.c - per-call resource limits for electric_exec_as_of()
+ *
+ * Each limit has a GUC (PGC_SUSET, so ALTER ROLE ... SET gives per-role
+ * limits that the role can't lift) and an electric_exec_as_of() option of the
+ * same name, which can only tighten it. 0 means unlimited.
+ *
+ *   max_rows             result rows          54L01  checked per row
+ *   max_result_bytes     result JSON text     54L02  checked per row
+ *   max_tuples_examined  tuple versions read  54L03  checked by the scan
+ *                                                    wrappers (electric_scan.c)
+ *   max_snapshot_age     xids since xmax      54L04  checked before executing
+ *   max_elapsed_ms       wall clock           57L01  timer, fires at the next
+ *                                                    CHECK_FOR_INTERRUPTS
+ *
+ * The elapsed-time timer works like statement_timeout: its handler asks for a
+ * query cancel, and the call turns the resulting cancel into 57L01. Nested
+ * calls share the timer, which is armed for the earliest deadline.
+ */
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/latch.h"
+#include "utils/builtins.h"
+#include "utils/numeric.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+
+#include "electric_poc.h"
+
+/* GUCs */
+int			electric_max_rows = 0;
+int			electric_max_result_bytes = 0;
+int			electric_max_tuples_examined = 0;
+int			electric_max_elapsed = 0;
+int			electric_max_snapshot_age = 0;
+
+/* The timer is registered per backend on first use (InitializeTimeouts resets it) */
+static bool timeout_registered = false;
+static TimeoutId electric_limit_timeout;
+
+/* Deadline the timer is armed for (0 = none), and the limit that set it */
+static TimestampTz electric_deadline = 0;
+static int	electric_deadline_ms = 0;
+
+/* Set by the timer; the cancel it requested is ours */
+static volatile sig_atomic_t electric_timed_out = false;
+
+static void
+electric_limit_timeout_handler(void)
+{
+	electric_timed_out = true;
+	QueryCancelPending = true;
+	InterruptPending = true;
+	SetLatch(MyLatch);
+}
+
+/* The tighter of two limits, where 0 is unlimited */
+static uint64
+electric_tighter(uint64 a, uint64 b)
+{
+	if (a == 0)
+		return b;
+	if (b == 0)
+		return a;
+	return Min(a, b);
+}
+
+/*
+ * Start from the GUCs; options may then tighten the limits
+ */
+void
+electric_limits_init(ElectricLimits *limits)
+{
+	memset(limits, 0, sizeof(ElectricLimits));
+	limits->max_rows = (uint64) electric_max_rows;
+	limits->max_result_bytes = (uint64) electric_max_result_bytes;
+	limits->max_tuples_examined = (uint64) electric_max_tuples_examined;
+	limits->max_elapsed_ms = (uint64) electric_max_elapsed;
+	limits->max_snapshot_age = (uint64) electric_max_snapshot_age;
+}
+
+/*
+ * Handle a limit given as an electric_exec_as_of() option. Returns false if
+ * key is not a limit.
+ */
+bool
+electric_limits_option(ElectricLimits *limits, const char *key, JsonbValue *v)
+{
+	uint64	   *target;
+	int64		value;
+
+	if (strcmp(key, "max_rows") == 0)
+		target = &limits->max_rows;
+	else if (strcmp(key, "max_result_bytes") == 0)
+		target = &limits->max_result_bytes;
+	else if (strcmp(key, "max_tuples_examined") == 0)
+		target = &limits->max_tuples_examined;
+	else if (strcmp(key, "max_elapsed_ms") == 0)
+		target = &limits->max_elapsed_ms;
+	else if (strcmp(key, "max_snapshot_age") == 0)
+		target = &limits->max_snapshot_age;
+	else
+		return false;
+
+	if (v->type != jbvNumeric)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" must be a number", key)));
+	value = DatumGetInt64(DirectFunctionCall1(numeric_int8, NumericGetDatum(v->val.numeric)));
+	if (value < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" must not be negative", key)));
+
+	/* An option can lower the configured limit, never raise it */
+	*target = electric_tighter(*target, (uint64) value);
+	return true;
+}
+
+void
+electric_limit_exceeded(ElectricLimitKind kind, uint64 limit)
+{
+	switch (kind)
+	{
+		case ELECTRIC_LIMIT_ROWS:
+			ereport(ERROR,
+					(errcode(ERRCODE_ELECTRIC_MAX_ROWS),
+					 errmsg("electric_exec_as_of result exceeds max_rows (" UINT64_FORMAT ")", limit)));
+			break;
+		case ELECTRIC_LIMIT_RESULT_BYTES:
+			ereport(ERROR,
+					(errcode(ERRCODE_ELECTRIC_MAX_RESULT_BYTES),
+					 errmsg("electric_exec_as_of result exceeds max_result_bytes (" UINT64_FORMAT ")", limit)));
+			break;
+		case ELECTRIC_LIMIT_TUPLES_EXAMINED:
+			ereport(ERROR,
+					(errcode(ERRCODE_ELECTRIC_MAX_TUPLES_EXAMINED),
+					 errmsg("electric_exec_as_of examined more than max_tuples_examined (" UINT64_FORMAT ") tuple versions",
+							limit),
+					 errhint("The snapshot may be old enough that the query walks long version chains.")));
+			break;
+		case ELECTRIC_LIMIT_SNAPSHOT_AGE:
+			ereport(ERROR,
+					(errcode(ERRCODE_ELECTRIC_MAX_SNAPSHOT_AGE),
+					 errmsg("snapshot is older than max_snapshot_age (" UINT64_FORMAT " transactions)", limit)));
+			break;
+		case ELECTRIC_LIMIT_ELAPSED:
+			ereport(ERROR,
+					(errcode(ERRCODE_ELECTRIC_MAX_ELAPSED),
+					 errmsg("electric_exec_as_of ran longer than max_elapsed_ms (" UINT64_FORMAT " ms)", limit)));
+			break;
+	}
+	pg_unreachable();
+}
+
+void
+electric_limits_check_snapshot_age(const ElectricLimits *limits, uint32 snapshot_age)
+{
+	if (limits->max_snapshot_age > 0 && snapshot_age > limits->max_snapshot_age)
+		electric_limit_exceeded(ELECTRIC_LIMIT_SNAPSHOT_AGE, limits->max_snapshot_age);
+}
+
+/*
+ * Arm the elapsed-time timer and the tuples-examined budget for a call.
+ * Must be paired with electric_limits_stop() on every path.
+ */
+void
+electric_limits_start(ElectricLimits *limits)
+{
+	/* First, as it can fail */
+	electric_scan_budget_push(limits->max_tuples_examined, &limits->saved_budget);
+
+	limits->saved_deadline = electric_deadline;
+	limits->saved_deadline_ms = electric_deadline_ms;
+
+	if (limits->max_elapsed_ms > 0)
+	{
+		TimestampTz deadline;
+
+		if (!timeout_registered)
+		{
+			electric_limit_timeout = RegisterTimeout(USER_TIMEOUT, electric_limit_timeout_handler);
+			timeout_registered = true;
+		}
+
+		deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+											   (int64) Min(limits->max_elapsed_ms, (uint64) INT_MAX));
+		if (electric_deadline == 0 || deadline < electric_deadline)
+		{
+			electric_deadline = deadline;
+			electric_deadline_ms = (int) Min(limits->max_elapsed_ms, (uint64) INT_MAX);
+			enable_timeout_at(electric_limit_timeout, deadline);
+		}
+	}
+}
+
+/* Put the timer back the way the enclosing call (if any) had it */
+static bool
+electric_limits_disarm(ElectricLimits *limits)
+{
+	bool		timed_out = electric_timed_out;
+
+	electric_scan_budget_pop(&limits->saved_budget);
+
+	if (electric_deadline != limits->saved_deadline)
+	{
+		if (limits->saved_deadline == 0)
+			disable_timeout(electric_limit_timeout, false);
+		else
+			enable_timeout_at(electric_limit_timeout, limits->saved_deadline);
+		electric_deadline = limits->saved_deadline;
+		electric_deadline_ms = limits->saved_deadline_ms;
+	}
+
+	if (timed_out)
+	{
+		/* The cancel was ours, not the client's */
+		electric_timed_out = false;
+		QueryCancelPending = false;
+	}
+	return timed_out;
+}
+
+/*
+ * End of a call that completed. If the deadline passed after the last
+ * interrupt check, the call still ran too long.
+ */
+void
+electric_limits_stop(ElectricLimits *limits)
+{
+	int			ms = electric_deadline_ms;
+
+	if (electric_limits_disarm(limits))
+		electric_limit_exceeded(ELECTRIC_LIMIT_ELAPSED, (uint64) ms);
+}
+
+/*
+ * From a PG_CATCH block: disarm, then rethrow the error, or replace the
+ * query cancel our own timer caused with 57L01.
+ */
+void
+electric_limits_rethrow(ElectricLimits *limits)
+{
+	int			ms = electric_deadline_ms;
+
+	if (electric_limits_disarm(limits) && geterrcode() == ERRCODE_QUERY_CANCELED)
+	{
+		FlushErrorState();
+		electric_limit_exceeded(ELECTRIC_LIMIT_ELAPSED, (uint64) ms);
+	}
+	PG_RE_THROW();
+}
+
+/* Transaction abort: nothing is armed any more */
+void
+electric_limits_reset(void)
+{
+	if (electric_deadline != 0 && timeout_registered)
+		disable_timeout(electric_limit_timeout, false);
+	electric_deadline = 0;
+	electric_deadline_ms = 0;
+	electric_timed_out = false;
+	electric_scan_budget_reset();
+}
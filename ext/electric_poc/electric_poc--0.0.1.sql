@@ -1,13 +1,477 @@
 -- electric_poc extension SQL definitions
 
 -- Function to execute a read-only query as-of a specific MVCC snapshot
+-- options: {"verbose": true} returns {"rows": [...], "timing": {...}}
 CREATE OR REPLACE FUNCTION electric_exec_as_of(
     snapshot pg_snapshot,
     sql text,
-    args jsonb DEFAULT '[]'::jsonb
+    args jsonb DEFAULT '[]'::jsonb,
+    options jsonb DEFAULT '{}'::jsonb
 ) RETURNS jsonb
 AS 'MODULE_PATHNAME', 'electric_exec_as_of'
 LANGUAGE C STRICT VOLATILE;
 
-COMMENT ON FUNCTION electric_exec_as_of(pg_snapshot, text, jsonb) IS
+COMMENT ON FUNCTION electric_exec_as_of(pg_snapshot, text, jsonb, jsonb) IS
     'Execute a read-only SELECT query under the specified MVCC snapshot and return results as JSON';
+
+-- options: {"analyze": true, "buffers": true, "verbose": false, "settings": false}
+CREATE OR REPLACE FUNCTION electric_explain_as_of(
+    snapshot pg_snapshot,
+    sql text,
+    args jsonb DEFAULT '[]'::jsonb,
+    options jsonb DEFAULT '{}'::jsonb
+) RETURNS jsonb
+AS 'MODULE_PATHNAME', 'electric_explain_as_of'
+LANGUAGE C STRICT VOLATILE;
+
+COMMENT ON FUNCTION electric_explain_as_of(pg_snapshot, text, jsonb, jsonb) IS
+    'EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) a read-only SELECT query under the specified MVCC snapshot';
+
+-- Statistics (requires shared_preload_libraries = 'electric_poc')
+CREATE OR REPLACE FUNCTION pg_stat_electric(
+    OUT entry_point text,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT min_time double precision,
+    OUT max_time double precision,
+    OUT rows bigint,
+    OUT result_bytes bigint,
+    OUT parse_time double precision,
+    OUT xcnt_0 bigint,
+    OUT xcnt_1_9 bigint,
+    OUT xcnt_10_99 bigint,
+    OUT xcnt_100_999 bigint,
+    OUT xcnt_1000_9999 bigint,
+    OUT xcnt_10000_plus bigint,
+    OUT heap_pages bigint,
+    OUT tuples_examined bigint,
+    OUT tuples_visible bigint,
+    OUT hot_hops bigint,
+    OUT stats_reset timestamptz
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric AS
+    SELECT * FROM pg_stat_electric();
+
+COMMENT ON VIEW pg_stat_electric IS
+    'Per entry point call counts, timings (ms), rows, result bytes and snapshot xcnt distribution';
+
+CREATE OR REPLACE FUNCTION pg_stat_electric_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'electric_stats_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pg_stat_electric_reset() FROM PUBLIC;
+
+CREATE OR REPLACE FUNCTION pg_stat_electric_phases(
+    OUT phase text,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT mean_time double precision,
+    OUT p50_time double precision,
+    OUT p90_time double precision,
+    OUT p99_time double precision,
+    OUT max_time double precision
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_stats_phases'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_phases AS
+    SELECT * FROM pg_stat_electric_phases();
+
+COMMENT ON VIEW pg_stat_electric_phases IS
+    'electric_exec_as_of latency percentiles (ms) per phase: parse, plan, execute, serialize, total';
+
+-- Per-relation heap traversal under synthetic snapshots (electric.track_scans)
+CREATE OR REPLACE FUNCTION pg_stat_electric_tables(
+    OUT relid oid,
+    OUT scans bigint,
+    OUT heap_pages bigint,
+    OUT tuples_examined bigint,
+    OUT tuples_visible bigint,
+    OUT hot_hops bigint
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_scan_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_tables AS
+    SELECT relid,
+           relid::regclass AS relname,
+           scans,
+           heap_pages,
+           tuples_examined,
+           tuples_visible,
+           tuples_examined - tuples_visible AS tuples_invisible,
+           hot_hops
+    FROM pg_stat_electric_tables();
+
+COMMENT ON VIEW pg_stat_electric_tables IS
+    'Heap pages and tuple versions examined vs visible per relation, for queries under a synthetic snapshot';
+
+-- Prometheus text exposition of electric_exec_as_of latency by snapshot age
+CREATE OR REPLACE FUNCTION pg_stat_electric_prometheus()
+RETURNS text
+AS 'MODULE_PATHNAME', 'electric_stats_prometheus'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Backends currently running under a synthetic snapshot or waiting in electric_poc
+CREATE OR REPLACE FUNCTION pg_stat_electric_activity(
+    OUT pid int4,
+    OUT datid oid,
+    OUT usesysid oid,
+    OUT source text,
+    OUT snapshot_xmin xid,
+    OUT snapshot_xmax xid,
+    OUT snapshot_xcnt int4,
+    OUT snapshot_age bigint,
+    OUT snapshot_since timestamptz,
+    OUT wait_event text,
+    OUT wait_start timestamptz
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_activity'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_activity AS
+    SELECT * FROM pg_stat_electric_activity();
+
+COMMENT ON VIEW pg_stat_electric_activity IS
+    'Synthetic snapshot and electric_poc wait event per backend; join to pg_stat_activity on pid';
+
+-- electric.max_concurrent admission control, per role
+CREATE OR REPLACE FUNCTION pg_stat_electric_admission(
+    OUT usesysid oid,
+    OUT running int4,
+    OUT running_weight int4,
+    OUT queued int4,
+    OUT oldest_queued timestamptz,
+    OUT admitted bigint,
+    OUT waited bigint,
+    OUT timed_out bigint,
+    OUT total_wait_time float8,
+    OUT max_wait_time float8
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_admission_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_admission AS
+    SELECT * FROM pg_stat_electric_admission();
+
+-- electric.coalesce: identical calls sharing one execution
+CREATE OR REPLACE FUNCTION pg_stat_electric_coalesce(
+    OUT in_flight int4,
+    OUT waiting int4,
+    OUT executions bigint,
+    OUT coalesced bigint,
+    OUT fallbacks bigint
+) RETURNS record
+AS 'MODULE_PATHNAME', 'electric_coalesce_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_coalesce AS
+    SELECT * FROM pg_stat_electric_coalesce();
+
+COMMENT ON VIEW pg_stat_electric_coalesce IS
+    'electric_exec_as_of calls leading a shared execution, waiting for one, or served by one';
+
+COMMENT ON VIEW pg_stat_electric_admission IS
+    'electric_exec_as_of calls running and queued under electric.max_concurrent, with wait counters, per role (NULL usesysid: roles beyond the first 64)';
+
+-- Dead tuple versions one relation keeps only because of live snapshots,
+-- estimated from a sample of its pages
+CREATE OR REPLACE FUNCTION electric_retention_sample(
+    relid regclass,
+    sample_pages int4 DEFAULT 64,
+    OUT total_pages bigint,
+    OUT sampled_pages int4,
+    OUT horizon xid,
+    OUT advanced_horizon xid,
+    OUT dead_tuples bigint,
+    OUT dead_bytes bigint,
+    OUT retained_tuples bigint,
+    OUT retained_bytes bigint,
+    OUT reclaimable_bytes bigint
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_retention_sample'
+LANGUAGE C STRICT VOLATILE;
+
+-- Retention cost for every user table pgstat reports dead tuples in, with the
+-- snapshot, slot or prepared transaction holding the horizon back
+CREATE OR REPLACE FUNCTION electric_retention_report(
+    sample_pages int4 DEFAULT 64,
+    OUT relid oid,
+    OUT relname regclass,
+    OUT total_pages bigint,
+    OUT sampled_pages int4,
+    OUT n_dead_tup bigint,
+    OUT retained_tuples bigint,
+    OUT retained_bytes bigint,
+    OUT reclaimable_bytes bigint,
+    OUT oldest_xmin xid,
+    OUT pinned_by text
+) RETURNS SETOF record
+LANGUAGE sql VOLATILE
+AS $$
+    WITH holders AS (
+        SELECT format('replication slot %s', slot_name) AS holder, xmin
+        FROM pg_replication_slots
+        WHERE xmin IS NOT NULL
+        UNION ALL
+        SELECT format('prepared transaction %L', gid), transaction
+        FROM pg_prepared_xacts
+        WHERE database = current_database()
+        UNION ALL
+        SELECT format('backend %s (%s)', pid,
+                      coalesce(nullif(application_name, ''), backend_type)),
+               backend_xmin
+        FROM pg_stat_activity
+        WHERE backend_xmin IS NOT NULL
+          AND pid <> pg_backend_pid()
+          AND (datname IS NULL OR datname = current_database())
+    )
+    SELECT t.relid,
+           t.relid::regclass,
+           s.total_pages,
+           s.sampled_pages,
+           t.n_dead_tup,
+           s.retained_tuples,
+           s.retained_bytes,
+           s.reclaimable_bytes,
+           s.horizon,
+           (SELECT h.holder FROM holders h
+            ORDER BY h.xmin = s.horizon DESC, age(h.xmin) DESC
+            LIMIT 1)
+    FROM pg_stat_user_tables t
+    JOIN pg_class c ON c.oid = t.relid
+    JOIN pg_am am ON am.oid = c.relam AND am.amname = 'heap',
+         LATERAL electric_retention_sample(t.relid, sample_pages) s
+    WHERE t.n_dead_tup > 0
+    ORDER BY s.retained_bytes DESC, t.relid
+$$;
+
+-- Snapshots electric_prune() keeps tuple versions for. Register with
+-- electric_register_snapshot(), release by deleting the row.
+CREATE TABLE electric_registered_snapshots (
+    id bigserial PRIMARY KEY,
+    snapshot text NOT NULL,
+    registered_at timestamptz NOT NULL DEFAULT now()
+);
+
+-- Tables electric_prune() may run on, with the counts of its last pass
+CREATE TABLE electric_pruned_tables (
+    relid regclass PRIMARY KEY,
+    last_pruned_at timestamptz,
+    last_horizon xid8,
+    pages_scanned bigint,
+    pages_pruned bigint,
+    pages_skipped bigint,
+    tuples_removed bigint,
+    tuples_truncated bigint,
+    bytes_freed bigint
+);
+
+-- Newest live horizon any pruning pass has used (one row)
+CREATE TABLE electric_prune_state (
+    pruned_through xid8 NOT NULL
+);
+INSERT INTO electric_prune_state VALUES ('0');
+
+CREATE OR REPLACE FUNCTION electric_register_snapshot(snapshot text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'electric_register_snapshot'
+LANGUAGE C STRICT VOLATILE;
+
+-- Remove the versions of relid no registered snapshot and no live backend
+-- can see; commits, so CALL it outside a transaction block
+CREATE OR REPLACE PROCEDURE electric_prune(relid regclass)
+AS 'MODULE_PATHNAME', 'electric_prune'
+LANGUAGE C;
+
+-- electric_prune() on every table in electric_pruned_tables
+CREATE OR REPLACE PROCEDURE electric_prune_all()
+AS 'MODULE_PATHNAME', 'electric_prune_all'
+LANGUAGE C;
+
+-- The snapshot a replication stream position stands for: the transactions
+-- whose commit records precede lsn. NULL means now (the lsn used is returned).
+CREATE OR REPLACE FUNCTION electric_snapshot_at_lsn(
+    target pg_lsn DEFAULT NULL,
+    OUT lsn pg_lsn,
+    OUT snapshot text,
+    OUT xmin xid,
+    OUT xmax xid,
+    OUT xip xid[]
+) RETURNS record
+AS 'MODULE_PATHNAME', 'electric_snapshot_at_lsn'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION electric_snapshot_at_lsn(pg_lsn) FROM PUBLIC;
+
+-- Queries the electric.precompute_database worker keeps answered per commit,
+-- so electric_exec_as_of() can return them without executing. Register with
+-- electric_register_query(), drop by deleting the row.
+CREATE TABLE electric_registered_queries (
+    id bigserial PRIMARY KEY,
+    sql text NOT NULL,
+    args jsonb NOT NULL,
+    role regrole NOT NULL,
+    search_path text NOT NULL,
+    timezone text NOT NULL,
+    relations regclass[] NOT NULL,
+    registered_at timestamptz NOT NULL DEFAULT now()
+);
+
+-- Runs as role (NULL: the current user) under the caller's search_path and
+-- TimeZone; callers get the stored result only with the same three
+CREATE OR REPLACE FUNCTION electric_register_query(
+    sql text,
+    args jsonb DEFAULT '[]',
+    role regrole DEFAULT NULL
+) RETURNS bigint
+AS 'MODULE_PATHNAME', 'electric_register_query'
+LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION electric_register_query(text, jsonb, regrole) FROM PUBLIC;
+
+CREATE OR REPLACE FUNCTION pg_stat_electric_precompute(
+    OUT query_id bigint,
+    OUT versions int4,
+    OUT last_commit xid,
+    OUT recomputes bigint,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT horizon xid
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'electric_precompute_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE OR REPLACE VIEW pg_stat_electric_precompute AS
+    SELECT * FROM pg_stat_electric_precompute();
+
+COMMENT ON VIEW pg_stat_electric_precompute IS
+    'Registered queries the precompute worker serves: results kept, recomputations, and electric_exec_as_of calls answered from them or not';
+
+-- Tables whose writes are kept as per-transaction key filters. Only
+-- snapshots whose xmin is past complete_from can be compared with them.
+CREATE TABLE electric_write_tracked_tables (
+    relid regclass PRIMARY KEY,
+    complete_from xid8 NOT NULL,
+    tracked_at timestamptz NOT NULL DEFAULT now()
+);
+
+-- Bloom filter of the primary keys one transaction wrote to one table;
+-- NULL filter: every key may have changed
+CREATE TABLE electric_write_filters (
+    xid xid8 NOT NULL,
+    relid regclass NOT NULL,
+    nkeys int4 NOT NULL,
+    filter bytea,
+    PRIMARY KEY (relid, xid)
+);
+
+CREATE OR REPLACE FUNCTION electric_write_filter_trigger()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'electric_write_filter_trigger'
+LANGUAGE C SECURITY DEFINER;
+
+-- Start keeping key filters for a table with a primary key. The extension
+-- is relocatable, so its tables are qualified with the schema it is in now
+-- rather than found through the caller's search_path.
+CREATE OR REPLACE FUNCTION electric_track_writes(relid regclass)
+RETURNS void
+LANGUAGE plpgsql
+AS $$
+DECLARE
+    nsp name := (SELECT n.nspname FROM pg_extension e
+                 JOIN pg_namespace n ON n.oid = e.extnamespace
+                 WHERE e.extname = 'electric_poc');
+    trigger_fn regprocedure := format('%I.electric_write_filter_trigger()', nsp)::regprocedure;
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM pg_index i WHERE i.indrelid = relid AND i.indisprimary) THEN
+        RAISE EXCEPTION '"%" has no primary key', relid
+            USING ERRCODE = 'invalid_table_definition';
+    END IF;
+    IF relid IN (format('%I.electric_write_filters', nsp)::regclass,
+                 format('%I.electric_write_tracked_tables', nsp)::regclass) THEN
+        RAISE EXCEPTION 'cannot track writes to "%"', relid;
+    END IF;
+
+    EXECUTE format('CREATE TRIGGER electric_write_filter_rows '
+                   'AFTER INSERT OR UPDATE OR DELETE ON %s '
+                   'FOR EACH ROW EXECUTE FUNCTION %s', relid, trigger_fn::regproc);
+    EXECUTE format('CREATE TRIGGER electric_write_filter_statements '
+                   'AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON %s '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION %s', relid, trigger_fn::regproc);
+    EXECUTE format('ALTER TABLE %s ENABLE ALWAYS TRIGGER electric_write_filter_rows', relid);
+    EXECUTE format('ALTER TABLE %s ENABLE ALWAYS TRIGGER electric_write_filter_statements', relid);
+
+    -- Writers that fired no trigger finished before this commits
+    EXECUTE format('INSERT INTO %I.electric_write_tracked_tables (relid, complete_from) '
+                   'VALUES ($1, pg_current_xact_id())', nsp)
+        USING relid;
+END
+$$;
+
+CREATE OR REPLACE FUNCTION electric_untrack_writes(relid regclass)
+RETURNS void
+LANGUAGE plpgsql
+AS $$
+DECLARE
+    nsp name := (SELECT n.nspname FROM pg_extension e
+                 JOIN pg_namespace n ON n.oid = e.extnamespace
+                 WHERE e.extname = 'electric_poc');
+BEGIN
+    EXECUTE format('DROP TRIGGER IF EXISTS electric_write_filter_rows ON %s', relid);
+    EXECUTE format('DROP TRIGGER IF EXISTS electric_write_filter_statements ON %s', relid);
+    EXECUTE format('DELETE FROM %I.electric_write_tracked_tables WHERE relid = $1', nsp)
+        USING relid;
+    EXECUTE format('DELETE FROM %I.electric_write_filters WHERE relid = $1', nsp)
+        USING relid;
+END
+$$;
+
+-- The elements of keys (a value per key, or an array of values for a
+-- multi-column primary key) that a transaction visible to only one of the
+-- snapshots may have written. May include keys that did not change.
+CREATE OR REPLACE FUNCTION electric_keys_changed_between(
+    rel regclass,
+    keys jsonb,
+    snap_a pg_snapshot,
+    snap_b pg_snapshot
+) RETURNS jsonb
+AS 'MODULE_PATHNAME', 'electric_keys_changed_between'
+LANGUAGE C STRICT VOLATILE;
+
+-- Drop the filters of transactions before xid; snapshots older than it get
+-- every key back
+CREATE OR REPLACE FUNCTION electric_trim_write_filters(before xid8)
+RETURNS bigint
+LANGUAGE plpgsql VOLATILE
+AS $$
+DECLARE
+    nsp name := (SELECT n.nspname FROM pg_extension e
+                 JOIN pg_namespace n ON n.oid = e.extnamespace
+                 WHERE e.extname = 'electric_poc');
+    trimmed bigint;
+BEGIN
+    EXECUTE format('UPDATE %I.electric_write_tracked_tables '
+                   'SET complete_from = greatest(complete_from, $1)', nsp)
+        USING before;
+    EXECUTE format('DELETE FROM %I.electric_write_filters WHERE xid < $1', nsp)
+        USING before;
+    GET DIAGNOSTICS trimmed = ROW_COUNT;
+    RETURN trimmed;
+END
+$$;
+
+-- This backend's electric.toast_cache_size cache
+CREATE OR REPLACE FUNCTION electric_toast_cache_stats(
+    OUT entries bigint,
+    OUT bytes bigint,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT evictions bigint
+) RETURNS record
+AS 'MODULE_PATHNAME', 'electric_toast_cache_stats'
+LANGUAGE C STRICT VOLATILE;
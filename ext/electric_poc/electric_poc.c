@@ -5,6 +5,7 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "utils/builtins.h"
+#include "utils/json.h"
 #include "utils/jsonb.h"
 #include "utils/snapmgr.h"
 #include "utils/snapshot.h"
@@ -17,6 +18,23 @@
 #include "access/xact.h"
 #include "executor/executor.h"
 #include "utils/guc.h"
+#include "access/htup_details.h"
+#include "access/transam.h"
+#include "commands/explain.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "nodes/queryjumble.h"
+#include "optimizer/planner.h"
+#include "postmaster/postmaster.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "utils/plancache.h"
+#include "utils/timestamp.h"
+
+#include "electric_poc.h"
 
 #include <ctype.h>
 #include <string.h>
@@ -25,6 +43,7 @@
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(electric_exec_as_of);
+PG_FUNCTION_INFO_V1(electric_explain_as_of);
 
 /*
  * SET LOCAL electric.snapshot support (POC)
@@ -39,16 +58,50 @@ PG_FUNCTION_INFO_V1(electric_exec_as_of);
 static char *electric_snapshot_guc = NULL;
 static Snapshot pending_snapshot = NULL;
 static bool snapshot_pending_install = false;
+/*
+ * Installed, but not yet checked against the pruning horizon nor waited for:
+ * done before the first query reads
+ */
+static bool snapshot_pending_checks = false;
 
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static planner_hook_type prev_planner_hook = NULL;
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* electric.track_stats: feed pg_stat_electric (needs shared_preload_libraries) */
+bool electric_track_stats = true;
+
+/* electric.log_phase_timing: one structured LOG line per electric_exec_as_of() call */
+bool electric_log_phase_timing = false;
 
-typedef struct ElectricParsedSnapshot
+/* electric.log_min_duration: log plans of slower electric_exec_as_of() calls (ms, -1 = off) */
+static int electric_log_min_duration = -1;
+
+/* electric.snapshot_wait_timeout: longest electric_wait_for_snapshot() waits (ms, 0 = no limit) */
+static int electric_snapshot_wait_timeout = 10000;
+
+/* Parse time of the last electric.snapshot check hook, reported by the assign hook */
+static instr_time guc_parse_time;
+
+/*
+ * The electric_exec_as_of() call currently executing in this backend
+ * (innermost one if calls nest). Hooks use it to attribute work to the call.
+ */
+typedef struct ElectricCallContext
 {
-	TransactionId xmin;
-	TransactionId xmax;
-	TransactionId *xip;
-	uint32 xcnt;
-} ElectricParsedSnapshot;
+	ElectricCallStats stats;
+	instr_time	planner_time;	/* spent in the planner during execution */
+	MemoryContext cxt;			/* caller's context, for scan_rels */
+	List	   *scan_rels;		/* ElectricRelScanStats *, electric.track_scans */
+	DestReceiver *dest;			/* identifies the call's own query */
+	const char *snapshot_str;	/* for electric.log_min_duration */
+	Snapshot	snapshot;		/* for pg_stat_electric_activity */
+	struct ElectricCallContext *parent;
+} ElectricCallContext;
+
+static ElectricCallContext *electric_current_call = NULL;
 
 static int
 txid_cmp(const void *a, const void *b)
@@ -62,11 +115,152 @@ txid_cmp(const void *a, const void *b)
 	return 0;
 }
 
+/*
+ * Publish whichever synthetic snapshot this backend runs under now: the
+ * innermost electric_exec_as_of() call's, else SET LOCAL electric.snapshot's.
+ */
+static void
+electric_activity_restore(void)
+{
+	if (electric_current_call != NULL)
+		electric_activity_report(ELECTRIC_ACTIVITY_EXEC_AS_OF, electric_current_call->snapshot);
+	else if (pending_snapshot != NULL)
+		electric_activity_report(ELECTRIC_ACTIVITY_SNAPSHOT_GUC, pending_snapshot);
+	else
+		electric_activity_report(ELECTRIC_ACTIVITY_NONE, NULL);
+}
+
 static void
 electric_clear_pending_snapshot(void)
 {
 	pending_snapshot = NULL;
 	snapshot_pending_install = false;
+	snapshot_pending_checks = false;
+	electric_activity_restore();
+}
+
+static bool
+electric_xid_in_list(TransactionId xid, const TransactionId *xip, uint32 xcnt)
+{
+	uint32		i;
+
+	for (i = 0; i < xcnt; i++)
+	{
+		if (TransactionIdEquals(xip[i], xid))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * An xid the synthetic snapshot treats as finished but which is still
+ * running here, or InvalidTransactionId if there is none.
+ */
+static TransactionId
+electric_snapshot_blocker(Snapshot snap)
+{
+	Snapshot	cur;
+	TransactionId next_xid;
+	TransactionId xid;
+	uint32		i;
+
+	/*
+	 * Nothing below the snapshot's xmax still running: the usual case, and
+	 * cheaper to tell than building a snapshot and matching it against xip.
+	 */
+	if (!RecoveryInProgress() &&
+		!TransactionIdPrecedes(GetOldestActiveTransactionId(), snap->xmax))
+		return InvalidTransactionId;
+
+	cur = GetLatestSnapshot();
+
+	/* Still running: the snapshot's xip doesn't list it */
+	for (i = 0; i < cur->xcnt; i++)
+	{
+		xid = cur->xip[i];
+		if (!TransactionIdPrecedes(xid, snap->xmin) &&
+			TransactionIdPrecedes(xid, snap->xmax) &&
+			!TransactionIdIsCurrentTransactionId(xid) &&
+			!electric_xid_in_list(xid, snap->xip, snap->xcnt))
+			return xid;
+	}
+
+	/* On a standby, running xids are all in subxip */
+	if (cur->takenDuringRecovery)
+	{
+		for (i = 0; i < (uint32) cur->subxcnt; i++)
+		{
+			xid = cur->subxip[i];
+			if (!TransactionIdPrecedes(xid, snap->xmin) &&
+				TransactionIdPrecedes(xid, snap->xmax) &&
+				!electric_xid_in_list(xid, snap->xip, snap->xcnt))
+				return xid;
+		}
+	}
+
+	/*
+	 * Assigned but not yet completed: xids from cur->xmax up to the next xid.
+	 * Xids that haven't been assigned yet can't have written anything.
+	 */
+	next_xid = XidFromFullTransactionId(ReadNextFullTransactionId());
+	for (xid = cur->xmax;
+		 TransactionIdPrecedes(xid, snap->xmax) && TransactionIdPrecedes(xid, next_xid);
+		 TransactionIdAdvance(xid))
+	{
+		if (!TransactionIdIsCurrentTransactionId(xid) &&
+			!electric_xid_in_list(xid, snap->xip, snap->xcnt))
+			return xid;
+	}
+
+	return InvalidTransactionId;
+}
+
+/*
+ * Wait until every xid the snapshot treats as finished has finished here.
+ *
+ * A commit can reach a client through logical replication as soon as its
+ * WAL is flushed, before the committing backend has updated clog and left
+ * the ProcArray. Reading in that window would take the xid for aborted and
+ * set hint bits to match, so we hold off until the ProcArray agrees.
+ * A snapshot that calls a long-running transaction finished would wait for
+ * it, so the wait gives up after electric.snapshot_wait_timeout (55L01).
+ */
+void
+electric_wait_for_snapshot(Snapshot snap)
+{
+	TransactionId blocker = electric_snapshot_blocker(snap);
+	TimestampTz deadline = 0;
+
+	if (!TransactionIdIsValid(blocker))
+		return;
+
+	if (electric_snapshot_wait_timeout > 0)
+		deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+											   electric_snapshot_wait_timeout);
+
+	electric_activity_wait_start(ELECTRIC_WAIT_SNAPSHOT);
+	PG_TRY();
+	{
+		do
+		{
+			if (deadline != 0 && GetCurrentTimestamp() >= deadline)
+				ereport(ERROR,
+						(errcode(ERRCODE_ELECTRIC_SNAPSHOT_WAIT_TIMEOUT),
+						 errmsg("transaction %u is still running after electric.snapshot_wait_timeout (%d ms)",
+								blocker, electric_snapshot_wait_timeout),
+						 errdetail("The snapshot treats it as finished.")));
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 1L, WAIT_EVENT_EXTENSION);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+			blocker = electric_snapshot_blocker(snap);
+		} while (TransactionIdIsValid(blocker));
+	}
+	PG_FINALLY();
+	{
+		electric_activity_wait_end();
+	}
+	PG_END_TRY();
 }
 
 static void
@@ -81,17 +275,36 @@ electric_xact_callback(XactEvent event, void *arg)
 		case XACT_EVENT_PARALLEL_ABORT:
 		case XACT_EVENT_PREPARE:
 			electric_clear_pending_snapshot();
+			electric_writeset_reset();
+			if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+			{
+				electric_limits_reset();
+				electric_admission_reset();
+				electric_flight_abort();
+			}
 			break;
 		default:
 			break;
 	}
 }
 
+/*
+ * A leader's error can end a subtransaction only (plpgsql EXCEPTION blocks).
+ * Let its followers go rather than have them wait for the top level.
+ */
+static void
+electric_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						  SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		electric_flight_abort();
+}
+
 /*
  * Parse pg_snapshot-like text into parts (xmin:xmax:xip_list).
  * Allocates the parsed xip array in TopTransactionContext.
  */
-static ElectricParsedSnapshot *
+ElectricParsedSnapshot *
 electric_parse_snapshot_text(const char *snapshot_str)
 {
 	ElectricParsedSnapshot *parsed;
@@ -235,7 +448,7 @@ electric_parse_snapshot_text(const char *snapshot_str)
  * Create a SnapshotData by copying a base snapshot and overriding MVCC fields.
  * Allocates in TopTransactionContext.
  */
-static Snapshot
+Snapshot
 electric_build_snapshot_from_parts(Snapshot base, const ElectricParsedSnapshot *parsed)
 {
 	Snapshot snap;
@@ -348,7 +561,14 @@ electric_snapshot_check_hook(char **newval, void **extra, GucSource source)
 				 errmsg("electric.snapshot must be set before the first query in the transaction")));
 
 	/* Validate format and parse */
-	*extra = (void *) electric_parse_snapshot_text(*newval);
+	{
+		instr_time	start;
+
+		INSTR_TIME_SET_CURRENT(start);
+		*extra = (void *) electric_parse_snapshot_text(*newval);
+		INSTR_TIME_SET_CURRENT(guc_parse_time);
+		INSTR_TIME_SUBTRACT(guc_parse_time, start);
+	}
 	return true;
 }
 
@@ -371,19 +591,107 @@ electric_snapshot_assign_hook(const char *newval, void *extra)
 	{
 		Snapshot base = NULL;
 		Snapshot snap = NULL;
+		instr_time start;
+		ElectricCallStats cs;
+
+		INSTR_TIME_SET_CURRENT(start);
 
 		/* Validate guardrails, then get a fully-initialized base snapshot. */
 		base = electric_ensure_txn_allows_synthetic_snapshot();
 		snap = electric_build_snapshot_from_parts(base, parsed);
 		pending_snapshot = snap;
 		snapshot_pending_install = false;
+		/* An assign hook must not block or fail: ExecutorStart checks */
+		snapshot_pending_checks = true;
 		FirstXactSnapshot = snap;
+		electric_activity_restore();
+
+		memset(&cs, 0, sizeof(cs));
+		INSTR_TIME_SET_CURRENT(cs.total);
+		INSTR_TIME_SUBTRACT(cs.total, start);
+		cs.phases[ELECTRIC_PHASE_PARSE] = guc_parse_time;
+		cs.xcnt = parsed->xcnt;
+		electric_stats_record(ELECTRIC_ENTRY_SNAPSHOT_GUC, &cs);
+		INSTR_TIME_SET_ZERO(guc_parse_time);
 	}
 }
 
+/*
+ * Is this the statement an electric_exec_as_of() call runs (as opposed to
+ * anything that statement runs in turn)? The call's own query is the one
+ * writing to its DestReceiver.
+ */
+static bool
+electric_is_call_query(QueryDesc *queryDesc)
+{
+	return electric_current_call != NULL &&
+		queryDesc->dest == electric_current_call->dest;
+}
+
+static bool
+electric_log_plan_wanted(QueryDesc *queryDesc)
+{
+	return electric_log_min_duration >= 0 && electric_is_call_query(queryDesc);
+}
+
+/*
+ * Log the plan of a slow electric_exec_as_of() query, auto_explain style.
+ */
+static void
+electric_log_slow_plan(QueryDesc *queryDesc)
+{
+	MemoryContext oldcxt;
+	ExplainState *es;
+	double		msec;
+
+	InstrEndLoop(queryDesc->totaltime);
+	msec = queryDesc->totaltime->total * 1000.0;
+	if (msec < electric_log_min_duration)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+	es = NewExplainState();
+	es->analyze = true;
+	es->buffers = true;
+	es->timing = true;
+	es->summary = true;
+	es->format = EXPLAIN_FORMAT_JSON;
+
+	ExplainBeginOutput(es);
+	ExplainQueryText(es, queryDesc);
+	ExplainQueryParameters(es, queryDesc->params, -1);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Turn the JSON array wrapper into an object, as auto_explain does */
+	es->str->data[0] = '{';
+	es->str->data[es->str->len - 1] = '}';
+
+	ereport(LOG,
+			(errmsg("electric_exec_as_of duration: %.3f ms  snapshot: %s  query_id: " INT64_FORMAT "  plan:\n%s",
+					msec, electric_current_call->snapshot_str,
+					(int64) queryDesc->plannedstmt->queryId, es->str->data),
+			 errhidestmt(true)));
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
 static void
 electric_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
+	/*
+	 * Only queries running under a synthetic snapshot are accounted, so
+	 * ordinary traffic never touches the shared counters.
+	 */
+	bool		track = pending_snapshot != NULL;
+	bool		log_plan = electric_log_plan_wanted(queryDesc);
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	if (track)
+		INSTR_TIME_SET_CURRENT(start);
+
 	/*
 	 * Fallback hook: currently we install at SET time. Keep this hook in place
 	 * as a safety net for future refactors where install is deferred.
@@ -395,10 +703,140 @@ electric_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		snapshot_pending_install = false;
 	}
 
+	/* Before the first query reads under SET LOCAL electric.snapshot's snapshot */
+	if (snapshot_pending_checks && pending_snapshot != NULL)
+	{
+		/* Cleared first: the prune check's own query comes through here */
+		snapshot_pending_checks = false;
+		PG_TRY();
+		{
+			electric_prune_check_snapshot(pending_snapshot);
+			electric_wait_for_snapshot(pending_snapshot);
+		}
+		PG_CATCH();
+		{
+			/* Caught by a savepoint, the next query tries again */
+			snapshot_pending_checks = (pending_snapshot != NULL);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	if (log_plan)
+		queryDesc->instrument_options |= INSTRUMENT_TIMER | INSTRUMENT_ROWS | INSTRUMENT_BUFFERS;
+
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
+
+	/* Lets callers match the call up with pg_stat_statements */
+	if (electric_is_call_query(queryDesc))
+		electric_current_call->stats.query_id = (int64) queryDesc->plannedstmt->queryId;
+
+	/* Total runtime is what electric.log_min_duration is compared against */
+	if (log_plan && queryDesc->totaltime == NULL)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	if (track)
+	{
+		ElectricCallStats cs;
+
+		memset(&cs, 0, sizeof(cs));
+		INSTR_TIME_SET_CURRENT(cs.total);
+		INSTR_TIME_SUBTRACT(cs.total, start);
+		cs.xcnt = pending_snapshot->xcnt;
+		electric_stats_record(ELECTRIC_ENTRY_EXECUTOR_START, &cs);
+	}
+
+	if ((electric_track_scans || electric_scan_budget_active()) &&
+		(pending_snapshot != NULL || electric_current_call != NULL) &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+		electric_scan_instrument(queryDesc);
+
+	if (electric_toast_cache_size > 0 &&
+		(pending_snapshot != NULL || electric_current_call != NULL) &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+		electric_toast_instrument(queryDesc);
+}
+
+static void
+electric_ExecutorEnd(QueryDesc *queryDesc)
+{
+	ElectricCallContext *call = electric_current_call;
+
+	if (call != NULL)
+		electric_scan_finish(queryDesc, &call->stats.scan, &call->scan_rels, call->cxt);
+	else
+		electric_scan_finish(queryDesc, NULL, NULL, NULL);
+
+	if (queryDesc->totaltime != NULL && electric_log_plan_wanted(queryDesc))
+		electric_log_slow_plan(queryDesc);
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+static PlannedStmt *
+electric_planner(Query *parse, const char *query_string, int cursorOptions,
+				 ParamListInfo boundParams)
+{
+	ElectricCallContext *call = electric_current_call;
+	PlannedStmt *result;
+	instr_time	start;
+	instr_time	end;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	if (prev_planner_hook)
+		result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+	else
+		result = standard_planner(parse, query_string, cursorOptions, boundParams);
+
+	if (call != NULL)
+	{
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_ACCUM_DIFF(call->planner_time, end, start);
+	}
+
+	return result;
+}
+
+static void
+electric_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(electric_stats_shmem_size());
+	RequestAddinShmemSpace(electric_activity_shmem_size());
+	electric_scan_shmem_request();
+	electric_admission_shmem_request();
+	electric_coalesce_shmem_request();
+	electric_precompute_shmem_request();
+}
+
+static void
+electric_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	electric_stats_shmem_init();
+	electric_activity_shmem_init();
+	electric_scan_shmem_init();
+	electric_admission_shmem_init();
+	electric_coalesce_shmem_init();
+	electric_precompute_shmem_init();
+	LWLockRelease(AddinShmemInitLock);
 }
 
 void
@@ -418,83 +856,461 @@ _PG_init(void)
 		NULL
 	);
 
-	RegisterXactCallback(electric_xact_callback, NULL);
-
-	prev_ExecutorStart = ExecutorStart_hook;
-	ExecutorStart_hook = electric_ExecutorStart;
-}
+	DefineCustomIntVariable(
+		"electric.snapshot_wait_timeout",
+		"Longest a synthetic snapshot waits for the xids it treats as finished to finish here.",
+		"Waits still blocked then fail with SQLSTATE 55L01. 0 waits indefinitely.",
+		&electric_snapshot_wait_timeout,
+		10000,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
 
-void
-_PG_fini(void)
-{
-	ExecutorStart_hook = prev_ExecutorStart;
-}
+	DefineCustomBoolVariable(
+		"electric.track_stats",
+		"Collect pg_stat_electric statistics.",
+		"Has no effect unless electric_poc is in shared_preload_libraries.",
+		&electric_track_stats,
+		true,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-/*
- * Check if the SQL starts with SELECT
- */
-static bool
-is_select_query(const char *sql)
-{
-    const char *p = sql;
-    while (*p && isspace((unsigned char) *p))
-        p++;
-    if (pg_strncasecmp(p, "select", 6) == 0)
-    {
-        char next = p[6];
-        if (next == '\0' || isspace((unsigned char) next))
-            return true;
-    }
-    if (pg_strncasecmp(p, "with", 4) == 0)
-    {
-        char next = p[4];
-        if (next == '\0' || isspace((unsigned char) next))
-            return true;
-    }
-    return false;
-}
+	DefineCustomBoolVariable(
+		"electric.log_phase_timing",
+		"Log a structured per-phase timing line for every electric_exec_as_of() call.",
+		"Lines are JSON objects suitable for conversion into trace spans.",
+		&electric_log_phase_timing,
+		false,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-/*
- * Parse JSON array of strings into an array of C strings
- */
-static char **
-parse_jsonb_args(Jsonb *jb, int *nargs)
-{
-    JsonbIterator *it;
-    JsonbValue  v;
-    JsonbIteratorToken type;
-    char      **args;
-    int         count = 0;
-    int         alloc = 8;
+	DefineCustomBoolVariable(
+		"electric.track_scans",
+		"Count heap pages and tuple versions examined by queries under a synthetic snapshot.",
+		"Reported per call by electric_exec_as_of() in verbose mode and per relation "
+		"in pg_stat_electric_tables. Adds per-row overhead to those queries.",
+		&electric_track_scans,
+		false,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-    *nargs = 0;
+	DefineCustomIntVariable(
+		"electric.log_min_duration",
+		"Log the plan of electric_exec_as_of() queries running at least this long.",
+		"Plans are logged as EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) together with the "
+		"snapshot. -1 disables; 0 logs every call. Enabling it instruments every as-of query.",
+		&electric_log_min_duration,
+		-1,
+		-1,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
 
-    if (jb == NULL || JB_ROOT_IS_SCALAR(jb))
-        return NULL;
+	DefineCustomStringVariable(
+		"electric.capture_file",
+		"Append every electric_exec_as_of() call to this file for later replay.",
+		"Relative paths are relative to the data directory. Empty disables capture. "
+		"Replay the file with bench/electric_replay.",
+		&electric_capture_file,
+		"",
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-    if (!JB_ROOT_IS_ARRAY(jb))
-        ereport(ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("args must be a JSON array")));
+	DefineCustomIntVariable(
+		"electric.max_rows",
+		"Largest number of rows electric_exec_as_of() may return.",
+		"Exceeding it raises SQLSTATE 54L01. 0 is unlimited. The max_rows option can only lower it.",
+		&electric_max_rows,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-    args = (char **) palloc(alloc * sizeof(char *));
+	DefineCustomIntVariable(
+		"electric.max_result_bytes",
+		"Largest result electric_exec_as_of() may build, as JSON text.",
+		"Exceeding it raises SQLSTATE 54L02. 0 is unlimited. The max_result_bytes option can only lower it.",
+		&electric_max_result_bytes,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_BYTE,
+		NULL,
+		NULL,
+		NULL
+	);
 
-    it = JsonbIteratorInit(&jb->root);
-    while ((type = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
-    {
-        if (type == WJB_ELEM)
-        {
-            char *str_val;
+	DefineCustomIntVariable(
+		"electric.max_tuples_examined",
+		"Most tuple versions an electric_exec_as_of() query may examine.",
+		"Exceeding it raises SQLSTATE 54L03. 0 is unlimited. Counted on instrumented seq and "
+		"index scans, as electric.track_scans does. The max_tuples_examined option can only lower it.",
+		&electric_max_tuples_examined,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
 
-            if (count >= alloc)
-            {
-                alloc *= 2;
-                args = (char **) repalloc(args, alloc * sizeof(char *));
-            }
+	DefineCustomIntVariable(
+		"electric.max_elapsed",
+		"Longest an electric_exec_as_of() call may run.",
+		"Exceeding it raises SQLSTATE 57L01. 0 is unlimited. The max_elapsed_ms option can only lower it.",
+		&electric_max_elapsed,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
 
-            switch (v.type)
-            {
-                case jbvString:
+	DefineCustomIntVariable(
+		"electric.max_snapshot_age",
+		"Oldest snapshot electric_exec_as_of() accepts, in transactions assigned since its xmax.",
+		"Older snapshots raise SQLSTATE 54L04. 0 is unlimited. The max_snapshot_age option can only lower it.",
+		&electric_max_snapshot_age,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomBoolVariable(
+		"electric.coalesce",
+		"Let identical concurrent electric_exec_as_of() calls share one execution.",
+		"Calls with the same snapshot, SQL, args, role, database, search_path and TimeZone "
+		"wait for the first one's result. Needs electric_poc in shared_preload_libraries.",
+		&electric_coalesce,
+		false,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.coalesce_wait_timeout",
+		"Longest a coalesced call waits for the call it joined.",
+		"A call still waiting then executes the query itself.",
+		&electric_coalesce_wait_timeout,
+		1000,
+		1,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.max_concurrent",
+		"Total admission weight of electric_exec_as_of() calls allowed to run at once.",
+		"Calls beyond it queue. 0 disables admission control. Needs electric_poc in "
+		"shared_preload_libraries.",
+		&electric_max_concurrent,
+		0,
+		0,
+		MAX_BACKENDS,
+		PGC_SIGHUP,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.admission_weight",
+		"Share of electric.max_concurrent each electric_exec_as_of() call takes.",
+		"Set per role with ALTER ROLE ... SET to give heavy readers fewer slots.",
+		&electric_admission_weight,
+		1,
+		1,
+		MAX_BACKENDS,
+		PGC_SUSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.admission_timeout",
+		"Longest an electric_exec_as_of() call waits to be admitted.",
+		"Calls still queued then fail with SQLSTATE 53L01. 0 waits indefinitely.",
+		&electric_admission_timeout,
+		0,
+		0,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomStringVariable(
+		"electric.server_socket",
+		"Unix socket path the as-of query server listens on.",
+		"Empty disables the server. With electric.server_workers > 1, worker n listens "
+		"on <path>.<n>. Needs electric_poc in shared_preload_libraries.",
+		&electric_server_socket,
+		"",
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.server_workers",
+		"Number of as-of query server workers, each with its own socket.",
+		NULL,
+		&electric_server_workers,
+		1,
+		1,
+		MAX_BACKENDS,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomStringVariable(
+		"electric.server_database",
+		"Database the as-of query server connects to.",
+		NULL,
+		&electric_server_database,
+		"postgres",
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomStringVariable(
+		"electric.server_user",
+		"Role the as-of query server runs queries as.",
+		"Anyone who can open the socket reads with this role's privileges. "
+		"Required, and must not be a superuser: the server doesn't start otherwise.",
+		&electric_server_user,
+		"",
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomStringVariable(
+		"electric.precompute_database",
+		"Database whose registered queries a background worker keeps answered per commit.",
+		"Empty disables the worker. Queries are registered with electric_register_query(). "
+		"Needs electric_poc in shared_preload_libraries and wal_level replica or higher.",
+		&electric_precompute_database,
+		"",
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.precompute_naptime",
+		"How long the precompute worker sleeps when it has read all flushed WAL.",
+		NULL,
+		&electric_precompute_naptime,
+		10,
+		1,
+		INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_MS,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.toast_cache_size",
+		"Memory each backend may use to keep detoasted values across historical queries.",
+		"0 disables the cache. Values larger than a quarter of it are not kept.",
+		&electric_toast_cache_size,
+		0,
+		0,
+		MaxAllocSize / 1024,
+		PGC_USERSET,
+		GUC_UNIT_KB,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	DefineCustomIntVariable(
+		"electric.write_filter_max_keys",
+		"Keys a transaction may write to a tracked table before its filter says every key changed.",
+		"Filters take about 10 bits per key and are rewritten at the end of every writing statement.",
+		&electric_write_filter_max_keys,
+		10000,
+		0,
+		INT_MAX / 16,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL,
+		NULL
+	);
+
+	MarkGUCPrefixReserved("electric");
+
+	/*
+	 * Have the core compute query ids (compute_query_id = auto) so the
+	 * statement electric_exec_as_of() plans has the same id it would have in
+	 * pg_stat_statements, even when that isn't loaded.
+	 */
+	EnableQueryId();
+
+	if (process_shared_preload_libraries_in_progress)
+	{
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = electric_shmem_request;
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = electric_shmem_startup;
+
+		electric_server_register();
+		electric_precompute_register();
+	}
+
+	RegisterXactCallback(electric_xact_callback, NULL);
+	RegisterSubXactCallback(electric_subxact_callback, NULL);
+
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = electric_ExecutorStart;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = electric_ExecutorEnd;
+	prev_planner_hook = planner_hook;
+	planner_hook = electric_planner;
+}
+
+void
+_PG_fini(void)
+{
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	planner_hook = prev_planner_hook;
+}
+
+/*
+ * Check if the SQL starts with SELECT
+ */
+static bool
+is_select_query(const char *sql)
+{
+    const char *p = sql;
+    while (*p && isspace((unsigned char) *p))
+        p++;
+    if (pg_strncasecmp(p, "select", 6) == 0)
+    {
+        char next = p[6];
+        if (next == '\0' || isspace((unsigned char) next))
+            return true;
+    }
+    if (pg_strncasecmp(p, "with", 4) == 0)
+    {
+        char next = p[4];
+        if (next == '\0' || isspace((unsigned char) next))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Parse JSON array of strings into an array of C strings
+ */
+static char **
+parse_jsonb_args(Jsonb *jb, int *nargs)
+{
+    JsonbIterator *it;
+    JsonbValue  v;
+    JsonbIteratorToken type;
+    char      **args;
+    int         count = 0;
+    int         alloc = 8;
+
+    *nargs = 0;
+
+    if (jb == NULL || JB_ROOT_IS_SCALAR(jb))
+        return NULL;
+
+    if (!JB_ROOT_IS_ARRAY(jb))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("args must be a JSON array")));
+
+    args = (char **) palloc(alloc * sizeof(char *));
+
+    it = JsonbIteratorInit(&jb->root);
+    while ((type = JsonbIteratorNext(&it, &v, false)) != WJB_DONE)
+    {
+        if (type == WJB_ELEM)
+        {
+            char *str_val;
+
+            if (count >= alloc)
+            {
+                alloc *= 2;
+                args = (char **) repalloc(args, alloc * sizeof(char *));
+            }
+
+            switch (v.type)
+            {
+                case jbvString:
                     str_val = pnstrdup(v.val.string.val, v.val.string.len);
                     break;
                 case jbvNumeric:
@@ -521,11 +1337,71 @@ parse_jsonb_args(Jsonb *jb, int *nargs)
     return args;
 }
 
+/*
+ * Text form of a pg_snapshot argument, via the type's output function
+ */
+static char *
+snapshot_arg_to_cstring(FunctionCallInfo fcinfo, int argno, Datum snapshot_datum)
+{
+    Oid         snapshot_typoid;
+    Oid         typoutput;
+    bool        typIsVarlena;
+
+    snapshot_typoid = get_fn_expr_argtype(fcinfo->flinfo, argno);
+    getTypeOutputInfo(snapshot_typoid, &typoutput, &typIsVarlena);
+    return OidOutputFunctionCall(typoutput, snapshot_datum);
+}
+
+void
+require_select_query(const char *sql)
+{
+    if (!is_select_query(sql))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("only SELECT queries are allowed"),
+                 errhint("The query must start with SELECT or WITH")));
+}
+
+/*
+ * Bind the JSON args array as text parameters $1..$n
+ */
+ParamListInfo
+build_text_params(Jsonb *args_jsonb, int *nargs, Oid **argtypes)
+{
+    char      **args = NULL;
+    ParamListInfo paramLI;
+    int         i;
+
+    *nargs = 0;
+    *argtypes = NULL;
+
+    if (args_jsonb != NULL)
+        args = parse_jsonb_args(args_jsonb, nargs);
+    if (*nargs == 0)
+        return NULL;
+
+    *argtypes = (Oid *) palloc(*nargs * sizeof(Oid));
+    paramLI = makeParamList(*nargs);
+
+    for (i = 0; i < *nargs; i++)
+    {
+        ParamExternData *prm = &paramLI->params[i];
+
+        (*argtypes)[i] = TEXTOID;
+        prm->ptype = TEXTOID;
+        prm->pflags = PARAM_FLAG_CONST;
+        prm->isnull = (args[i] == NULL);
+        prm->value = prm->isnull ? (Datum) 0 : CStringGetTextDatum(args[i]);
+    }
+
+    return paramLI;
+}
+
 /*
  * Parse snapshot string and create a custom MVCC snapshot.
  * Format: xmin:xmax:xip1,xip2,...
  */
-static Snapshot
+Snapshot
 create_custom_snapshot(const char *snapshot_str)
 {
     Snapshot    base;
@@ -626,55 +1502,398 @@ create_custom_snapshot(const char *snapshot_str)
     return snap;
 }
 
+/*
+ * Per-call options for electric_exec_as_of(), from its `options` jsonb object
+ */
+typedef struct ElectricExecOptions
+{
+    bool        verbose;        /* wrap result as {"rows": ..., "timing": ...} */
+    ElectricLimits limits;      /* electric.max_* GUCs, tightened by max_* options */
+} ElectricExecOptions;
+
+typedef struct ElectricExplainOptions
+{
+    bool        analyze;
+    bool        buffers;
+    bool        verbose;
+    bool        settings;
+    ElectricLimits limits;
+} ElectricExplainOptions;
+
+/* Returns false if the key is not an option of this function */
+typedef bool (*ElectricOptionHandler) (const char *key, JsonbValue *v, void *opts);
+
+static bool
+electric_option_bool(const char *key, JsonbValue *v)
+{
+    if (v->type != jbvBool)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("option \"%s\" must be a boolean", key)));
+    return v->val.boolean;
+}
+
+/*
+ * Walk an options object, handing each key/value to the handler. Unknown
+ * keys are rejected so typos don't silently turn an option off.
+ */
+static void
+parse_options(Jsonb *jb, ElectricOptionHandler handler, void *opts)
+{
+    JsonbIterator *it;
+    JsonbValue  v;
+    JsonbIteratorToken type;
+    char       *key = NULL;
+
+    if (jb == NULL)
+        return;
+
+    if (!JB_ROOT_IS_OBJECT(jb))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("options must be a JSON object")));
+
+    it = JsonbIteratorInit(&jb->root);
+    while ((type = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+    {
+        if (type == WJB_KEY)
+        {
+            key = pnstrdup(v.val.string.val, v.val.string.len);
+            continue;
+        }
+        if (type != WJB_VALUE)
+            continue;
+
+        if (!handler(key, &v, opts))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("unrecognized option \"%s\"", key)));
+    }
+}
+
+static bool
+exec_option(const char *key, JsonbValue *v, void *arg)
+{
+    ElectricExecOptions *opts = (ElectricExecOptions *) arg;
+
+    if (strcmp(key, "verbose") == 0)
+        opts->verbose = electric_option_bool(key, v);
+    else
+        return electric_limits_option(&opts->limits, key, v);
+    return true;
+}
+
+static bool
+explain_option(const char *key, JsonbValue *v, void *arg)
+{
+    ElectricExplainOptions *opts = (ElectricExplainOptions *) arg;
+
+    if (strcmp(key, "analyze") == 0)
+        opts->analyze = electric_option_bool(key, v);
+    else if (strcmp(key, "buffers") == 0)
+        opts->buffers = electric_option_bool(key, v);
+    else if (strcmp(key, "verbose") == 0)
+        opts->verbose = electric_option_bool(key, v);
+    else if (strcmp(key, "settings") == 0)
+        opts->settings = electric_option_bool(key, v);
+    else
+        return electric_limits_option(&opts->limits, key, v);
+    return true;
+}
+
+static void
+parse_exec_options(Jsonb *jb, ElectricExecOptions *opts)
+{
+    memset(opts, 0, sizeof(ElectricExecOptions));
+    electric_limits_init(&opts->limits);
+    parse_options(jb, exec_option, opts);
+}
+
+static void
+parse_explain_options(Jsonb *jb, ElectricExplainOptions *opts)
+{
+    memset(opts, 0, sizeof(ElectricExplainOptions));
+    opts->analyze = true;
+    opts->buffers = true;
+    electric_limits_init(&opts->limits);
+    parse_options(jb, explain_option, opts);
+}
+
+/*
+ * DestReceiver that serializes each result row with row_to_json() straight
+ * into a JSON array, so rows are never materialized in an SPI tuptable.
+ * Equivalent to the old json_agg(row_to_json(q)) wrapper, but lets us time
+ * serialization separately from execution.
+ */
+static void
+electric_json_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    ElectricJsonReceiver *r = (ElectricJsonReceiver *) self;
+    MemoryContext oldcxt;
+
+    (void) operation;
+
+    /* row_to_json() looks the record type up by typmod, so bless it */
+    oldcxt = MemoryContextSwitchTo(r->mycxt);
+    r->tupdesc = BlessTupleDesc(CreateTupleDescCopy(typeinfo));
+    MemoryContextSwitchTo(oldcxt);
+}
+
+static bool
+electric_json_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+    ElectricJsonReceiver *r = (ElectricJsonReceiver *) self;
+    MemoryContext oldcxt;
+    instr_time  start;
+    instr_time  end;
+    HeapTuple   tuple;
+    bool        should_free;
+    text       *row_json;
+
+    if (r->max_rows > 0 && r->nrows >= r->max_rows)
+        electric_limit_exceeded(ELECTRIC_LIMIT_ROWS, r->max_rows);
+
+    INSTR_TIME_SET_CURRENT(start);
+    oldcxt = MemoryContextSwitchTo(r->row_cxt);
+
+    tuple = ExecFetchSlotHeapTuple(slot, false, &should_free);
+    row_json = DatumGetTextPP(DirectFunctionCall1(row_to_json,
+                                                  heap_copy_tuple_as_datum(tuple, r->tupdesc)));
+
+    if (r->nrows > 0)
+        appendStringInfoChar(r->buf, ',');
+    appendBinaryStringInfo(r->buf, VARDATA_ANY(row_json), VARSIZE_ANY_EXHDR(row_json));
+    r->nrows++;
+
+    if (r->max_bytes > 0 && (uint64) r->buf->len > r->max_bytes)
+        electric_limit_exceeded(ELECTRIC_LIMIT_RESULT_BYTES, r->max_bytes);
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextReset(r->row_cxt);
+
+    INSTR_TIME_SET_CURRENT(end);
+    INSTR_TIME_ACCUM_DIFF(*r->serialize_time, end, start);
+    return true;
+}
+
+static void
+electric_json_shutdown(DestReceiver *self)
+{
+    (void) self;
+}
+
+static void
+electric_json_destroy(DestReceiver *self)
+{
+    (void) self;
+}
+
+/*
+ * Set up a receiver appending to buf. The row context is a child of the
+ * current context; delete r->row_cxt when done.
+ */
+void
+electric_json_receiver_init(ElectricJsonReceiver *r, StringInfo buf,
+                            instr_time *serialize_time)
+{
+    memset(r, 0, sizeof(*r));
+    r->pub.receiveSlot = electric_json_receive;
+    r->pub.rStartup = electric_json_startup;
+    r->pub.rShutdown = electric_json_shutdown;
+    r->pub.rDestroy = electric_json_destroy;
+    /* Any tuple-accepting destination other than DestNone/DestSPI gets SPI_OK_SELECT */
+    r->pub.mydest = DestTuplestore;
+    r->buf = buf;
+    r->mycxt = CurrentMemoryContext;
+    r->row_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                       "electric_exec_as_of row",
+                                       ALLOCSET_SMALL_SIZES);
+    r->serialize_time = serialize_time;
+}
+
+/*
+ * How far behind the snapshot is: the number of xids assigned since its xmax.
+ * A snapshot from the future (or one we can't order) counts as age 0.
+ */
+uint32
+electric_snapshot_age(TransactionId xmax)
+{
+    TransactionId next_xid = XidFromFullTransactionId(ReadNextFullTransactionId());
+
+    if (!TransactionIdIsNormal(xmax) || !TransactionIdPrecedes(xmax, next_xid))
+        return 0;
+    return (uint32) (next_xid - xmax);
+}
+
+/*
+ * Emit one structured log line per call that tracing pipelines can turn into
+ * a span with per-phase child spans (electric.log_phase_timing).
+ */
+static void
+electric_log_call_timing(TimestampTz start_ts, const ElectricCallStats *cs)
+{
+    StringInfoData buf;
+    int         p;
+
+    initStringInfo(&buf);
+    appendStringInfo(&buf,
+                     "{\"span\":\"electric_exec_as_of\",\"pid\":%d,\"start_us\":" INT64_FORMAT
+                     ",\"query_id\":\"" INT64_FORMAT "\""
+                     ",\"xcnt\":%u,\"snapshot_age\":%u,\"rows\":" UINT64_FORMAT ",\"bytes\":" UINT64_FORMAT
+                     ",\"total_us\":%.3f,\"phases\":{",
+                     MyProcPid,
+                     (int64) start_ts + (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY,
+                     cs->query_id, cs->xcnt, cs->snapshot_age, cs->rows, cs->result_bytes,
+                     (double) INSTR_TIME_GET_NANOSEC(cs->total) / 1000.0);
+    for (p = 0; p < ELECTRIC_NUM_PHASES; p++)
+        appendStringInfo(&buf, "%s\"%s_us\":%.3f",
+                         p > 0 ? "," : "",
+                         electric_phase_names[p],
+                         (double) INSTR_TIME_GET_NANOSEC(cs->phases[p]) / 1000.0);
+    appendStringInfoChar(&buf, '}');
+    if (cs->scan.heap_pages > 0 || cs->scan.tuples_examined > 0)
+        appendStringInfo(&buf,
+                         ",\"scan\":{\"heap_pages\":" UINT64_FORMAT ",\"tuples_examined\":" UINT64_FORMAT
+                         ",\"tuples_visible\":" UINT64_FORMAT ",\"hot_hops\":" UINT64_FORMAT "}",
+                         cs->scan.heap_pages, cs->scan.tuples_examined,
+                         cs->scan.tuples_visible, cs->scan.hot_hops);
+    appendStringInfoChar(&buf, '}');
+
+    ereport(LOG,
+            (errmsg("electric_exec_as_of trace: %s", buf.data),
+             errhidestmt(true)));
+    pfree(buf.data);
+}
+
+/*
+ * Build the verbose result: {"rows": [...], "timing": {"<phase>_ms": ...}}
+ */
+static void
+append_verbose_timing(StringInfo buf, const ElectricCallStats *cs)
+{
+    int         p;
+
+    appendStringInfoString(buf, ",\"timing\":{");
+    for (p = 0; p < ELECTRIC_NUM_PHASES; p++)
+        appendStringInfo(buf, "\"%s_ms\":%.3f,",
+                         electric_phase_names[p],
+                         INSTR_TIME_GET_MILLISEC(cs->phases[p]));
+    appendStringInfo(buf, "\"total_ms\":%.3f}", INSTR_TIME_GET_MILLISEC(cs->total));
+}
+
+/*
+ * Append ,"scans":[{"relation": ..., "heap_pages": ..., ...}] for the
+ * relations scanned by the call (electric.track_scans)
+ */
+static void
+append_verbose_scans(StringInfo buf, List *scan_rels)
+{
+    ListCell   *lc;
+
+    appendStringInfoString(buf, ",\"scans\":[");
+    foreach(lc, scan_rels)
+    {
+        ElectricRelScanStats *rs = (ElectricRelScanStats *) lfirst(lc);
+        char       *relname = get_rel_name(rs->relid);
+        char       *nspname = get_namespace_name(get_rel_namespace(rs->relid));
+
+        if (foreach_current_index(lc) > 0)
+            appendStringInfoChar(buf, ',');
+        appendStringInfoString(buf, "{\"relation\":");
+        escape_json(buf, relname && nspname ? quote_qualified_identifier(nspname, relname) : "?");
+        appendStringInfo(buf,
+                         ",\"heap_pages\":" UINT64_FORMAT ",\"tuples_examined\":" UINT64_FORMAT
+                         ",\"tuples_visible\":" UINT64_FORMAT ",\"hot_hops\":" UINT64_FORMAT "}",
+                         rs->counters.heap_pages, rs->counters.tuples_examined,
+                         rs->counters.tuples_visible, rs->counters.hot_hops);
+    }
+    appendStringInfoChar(buf, ']');
+}
+
+/*
+ * Account a call whose result came from elsewhere (precomputed, or another
+ * backend's coalesced execution), without executing. Phases other than parse stay zero.
+ */
+static void
+record_served_call(ElectricEntryPoint entry, uint32 capture_flags,
+                   ElectricCallStats *stats, instr_time start, TimestampTz start_ts,
+                   const char *snapshot_str, const char *sql, const char *args_str,
+                   Datum result)
+{
+    INSTR_TIME_SET_CURRENT(stats->total);
+    INSTR_TIME_SUBTRACT(stats->total, start);
+    stats->rows = JB_ROOT_COUNT(DatumGetJsonbP(result));
+    stats->result_bytes = VARSIZE_ANY(DatumGetPointer(result));
+
+    electric_stats_record(entry, stats);
+    if (electric_capture_file[0] != '\0')
+        electric_capture_record(start_ts, snapshot_str, sql, args_str,
+                                INSTR_TIME_GET_NANOSEC(stats->total),
+                                (int64) stats->rows, capture_flags);
+}
+
 Datum
 electric_exec_as_of(PG_FUNCTION_ARGS)
 {
     Datum       snapshot_datum = PG_GETARG_DATUM(0);
     text       *sql_text = PG_GETARG_TEXT_PP(1);
     Jsonb      *args_jsonb = PG_ARGISNULL(2) ? NULL : PG_GETARG_JSONB_P(2);
+    Jsonb      *options_jsonb = (PG_NARGS() > 3 && !PG_ARGISNULL(3)) ? PG_GETARG_JSONB_P(3) : NULL;
+    ElectricExecOptions opts;
     char       *sql;
     char       *snapshot_str;
-    StringInfoData wrapped_sql;
+    char       *args_str;
     int         ret;
-    Datum       result;
-    bool        isnull;
-    char      **args = NULL;
+    Datum       result = (Datum) 0;
     int         nargs = 0;
     Oid        *argtypes = NULL;
-    Datum      *argvalues = NULL;
-    char       *nulls = NULL;
-    int         i;
+    ParamListInfo paramLI = NULL;
     Snapshot    custom_snap;
-
-    /* Convert pg_snapshot to text string using the output function */
-    {
-        Oid         snapshot_typoid;
-        Oid         typoutput;
-        bool        typIsVarlena;
-        
-        snapshot_typoid = get_fn_expr_argtype(fcinfo->flinfo, 0);
-        getTypeOutputInfo(snapshot_typoid, &typoutput, &typIsVarlena);
-        snapshot_str = OidOutputFunctionCall(typoutput, snapshot_datum);
-    }
+    SPIPlanPtr  plan;
+    SPIExecuteOptions exec_opts;
+    ElectricJsonReceiver receiver;
+    StringInfoData json;
+    ElectricCallContext call;
+    TimestampTz start_ts;
+    instr_time  start;
+    instr_time  phase_start;
+    instr_time  now;
+    volatile bool admitted = false;
+    ElectricFlightKey *flight_key = NULL;
+
+    INSTR_TIME_SET_CURRENT(start);
+    start_ts = GetCurrentTimestamp();
+    memset(&call, 0, sizeof(call));
+    call.cxt = CurrentMemoryContext;
+
+    parse_exec_options(options_jsonb, &opts);
+
+    snapshot_str = snapshot_arg_to_cstring(fcinfo, 0, snapshot_datum);
 
     /* Get SQL */
     sql = text_to_cstring(sql_text);
-
-    if (!is_select_query(sql))
-        ereport(ERROR,
-                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("only SELECT queries are allowed"),
-                 errhint("The query must start with SELECT or WITH")));
+    require_select_query(sql);
 
     /* Parse args */
-    if (args_jsonb != NULL)
-        args = parse_jsonb_args(args_jsonb, &nargs);
-
-    /* Build wrapped SQL */
-    initStringInfo(&wrapped_sql);
-    appendStringInfo(&wrapped_sql,
-                     "SELECT COALESCE(json_agg(row_to_json(q)), '[]'::json)::jsonb FROM (%s) q",
-                     sql);
+    paramLI = build_text_params(args_jsonb, &nargs, &argtypes);
+    args_str = args_jsonb ? JsonbToCString(NULL, &args_jsonb->root, VARSIZE(args_jsonb)) : "[]";
+
+    /* The JSON array is built in the caller's context so it outlives SPI */
+    initStringInfo(&json);
+    if (opts.verbose)
+        appendStringInfoString(&json, "{\"rows\":");
+    appendStringInfoChar(&json, '[');
+
+    electric_json_receiver_init(&receiver, &json,
+                                &call.stats.phases[ELECTRIC_PHASE_SERIALIZE]);
+    receiver.max_rows = opts.limits.max_rows;
+    receiver.max_bytes = opts.limits.max_result_bytes;
+    call.dest = (DestReceiver *) &receiver;
+    call.snapshot_str = snapshot_str;
+
+    /* Verbose output is per call, so only plain top-level calls coalesce */
+    if (electric_coalesce && !opts.verbose && electric_current_call == NULL)
+        flight_key = electric_flight_key(snapshot_str, sql, args_str);
 
     /* Connect to SPI */
     if (SPI_connect() != SPI_OK_CONNECT)
@@ -683,73 +1902,334 @@ electric_exec_as_of(PG_FUNCTION_ARGS)
                  errmsg("SPI_connect failed")));
 
     /* Create custom snapshot from the provided pg_snapshot */
+    INSTR_TIME_SET_CURRENT(phase_start);
     custom_snap = create_custom_snapshot(snapshot_str);
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_ACCUM_DIFF(call.stats.phases[ELECTRIC_PHASE_PARSE], now, phase_start);
+    call.stats.xcnt = custom_snap->xcnt;
+    call.stats.snapshot_age = electric_snapshot_age(custom_snap->xmax);
+    electric_limits_check_snapshot_age(&opts.limits, call.stats.snapshot_age);
+
+    /* A registered query the precompute worker has answered for this snapshot? */
+    if (!opts.verbose && electric_current_call == NULL)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(call.cxt);
+
+        result = electric_precomputed_lookup(custom_snap, sql, args_str, &opts.limits);
+        MemoryContextSwitchTo(oldcxt);
+        if (result != (Datum) 0)
+        {
+            SPI_finish();
+            MemoryContextDelete(receiver.row_cxt);
+            record_served_call(ELECTRIC_ENTRY_PRECOMPUTED, ELECTRIC_CAPTURE_PRECOMPUTED,
+                               &call.stats, start, start_ts, snapshot_str, sql, args_str,
+                               result);
+            PG_RETURN_DATUM(result);
+        }
+    }
+
+    /* The same call already running in another backend? Take its result */
+    if (flight_key != NULL)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(call.cxt);
+
+        result = electric_flight_join(flight_key, &opts.limits);
+        MemoryContextSwitchTo(oldcxt);
+        if (result != (Datum) 0)
+        {
+            SPI_finish();
+            MemoryContextDelete(receiver.row_cxt);
+            record_served_call(ELECTRIC_ENTRY_COALESCED, ELECTRIC_CAPTURE_COALESCED,
+                               &call.stats, start, start_ts, snapshot_str, sql, args_str,
+                               result);
+            PG_RETURN_DATUM(result);
+        }
+    }
 
     /* Push our custom snapshot */
     PushActiveSnapshot(custom_snap);
 
+    call.snapshot = custom_snap;
+    call.parent = electric_current_call;
+    electric_current_call = &call;
+    electric_activity_restore();
+
+    /* Time and tuple limits cover waiting, planning and execution */
+    electric_limits_start(&opts.limits);
+
     PG_TRY();
     {
-        if (nargs > 0)
-        {
-            argtypes = (Oid *) palloc(nargs * sizeof(Oid));
-            argvalues = (Datum *) palloc(nargs * sizeof(Datum));
-            nulls = (char *) palloc(nargs * sizeof(char));
+        /* Published above, so a concurrent electric_prune() keeps its versions */
+        electric_prune_check_snapshot(custom_snap);
+
+        /* Before queueing, so a waiting call doesn't hold admission */
+        electric_wait_for_snapshot(custom_snap);
+
+        /* Queue behind electric.max_concurrent, if set */
+        admitted = electric_admission_acquire();
+
+        /*
+         * Plan the user's statement directly. Planner time spent inside
+         * SPI_execute_plan_extended() is attributed by electric_planner().
+         */
+        INSTR_TIME_SET_CURRENT(phase_start);
+        plan = SPI_prepare_cursor(sql, nargs, argtypes, CURSOR_OPT_PARALLEL_OK);
+        if (plan == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+        if (!SPI_is_cursor_plan(plan))
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("only SELECT queries are allowed"),
+                     errhint("The query must be a single statement returning rows")));
+        INSTR_TIME_SET_CURRENT(now);
+        INSTR_TIME_ACCUM_DIFF(call.stats.phases[ELECTRIC_PHASE_PLAN], now, phase_start);
 
-            for (i = 0; i < nargs; i++)
-            {
-                argtypes[i] = TEXTOID;
-                if (args[i] != NULL)
-                {
-                    argvalues[i] = CStringGetTextDatum(args[i]);
-                    nulls[i] = ' ';
-                }
-                else
-                {
-                    argvalues[i] = (Datum) 0;
-                    nulls[i] = 'n';
-                }
-            }
+        memset(&exec_opts, 0, sizeof(exec_opts));
+        exec_opts.params = paramLI;
+        exec_opts.read_only = true;
+        exec_opts.dest = (DestReceiver *) &receiver;
 
-            ret = SPI_execute_with_args(wrapped_sql.data,
-                                        nargs,
-                                        argtypes,
-                                        argvalues,
-                                        nulls,
-                                        true,
-                                        0);
-        }
-        else
-        {
-            ret = SPI_execute(wrapped_sql.data, true, 0);
-        }
+        INSTR_TIME_SET_CURRENT(phase_start);
+        ret = SPI_execute_plan_extended(plan, &exec_opts);
+        INSTR_TIME_SET_CURRENT(now);
 
         if (ret != SPI_OK_SELECT)
             ereport(ERROR,
                     (errcode(ERRCODE_INTERNAL_ERROR),
                      errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
 
-        if (SPI_processed != 1)
+        /* Execution is what's left after planning and serialization */
+        INSTR_TIME_ACCUM_DIFF(call.stats.phases[ELECTRIC_PHASE_EXECUTE], now, phase_start);
+        INSTR_TIME_SUBTRACT(call.stats.phases[ELECTRIC_PHASE_EXECUTE], call.planner_time);
+        INSTR_TIME_SUBTRACT(call.stats.phases[ELECTRIC_PHASE_EXECUTE],
+                            call.stats.phases[ELECTRIC_PHASE_SERIALIZE]);
+        INSTR_TIME_ADD(call.stats.phases[ELECTRIC_PHASE_PLAN], call.planner_time);
+    }
+    PG_CATCH();
+    {
+        electric_current_call = call.parent;
+        electric_activity_restore();
+        PopActiveSnapshot();
+        SPI_finish();
+        if (admitted)
+            electric_admission_release();
+        /* Followers of this call run it themselves */
+        electric_flight_abort();
+        /* A cancel from our own max_elapsed_ms timer becomes 57L01 */
+        electric_limits_rethrow(&opts.limits);
+    }
+    PG_END_TRY();
+
+    electric_current_call = call.parent;
+    electric_activity_restore();
+    PopActiveSnapshot();
+    SPI_finish();
+    if (admitted)
+        electric_admission_release();
+    electric_limits_stop(&opts.limits);
+
+    MemoryContextDelete(receiver.row_cxt);
+
+    INSTR_TIME_SET_CURRENT(phase_start);
+    appendStringInfoChar(&json, ']');
+    if (!opts.verbose)
+        result = DirectFunctionCall1(jsonb_in, CStringGetDatum(json.data));
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_ACCUM_DIFF(call.stats.phases[ELECTRIC_PHASE_SERIALIZE], now, phase_start);
+
+    INSTR_TIME_SET_CURRENT(call.stats.total);
+    INSTR_TIME_SUBTRACT(call.stats.total, start);
+    call.stats.rows = receiver.nrows;
+
+    if (opts.verbose)
+    {
+        /* Text, since JSON readers often can't hold a full int64 */
+        appendStringInfo(&json, ",\"query_id\":\"" INT64_FORMAT "\"", call.stats.query_id);
+        /* The reported timing can't include its own conversion; stats do */
+        append_verbose_timing(&json, &call.stats);
+        if (call.scan_rels != NIL)
+            append_verbose_scans(&json, call.scan_rels);
+        appendStringInfoChar(&json, '}');
+        INSTR_TIME_SET_CURRENT(phase_start);
+        result = DirectFunctionCall1(jsonb_in, CStringGetDatum(json.data));
+        INSTR_TIME_SET_CURRENT(now);
+        INSTR_TIME_ACCUM_DIFF(call.stats.phases[ELECTRIC_PHASE_SERIALIZE], now, phase_start);
+        INSTR_TIME_ACCUM_DIFF(call.stats.total, now, phase_start);
+    }
+    call.stats.result_bytes = VARSIZE_ANY(DatumGetPointer(result));
+    if (flight_key != NULL)
+        electric_flight_finish(flight_key, result, call.stats.rows, (uint64) json.len);
+
+    electric_stats_record(ELECTRIC_ENTRY_EXEC_AS_OF, &call.stats);
+    if (electric_log_phase_timing)
+        electric_log_call_timing(start_ts, &call.stats);
+    if (electric_capture_file[0] != '\0')
+        electric_capture_record(start_ts, snapshot_str, sql, args_str,
+                                INSTR_TIME_GET_NANOSEC(call.stats.total),
+                                (int64) call.stats.rows, 0);
+
+    PG_RETURN_DATUM(result);
+}
+
+/*
+ * Reject anything that isn't a plain read-only SELECT after rewriting.
+ * EXPLAIN ANALYZE really executes its statement, so the prefix check done
+ * by is_select_query() isn't enough (data-modifying CTEs, SELECT INTO).
+ */
+static void
+require_read_only_plan(SPIPlanPtr plan)
+{
+    List       *sources = SPI_plan_get_plan_sources(plan);
+    ListCell   *lc;
+
+    if (list_length(sources) != 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("only SELECT queries are allowed"),
+                 errhint("The query must be a single statement returning rows")));
+
+    foreach(lc, ((CachedPlanSource *) linitial(sources))->query_list)
+    {
+        Query      *query = lfirst_node(Query, lc);
+
+        if (query->commandType != CMD_SELECT ||
+            query->utilityStmt != NULL ||
+            query->hasModifyingCTE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("only SELECT queries are allowed"),
+                     errhint("The query must not modify data")));
+    }
+}
+
+/*
+ * electric_explain_as_of(snapshot, sql, args, options) -> jsonb
+ *
+ * Runs EXPLAIN (ANALYZE, BUFFERS, FORMAT JSON) on sql under the given
+ * snapshot and returns EXPLAIN's JSON output. The plan and buffer counts are
+ * the ones the historical read really gets, dead versions and all.
+ *
+ * options: {"analyze": bool, "buffers": bool, "verbose": bool, "settings": bool}
+ * plus the limits electric_exec_as_of() takes. It queues for admission like
+ * electric_exec_as_of(), since EXPLAIN ANALYZE runs the query in full.
+ */
+Datum
+electric_explain_as_of(PG_FUNCTION_ARGS)
+{
+    Datum       snapshot_datum = PG_GETARG_DATUM(0);
+    text       *sql_text = PG_GETARG_TEXT_PP(1);
+    Jsonb      *args_jsonb = PG_ARGISNULL(2) ? NULL : PG_GETARG_JSONB_P(2);
+    Jsonb      *options_jsonb = PG_ARGISNULL(3) ? NULL : PG_GETARG_JSONB_P(3);
+    ElectricExplainOptions opts;
+    char       *snapshot_str;
+    char       *sql;
+    StringInfoData explain_sql;
+    int         nargs = 0;
+    Oid        *argtypes = NULL;
+    ParamListInfo paramLI;
+    Datum      *values = NULL;
+    char       *nulls = NULL;
+    Snapshot    custom_snap;
+    SPIPlanPtr  plan;
+    int         ret;
+    int         i;
+    Datum       result = (Datum) 0;
+    volatile bool admitted = false;
+
+    parse_explain_options(options_jsonb, &opts);
+
+    snapshot_str = snapshot_arg_to_cstring(fcinfo, 0, snapshot_datum);
+    sql = text_to_cstring(sql_text);
+    require_select_query(sql);
+    paramLI = build_text_params(args_jsonb, &nargs, &argtypes);
+    if (nargs > 0)
+    {
+        values = (Datum *) palloc(nargs * sizeof(Datum));
+        nulls = (char *) palloc(nargs * sizeof(char));
+        for (i = 0; i < nargs; i++)
+        {
+            values[i] = paramLI->params[i].value;
+            nulls[i] = paramLI->params[i].isnull ? 'n' : ' ';
+        }
+    }
+
+    initStringInfo(&explain_sql);
+    appendStringInfo(&explain_sql,
+                     "EXPLAIN (ANALYZE %s, BUFFERS %s, VERBOSE %s, SETTINGS %s, FORMAT JSON) %s",
+                     opts.analyze ? "true" : "false",
+                     opts.buffers ? "true" : "false",
+                     opts.verbose ? "true" : "false",
+                     opts.settings ? "true" : "false",
+                     sql);
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("SPI_connect failed")));
+
+    custom_snap = create_custom_snapshot(snapshot_str);
+    electric_limits_check_snapshot_age(&opts.limits, electric_snapshot_age(custom_snap->xmax));
+    PushActiveSnapshot(custom_snap);
+    electric_activity_report(ELECTRIC_ACTIVITY_EXPLAIN_AS_OF, custom_snap);
+
+    electric_limits_start(&opts.limits);
+
+    PG_TRY();
+    {
+        electric_prune_check_snapshot(custom_snap);
+        electric_wait_for_snapshot(custom_snap);
+        admitted = electric_admission_acquire();
+
+        /* Vet the statement itself before EXPLAIN ANALYZE runs it */
+        plan = SPI_prepare(sql, nargs, argtypes);
+        if (plan == NULL)
             ereport(ERROR,
                     (errcode(ERRCODE_INTERNAL_ERROR),
-                     errmsg("expected 1 result row, got %lu", (unsigned long) SPI_processed)));
+                     errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+        require_read_only_plan(plan);
+        SPI_freeplan(plan);
 
-        result = SPI_getbinval(SPI_tuptable->vals[0],
-                               SPI_tuptable->tupdesc,
-                               1,
-                               &isnull);
+        plan = SPI_prepare(explain_sql.data, nargs, argtypes);
+        if (plan == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+
+        /*
+         * SPI refuses utility statements in read-only mode, so pass the
+         * snapshot explicitly instead of relying on the pushed one.
+         */
+        ret = SPI_execute_snapshot(plan, values, nulls, custom_snap, InvalidSnapshot,
+                                   false, false, 0);
+        if (ret != SPI_OK_UTILITY || SPI_processed != 1)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("EXPLAIN failed: %s", SPI_result_code_string(ret))));
 
-        if (isnull)
-            result = DirectFunctionCall1(jsonb_in, CStringGetDatum("[]"));
-        else
-            result = datumCopy(result, false, -1);
+        result = DirectFunctionCall1(jsonb_in,
+                                     CStringGetDatum(SPI_getvalue(SPI_tuptable->vals[0],
+                                                                  SPI_tuptable->tupdesc, 1)));
+        result = SPI_datumTransfer(result, false, -1);
     }
-    PG_FINALLY();
+    PG_CATCH();
     {
+        electric_activity_restore();
         PopActiveSnapshot();
         SPI_finish();
+        if (admitted)
+            electric_admission_release();
+        electric_limits_rethrow(&opts.limits);
     }
     PG_END_TRY();
 
+    electric_activity_restore();
+    PopActiveSnapshot();
+    SPI_finish();
+    if (admitted)
+        electric_admission_release();
+    electric_limits_stop(&opts.limits);
+
     PG_RETURN_DATUM(result);
 }
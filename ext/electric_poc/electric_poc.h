@@ -0,0 +1,312 @@
+/*
+ * electric_poc.h - shared declarations for the electric_poc extension
+ */
+#ifndef ELECTRIC_POC_H
+#define ELECTRIC_POC_H
+
+#include "postgres.h"
+#include "access/transam.h"
+#include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
+#include "executor/execdesc.h"
+#include "lib/stringinfo.h"
+#include "nodes/params.h"
+#include "nodes/pg_list.h"
+#include "portability/instr_time.h"
+#include "utils/jsonb.h"
+#include "utils/snapshot.h"
+
+/*
+ * Instrumented entry points. Each one gets its own row in pg_stat_electric.
+ */
+typedef enum ElectricEntryPoint
+{
+	ELECTRIC_ENTRY_EXEC_AS_OF,		/* electric_exec_as_of() */
+	ELECTRIC_ENTRY_SNAPSHOT_GUC,	/* SET LOCAL electric.snapshot (assign hook) */
+	ELECTRIC_ENTRY_EXECUTOR_START,	/* ExecutorStart under a synthetic snapshot */
+	ELECTRIC_ENTRY_SERVER,		/* execute request to the as-of query server */
+	ELECTRIC_ENTRY_PRECOMPUTED,	/* electric_exec_as_of() from a precomputed result */
+	ELECTRIC_ENTRY_COALESCED,	/* electric_exec_as_of() from a coalesced leader */
+	ELECTRIC_NUM_ENTRY_POINTS
+} ElectricEntryPoint;
+
+/*
+ * Phases of an electric_exec_as_of() call. Execution and serialization
+ * interleave (rows are serialized as they are produced); each phase
+ * accumulates only its own time.
+ */
+typedef enum ElectricPhase
+{
+	ELECTRIC_PHASE_PARSE,		/* snapshot text -> xmin/xmax/xip */
+	ELECTRIC_PHASE_PLAN,		/* parse analysis + planner */
+	ELECTRIC_PHASE_EXECUTE,		/* executor, minus row serialization */
+	ELECTRIC_PHASE_SERIALIZE,	/* rows -> JSON -> jsonb */
+	ELECTRIC_NUM_PHASES
+} ElectricPhase;
+
+/*
+ * What put a backend under a synthetic snapshot (pg_stat_electric_activity)
+ */
+typedef enum ElectricActivitySource
+{
+	ELECTRIC_ACTIVITY_NONE,
+	ELECTRIC_ACTIVITY_EXEC_AS_OF,	/* electric_exec_as_of() */
+	ELECTRIC_ACTIVITY_EXPLAIN_AS_OF,	/* electric_explain_as_of() */
+	ELECTRIC_ACTIVITY_SNAPSHOT_GUC,	/* SET LOCAL electric.snapshot */
+	ELECTRIC_ACTIVITY_SERVER	/* as-of query server (electric_server.c) */
+} ElectricActivitySource;
+
+/* Things a backend can wait for inside electric_poc */
+typedef enum ElectricWaitEvent
+{
+	ELECTRIC_WAIT_NONE,
+	ELECTRIC_WAIT_SNAPSHOT,		/* xids the snapshot calls finished still running */
+	ELECTRIC_WAIT_ADMISSION,	/* waiting to be admitted */
+	ELECTRIC_WAIT_COALESCE		/* waiting for an identical call's result */
+} ElectricWaitEvent;
+
+/*
+ * SQLSTATEs raised when an electric_exec_as_of() call hits a resource limit
+ * (electric_limits.c). Class 54 is program_limit_exceeded, class 57 operator
+ * intervention (where statement_timeout's query_canceled lives).
+ */
+#define ERRCODE_ELECTRIC_MAX_ROWS				MAKE_SQLSTATE('5','4','L','0','1')
+#define ERRCODE_ELECTRIC_MAX_RESULT_BYTES		MAKE_SQLSTATE('5','4','L','0','2')
+#define ERRCODE_ELECTRIC_MAX_TUPLES_EXAMINED	MAKE_SQLSTATE('5','4','L','0','3')
+#define ERRCODE_ELECTRIC_MAX_SNAPSHOT_AGE		MAKE_SQLSTATE('5','4','L','0','4')
+#define ERRCODE_ELECTRIC_MAX_ELAPSED			MAKE_SQLSTATE('5','7','L','0','1')
+
+/* Not admitted within electric.admission_timeout (electric_admission.c) */
+#define ERRCODE_ELECTRIC_ADMISSION_TIMEOUT		MAKE_SQLSTATE('5','3','L','0','1')
+
+/* Xids a synthetic snapshot treats as finished still running after electric.snapshot_wait_timeout */
+#define ERRCODE_ELECTRIC_SNAPSHOT_WAIT_TIMEOUT	MAKE_SQLSTATE('5','5','L','0','1')
+
+typedef enum ElectricLimitKind
+{
+	ELECTRIC_LIMIT_ROWS,
+	ELECTRIC_LIMIT_RESULT_BYTES,
+	ELECTRIC_LIMIT_TUPLES_EXAMINED,
+	ELECTRIC_LIMIT_SNAPSHOT_AGE,
+	ELECTRIC_LIMIT_ELAPSED
+} ElectricLimitKind;
+
+/*
+ * Heap traversal under a synthetic snapshot (electric.track_scans).
+ * tuples_examined - tuples_visible is what the query paid for old versions.
+ */
+typedef struct ElectricScanCounters
+{
+	uint64		heap_pages;		/* heap pages read */
+	uint64		tuples_examined;	/* tuple versions looked at */
+	uint64		tuples_visible;	/* of those, visible to the snapshot */
+	uint64		hot_hops;		/* HOT chain links followed to reach a tuple */
+} ElectricScanCounters;
+
+/* Tuple versions the running call may still examine (max 0 = unlimited) */
+typedef struct ElectricScanBudget
+{
+	uint64		max;
+	uint64		examined;
+} ElectricScanBudget;
+
+/*
+ * Effective limits of one electric_exec_as_of() call, 0 meaning unlimited,
+ * plus what the call replaced of its caller's while it runs
+ */
+typedef struct ElectricLimits
+{
+	uint64		max_rows;
+	uint64		max_result_bytes;
+	uint64		max_tuples_examined;
+	uint64		max_elapsed_ms;
+	uint64		max_snapshot_age;
+
+	TimestampTz saved_deadline;
+	int			saved_deadline_ms;
+	ElectricScanBudget saved_budget;
+} ElectricLimits;
+
+/* What an electric_exec_as_of() result depends on (electric_coalesce.c) */
+typedef struct ElectricFlightKey
+{
+	uint64		hash;
+	char	   *data;
+	Size		len;
+} ElectricFlightKey;
+
+typedef struct ElectricRelScanStats
+{
+	Oid			relid;
+	ElectricScanCounters counters;
+} ElectricRelScanStats;
+
+/*
+ * Per-call measurements handed to the stats collector. Fields that don't
+ * apply to an entry point are left zero.
+ */
+typedef struct ElectricCallStats
+{
+	instr_time	total;			/* whole call */
+	instr_time	phases[ELECTRIC_NUM_PHASES];
+	uint64		rows;			/* rows returned */
+	uint64		result_bytes;	/* size of the returned datum */
+	uint32		xcnt;			/* xip entries in the snapshot */
+	uint32		snapshot_age;	/* xids between snapshot xmax and next xid */
+	ElectricScanCounters scan;
+	int64		query_id;		/* queryId of the statement run, 0 if none */
+} ElectricCallStats;
+
+/* Parts of a snapshot string (xmin:xmax:xip_list), xip sorted */
+typedef struct ElectricParsedSnapshot
+{
+	TransactionId xmin;
+	TransactionId xmax;
+	TransactionId *xip;
+	uint32		xcnt;
+} ElectricParsedSnapshot;
+
+/*
+ * DestReceiver that appends each row as row_to_json() text to a JSON array
+ * (electric_exec_as_of's result)
+ */
+typedef struct ElectricJsonReceiver
+{
+	DestReceiver pub;
+	StringInfo	buf;			/* JSON array text, owned by the caller */
+	MemoryContext mycxt;		/* caller's context; holds tupdesc */
+	MemoryContext row_cxt;		/* reset after every row */
+	TupleDesc	tupdesc;		/* blessed copy of the result descriptor */
+	uint64		nrows;
+	uint64		max_rows;		/* 0 = unlimited */
+	uint64		max_bytes;		/* limit on buf->len, 0 = unlimited */
+	instr_time *serialize_time;
+} ElectricJsonReceiver;
+
+/* electric_poc.c */
+extern bool electric_track_stats;
+extern bool electric_log_phase_timing;
+extern uint32 electric_snapshot_age(TransactionId xmax);
+
+/* electric_poc.c: hot-path primitives, also timed by electric_bench.c */
+extern ElectricParsedSnapshot *electric_parse_snapshot_text(const char *snapshot_str);
+extern Snapshot create_custom_snapshot(const char *snapshot_str);
+extern Snapshot electric_build_snapshot_from_parts(Snapshot base,
+												   const ElectricParsedSnapshot *parsed);
+extern void electric_wait_for_snapshot(Snapshot snap);
+extern void require_select_query(const char *sql);
+extern ParamListInfo build_text_params(Jsonb *args_jsonb, int *nargs, Oid **argtypes);
+extern void electric_json_receiver_init(ElectricJsonReceiver *r, StringInfo buf,
+										instr_time *serialize_time);
+
+/* electric_stats.c */
+extern const char *const electric_phase_names[ELECTRIC_NUM_PHASES];
+extern Size electric_stats_shmem_size(void);
+extern void electric_stats_shmem_init(void);
+extern void electric_stats_record(ElectricEntryPoint entry, const ElectricCallStats *cs);
+
+/* electric_scan.c */
+extern bool electric_track_scans;
+extern Size electric_scan_shmem_size(void);
+extern void electric_scan_shmem_request(void);
+extern void electric_scan_shmem_init(void);
+extern void electric_scan_stats_reset(void);
+extern void electric_scan_instrument(QueryDesc *queryDesc);
+extern void electric_scan_finish(QueryDesc *queryDesc, ElectricScanCounters *total,
+								 List **rels, MemoryContext cxt);
+extern bool electric_scan_budget_active(void);
+extern void electric_scan_budget_push(uint64 max, ElectricScanBudget *saved);
+extern void electric_scan_budget_pop(const ElectricScanBudget *saved);
+extern void electric_scan_budget_reset(void);
+
+/* electric_activity.c */
+extern Size electric_activity_shmem_size(void);
+extern void electric_activity_shmem_init(void);
+extern void electric_activity_report(ElectricActivitySource source, Snapshot snap);
+extern void electric_activity_wait_start(ElectricWaitEvent event);
+extern void electric_activity_wait_end(void);
+extern TransactionId electric_activity_oldest_xmin(void);
+
+/* electric_limits.c */
+extern int	electric_max_rows;
+extern int	electric_max_result_bytes;
+extern int	electric_max_tuples_examined;
+extern int	electric_max_elapsed;
+extern int	electric_max_snapshot_age;
+extern void electric_limits_init(ElectricLimits *limits);
+extern bool electric_limits_option(ElectricLimits *limits, const char *key, JsonbValue *v);
+extern void electric_limits_check_snapshot_age(const ElectricLimits *limits, uint32 snapshot_age);
+extern void electric_limits_start(ElectricLimits *limits);
+extern void electric_limits_stop(ElectricLimits *limits);
+extern void electric_limits_rethrow(ElectricLimits *limits) pg_attribute_noreturn();
+extern void electric_limits_reset(void);
+extern void electric_limit_exceeded(ElectricLimitKind kind, uint64 limit) pg_attribute_noreturn();
+
+/* electric_admission.c */
+extern int	electric_max_concurrent;
+extern int	electric_admission_weight;
+extern int	electric_admission_timeout;
+extern Size electric_admission_shmem_size(void);
+extern void electric_admission_shmem_request(void);
+extern void electric_admission_shmem_init(void);
+extern bool electric_admission_acquire(void);
+extern void electric_admission_release(void);
+extern void electric_admission_reset(void);
+extern void electric_admission_stats_reset(void);
+
+/* electric_coalesce.c */
+extern bool electric_coalesce;
+extern int	electric_coalesce_wait_timeout;
+extern Size electric_coalesce_shmem_size(void);
+extern void electric_coalesce_shmem_request(void);
+extern void electric_coalesce_shmem_init(void);
+extern ElectricFlightKey *electric_flight_key(const char *snapshot, const char *sql, const char *args);
+extern Datum electric_flight_join(const ElectricFlightKey *key, const ElectricLimits *limits);
+extern void electric_flight_finish(const ElectricFlightKey *key, Datum result, uint64 nrows,
+								   uint64 json_len);
+extern void electric_flight_abort(void);
+extern void electric_coalesce_stats_reset(void);
+
+/* electric_server.c */
+extern char *electric_server_socket;
+extern int	electric_server_workers;
+extern char *electric_server_database;
+extern char *electric_server_user;
+extern void electric_server_register(void);
+
+/* electric_capture.c */
+extern char *electric_capture_file;
+/* Flags of a capture record: how the call was served, if not executed */
+#define ELECTRIC_CAPTURE_PRECOMPUTED	0x0001
+#define ELECTRIC_CAPTURE_COALESCED		0x0002
+extern void electric_capture_record(TimestampTz start, const char *snapshot, const char *sql,
+									const char *args, int64 duration_ns, int64 rows,
+									uint32 flags);
+
+/* electric_prune.c */
+extern FullTransactionId electric_full_xid(TransactionId xid);
+extern void electric_prune_check_snapshot(Snapshot snap);
+
+/* electric_bootstrap.c */
+extern ElectricParsedSnapshot *electric_snapshot_at(XLogRecPtr target, XLogRecPtr *lsn);
+
+/* electric_precompute.c */
+extern char *electric_precompute_database;
+extern int	electric_precompute_naptime;
+extern Size electric_precompute_shmem_size(void);
+extern void electric_precompute_shmem_request(void);
+extern void electric_precompute_shmem_init(void);
+extern void electric_precompute_register(void);
+extern Datum electric_precomputed_lookup(Snapshot snap, const char *sql, const char *args,
+										 const ElectricLimits *limits);
+extern void electric_precompute_stats_reset(void);
+
+/* electric_writeset.c */
+extern int	electric_write_filter_max_keys;
+extern void electric_writeset_reset(void);
+
+/* electric_toast.c */
+extern int	electric_toast_cache_size;
+extern void electric_toast_instrument(QueryDesc *queryDesc);
+
+#endif							/* ELECTRIC_POC_H */
@@ -0,0 +1,51 @@
+-- Microbenchmark functions for electric_poc's hot-path primitives.
+-- Only available in builds made with ELECTRIC_BENCH=1 (make bench); load with
+--   psql -f "$(pg_config --sharedir)/extension/electric_poc_bench.sql"
+-- Each returns nanoseconds per operation.
+
+CREATE OR REPLACE FUNCTION electric_bench_parse_snapshot(xcnt int4, iterations int4 DEFAULT 100000)
+RETURNS float8
+AS '$libdir/electric_poc', 'electric_bench_parse_snapshot'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION electric_bench_create_snapshot(xcnt int4, iterations int4 DEFAULT 100000)
+RETURNS float8
+AS '$libdir/electric_poc', 'electric_bench_create_snapshot'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION electric_bench_parse_args(nargs int4, iterations int4 DEFAULT 100000)
+RETURNS float8
+AS '$libdir/electric_poc', 'electric_bench_parse_args'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION electric_bench_json_result(nrows int4, ncols int4, width int4,
+                                                      iterations int4 DEFAULT 10000)
+RETURNS float8
+AS '$libdir/electric_poc', 'electric_bench_json_result'
+LANGUAGE C STRICT VOLATILE;
+
+-- Sweep every primitive over typical input sizes
+CREATE OR REPLACE FUNCTION electric_bench_all(
+    scale float8 DEFAULT 1,
+    OUT primitive text,
+    OUT params text,
+    OUT ns_per_op float8
+) RETURNS SETOF record
+LANGUAGE sql VOLATILE
+AS $$
+    SELECT 'parse_snapshot', format('xcnt=%s', x),
+           electric_bench_parse_snapshot(x, greatest(1, (100000 * scale / (1 + x / 100))::int))
+    FROM unnest(ARRAY[0, 10, 100, 1000, 10000]) x
+    UNION ALL
+    SELECT 'create_snapshot', format('xcnt=%s', x),
+           electric_bench_create_snapshot(x, greatest(1, (100000 * scale / (1 + x / 100))::int))
+    FROM unnest(ARRAY[0, 10, 100, 1000, 10000]) x
+    UNION ALL
+    SELECT 'parse_args', format('nargs=%s', n),
+           electric_bench_parse_args(n, greatest(1, (100000 * scale)::int))
+    FROM unnest(ARRAY[0, 1, 4, 16, 64]) n
+    UNION ALL
+    SELECT 'json_result', format('rows=%s cols=%s width=%s', r, c, w),
+           electric_bench_json_result(r, c, w, greatest(1, (10000 * scale / r)::int))
+    FROM unnest(ARRAY[1, 100]) r, unnest(ARRAY[3, 20]) c, unnest(ARRAY[10, 1000]) w
+$$;
@@ -0,0 +1,1381 @@
+/*
+ * electric_precompute.c - results of registered queries kept per commit
+ *	(electric.precompute_database, pg_stat_electric_precompute)
+ *
+ * Sync validates the same few permission queries with the same arguments at
+ * snapshot after snapshot, and almost every commit leaves their answer as it
+ * was. A query registered with electric_register_query() (SQL, args and the
+ * role, search_path and TimeZone it runs under) is kept answered by a
+ * background worker that follows the WAL:
+ *
+ *   - Like electric_snapshot_at(), the worker tracks the transactions
+ *     running at each point of the WAL, so it knows the snapshot that sees
+ *     exactly the commits before a commit record and that one: the commit
+ *     snapshot.
+ *   - It notes which transactions write heap (or TOAST) pages of the
+ *     relations a registered query reads. On the commit of such a
+ *     transaction, or a relcache invalidation of one of those relations, it
+ *     runs the query at the commit snapshot and publishes the result as a
+ *     new version. Any other commit carries every result forward unchanged.
+ *
+ * A version made at commit C (snapshot T) answers a call at snapshot S when
+ * S sees everything T sees, S doesn't see the commit of any newer version,
+ * and every xid below S's xmax has finished and been read by the worker, so
+ * no relevant commit S sees is still to come. electric_exec_as_of() then
+ * copies the result out of a DSM segment instead of executing. Anything
+ * else, including the first commits after a version dropped out of the
+ * ring, just executes.
+ *
+ * Segment layout: ElectricPrecomputedResult, T's xip, the lookup key, then
+ * the jsonb result. Readers compare the key, so a hash collision is harmless.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/relation.h"
+#include "access/rmgr.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "access/xlogreader.h"
+#include "access/xlogutils.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type_d.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/sinval.h"
+#include "storage/standbydefs.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/wait_event.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_register_query);
+PG_FUNCTION_INFO_V1(electric_precompute_stats);
+
+PGDLLEXPORT void electric_precompute_main(Datum main_arg);
+
+/* Registered queries served; more are ignored with a warning */
+#define ELECTRIC_PRECOMPUTE_QUERIES 32
+
+/* Newest results kept per query */
+#define ELECTRIC_PRECOMPUTE_VERSIONS 4
+
+/* Touched-bit of electric_registered_queries itself */
+#define ELECTRIC_PRECOMPUTE_REGISTRY ELECTRIC_PRECOMPUTE_QUERIES
+
+typedef struct ElectricPrecomputedQuery
+{
+	int64		id;				/* electric_registered_queries.id, 0 = free */
+	uint64		hash;			/* of the lookup key */
+	int			nversions;
+	/* Oldest first; commit_xid is invalid for a result made on registration */
+	TransactionId commit_xid[ELECTRIC_PRECOMPUTE_VERSIONS];
+	dsm_handle	handle[ELECTRIC_PRECOMPUTE_VERSIONS];
+	uint64		recomputes;
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+} ElectricPrecomputedQuery;
+
+typedef struct ElectricPrecomputeShared
+{
+	LWLock	   *lock;
+	bool		ready;			/* the worker has caught up once */
+	TransactionId horizon;		/* every xid before it has been read finishing */
+	ElectricPrecomputedQuery queries[ELECTRIC_PRECOMPUTE_QUERIES];
+} ElectricPrecomputeShared;
+
+/* Header of a result segment */
+typedef struct ElectricPrecomputedResult
+{
+	Size		key_len;
+	Size		result_len;		/* jsonb datum, varlena header included */
+	uint64		nrows;
+	uint64		json_len;		/* result as JSON text, for max_result_bytes */
+	TransactionId xmin;			/* the snapshot it was computed at */
+	TransactionId xmax;
+	uint32		xcnt;
+} ElectricPrecomputedResult;
+
+/* A registration, as the worker runs it */
+typedef struct ElectricPrecomputeQuery
+{
+	int64		id;
+	char	   *sql;
+	char	   *args;			/* jsonb text, as electric_exec_as_of() keys it */
+	Oid			role;
+	char	   *search_path;
+	char	   *timezone;
+} ElectricPrecomputeQuery;
+
+/* A transaction running at the worker's WAL position */
+typedef struct ElectricRunningXid
+{
+	TransactionId xid;			/* hash key */
+	Bitmapset  *touched;		/* queries whose relations it wrote */
+} ElectricRunningXid;
+
+typedef struct ElectricWatchedLocator
+{
+	RelFileLocator locator;		/* hash key */
+	Bitmapset  *queries;
+} ElectricWatchedLocator;
+
+typedef struct ElectricWatchedRelid
+{
+	Oid			relid;			/* hash key */
+	Bitmapset  *queries;
+} ElectricWatchedRelid;
+
+/* GUCs */
+char	   *electric_precompute_database = NULL;
+int			electric_precompute_naptime = 10;
+
+static ElectricPrecomputeShared *electric_precompute_shared = NULL;
+
+/* Worker state */
+static MemoryContext worker_cxt = NULL;	/* running xids and their bitmaps */
+static MemoryContext registry_cxt = NULL;	/* queries[] */
+static MemoryContext maps_cxt = NULL;	/* watched relations */
+static ElectricPrecomputeQuery *queries[ELECTRIC_PRECOMPUTE_QUERIES];
+static HTAB *running = NULL;
+static TransactionId tracker_xmax = InvalidTransactionId;
+static HTAB *watched_locators = NULL;
+static HTAB *watched_relids = NULL;
+static Oid	registry_relid = InvalidOid;
+static bool maps_stale = false;
+
+Size
+electric_precompute_shmem_size(void)
+{
+	return sizeof(ElectricPrecomputeShared);
+}
+
+void
+electric_precompute_shmem_request(void)
+{
+	RequestAddinShmemSpace(electric_precompute_shmem_size());
+	RequestNamedLWLockTranche("electric_poc precompute", 1);
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_precompute_shmem_init(void)
+{
+	bool		found;
+	int			i;
+
+	electric_precompute_shared = ShmemInitStruct("electric_poc precompute",
+												 electric_precompute_shmem_size(),
+												 &found);
+	if (!found)
+	{
+		memset(electric_precompute_shared, 0, electric_precompute_shmem_size());
+		electric_precompute_shared->lock = &(GetNamedLWLockTranche("electric_poc precompute"))->lock;
+		for (i = 0; i < ELECTRIC_PRECOMPUTE_QUERIES; i++)
+		{
+			pg_atomic_init_u64(&electric_precompute_shared->queries[i].hits, 0);
+			pg_atomic_init_u64(&electric_precompute_shared->queries[i].misses, 0);
+		}
+	}
+}
+
+/*
+ * Called from _PG_init() while preloading
+ */
+void
+electric_precompute_register(void)
+{
+	BackgroundWorker worker;
+
+	if (electric_precompute_database == NULL || electric_precompute_database[0] == '\0')
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 5;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "electric_poc");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "electric_precompute_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "electric_precompute");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "electric_precompute");
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * What a result depends on besides the snapshot: the same as a coalescing
+ * key (see electric_flight_key()) without it.
+ */
+static void
+electric_precompute_key(StringInfo buf, const char *sql, const char *args)
+{
+	Oid			ids[2];
+
+	ids[0] = MyDatabaseId;
+	ids[1] = GetUserId();
+
+	initStringInfo(buf);
+	appendBinaryStringInfo(buf, (const char *) ids, sizeof(ids));
+	appendStringInfoString(buf, GetConfigOption("search_path", false, false));
+	appendStringInfoChar(buf, '\0');
+	appendStringInfoString(buf, GetConfigOption("TimeZone", false, false));
+	appendStringInfoChar(buf, '\0');
+	appendStringInfoString(buf, sql);
+	appendStringInfoChar(buf, '\0');
+	appendStringInfoString(buf, args);
+}
+
+static uint64
+electric_precompute_hash(StringInfo key)
+{
+	return DatumGetUInt64(hash_bytes_extended((const unsigned char *) key->data, key->len, 0));
+}
+
+/* ----------------------------------------------------------------
+ * Lookup (any backend)
+ * ----------------------------------------------------------------
+ */
+
+static bool
+electric_xid_in(TransactionId xid, const TransactionId *xip, uint32 xcnt)
+{
+	uint32		lo = 0;
+	uint32		hi = xcnt;
+
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+
+		if (xip[mid] == xid)
+			return true;
+		if (xip[mid] < xid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+/* Does snap see every transaction the result's snapshot sees? */
+static bool
+electric_precompute_covers(Snapshot snap, const ElectricPrecomputedResult *hdr,
+						   const TransactionId *xip)
+{
+	uint32		i;
+	uint32		later = 0;
+
+	/* Finished for the result, running for snap */
+	for (i = 0; i < snap->xcnt; i++)
+	{
+		if (TransactionIdPrecedes(snap->xip[i], hdr->xmax) &&
+			!electric_xid_in(snap->xip[i], xip, hdr->xcnt))
+			return false;
+	}
+
+	/* Finished for the result, not yet assigned for snap */
+	if (!TransactionIdPrecedes(snap->xmax, hdr->xmax))
+		return true;
+	for (i = 0; i < hdr->xcnt; i++)
+	{
+		if (TransactionIdFollowsOrEquals(xip[i], snap->xmax))
+			later++;
+	}
+	return later == hdr->xmax - snap->xmax;
+}
+
+/*
+ * The result of a registered query at snap, if the worker has one that
+ * holds there; (Datum) 0 otherwise, and the caller executes. Allocated in
+ * the current context.
+ */
+Datum
+electric_precomputed_lookup(Snapshot snap, const char *sql, const char *args,
+							const ElectricLimits *limits)
+{
+	ElectricPrecomputeShared *shared = electric_precompute_shared;
+	ElectricPrecomputedQuery *q = NULL;
+	StringInfoData key;
+	uint64		hash;
+	dsm_segment *seg = NULL;
+	ElectricPrecomputedResult *hdr;
+	TransactionId *xip;
+	char	   *p;
+	Datum		result = (Datum) 0;
+	int			i;
+
+	if (shared == NULL || !shared->ready)
+		return (Datum) 0;
+
+	electric_precompute_key(&key, sql, args);
+	hash = electric_precompute_hash(&key);
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	for (i = 0; i < ELECTRIC_PRECOMPUTE_QUERIES; i++)
+	{
+		if (shared->queries[i].id != 0 && shared->queries[i].nversions > 0 &&
+			shared->queries[i].hash == hash)
+		{
+			q = &shared->queries[i];
+			break;
+		}
+	}
+	if (q == NULL)
+	{
+		LWLockRelease(shared->lock);
+		pfree(key.data);
+		return (Datum) 0;
+	}
+
+	/* A relevant commit snap sees may not have been read yet */
+	if (TransactionIdPrecedesOrEquals(snap->xmax, shared->horizon))
+	{
+		/* The newest version whose commit snap sees */
+		for (i = q->nversions - 1; i >= 0; i--)
+		{
+			if (!TransactionIdIsValid(q->commit_xid[i]) ||
+				!XidInMVCCSnapshot(q->commit_xid[i], snap))
+				break;
+		}
+		/* Attached under the lock, so the worker can't drop it first */
+		if (i >= 0)
+			seg = dsm_attach(q->handle[i]);
+	}
+	LWLockRelease(shared->lock);
+
+	if (seg == NULL)
+	{
+		pg_atomic_fetch_add_u64(&q->misses, 1);
+		pfree(key.data);
+		return (Datum) 0;
+	}
+
+	hdr = (ElectricPrecomputedResult *) dsm_segment_address(seg);
+	xip = (TransactionId *) ((char *) hdr + MAXALIGN(sizeof(ElectricPrecomputedResult)));
+	p = (char *) xip + MAXALIGN(hdr->xcnt * sizeof(TransactionId));
+	if (hdr->key_len == key.len && memcmp(p, key.data, key.len) == 0 &&
+		electric_precompute_covers(snap, hdr, xip))
+	{
+		if (limits->max_rows > 0 && hdr->nrows > limits->max_rows)
+		{
+			dsm_detach(seg);
+			electric_limit_exceeded(ELECTRIC_LIMIT_ROWS, limits->max_rows);
+		}
+		if (limits->max_result_bytes > 0 && hdr->json_len > limits->max_result_bytes)
+		{
+			dsm_detach(seg);
+			electric_limit_exceeded(ELECTRIC_LIMIT_RESULT_BYTES, limits->max_result_bytes);
+		}
+
+		result = PointerGetDatum(palloc(hdr->result_len));
+		memcpy(DatumGetPointer(result), p + MAXALIGN(key.len), hdr->result_len);
+	}
+	dsm_detach(seg);
+	pfree(key.data);
+
+	pg_atomic_fetch_add_u64(result != (Datum) 0 ? &q->hits : &q->misses, 1);
+	return result;
+}
+
+/* ----------------------------------------------------------------
+ * Publishing (worker)
+ * ----------------------------------------------------------------
+ */
+
+/* Lock held exclusively */
+static void
+electric_precompute_drop_versions(ElectricPrecomputedQuery *q)
+{
+	int			i;
+
+	for (i = 0; i < q->nversions; i++)
+		dsm_unpin_segment(q->handle[i]);
+	q->nversions = 0;
+}
+
+static void
+electric_precompute_release(int slot)
+{
+	ElectricPrecomputedQuery *q = &electric_precompute_shared->queries[slot];
+
+	LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+	electric_precompute_drop_versions(q);
+	q->id = 0;
+	LWLockRelease(electric_precompute_shared->lock);
+}
+
+/*
+ * Add a version, evicting the oldest if the ring is full. A result without a
+ * commit replaces all others: they were made under another registration or
+ * before a gap.
+ */
+static void
+electric_precompute_publish(int slot, uint64 hash, TransactionId commit_xid,
+							dsm_handle handle)
+{
+	ElectricPrecomputedQuery *q = &electric_precompute_shared->queries[slot];
+
+	LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+	if (!TransactionIdIsValid(commit_xid))
+		electric_precompute_drop_versions(q);
+	else if (q->nversions == ELECTRIC_PRECOMPUTE_VERSIONS)
+	{
+		dsm_unpin_segment(q->handle[0]);
+		memmove(&q->commit_xid[0], &q->commit_xid[1],
+				(ELECTRIC_PRECOMPUTE_VERSIONS - 1) * sizeof(TransactionId));
+		memmove(&q->handle[0], &q->handle[1],
+				(ELECTRIC_PRECOMPUTE_VERSIONS - 1) * sizeof(dsm_handle));
+		q->nversions--;
+	}
+	q->hash = hash;
+	q->commit_xid[q->nversions] = commit_xid;
+	q->handle[q->nversions] = handle;
+	q->nversions++;
+	q->recomputes++;
+	LWLockRelease(electric_precompute_shared->lock);
+}
+
+/* Copy a result into a pinned segment; DSM_HANDLE_INVALID if none is left */
+static dsm_handle
+electric_precompute_store(StringInfo key, const ElectricParsedSnapshot *t, Datum result,
+						  uint64 nrows, uint64 json_len)
+{
+	Size		result_len = VARSIZE_ANY(DatumGetPointer(result));
+	Size		hdr_len = MAXALIGN(sizeof(ElectricPrecomputedResult));
+	Size		xip_len = MAXALIGN(t->xcnt * sizeof(TransactionId));
+	dsm_segment *seg;
+	dsm_handle	handle;
+	ElectricPrecomputedResult *hdr;
+	char	   *p;
+
+	seg = dsm_create(hdr_len + xip_len + MAXALIGN(key->len) + result_len,
+					 DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+		return DSM_HANDLE_INVALID;
+
+	hdr = (ElectricPrecomputedResult *) dsm_segment_address(seg);
+	hdr->key_len = key->len;
+	hdr->result_len = result_len;
+	hdr->nrows = nrows;
+	hdr->json_len = json_len;
+	hdr->xmin = t->xmin;
+	hdr->xmax = t->xmax;
+	hdr->xcnt = t->xcnt;
+	p = (char *) hdr + hdr_len;
+	if (t->xcnt > 0)
+		memcpy(p, t->xip, t->xcnt * sizeof(TransactionId));
+	p += xip_len;
+	memcpy(p, key->data, key->len);
+	memcpy(p + MAXALIGN(key->len), DatumGetPointer(result), result_len);
+
+	dsm_pin_segment(seg);
+	handle = dsm_segment_handle(seg);
+	dsm_detach(seg);
+	return handle;
+}
+
+/* ----------------------------------------------------------------
+ * Transaction tracking (worker)
+ * ----------------------------------------------------------------
+ */
+
+static int
+electric_precompute_xid_cmp(const void *a, const void *b)
+{
+	TransactionId xa = *(const TransactionId *) a;
+	TransactionId xb = *(const TransactionId *) b;
+
+	return (xa > xb) - (xa < xb);
+}
+
+/* xid appeared in a record: it and every xid before it have been assigned */
+static void
+electric_tracker_assigned(TransactionId xid)
+{
+	ElectricRunningXid *entry;
+
+	while (TransactionIdPrecedesOrEquals(tracker_xmax, xid))
+	{
+		entry = hash_search(running, &tracker_xmax, HASH_ENTER, NULL);
+		entry->touched = NULL;
+		TransactionIdAdvance(tracker_xmax);
+	}
+}
+
+/* xid committed or aborted; returns what it touched */
+static Bitmapset *
+electric_tracker_finish(TransactionId xid)
+{
+	ElectricRunningXid *entry;
+	Bitmapset  *touched = NULL;
+
+	if (!TransactionIdIsNormal(xid))
+		return NULL;
+	electric_tracker_assigned(xid);
+	entry = hash_search(running, &xid, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		touched = entry->touched;
+		hash_search(running, &xid, HASH_REMOVE, NULL);
+	}
+	return touched;
+}
+
+static TransactionId
+electric_tracker_xmin(void)
+{
+	HASH_SEQ_STATUS seq;
+	ElectricRunningXid *entry;
+	TransactionId xmin = tracker_xmax;
+
+	hash_seq_init(&seq, running);
+	while ((entry = hash_seq_search(&seq)) != NULL)
+	{
+		if (TransactionIdPrecedes(entry->xid, xmin))
+			xmin = entry->xid;
+	}
+	return xmin;
+}
+
+/* The snapshot at the current WAL position, in the current context */
+static ElectricParsedSnapshot *
+electric_tracker_snapshot(void)
+{
+	ElectricParsedSnapshot *t = palloc(sizeof(ElectricParsedSnapshot));
+	HASH_SEQ_STATUS seq;
+	ElectricRunningXid *entry;
+
+	t->xmax = tracker_xmax;
+	t->xcnt = 0;
+	t->xip = palloc(Max(hash_get_num_entries(running), 1) * sizeof(TransactionId));
+	hash_seq_init(&seq, running);
+	while ((entry = hash_seq_search(&seq)) != NULL)
+		t->xip[t->xcnt++] = entry->xid;
+	qsort(t->xip, t->xcnt, sizeof(TransactionId), electric_precompute_xid_cmp);
+	t->xmin = electric_tracker_xmin();
+	return t;
+}
+
+/* Let lookups use everything read so far */
+static void
+electric_precompute_advance(void)
+{
+	TransactionId horizon = electric_tracker_xmin();
+
+	LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+	electric_precompute_shared->horizon = horizon;
+	electric_precompute_shared->ready = true;
+	LWLockRelease(electric_precompute_shared->lock);
+}
+
+/* ----------------------------------------------------------------
+ * Registry (worker)
+ * ----------------------------------------------------------------
+ */
+
+static void
+electric_precompute_watch(Oid relid, int slot)
+{
+	Relation	rel;
+	ElectricWatchedRelid *r;
+	ElectricWatchedLocator *l;
+	Oid			toastrelid;
+	MemoryContext oldcxt;
+
+	rel = try_relation_open(relid, AccessShareLock);
+	if (rel == NULL)
+		return;					/* dropped; the query will fail on its own */
+
+	oldcxt = MemoryContextSwitchTo(maps_cxt);
+	r = hash_search(watched_relids, &relid, HASH_ENTER, NULL);
+	r->queries = bms_add_member(r->queries, slot);
+	if (RELKIND_HAS_STORAGE(rel->rd_rel->relkind))
+	{
+		l = hash_search(watched_locators, &rel->rd_locator, HASH_ENTER, NULL);
+		l->queries = bms_add_member(l->queries, slot);
+	}
+	MemoryContextSwitchTo(oldcxt);
+
+	toastrelid = rel->rd_rel->reltoastrelid;
+	relation_close(rel, AccessShareLock);
+	if (OidIsValid(toastrelid))
+		electric_precompute_watch(toastrelid, slot);
+}
+
+static bool
+electric_precompute_same(const ElectricPrecomputeQuery *a, const ElectricPrecomputeQuery *b)
+{
+	return a != NULL && b != NULL && a->id == b->id && a->role == b->role &&
+		strcmp(a->sql, b->sql) == 0 && strcmp(a->args, b->args) == 0 &&
+		strcmp(a->search_path, b->search_path) == 0 &&
+		strcmp(a->timezone, b->timezone) == 0;
+}
+
+/*
+ * Read electric_registered_queries and rebuild the watched relations. Returns
+ * the slots whose registration is new or changed; the caller computes them
+ * from scratch. Inside a transaction.
+ */
+static Bitmapset *
+electric_precompute_load(void)
+{
+	MemoryContext caller_cxt = CurrentMemoryContext;
+	MemoryContext new_cxt;
+	ElectricPrecomputeQuery *loaded[ELECTRIC_PRECOMPUTE_QUERIES];
+	Bitmapset  *fresh = NULL;
+	HASHCTL		ctl;
+	bool		isnull;
+	uint64		row;
+	int			slot;
+	int			ret;
+
+	MemoryContextReset(maps_cxt);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(RelFileLocator);
+	ctl.entrysize = sizeof(ElectricWatchedLocator);
+	ctl.hcxt = maps_cxt;
+	watched_locators = hash_create("electric watched locators", 64, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(ElectricWatchedRelid);
+	watched_relids = hash_create("electric watched relids", 64, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	maps_stale = false;
+
+	new_cxt = AllocSetContextCreate(worker_cxt, "electric_precompute registry",
+									ALLOCSET_SMALL_SIZES);
+	memset(loaded, 0, sizeof(loaded));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	/* The registry is wherever the extension was created, if it was */
+	ret = SPI_execute("SELECT c.oid FROM pg_extension e JOIN pg_class c "
+					  "ON c.relnamespace = e.extnamespace AND c.relname = 'electric_registered_queries' "
+					  "WHERE e.extname = 'electric_poc'", true, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	registry_relid = SPI_processed == 1 ?
+		DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull)) :
+		InvalidOid;
+
+	if (OidIsValid(registry_relid))
+	{
+		StringInfoData query;
+
+		electric_precompute_watch(registry_relid, ELECTRIC_PRECOMPUTE_REGISTRY);
+
+		initStringInfo(&query);
+		appendStringInfo(&query,
+						 "SELECT id, sql, args::text, role::oid, search_path, timezone, "
+						 "relations::oid[] FROM %s ORDER BY id",
+						 quote_qualified_identifier(get_namespace_name(get_rel_namespace(registry_relid)),
+													get_rel_name(registry_relid)));
+		ret = SPI_execute(query.data, true, 0);
+		if (ret != SPI_OK_SELECT)
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+		for (row = 0; row < SPI_processed; row++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[row];
+			TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+			ElectricPrecomputeQuery *q;
+			int64		id;
+			Datum	   *relids;
+			int			nrelids;
+			int			free_slot = -1;
+			int			i;
+
+			id = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+			slot = -1;
+			for (i = 0; i < ELECTRIC_PRECOMPUTE_QUERIES; i++)
+			{
+				if (queries[i] != NULL && queries[i]->id == id)
+					slot = i;
+				else if (queries[i] == NULL && loaded[i] == NULL && free_slot < 0)
+					free_slot = i;
+			}
+			if (slot < 0)
+				slot = free_slot;
+			if (slot < 0)
+			{
+				ereport(WARNING,
+						(errmsg("electric_precompute serves at most %d registered queries; ignoring query " INT64_FORMAT,
+								ELECTRIC_PRECOMPUTE_QUERIES, id)));
+				continue;
+			}
+
+			q = MemoryContextAlloc(new_cxt, sizeof(ElectricPrecomputeQuery));
+			q->id = id;
+			q->sql = MemoryContextStrdup(new_cxt, SPI_getvalue(tuple, tupdesc, 2));
+			q->args = MemoryContextStrdup(new_cxt, SPI_getvalue(tuple, tupdesc, 3));
+			q->role = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+			q->search_path = MemoryContextStrdup(new_cxt, SPI_getvalue(tuple, tupdesc, 5));
+			q->timezone = MemoryContextStrdup(new_cxt, SPI_getvalue(tuple, tupdesc, 6));
+			loaded[slot] = q;
+			if (!electric_precompute_same(q, queries[slot]))
+			{
+				MemoryContext oldcxt = MemoryContextSwitchTo(caller_cxt);
+
+				fresh = bms_add_member(fresh, slot);
+				MemoryContextSwitchTo(oldcxt);
+			}
+
+			/* Partitions and inheritance children are written, not the parent */
+			deconstruct_array_builtin(DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 7, &isnull)),
+									  OIDOID, &relids, NULL, &nrelids);
+			for (i = 0; i < nrelids; i++)
+			{
+				ListCell   *lc;
+
+				foreach(lc, find_all_inheritors(DatumGetObjectId(relids[i]), AccessShareLock, NULL))
+					electric_precompute_watch(lfirst_oid(lc), slot);
+			}
+		}
+	}
+	SPI_finish();
+
+	for (slot = 0; slot < ELECTRIC_PRECOMPUTE_QUERIES; slot++)
+	{
+		if (loaded[slot] == NULL && queries[slot] != NULL)
+			electric_precompute_release(slot);
+		else if (loaded[slot] != NULL && queries[slot] == NULL)
+		{
+			LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+			electric_precompute_shared->queries[slot].id = loaded[slot]->id;
+			LWLockRelease(electric_precompute_shared->lock);
+		}
+		queries[slot] = loaded[slot];
+	}
+	if (registry_cxt != NULL)
+		MemoryContextDelete(registry_cxt);
+	registry_cxt = new_cxt;
+
+	/* Writes before now went unwatched: assume they touched the new ones */
+	if (fresh != NULL)
+	{
+		HASH_SEQ_STATUS seq;
+		ElectricRunningXid *entry;
+		MemoryContext oldcxt = MemoryContextSwitchTo(worker_cxt);
+
+		hash_seq_init(&seq, running);
+		while ((entry = hash_seq_search(&seq)) != NULL)
+			entry->touched = bms_add_members(entry->touched, fresh);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	return fresh;
+}
+
+/* ----------------------------------------------------------------
+ * Computing results (worker)
+ * ----------------------------------------------------------------
+ */
+
+/* Run the query at t as electric_exec_as_of() would; returns the segment */
+static dsm_handle
+electric_precompute_run(ElectricPrecomputeQuery *q, const ElectricParsedSnapshot *t,
+						uint64 *hash)
+{
+	Jsonb	   *args_jsonb;
+	ParamListInfo paramLI;
+	int			nargs;
+	Oid		   *argtypes;
+	ElectricJsonReceiver receiver;
+	StringInfoData json;
+	StringInfoData key;
+	instr_time	serialize_time;
+	Snapshot	snap;
+	SPIPlanPtr	plan;
+	SPIExecuteOptions exec_opts;
+	Datum		result;
+	dsm_handle	handle;
+	int			ret;
+
+	args_jsonb = DatumGetJsonbP(DirectFunctionCall1(jsonb_in, CStringGetDatum(q->args)));
+	paramLI = build_text_params(args_jsonb, &nargs, &argtypes);
+
+	initStringInfo(&json);
+	appendStringInfoChar(&json, '[');
+	INSTR_TIME_SET_ZERO(serialize_time);
+	electric_json_receiver_init(&receiver, &json, &serialize_time);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	snap = electric_build_snapshot_from_parts(GetTransactionSnapshot(), t);
+	PushActiveSnapshot(snap);
+	electric_wait_for_snapshot(snap);
+
+	plan = SPI_prepare_cursor(q->sql, nargs, argtypes, CURSOR_OPT_PARALLEL_OK);
+	if (plan == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+
+	memset(&exec_opts, 0, sizeof(exec_opts));
+	exec_opts.params = paramLI;
+	exec_opts.read_only = true;
+	exec_opts.dest = (DestReceiver *) &receiver;
+	ret = SPI_execute_plan_extended(plan, &exec_opts);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	PopActiveSnapshot();
+	SPI_finish();
+	MemoryContextDelete(receiver.row_cxt);
+
+	appendStringInfoChar(&json, ']');
+	result = DirectFunctionCall1(jsonb_in, CStringGetDatum(json.data));
+
+	/* Under the registration's role and settings, as a caller's would be */
+	electric_precompute_key(&key, q->sql, q->args);
+	*hash = electric_precompute_hash(&key);
+	handle = electric_precompute_store(&key, t, result, receiver.nrows, (uint64) json.len);
+	pfree(key.data);
+	pfree(json.data);
+	return handle;
+}
+
+/*
+ * Compute a query at t and publish it as the version of commit_xid (invalid:
+ * a first result). A failing query only loses its versions.
+ */
+static void
+electric_precompute_compute(int slot, const ElectricParsedSnapshot *t, TransactionId commit_xid)
+{
+	ElectricPrecomputeQuery *q = queries[slot];
+	MemoryContext oldcxt = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	volatile dsm_handle handle = DSM_HANDLE_INVALID;
+	volatile uint64 hash = 0;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_TRY();
+	{
+		Oid			save_userid;
+		int			save_sec_context;
+		uint64		run_hash;
+
+		GetUserIdAndSecContext(&save_userid, &save_sec_context);
+		SetUserIdAndSecContext(q->role, save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+		(void) set_config_option("search_path", q->search_path, PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_LOCAL, true, 0, false);
+		(void) set_config_option("TimeZone", q->timezone, PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_LOCAL, true, 0, false);
+
+		handle = electric_precompute_run(q, t, &run_hash);
+		hash = run_hash;
+
+		SetUserIdAndSecContext(save_userid, save_sec_context);
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		CurrentResourceOwner = oldowner;
+
+		ereport(WARNING,
+				(errmsg("electric_precompute could not compute registered query " INT64_FORMAT ": %s",
+						q->id, edata->message)));
+		FreeErrorData(edata);
+		handle = DSM_HANDLE_INVALID;
+	}
+	PG_END_TRY();
+
+	if (handle != DSM_HANDLE_INVALID)
+		electric_precompute_publish(slot, hash, commit_xid, handle);
+	else
+	{
+		/* Without this version the older ones would answer past it */
+		LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+		electric_precompute_drop_versions(&electric_precompute_shared->queries[slot]);
+		LWLockRelease(electric_precompute_shared->lock);
+	}
+}
+
+/*
+ * A commit touched the queries in touched (or the registry): recompute them
+ * at its commit snapshot.
+ */
+static void
+electric_precompute_commit(TransactionId xid, Bitmapset *touched)
+{
+	ElectricParsedSnapshot *t;
+	Bitmapset  *fresh = NULL;
+	int			slot;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, "electric_precompute");
+
+	if (bms_is_member(ELECTRIC_PRECOMPUTE_REGISTRY, touched) || maps_stale)
+		fresh = electric_precompute_load();
+
+	t = electric_tracker_snapshot();
+	slot = -1;
+	while ((slot = bms_next_member(touched, slot)) >= 0)
+	{
+		if (slot < ELECTRIC_PRECOMPUTE_QUERIES && queries[slot] != NULL &&
+			!bms_is_member(slot, fresh))
+			electric_precompute_compute(slot, t, xid);
+	}
+	slot = -1;
+	while ((slot = bms_next_member(fresh, slot)) >= 0)
+		electric_precompute_compute(slot, t, InvalidTransactionId);
+
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/* ----------------------------------------------------------------
+ * Reading the WAL (worker)
+ * ----------------------------------------------------------------
+ */
+
+/* Relcache invalidations: a watched relation changed shape or storage */
+static Bitmapset *
+electric_precompute_invals(const xl_xact_parsed_commit *parsed, Bitmapset *touched)
+{
+	int			i;
+
+	for (i = 0; i < parsed->nmsgs; i++)
+	{
+		const SharedInvalidationMessage *msg = &parsed->msgs[i];
+		ElectricWatchedRelid *r;
+
+		if (msg->id != SHAREDINVALRELCACHE_ID ||
+			(msg->rc.dbId != MyDatabaseId && OidIsValid(msg->rc.dbId)))
+			continue;
+
+		if (!OidIsValid(msg->rc.relId) || !OidIsValid(registry_relid))
+		{
+			/* Every relation, or the extension may just have been created */
+			touched = bms_add_range(touched, 0, ELECTRIC_PRECOMPUTE_REGISTRY);
+			maps_stale = true;
+		}
+		else if ((r = hash_search(watched_relids, &msg->rc.relId, HASH_FIND, NULL)) != NULL)
+		{
+			touched = bms_add_members(touched, r->queries);
+			maps_stale = true;
+		}
+	}
+	return touched;
+}
+
+static void
+electric_precompute_record(XLogReaderState *reader)
+{
+	TransactionId xid = XLogRecGetXid(reader);
+	RmgrId		rmid = XLogRecGetRmid(reader);
+	uint8		info = XLogRecGetInfo(reader) & ~XLR_INFO_MASK;
+	MemoryContext oldcxt = MemoryContextSwitchTo(worker_cxt);
+	int			i;
+
+	if (TransactionIdIsNormal(xid))
+		electric_tracker_assigned(xid);
+
+	if ((rmid == RM_HEAP_ID || rmid == RM_HEAP2_ID) && TransactionIdIsNormal(xid))
+	{
+		ElectricRunningXid *entry = hash_search(running, &xid, HASH_FIND, NULL);
+
+		for (i = 0; entry != NULL && i <= XLogRecMaxBlockId(reader); i++)
+		{
+			RelFileLocator locator;
+			ElectricWatchedLocator *l;
+
+			if (!XLogRecGetBlockTagExtended(reader, i, &locator, NULL, NULL, NULL))
+				continue;
+			l = hash_search(watched_locators, &locator, HASH_FIND, NULL);
+			if (l != NULL)
+				entry->touched = bms_add_members(entry->touched, l->queries);
+		}
+	}
+	else if (rmid == RM_XACT_ID)
+	{
+		uint8		xact_info = info & XLOG_XACT_OPMASK;
+		Bitmapset  *touched = NULL;
+
+		if (xact_info == XLOG_XACT_COMMIT || xact_info == XLOG_XACT_COMMIT_PREPARED)
+		{
+			xl_xact_parsed_commit parsed;
+			TransactionId top;
+
+			ParseCommitRecord(XLogRecGetInfo(reader),
+							  (xl_xact_commit *) XLogRecGetData(reader), &parsed);
+			top = xact_info == XLOG_XACT_COMMIT ? xid : parsed.twophase_xid;
+			touched = electric_tracker_finish(top);
+			for (i = 0; i < parsed.nsubxacts; i++)
+				touched = bms_join(touched, electric_tracker_finish(parsed.subxacts[i]));
+			touched = electric_precompute_invals(&parsed, touched);
+
+			if (touched != NULL)
+				electric_precompute_commit(top, touched);
+			bms_free(touched);
+			electric_precompute_advance();
+		}
+		else if (xact_info == XLOG_XACT_ABORT || xact_info == XLOG_XACT_ABORT_PREPARED)
+		{
+			xl_xact_parsed_abort parsed;
+
+			ParseAbortRecord(XLogRecGetInfo(reader),
+							 (xl_xact_abort *) XLogRecGetData(reader), &parsed);
+			bms_free(electric_tracker_finish(xact_info == XLOG_XACT_ABORT ? xid : parsed.twophase_xid));
+			for (i = 0; i < parsed.nsubxacts; i++)
+				bms_free(electric_tracker_finish(parsed.subxacts[i]));
+		}
+	}
+	else if (rmid == RM_STANDBY_ID && info == XLOG_RUNNING_XACTS)
+	{
+		xl_running_xacts *xlrec = (xl_running_xacts *) XLogRecGetData(reader);
+		HASH_SEQ_STATUS seq;
+		ElectricRunningXid *entry;
+
+		/* Older xids never wrote a commit or abort: their backend crashed */
+		hash_seq_init(&seq, running);
+		while ((entry = hash_seq_search(&seq)) != NULL)
+		{
+			if (TransactionIdPrecedes(entry->xid, xlrec->oldestRunningXid))
+			{
+				bms_free(entry->touched);
+				hash_search(running, &entry->xid, HASH_REMOVE, NULL);
+			}
+		}
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+void
+electric_precompute_main(Datum main_arg)
+{
+	ReadLocalXLogPageNoWaitPrivate *private_data;
+	XLogReaderState *reader;
+	ElectricParsedSnapshot *start;
+	XLogRecPtr	lsn;
+	XLogRecPtr	first;
+	HASHCTL		ctl;
+	Bitmapset  *fresh;
+	ElectricParsedSnapshot *t;
+	int			slot;
+	uint32		i;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(electric_precompute_database, NULL, 0);
+	pgstat_report_appname("electric_precompute");
+
+	worker_cxt = AllocSetContextCreate(TopMemoryContext, "electric_precompute",
+									   ALLOCSET_DEFAULT_SIZES);
+	maps_cxt = AllocSetContextCreate(worker_cxt, "electric_precompute relations",
+									 ALLOCSET_DEFAULT_SIZES);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(TransactionId);
+	ctl.entrysize = sizeof(ElectricRunningXid);
+	ctl.hcxt = worker_cxt;
+	running = hash_create("electric running xids", 256, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* Versions left by a previous run of the worker */
+	for (slot = 0; slot < ELECTRIC_PRECOMPUTE_QUERIES; slot++)
+		electric_precompute_release(slot);
+	LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+	electric_precompute_shared->ready = false;
+	LWLockRelease(electric_precompute_shared->lock);
+
+	/* Start at a fresh running-xacts record, everything computed there */
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	pgstat_report_activity(STATE_RUNNING, "electric_precompute");
+	start = electric_snapshot_at(InvalidXLogRecPtr, &lsn);
+	tracker_xmax = start->xmax;
+	for (i = 0; i < start->xcnt; i++)
+	{
+		ElectricRunningXid *entry = hash_search(running, &start->xip[i], HASH_ENTER, NULL);
+
+		entry->touched = NULL;
+	}
+	fresh = electric_precompute_load();
+	t = electric_tracker_snapshot();
+	slot = -1;
+	while ((slot = bms_next_member(fresh, slot)) >= 0)
+		electric_precompute_compute(slot, t, InvalidTransactionId);
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	private_data = MemoryContextAllocZero(worker_cxt, sizeof(ReadLocalXLogPageNoWaitPrivate));
+	reader = XLogReaderAllocate(wal_segment_size, NULL,
+								XL_ROUTINE(.page_read = &read_local_xlog_page_no_wait,
+										   .segment_open = &wal_segment_open,
+										   .segment_close = &wal_segment_close),
+								private_data);
+	if (reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	while (XLogRecPtrIsInvalid(first = XLogFindNextRecord(reader, lsn)))
+	{
+		private_data->end_of_wal = false;
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 electric_precompute_naptime, WAIT_EVENT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+	XLogBeginRead(reader, first);
+	electric_precompute_advance();
+	ereport(LOG,
+			(errmsg("electric_precompute following the WAL from %X/%X", LSN_FORMAT_ARGS(first))));
+
+	for (;;)
+	{
+		char	   *errormsg;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (XLogReadRecord(reader, &errormsg) != NULL)
+		{
+			electric_precompute_record(reader);
+			continue;
+		}
+		if (!private_data->end_of_wal)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read WAL at %X/%X%s%s",
+							LSN_FORMAT_ARGS(reader->EndRecPtr),
+							errormsg ? ": " : "", errormsg ? errormsg : "")));
+
+		/* Caught up: wait for more */
+		electric_precompute_advance();
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 electric_precompute_naptime, WAIT_EVENT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+		private_data->end_of_wal = false;
+		XLogBeginRead(reader, reader->EndRecPtr);
+	}
+}
+
+/* ----------------------------------------------------------------
+ * SQL
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * SQL: electric_register_query(sql, args, role) -> id
+ *
+ * Planned as role, to check it and to find the relations it reads (views
+ * and row security policies expanded). role NULL means the current user.
+ * The worker later runs the query as role, so the caller must have that
+ * role's privileges, and only a superuser may register for a superuser.
+ */
+Datum
+electric_register_query(PG_FUNCTION_ARGS)
+{
+	char	   *sql;
+	Jsonb	   *args_jsonb;
+	Oid			role = PG_ARGISNULL(2) ? GetUserId() : PG_GETARG_OID(2);
+	int			nargs;
+	Oid		   *argtypes;
+	Oid			save_userid;
+	int			save_sec_context;
+	SPIPlanPtr	plan;
+	List	   *relids = NIL;
+	ListCell   *lc;
+	Datum	   *elems;
+	Datum		values[4];
+	Oid			types[4] = {TEXTOID, JSONBOID, OIDOID, OIDARRAYOID};
+	int			ret;
+	int			i;
+	bool		isnull;
+	int64		id;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("sql and args must not be NULL")));
+	sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	args_jsonb = PG_GETARG_JSONB_P(1);
+
+	if (!has_privs_of_role(GetUserId(), role))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to register a query for role \"%s\"",
+						GetUserNameFromId(role, false)),
+				 errdetail("Only roles with the privileges of the role may register queries for it.")));
+	if (superuser_arg(role) && !superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to register a query for role \"%s\"",
+						GetUserNameFromId(role, false)),
+				 errdetail("Only superusers may register queries for superuser roles.")));
+
+	require_select_query(sql);
+	(void) build_text_params(args_jsonb, &nargs, &argtypes);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(role, save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+	plan = SPI_prepare_cursor(sql, nargs, argtypes, 0);
+	if (plan == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+	if (!SPI_is_cursor_plan(plan))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("only SELECT queries are allowed"),
+				 errhint("The query must be a single statement returning rows")));
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	foreach(lc, SPI_plan_get_plan_sources(plan))
+	{
+		CachedPlanSource *source = (CachedPlanSource *) lfirst(lc);
+		ListCell   *rc;
+
+		foreach(rc, source->relationOids)
+			relids = list_append_unique_oid(relids, lfirst_oid(rc));
+	}
+
+	elems = palloc(Max(list_length(relids), 1) * sizeof(Datum));
+	i = 0;
+	foreach(lc, relids)
+		elems[i++] = ObjectIdGetDatum(lfirst_oid(lc));
+
+	values[0] = CStringGetTextDatum(sql);
+	values[1] = JsonbPGetDatum(args_jsonb);
+	values[2] = ObjectIdGetDatum(role);
+	values[3] = PointerGetDatum(construct_array_builtin(elems, list_length(relids), OIDOID));
+	ret = SPI_execute_with_args("INSERT INTO electric_registered_queries "
+								"(sql, args, role, search_path, timezone, relations) "
+								"VALUES ($1, $2, $3, current_setting('search_path'), "
+								"current_setting('TimeZone'), $4::regclass[]) RETURNING id",
+								4, types, values, NULL, false, 1);
+	if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+	SPI_finish();
+	PG_RETURN_INT64(id);
+}
+
+/* pg_stat_electric_reset() */
+void
+electric_precompute_stats_reset(void)
+{
+	int			i;
+
+	if (electric_precompute_shared == NULL)
+		return;
+
+	LWLockAcquire(electric_precompute_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < ELECTRIC_PRECOMPUTE_QUERIES; i++)
+	{
+		electric_precompute_shared->queries[i].recomputes = 0;
+		pg_atomic_write_u64(&electric_precompute_shared->queries[i].hits, 0);
+		pg_atomic_write_u64(&electric_precompute_shared->queries[i].misses, 0);
+	}
+	LWLockRelease(electric_precompute_shared->lock);
+}
+
+/*
+ * SQL: pg_stat_electric_precompute() -> one row per registered query served
+ */
+Datum
+electric_precompute_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	ElectricPrecomputeShared *shared = electric_precompute_shared;
+	int			i;
+
+	if (shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(shared->lock, LW_SHARED);
+	for (i = 0; i < ELECTRIC_PRECOMPUTE_QUERIES; i++)
+	{
+		ElectricPrecomputedQuery *q = &shared->queries[i];
+		Datum		values[7];
+		bool		nulls[7];
+
+		if (q->id == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(q->id);
+		values[1] = Int32GetDatum(q->nversions);
+		if (q->nversions > 0 && TransactionIdIsValid(q->commit_xid[q->nversions - 1]))
+			values[2] = TransactionIdGetDatum(q->commit_xid[q->nversions - 1]);
+		else
+			nulls[2] = true;
+		values[3] = Int64GetDatum((int64) q->recomputes);
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&q->hits));
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&q->misses));
+		values[6] = TransactionIdGetDatum(shared->horizon);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	LWLockRelease(shared->lock);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,710 @@
+/*
+ * electric_prune.c - keep only the tuple versions registered snapshots need
+ *
+ * Holding one global horizon back (a replication slot, or autovacuum turned
+ * off) keeps every version a row ever had, although as-of queries only run
+ * at a handful of snapshots. CALL electric_prune(rel) removes, from a table
+ * listed in electric_pruned_tables, each dead version that
+ *
+ *   - died before the live horizon: the oldest xid still running or still
+ *     in some backend's snapshot, synthetic ones included (from the activity
+ *     slots, electric_activity.c). Replication slots do not count, they are
+ *     the hold this works around; and
+ *   - is invisible to every snapshot in electric_registered_snapshots
+ *     (xmin not visible to it, or the deleting xid visible to it).
+ *
+ * Versions outside HOT chains are set LP_DEAD, as heap pruning does; their
+ * index entries go at the next VACUUM. HOT chain members cannot be unlinked
+ * without breaking the xmin/xmax links chain walks check, so they are cut
+ * down to their header instead: visibility of the chain is unchanged, the
+ * column data is gone. Each page is then defragmented and WAL-logged with a
+ * generic WAL record, so the changes survive a crash and reach physical
+ * standbys. Generic records carry no recovery-conflict information: queries
+ * on a standby are not protected from the pass (see README).
+ *
+ * A snapshot registered or first used after a pass may already miss
+ * versions that pass removed, so the pass first records its horizon in
+ * electric_prune_state and commits (hence a procedure), and snapshots whose
+ * xmin precedes that horizon are refused; one at or past it sees every
+ * version the pass may remove as deleted anyway:
+ *
+ *   - electric_register_snapshot() locks the state row, so a pass either
+ *     sees a snapshot in the registry or the registration sees the pass's
+ *     horizon;
+ *   - an unregistered snapshot is checked by electric_prune_check_snapshot()
+ *     after its backend publishes it in its activity slot. The pass reads
+ *     the slots again after committing its horizon, so it either sees the
+ *     snapshot or the check sees the horizon.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/generic_xlog.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/transam.h"
+#include "access/xlog.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_am_d.h"
+#include "catalog/pg_class_d.h"
+#include "catalog/pg_type_d.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "storage/freespace.h"
+#include "storage/procarray.h"
+#include "storage/sinvaladt.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/xid8.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_register_snapshot);
+PG_FUNCTION_INFO_V1(electric_prune);
+PG_FUNCTION_INFO_V1(electric_prune_all);
+
+typedef struct ElectricPruneCounts
+{
+	int64		pages_scanned;
+	int64		pages_pruned;
+	int64		pages_skipped;	/* no cleanup lock */
+	int64		tuples_removed; /* set LP_DEAD */
+	int64		tuples_truncated;	/* HOT chain members cut to a header */
+	int64		bytes_freed;
+} ElectricPruneCounts;
+
+/*
+ * Oldest xid a live backend may still need: the oldest running xid, or an
+ * older xmin some backend's snapshot, real or synthetic, holds. Unlike
+ * VACUUM's horizon this ignores replication slots.
+ *
+ * Computing the oldest running xid first makes reading the xmins unlocked
+ * safe: a backend that sets its xmin later computes it under ProcArrayLock,
+ * so it cannot be older than a transaction that was still running then.
+ */
+static TransactionId
+electric_live_horizon(void)
+{
+	TransactionId horizon = GetOldestActiveTransactionId();
+	TransactionId xmin;
+	int			backend;
+
+	for (backend = 1; backend <= MaxBackends; backend++)
+	{
+		TransactionId xid;
+		int			nsubxid;
+		bool		overflowed;
+
+		BackendIdGetTransactionIds(backend, &xid, &xmin, &nsubxid, &overflowed);
+		if (TransactionIdIsNormal(xmin) && TransactionIdPrecedes(xmin, horizon))
+			horizon = xmin;
+	}
+
+	xmin = electric_activity_oldest_xmin();
+	if (TransactionIdIsValid(xmin) && TransactionIdPrecedes(xmin, horizon))
+		horizon = xmin;
+	return horizon;
+}
+
+/* 64-bit form of an xid that is not in the future */
+FullTransactionId
+electric_full_xid(TransactionId xid)
+{
+	FullTransactionId next = ReadNextFullTransactionId();
+	uint32		epoch = EpochFromFullTransactionId(next);
+
+	if (xid > XidFromFullTransactionId(next))
+		epoch--;
+	return FullTransactionIdFromEpochAndXid(epoch, xid);
+}
+
+/*
+ * The pruned_through in SPI_tuptable (rows of electric_prune_state) that a
+ * snapshot with this xmin is too old for, else InvalidTransactionId
+ */
+static TransactionId
+electric_pruned_past(TransactionId xmin)
+{
+	FullTransactionId next = ReadNextFullTransactionId();
+	uint64		i;
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		FullTransactionId pruned;
+		bool		isnull;
+
+		pruned = DatumGetFullTransactionId(SPI_getbinval(SPI_tuptable->vals[i],
+														 SPI_tuptable->tupdesc,
+														 1, &isnull));
+		if (isnull || !FullTransactionIdIsNormal(pruned) ||
+			U64FromFullTransactionId(next) - U64FromFullTransactionId(pruned) >= (UINT64CONST(1) << 31))
+			continue;
+
+		if (TransactionIdPrecedes(xmin, XidFromFullTransactionId(pruned)))
+			return XidFromFullTransactionId(pruned);
+	}
+	return InvalidTransactionId;
+}
+
+/* Is snap in electric_registered_snapshots? Needs SPI connected. */
+static bool
+electric_snapshot_registered(Snapshot snap, const char *nspname)
+{
+	uint64		i;
+	uint32		j;
+	int			ret;
+
+	ret = SPI_execute(psprintf("SELECT snapshot FROM %s",
+							   quote_qualified_identifier(nspname, "electric_registered_snapshots")),
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		ElectricParsedSnapshot *parsed;
+
+		parsed = electric_parse_snapshot_text(SPI_getvalue(SPI_tuptable->vals[i],
+														   SPI_tuptable->tupdesc, 1));
+		if (parsed->xmin != snap->xmin || parsed->xmax != snap->xmax ||
+			parsed->xcnt != snap->xcnt)
+			continue;
+		for (j = 0; j < snap->xcnt; j++)
+		{
+			uint32		k;
+
+			for (k = 0; k < parsed->xcnt; k++)
+			{
+				if (parsed->xip[k] == snap->xip[j])
+					break;
+			}
+			if (k == parsed->xcnt)
+				break;
+		}
+		if (j == snap->xcnt)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Refuse an unregistered snapshot some pass has already pruned past. The
+ * caller must have published it in its activity slot (see the top of the
+ * file).
+ */
+void
+electric_prune_check_snapshot(Snapshot snap)
+{
+	Oid			ext_oid;
+	char	   *nspname;
+	TransactionId pruned;
+	int			ret;
+
+	/* Passes don't run during recovery, nor protect standby queries */
+	if (RecoveryInProgress())
+		return;
+
+	/*
+	 * A pass's horizon is never newer than the oldest transaction running
+	 * when it started, which only moves forward. Snapshots that see nothing
+	 * older as running need no lookup.
+	 */
+	if (!TransactionIdPrecedes(snap->xmin, GetOldestActiveTransactionId()))
+		return;
+
+	ext_oid = get_extension_oid("electric_poc", true);
+	if (!OidIsValid(ext_oid))
+		return;
+	nspname = get_namespace_name(get_extension_schema(ext_oid));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	/* The latest horizon, not the one the caller's snapshot would show */
+	PushActiveSnapshot(GetLatestSnapshot());
+	ret = SPI_execute(psprintf("SELECT pruned_through FROM %s",
+							   quote_qualified_identifier(nspname, "electric_prune_state")),
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	pruned = electric_pruned_past(snap->xmin);
+	if (TransactionIdIsValid(pruned) && electric_snapshot_registered(snap, nspname))
+		pruned = InvalidTransactionId;
+	PopActiveSnapshot();
+	SPI_finish();
+
+	if (TransactionIdIsValid(pruned))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("snapshot is older than the pruning horizon"),
+				 errdetail("Its xmin is %u, but electric_prune() has already removed versions deleted before %u.",
+						   snap->xmin, pruned),
+				 errhint("Register snapshots with electric_register_snapshot() before pruning passes run past them.")));
+}
+
+/*
+ * SQL: electric_register_snapshot(snapshot text) -> id in
+ * electric_registered_snapshots
+ */
+Datum
+electric_register_snapshot(PG_FUNCTION_ARGS)
+{
+	text	   *snapshot_text = PG_GETARG_TEXT_PP(0);
+	char	   *snapshot_str = text_to_cstring(snapshot_text);
+	ElectricParsedSnapshot *parsed;
+	Oid			argtypes[1] = {TEXTOID};
+	Datum		values[1];
+	bool		isnull;
+	int64		id;
+	char	   *nspname;
+	TransactionId pruned;
+	int			ret;
+
+	parsed = electric_parse_snapshot_text(snapshot_str);
+	nspname = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	/* Waits for a pass that is recording a newer horizon */
+	ret = SPI_execute(psprintf("SELECT pruned_through FROM %s FOR SHARE",
+							   quote_qualified_identifier(nspname, "electric_prune_state")),
+					  false, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	pruned = electric_pruned_past(parsed->xmin);
+	if (TransactionIdIsValid(pruned))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("snapshot \"%s\" is older than the pruning horizon",
+						snapshot_str),
+				 errdetail("Its xmin is %u, but electric_prune() has already removed versions deleted before %u.",
+						   parsed->xmin, pruned),
+				 errhint("Register snapshots before pruning passes run past them.")));
+
+	values[0] = PointerGetDatum(snapshot_text);
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s (snapshot) VALUES ($1) RETURNING id",
+										 quote_qualified_identifier(nspname, "electric_registered_snapshots")),
+								1, argtypes, values, NULL, false, 1);
+	if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+									 1, &isnull));
+
+	SPI_finish();
+	PG_RETURN_INT64(id);
+}
+
+/*
+ * Registered snapshots, built like electric_exec_as_of() builds them so the
+ * pass agrees exactly with what queries at them see. Needs SPI connected.
+ */
+static Snapshot *
+electric_prune_snapshots(const char *nspname, int *nsnaps)
+{
+	Snapshot	base = GetTransactionSnapshot();
+	Snapshot   *snaps;
+	uint64		i;
+	int			ret;
+
+	ret = SPI_execute(psprintf("SELECT snapshot FROM %s",
+							   quote_qualified_identifier(nspname, "electric_registered_snapshots")),
+					  false, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	snaps = palloc(sizeof(Snapshot) * Max(SPI_processed, 1));
+	*nsnaps = 0;
+	for (i = 0; i < SPI_processed; i++)
+	{
+		char	   *str = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+
+		snaps[(*nsnaps)++] =
+			electric_build_snapshot_from_parts(base, electric_parse_snapshot_text(str));
+	}
+	return snaps;
+}
+
+/* Can some registered snapshot see this version, which died at dead_after? */
+static bool
+electric_prune_needed(HeapTupleHeader htup, TransactionId dead_after,
+					  Snapshot *snaps, int nsnaps)
+{
+	TransactionId xmin = HeapTupleHeaderGetXmin(htup);
+	int			i;
+
+	for (i = 0; i < nsnaps; i++)
+	{
+		if (!XidInMVCCSnapshot(xmin, snaps[i]) &&
+			XidInMVCCSnapshot(dead_after, snaps[i]))
+			return true;
+	}
+	return false;
+}
+
+/* Cut a HOT chain member down to its header, in place */
+static void
+electric_prune_truncate(Page page, OffsetNumber off)
+{
+	ItemId		lp = PageGetItemId(page, off);
+	HeapTupleHeader htup = (HeapTupleHeader) PageGetItem(page, lp);
+
+	HeapTupleHeaderSetNatts(htup, 0);
+	htup->t_infomask &= ~(HEAP_HASNULL | HEAP_HASVARWIDTH | HEAP_HASEXTERNAL);
+	htup->t_hoff = MAXALIGN(SizeofHeapTupleHeader);
+	ItemIdSetNormal(lp, ItemIdGetOffset(lp), htup->t_hoff);
+}
+
+/*
+ * Prune one page, cleanup-locked by the caller. Returns whether it was
+ * changed.
+ */
+static bool
+electric_prune_page(Relation rel, Buffer buf, BlockNumber blkno,
+					TransactionId horizon, Snapshot *snaps, int nsnaps,
+					ElectricPruneCounts *counts)
+{
+	Page		page = BufferGetPage(buf);
+	OffsetNumber dead[MaxHeapTuplesPerPage];
+	OffsetNumber cut[MaxHeapTuplesPerPage];
+	int			ndead = 0;
+	int			ncut = 0;
+	OffsetNumber off;
+	OffsetNumber maxoff;
+	GenericXLogState *state;
+	Size		freespace;
+	int			i;
+
+	if (PageIsNew(page) || PageIsEmpty(page))
+		return false;
+
+	maxoff = PageGetMaxOffsetNumber(page);
+	for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId		lp = PageGetItemId(page, off);
+		HeapTupleData tuple;
+		TransactionId dead_after = InvalidTransactionId;
+
+		if (!ItemIdIsNormal(lp))
+			continue;
+
+		tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+		tuple.t_len = ItemIdGetLength(lp);
+		tuple.t_tableOid = RelationGetRelid(rel);
+		ItemPointerSet(&tuple.t_self, blkno, off);
+
+		/* DEAD versions are left to heap pruning and VACUUM */
+		if (HeapTupleSatisfiesVacuumHorizon(&tuple, buf, &dead_after) != HEAPTUPLE_RECENTLY_DEAD)
+			continue;
+		if (!TransactionIdPrecedes(dead_after, horizon))
+			continue;
+		if (electric_prune_needed(tuple.t_data, dead_after, snaps, nsnaps))
+			continue;
+
+		if (HeapTupleHeaderIsHeapOnly(tuple.t_data) ||
+			HeapTupleHeaderIsHotUpdated(tuple.t_data))
+		{
+			if (HeapTupleHeaderGetNatts(tuple.t_data) > 0)
+				cut[ncut++] = off;
+		}
+		else
+			dead[ndead++] = off;
+	}
+
+	if (ndead == 0 && ncut == 0)
+		return false;
+
+	state = GenericXLogStart(rel);
+	page = GenericXLogRegisterBuffer(state, buf, 0);
+	freespace = PageGetExactFreeSpace(page);
+
+	for (i = 0; i < ndead; i++)
+		ItemIdSetDead(PageGetItemId(page, dead[i]));
+	for (i = 0; i < ncut; i++)
+		electric_prune_truncate(page, cut[i]);
+	PageRepairFragmentation(page);
+
+	counts->bytes_freed += PageGetExactFreeSpace(page) - freespace;
+	GenericXLogFinish(state);
+
+	counts->tuples_removed += ndead;
+	counts->tuples_truncated += ncut;
+	return true;
+}
+
+/* Open a relation electric_prune() may work on; NULL if it was dropped */
+static Relation
+electric_prune_open(Oid relid, LOCKMODE lockmode)
+{
+	Relation	rel = try_relation_open(relid, lockmode);
+
+	if (rel == NULL)
+		return NULL;
+
+	if ((rel->rd_rel->relkind != RELKIND_RELATION &&
+		 rel->rd_rel->relkind != RELKIND_MATVIEW) ||
+		rel->rd_rel->relam != HEAP_TABLE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a heap table",
+						RelationGetRelationName(rel))));
+	if (RELATION_IS_OTHER_TEMP(rel))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot prune temporary tables of other sessions")));
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER, get_relkind_objtype(rel->rd_rel->relkind),
+					   RelationGetRelationName(rel));
+	return rel;
+}
+
+static void
+electric_prune_record(const char *nspname, Oid relid, TransactionId horizon,
+					  const ElectricPruneCounts *counts)
+{
+	Oid			argtypes[8] = {REGCLASSOID, XID8OID, INT8OID, INT8OID,
+							   INT8OID, INT8OID, INT8OID, INT8OID};
+	Datum		values[8];
+	int			ret;
+
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = FullTransactionIdGetDatum(electric_full_xid(horizon));
+	values[2] = Int64GetDatum(counts->pages_scanned);
+	values[3] = Int64GetDatum(counts->pages_pruned);
+	values[4] = Int64GetDatum(counts->pages_skipped);
+	values[5] = Int64GetDatum(counts->tuples_removed);
+	values[6] = Int64GetDatum(counts->tuples_truncated);
+	values[7] = Int64GetDatum(counts->bytes_freed);
+
+	ret = SPI_execute_with_args(psprintf("UPDATE %s SET "
+										 "last_pruned_at = now(), last_horizon = $2, "
+										 "pages_scanned = $3, pages_pruned = $4, pages_skipped = $5, "
+										 "tuples_removed = $6, tuples_truncated = $7, bytes_freed = $8 "
+										 "WHERE relid = $1",
+										 quote_qualified_identifier(nspname, "electric_pruned_tables")),
+								8, argtypes, values, NULL, false, 0);
+	if (ret != SPI_OK_UPDATE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+}
+
+/* Passes commit, so they need a CALL outside a transaction block */
+static void
+electric_prune_check_call(FunctionCallInfo fcinfo, const char *name)
+{
+	if (fcinfo->context == NULL || !IsA(fcinfo->context, CallContext) ||
+		castNode(CallContext, fcinfo->context)->atomic)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TRANSACTION_TERMINATION),
+				 errmsg("%s() must be called with CALL outside a transaction block", name)));
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("%s() cannot be executed during recovery.", name)));
+}
+
+/*
+ * One pass over relid; the extension's tables are in schema nspname. Counts
+ * of the pass are stored in the relation's electric_pruned_tables row.
+ */
+static void
+electric_prune_relation(Oid relid, const char *nspname)
+{
+	Relation	rel;
+	TransactionId horizon;
+	TransactionId recheck;
+	Snapshot   *snaps;
+	int			nsnaps;
+	ElectricPruneCounts counts;
+	BufferAccessStrategy strategy;
+	BlockNumber nblocks;
+	BlockNumber blkno;
+	Oid			argtypes[2] = {REGCLASSOID, XID8OID};
+	Datum		values[2];
+	int			ret;
+
+	rel = electric_prune_open(relid, AccessShareLock);
+	if (rel == NULL)
+		return;
+	relation_close(rel, AccessShareLock);
+
+	if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+
+	/* Record the horizon before any page loses a version to it */
+	horizon = electric_live_horizon();
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = FullTransactionIdGetDatum(electric_full_xid(horizon));
+	ret = SPI_execute_with_args(psprintf("SELECT 1 FROM %s WHERE relid = $1",
+										 quote_qualified_identifier(nspname, "electric_pruned_tables")),
+								1, argtypes, values, NULL, false, 1);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("\"%s\" is not in electric_pruned_tables", get_rel_name(relid)),
+				 errhint("Opt the table in with INSERT INTO electric_pruned_tables (relid) VALUES ('%s').",
+						 get_rel_name(relid))));
+
+	ret = SPI_execute_with_args(psprintf("UPDATE %s SET pruned_through = greatest(pruned_through, $2)",
+										 quote_qualified_identifier(nspname, "electric_prune_state")),
+								2, argtypes, values, NULL, false, 0);
+	if (ret != SPI_OK_UPDATE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	SPI_commit();
+
+	/*
+	 * A synthetic snapshot checked against the old horizon is in its
+	 * activity slot by now (electric_prune_check_snapshot()): keep its
+	 * versions too.
+	 */
+	recheck = electric_live_horizon();
+	if (TransactionIdPrecedes(recheck, horizon))
+		horizon = recheck;
+
+	snaps = electric_prune_snapshots(nspname, &nsnaps);
+
+	rel = electric_prune_open(relid, ShareUpdateExclusiveLock);
+	if (rel == NULL)
+	{
+		SPI_finish();
+		return;
+	}
+
+	memset(&counts, 0, sizeof(counts));
+	strategy = GetAccessStrategy(BAS_VACUUM);
+	nblocks = RelationGetNumberOfBlocks(rel);
+	for (blkno = 0; blkno < nblocks; blkno++)
+	{
+		Buffer		buf;
+		Size		freespace;
+		bool		pruned;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		counts.pages_scanned++;
+		if (!ConditionalLockBufferForCleanup(buf))
+		{
+			ReleaseBuffer(buf);
+			counts.pages_skipped++;
+			continue;
+		}
+
+		pruned = electric_prune_page(rel, buf, blkno, horizon, snaps, nsnaps, &counts);
+		freespace = PageGetHeapFreeSpace(BufferGetPage(buf));
+		UnlockReleaseBuffer(buf);
+
+		if (pruned)
+		{
+			counts.pages_pruned++;
+			RecordPageWithFreeSpace(rel, blkno, freespace);
+		}
+	}
+	if (counts.pages_pruned > 0)
+		FreeSpaceMapVacuum(rel);
+
+	FreeAccessStrategy(strategy);
+	relation_close(rel, NoLock);
+
+	electric_prune_record(nspname, relid, horizon, &counts);
+	SPI_finish();
+}
+
+/*
+ * SQL: CALL electric_prune(relid)
+ */
+Datum
+electric_prune(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+
+	electric_prune_check_call(fcinfo, "electric_prune");
+	electric_prune_relation(relid,
+							get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL: CALL electric_prune_all(), one pass per electric_pruned_tables row.
+ * In C rather than PL/pgSQL so the tables are qualified with the extension's
+ * schema: a procedure with a SET search_path clause cannot commit, and a
+ * dynamic CALL runs atomically.
+ */
+Datum
+electric_prune_all(PG_FUNCTION_ARGS)
+{
+	char	   *nspname;
+	Oid		   *relids;
+	uint64		nrelids;
+	uint64		i;
+	int			ret;
+
+	electric_prune_check_call(fcinfo, "electric_prune_all");
+	nspname = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+	ret = SPI_execute(psprintf("SELECT relid FROM %s ORDER BY relid",
+							   quote_qualified_identifier(nspname, "electric_pruned_tables")),
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	/* In the procedure's context, which outlives the passes' commits */
+	nrelids = SPI_processed;
+	relids = SPI_palloc(sizeof(Oid) * Max(nrelids, 1));
+	for (i = 0; i < nrelids; i++)
+	{
+		bool		isnull;
+
+		relids[i] = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+												   SPI_tuptable->tupdesc, 1, &isnull));
+	}
+	SPI_finish();
+
+	for (i = 0; i < nrelids; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		electric_prune_relation(relids[i], nspname);
+	}
+
+	PG_RETURN_VOID();
+}
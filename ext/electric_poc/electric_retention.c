@@ -0,0 +1,217 @@
+/*
+ * electric_retention.c - what history retention costs, per relation
+ *
+ * electric_retention_sample() reads a random sample of a heap relation's
+ * pages (the same block sampler ANALYZE uses) and classifies every dead tuple
+ * version on them against two horizons:
+ *
+ *   horizon  - what VACUUM may remove today, i.e. the relation's oldest
+ *              non-removable xid. It is held back by the oldest snapshot,
+ *              replication slot or prepared transaction.
+ *   advanced - where that horizon would be if only transactions that still
+ *              run with an xid held it back (no snapshots, no slots).
+ *
+ * Versions that died before the horizon are dead already (VACUUM has just not
+ * run yet). Versions that died between the two are retained only because
+ * some live snapshot might still read them: that is the cost of retention.
+ * Counts are extrapolated from the sample to the whole relation, so calling
+ * this costs at most sample_pages page reads per relation.
+ *
+ * electric_retention_report() (SQL) runs it over every user table that
+ * pgstat says has dead tuples and names the holder of the horizon.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/transam.h"
+#include "access/xlog.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_am_d.h"
+#include "common/pg_prng.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/procarray.h"
+#include "utils/acl.h"
+#include "utils/rel.h"
+#include "utils/sampling.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_retention_sample);
+
+typedef struct ElectricRetentionCounts
+{
+	int64		dead_tuples;
+	int64		dead_bytes;
+	int64		retained_tuples;
+	int64		retained_bytes;
+} ElectricRetentionCounts;
+
+/* Classify the dead versions on one sampled page */
+static void
+electric_retention_page(Relation rel, Buffer buf, BlockNumber blkno,
+						TransactionId horizon, TransactionId advanced,
+						ElectricRetentionCounts *counts)
+{
+	Page		page;
+	OffsetNumber off;
+	OffsetNumber maxoff;
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	if (PageIsNew(page) || PageIsEmpty(page))
+	{
+		LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+		return;
+	}
+
+	maxoff = PageGetMaxOffsetNumber(page);
+	for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId		lp = PageGetItemId(page, off);
+		HeapTupleData tuple;
+		TransactionId dead_after = InvalidTransactionId;
+
+		if (!ItemIdIsNormal(lp))
+			continue;
+
+		tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+		tuple.t_len = ItemIdGetLength(lp);
+		tuple.t_tableOid = RelationGetRelid(rel);
+		ItemPointerSet(&tuple.t_self, blkno, off);
+
+		switch (HeapTupleSatisfiesVacuumHorizon(&tuple, buf, &dead_after))
+		{
+			case HEAPTUPLE_DEAD:
+				counts->dead_tuples++;
+				counts->dead_bytes += tuple.t_len;
+				break;
+			case HEAPTUPLE_RECENTLY_DEAD:
+				Assert(TransactionIdIsValid(dead_after));
+				if (TransactionIdPrecedes(dead_after, horizon))
+				{
+					counts->dead_tuples++;
+					counts->dead_bytes += tuple.t_len;
+				}
+				else if (TransactionIdPrecedes(dead_after, advanced))
+				{
+					counts->retained_tuples++;
+					counts->retained_bytes += tuple.t_len;
+				}
+				/* else a running transaction may still see it */
+				break;
+			default:
+				break;
+		}
+	}
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+}
+
+static inline int64
+electric_extrapolate(int64 sampled, BlockNumber nblocks, int nsampled)
+{
+	if (nsampled == 0)
+		return 0;
+	return (int64) ((double) sampled * nblocks / nsampled + 0.5);
+}
+
+/*
+ * SQL: electric_retention_sample(relid, sample_pages) -> one row with the
+ * relation's size, the horizon, and dead / retained tuple estimates. No rows
+ * if the relation has been dropped meanwhile.
+ */
+Datum
+electric_retention_sample(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	int32		sample_pages = PG_GETARG_INT32(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Relation	rel;
+	AclResult	aclresult;
+	BlockNumber nblocks;
+	BlockSamplerData bs;
+	BufferAccessStrategy strategy;
+	TransactionId horizon;
+	TransactionId advanced;
+	ElectricRetentionCounts counts;
+	int			nsampled = 0;
+	Datum		values[9];
+	bool		nulls[9];
+
+	if (sample_pages < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample_pages must be at least 1")));
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("electric_retention_sample() cannot be executed during recovery.")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	rel = try_relation_open(relid, AccessShareLock);
+	if (rel == NULL)
+		return (Datum) 0;
+
+	if ((rel->rd_rel->relkind != RELKIND_RELATION &&
+		 rel->rd_rel->relkind != RELKIND_MATVIEW &&
+		 rel->rd_rel->relkind != RELKIND_TOASTVALUE) ||
+		rel->rd_rel->relam != HEAP_TABLE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a heap table",
+						RelationGetRelationName(rel))));
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+					   RelationGetRelationName(rel));
+
+	horizon = GetOldestNonRemovableTransactionId(rel);
+	advanced = GetOldestActiveTransactionId();
+	if (TransactionIdPrecedes(advanced, horizon))
+		advanced = horizon;
+
+	memset(&counts, 0, sizeof(counts));
+	nblocks = RelationGetNumberOfBlocks(rel);
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+
+	BlockSampler_Init(&bs, nblocks, sample_pages,
+					  pg_prng_uint32(&pg_global_prng_state));
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber blkno = BlockSampler_Next(&bs);
+		Buffer		buf;
+
+		CHECK_FOR_INTERRUPTS();
+
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		electric_retention_page(rel, buf, blkno, horizon, advanced, &counts);
+		ReleaseBuffer(buf);
+		nsampled++;
+	}
+
+	FreeAccessStrategy(strategy);
+	relation_close(rel, AccessShareLock);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) nblocks);
+	values[1] = Int32GetDatum(nsampled);
+	values[2] = TransactionIdGetDatum(horizon);
+	values[3] = TransactionIdGetDatum(advanced);
+	values[4] = Int64GetDatum(electric_extrapolate(counts.dead_tuples, nblocks, nsampled));
+	values[5] = Int64GetDatum(electric_extrapolate(counts.dead_bytes, nblocks, nsampled));
+	values[6] = Int64GetDatum(electric_extrapolate(counts.retained_tuples, nblocks, nsampled));
+	values[7] = Int64GetDatum(electric_extrapolate(counts.retained_bytes, nblocks, nsampled));
+	values[8] = Int64GetDatum(electric_extrapolate(counts.dead_bytes + counts.retained_bytes,
+												   nblocks, nsampled));
+
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+	return (Datum) 0;
+}
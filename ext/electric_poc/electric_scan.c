@@ -0,0 +1,808 @@
+/*
+ * electric_scan.c - dead-version traversal counters for historical queries
+ *
+ * With electric.track_scans on, the scan nodes of every query that runs under
+ * a synthetic snapshot (electric_exec_as_of() or SET LOCAL electric.snapshot)
+ * get a wrapper around their ExecProcNode. The wrapper never changes what the
+ * node returns; it only inspects the scan's heap state afterwards:
+ *
+ *   SeqScan   - each heap page the scan passes is counted once. Its LP_NORMAL
+ *               line pointers are tuples examined; the ones the snapshot let
+ *               through (rs_ntuples) are tuples visible. Pages that yield no
+ *               row never surface in the wrapper, so they are re-pinned and
+ *               checked against the snapshot when the scan moves past them.
+ *   IndexScan - index entries followed vs heap tuples found come from the
+ *               index's pgstat counters, heap pages from the table's. HOT
+ *               hops are counted by walking the chain from the index's root
+ *               TID to the tuple that was returned.
+ *
+ * Other scan types and parallel workers are not instrumented.
+ *
+ * Per-query counters are handed to the caller at ExecutorEnd (for per-call
+ * reporting) and added to a shared per-relation table, pg_stat_electric_tables.
+ *
+ * The same wrappers enforce electric_exec_as_of()'s max_tuples_examined: every
+ * time they count tuples examined they charge the running call's budget and
+ * raise 54L03 once it is spent. A seq scan is only seen when it returns a row
+ * or ends, so one that finds nothing for a long time overshoots; max_elapsed_ms
+ * is the backstop for that.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/relscan.h"
+#include "access/tableam.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/bufmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_scan_stats);
+
+/* electric.track_scans */
+bool		electric_track_scans = false;
+
+/* Relations tracked in shared memory; later ones are not recorded */
+#define ELECTRIC_MAX_TABLES 1000
+
+typedef struct ElectricRelKey
+{
+	Oid			dbid;
+	Oid			relid;
+} ElectricRelKey;
+
+typedef struct ElectricRelEntry
+{
+	ElectricRelKey key;
+	pg_atomic_uint64 scans;
+	pg_atomic_uint64 heap_pages;
+	pg_atomic_uint64 tuples_examined;
+	pg_atomic_uint64 tuples_visible;
+	pg_atomic_uint64 hot_hops;
+} ElectricRelEntry;
+
+static HTAB *electric_rel_hash = NULL;
+static LWLock *electric_rel_lock = NULL;
+
+/* One instrumented scan node */
+typedef struct ElectricScanNode
+{
+	PlanState  *node;
+	ExecProcNodeMtd orig;
+	ElectricRelScanStats *rel;	/* accumulator for the scanned table */
+
+	/* SeqScan: pages accounted in the current pass */
+	BlockNumber last_block;
+	BlockNumber blocks_done;
+
+	/* IndexScan: pgstat counters as of the last call */
+	PgStat_Counter index_returned;
+	PgStat_Counter index_fetched;
+	PgStat_Counter heap_blocks;
+} ElectricScanNode;
+
+/* All instrumented nodes of one query */
+typedef struct ElectricScanQuery
+{
+	QueryDesc  *queryDesc;
+	List	   *nodes;			/* ElectricScanNode * */
+	List	   *rels;			/* ElectricRelScanStats *, one per table */
+	MemoryContextCallback cleanup;
+	struct ElectricScanQuery *next;
+} ElectricScanQuery;
+
+/* Queries with instrumented nodes, innermost first */
+static ElectricScanQuery *electric_scan_queries = NULL;
+static ElectricScanNode *electric_scan_last = NULL;
+
+/* max_tuples_examined of the running electric_exec_as_of() call */
+static ElectricScanBudget electric_scan_budget = {0, 0};
+
+static inline uint64
+electric_scan_charge(uint64 ntuples)
+{
+	if (electric_scan_budget.max > 0)
+	{
+		electric_scan_budget.examined += ntuples;
+		if (electric_scan_budget.examined > electric_scan_budget.max)
+			electric_limit_exceeded(ELECTRIC_LIMIT_TUPLES_EXAMINED, electric_scan_budget.max);
+	}
+	return ntuples;
+}
+
+/* ----------------------------------------------------------------
+ * Shared per-relation table
+ * ----------------------------------------------------------------
+ */
+
+Size
+electric_scan_shmem_size(void)
+{
+	return hash_estimate_size(ELECTRIC_MAX_TABLES, sizeof(ElectricRelEntry));
+}
+
+void
+electric_scan_shmem_request(void)
+{
+	RequestAddinShmemSpace(electric_scan_shmem_size());
+	RequestNamedLWLockTranche("electric_poc scans", 1);
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_scan_shmem_init(void)
+{
+	HASHCTL		info;
+
+	electric_rel_lock = &(GetNamedLWLockTranche("electric_poc scans"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ElectricRelKey);
+	info.entrysize = sizeof(ElectricRelEntry);
+	electric_rel_hash = ShmemInitHash("electric_poc relation scans",
+									  ELECTRIC_MAX_TABLES, ELECTRIC_MAX_TABLES,
+									  &info, HASH_ELEM | HASH_BLOBS);
+}
+
+static void
+electric_rel_add(ElectricRelEntry *entry, const ElectricRelScanStats *rs)
+{
+	pg_atomic_fetch_add_u64(&entry->scans, 1);
+	pg_atomic_fetch_add_u64(&entry->heap_pages, rs->counters.heap_pages);
+	pg_atomic_fetch_add_u64(&entry->tuples_examined, rs->counters.tuples_examined);
+	pg_atomic_fetch_add_u64(&entry->tuples_visible, rs->counters.tuples_visible);
+	pg_atomic_fetch_add_u64(&entry->hot_hops, rs->counters.hot_hops);
+}
+
+/*
+ * Add a query's counters to its relation's entry. The adds happen under the
+ * lock: pg_stat_electric_reset() frees entries for reuse by other relations.
+ */
+static void
+electric_rel_record(const ElectricRelScanStats *rs)
+{
+	ElectricRelKey key;
+	ElectricRelEntry *entry;
+	bool		found;
+
+	if (electric_rel_hash == NULL || !electric_track_stats)
+		return;
+
+	key.dbid = MyDatabaseId;
+	key.relid = rs->relid;
+
+	LWLockAcquire(electric_rel_lock, LW_SHARED);
+	entry = hash_search(electric_rel_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		electric_rel_add(entry, rs);
+		LWLockRelease(electric_rel_lock);
+		return;
+	}
+	LWLockRelease(electric_rel_lock);
+
+	LWLockAcquire(electric_rel_lock, LW_EXCLUSIVE);
+	entry = hash_search(electric_rel_hash, &key, HASH_ENTER_NULL, &found);
+	if (entry != NULL)
+	{
+		if (!found)
+		{
+			pg_atomic_init_u64(&entry->scans, 0);
+			pg_atomic_init_u64(&entry->heap_pages, 0);
+			pg_atomic_init_u64(&entry->tuples_examined, 0);
+			pg_atomic_init_u64(&entry->tuples_visible, 0);
+			pg_atomic_init_u64(&entry->hot_hops, 0);
+		}
+		electric_rel_add(entry, rs);
+	}
+	LWLockRelease(electric_rel_lock);
+}
+
+void
+electric_scan_stats_reset(void)
+{
+	HASH_SEQ_STATUS status;
+	ElectricRelEntry *entry;
+
+	if (electric_rel_hash == NULL)
+		return;
+
+	LWLockAcquire(electric_rel_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, electric_rel_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(electric_rel_hash, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(electric_rel_lock);
+}
+
+/* ----------------------------------------------------------------
+ * Scan node wrappers
+ * ----------------------------------------------------------------
+ */
+
+static ElectricScanNode *
+electric_scan_lookup(PlanState *node)
+{
+	ElectricScanQuery *q;
+	ListCell   *lc;
+
+	if (electric_scan_last != NULL && electric_scan_last->node == node)
+		return electric_scan_last;
+
+	for (q = electric_scan_queries; q != NULL; q = q->next)
+	{
+		foreach(lc, q->nodes)
+		{
+			ElectricScanNode *sn = (ElectricScanNode *) lfirst(lc);
+
+			if (sn->node == node)
+			{
+				electric_scan_last = sn;
+				return sn;
+			}
+		}
+	}
+	elog(ERROR, "electric_poc: scan node is not instrumented");
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Count LP_NORMAL line pointers on a pinned heap page. If snapshot is given,
+ * also count how many of those tuples it can see into *nvisible.
+ */
+static uint64
+electric_page_tuples(Relation rel, Buffer buf, Snapshot snapshot, uint64 *nvisible)
+{
+	Page		page;
+	BlockNumber blkno = BufferGetBlockNumber(buf);
+	OffsetNumber off;
+	OffsetNumber maxoff;
+	uint64		ntuples = 0;
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoff = PageGetMaxOffsetNumber(page);
+	for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId		lp = PageGetItemId(page, off);
+
+		if (!ItemIdIsNormal(lp))
+			continue;
+		ntuples++;
+
+		if (snapshot != NULL)
+		{
+			HeapTupleData tuple;
+
+			tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+			tuple.t_len = ItemIdGetLength(lp);
+			tuple.t_tableOid = RelationGetRelid(rel);
+			ItemPointerSet(&tuple.t_self, blkno, off);
+			if (HeapTupleSatisfiesVisibility(&tuple, snapshot, buf))
+				(*nvisible)++;
+		}
+	}
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+	return ntuples;
+}
+
+/*
+ * Account a page the scan moved past without returning a row from it: either
+ * nothing was visible or nothing passed the quals.
+ */
+static void
+electric_seqscan_skipped_page(ElectricScanNode *sn, HeapScanDesc scan, BlockNumber blkno)
+{
+	Relation	rel = scan->rs_base.rs_rd;
+	Buffer		buf;
+	uint64		ntuples;
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, scan->rs_strategy);
+	sn->rel->counters.heap_pages++;
+	ntuples = electric_page_tuples(rel, buf, scan->rs_base.rs_snapshot,
+								   &sn->rel->counters.tuples_visible);
+	ReleaseBuffer(buf);
+	sn->rel->counters.tuples_examined += electric_scan_charge(ntuples);
+}
+
+/* Account the page the scan just returned a row from */
+static void
+electric_seqscan_current_page(ElectricScanNode *sn, HeapScanDesc scan)
+{
+	sn->rel->counters.heap_pages++;
+	sn->rel->counters.tuples_visible += scan->rs_ntuples;
+	sn->rel->counters.tuples_examined +=
+		electric_scan_charge(electric_page_tuples(scan->rs_base.rs_rd, scan->rs_cbuf, NULL, NULL));
+}
+
+static TupleTableSlot *
+electric_exec_seqscan(PlanState *pstate)
+{
+	ElectricScanNode *sn = electric_scan_lookup(pstate);
+	ScanState  *node = (ScanState *) pstate;
+	TupleTableSlot *slot;
+	HeapScanDesc scan;
+	BlockNumber nblocks;
+
+	slot = sn->orig(pstate);
+
+	/* The scan descriptor is created on the first call */
+	scan = (HeapScanDesc) node->ss_currentScanDesc;
+	if (scan == NULL)
+		return slot;
+
+	/* Parallel scans hand out blocks out of order; count what we see */
+	if (scan->rs_base.rs_parallel != NULL)
+	{
+		if (!TupIsNull(slot) && scan->rs_cblock != sn->last_block)
+		{
+			sn->last_block = scan->rs_cblock;
+			electric_seqscan_current_page(sn, scan);
+		}
+		return slot;
+	}
+
+	nblocks = scan->rs_nblocks;
+	if (scan->rs_numblocks != InvalidBlockNumber)
+		nblocks = Min(nblocks, scan->rs_numblocks);
+
+	if (TupIsNull(slot))
+	{
+		/* End of scan: no row came from any of the remaining pages */
+		BlockNumber blkno = (sn->last_block == InvalidBlockNumber) ?
+			scan->rs_startblock : (sn->last_block + 1) % scan->rs_nblocks;
+
+		while (sn->blocks_done < nblocks)
+		{
+			electric_seqscan_skipped_page(sn, scan, blkno);
+			sn->blocks_done++;
+			blkno = (blkno + 1) % scan->rs_nblocks;
+		}
+
+		/* Ready for a rescan */
+		sn->last_block = InvalidBlockNumber;
+		sn->blocks_done = 0;
+		return slot;
+	}
+
+	if (scan->rs_cblock == sn->last_block)
+		return slot;
+
+	/* A rescan that didn't run to completion starts over */
+	if (scan->rs_cblock == scan->rs_startblock && sn->blocks_done > 0)
+	{
+		sn->last_block = InvalidBlockNumber;
+		sn->blocks_done = 0;
+	}
+
+	/* No row came from the pages between the last one we saw and this one */
+	{
+		BlockNumber blkno = (sn->last_block == InvalidBlockNumber) ?
+			scan->rs_startblock : (sn->last_block + 1) % scan->rs_nblocks;
+
+		while (blkno != scan->rs_cblock && sn->blocks_done < nblocks)
+		{
+			electric_seqscan_skipped_page(sn, scan, blkno);
+			sn->blocks_done++;
+			blkno = (blkno + 1) % scan->rs_nblocks;
+		}
+	}
+
+	sn->last_block = scan->rs_cblock;
+	sn->blocks_done++;
+	electric_seqscan_current_page(sn, scan);
+
+	return slot;
+}
+
+/*
+ * Number of heap tuples stepped over on the way from the HOT chain root the
+ * index pointed at to the tuple that was returned. By the time we see the
+ * tuple heapam has replaced the index's TID with the found one, so the root
+ * is looked up on the page.
+ */
+static uint64
+electric_hot_hops(Buffer buf, ItemPointer found)
+{
+	OffsetNumber root_offsets[MaxHeapTuplesPerPage];
+	Page		page;
+	OffsetNumber off;
+	OffsetNumber target;
+	OffsetNumber maxoff;
+	uint64		hops = 0;
+	int			guard;
+
+	if (!BufferIsValid(buf) || !ItemPointerIsValid(found) ||
+		BufferGetBlockNumber(buf) != ItemPointerGetBlockNumber(found))
+		return 0;
+	target = ItemPointerGetOffsetNumber(found);
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	maxoff = PageGetMaxOffsetNumber(page);
+	heap_get_root_tuples(page, root_offsets);
+	off = (target <= maxoff) ? root_offsets[target - 1] : InvalidOffsetNumber;
+	if (off == InvalidOffsetNumber)
+		off = target;
+
+	for (guard = 0; guard < MaxHeapTuplesPerPage && off != target; guard++)
+	{
+		ItemId		lp;
+		HeapTupleHeader htup;
+
+		if (off < FirstOffsetNumber || off > maxoff)
+			break;
+		lp = PageGetItemId(page, off);
+		if (ItemIdIsRedirected(lp))
+		{
+			off = ItemIdGetRedirect(lp);
+			continue;
+		}
+		if (!ItemIdIsNormal(lp))
+			break;
+
+		htup = (HeapTupleHeader) PageGetItem(page, lp);
+		hops++;
+		if (!HeapTupleHeaderIsHotUpdated(htup))
+			break;
+		off = ItemPointerGetOffsetNumber(&htup->t_ctid);
+	}
+	LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+
+	return hops;
+}
+
+static TupleTableSlot *
+electric_exec_indexscan(PlanState *pstate)
+{
+	ElectricScanNode *sn = electric_scan_lookup(pstate);
+	IndexScanState *node = (IndexScanState *) pstate;
+	Relation	heaprel = node->ss.ss_currentRelation;
+	TupleTableSlot *slot;
+	PgStat_TableStatus *istat;
+	PgStat_TableStatus *hstat;
+
+	slot = sn->orig(pstate);
+
+	/* pgstat_info may be set up lazily, so look it up each time */
+	istat = node->iss_RelationDesc ? node->iss_RelationDesc->pgstat_info : NULL;
+	hstat = heaprel->pgstat_info;
+
+	if (istat != NULL)
+	{
+		uint64		examined = istat->counts.tuples_returned - sn->index_returned;
+
+		sn->rel->counters.tuples_examined += examined;
+		sn->rel->counters.tuples_visible += istat->counts.tuples_fetched - sn->index_fetched;
+		sn->index_returned = istat->counts.tuples_returned;
+		sn->index_fetched = istat->counts.tuples_fetched;
+		(void) electric_scan_charge(examined);
+	}
+	if (hstat != NULL)
+	{
+		sn->rel->counters.heap_pages += hstat->counts.blocks_fetched - sn->heap_blocks;
+		sn->heap_blocks = hstat->counts.blocks_fetched;
+	}
+
+	if (!TupIsNull(slot) && node->iss_ScanDesc != NULL)
+	{
+		IndexScanDesc scan = node->iss_ScanDesc;
+		IndexFetchHeapData *hscan = (IndexFetchHeapData *) scan->xs_heapfetch;
+
+		/* slot may be the projection's; the scan slot has the heap TID */
+		if (hscan != NULL)
+			sn->rel->counters.hot_hops +=
+				electric_hot_hops(hscan->xs_cbuf, &node->ss.ss_ScanTupleSlot->tts_tid);
+	}
+
+	return slot;
+}
+
+/* ----------------------------------------------------------------
+ * Per-query setup and teardown
+ * ----------------------------------------------------------------
+ */
+
+static ElectricRelScanStats *
+electric_scan_rel(ElectricScanQuery *q, Oid relid)
+{
+	ElectricRelScanStats *rs;
+	ListCell   *lc;
+
+	foreach(lc, q->rels)
+	{
+		rs = (ElectricRelScanStats *) lfirst(lc);
+		if (rs->relid == relid)
+			return rs;
+	}
+	rs = palloc0(sizeof(ElectricRelScanStats));
+	rs->relid = relid;
+	q->rels = lappend(q->rels, rs);
+	return rs;
+}
+
+static bool
+electric_scan_walker(PlanState *ps, void *context)
+{
+	ElectricScanQuery *q = (ElectricScanQuery *) context;
+	ExecProcNodeMtd wrapper = NULL;
+	Relation	rel = NULL;
+
+	if (ps == NULL)
+		return false;
+
+	switch (nodeTag(ps))
+	{
+		case T_SeqScanState:
+			wrapper = electric_exec_seqscan;
+			rel = ((ScanState *) ps)->ss_currentRelation;
+			break;
+		case T_IndexScanState:
+			wrapper = electric_exec_indexscan;
+			rel = ((ScanState *) ps)->ss_currentRelation;
+			break;
+		default:
+			break;
+	}
+
+	/* The counters read heapam internals, so only wrap heap tables */
+	if (wrapper != NULL && rel != NULL && rel->rd_tableam == GetHeapamTableAmRoutine())
+	{
+		ElectricScanNode *sn = palloc0(sizeof(ElectricScanNode));
+
+		sn->node = ps;
+		sn->orig = ps->ExecProcNodeReal;
+		sn->rel = electric_scan_rel(q, RelationGetRelid(rel));
+		sn->last_block = InvalidBlockNumber;
+
+		if (IsA(ps, IndexScanState))
+		{
+			IndexScanState *is = (IndexScanState *) ps;
+
+			if (is->iss_RelationDesc && is->iss_RelationDesc->pgstat_info)
+			{
+				sn->index_returned = is->iss_RelationDesc->pgstat_info->counts.tuples_returned;
+				sn->index_fetched = is->iss_RelationDesc->pgstat_info->counts.tuples_fetched;
+			}
+			if (rel->pgstat_info)
+				sn->heap_blocks = rel->pgstat_info->counts.blocks_fetched;
+		}
+
+		/* ExecProcNodeFirst() installs ExecProcNodeReal on the first call */
+		ps->ExecProcNodeReal = wrapper;
+		q->nodes = lappend(q->nodes, sn);
+	}
+
+	return planstate_tree_walker(ps, electric_scan_walker, context);
+}
+
+/* The query's memory is going away (ExecutorEnd or abort): forget it */
+static void
+electric_scan_query_cleanup(void *arg)
+{
+	ElectricScanQuery *q = (ElectricScanQuery *) arg;
+	ElectricScanQuery **prev;
+
+	for (prev = &electric_scan_queries; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == q)
+		{
+			*prev = q->next;
+			break;
+		}
+	}
+	electric_scan_last = NULL;
+}
+
+/*
+ * Wrap the scan nodes of a query that has just been through ExecutorStart.
+ */
+void
+electric_scan_instrument(QueryDesc *queryDesc)
+{
+	EState	   *estate = queryDesc->estate;
+	ElectricScanQuery *q;
+	MemoryContext oldcxt;
+
+	if (queryDesc->planstate == NULL)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+
+	q = palloc0(sizeof(ElectricScanQuery));
+	q->queryDesc = queryDesc;
+	(void) electric_scan_walker(queryDesc->planstate, q);
+
+	if (q->nodes == NIL)
+	{
+		MemoryContextSwitchTo(oldcxt);
+		return;
+	}
+
+	q->cleanup.func = electric_scan_query_cleanup;
+	q->cleanup.arg = q;
+	MemoryContextRegisterResetCallback(estate->es_query_cxt, &q->cleanup);
+	q->next = electric_scan_queries;
+	electric_scan_queries = q;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * At ExecutorEnd: publish the query's per-relation counters to shared memory
+ * and, if the caller wants them, add them to *total and merge them into
+ * *rels (a list of ElectricRelScanStats allocated in cxt).
+ */
+void
+electric_scan_finish(QueryDesc *queryDesc, ElectricScanCounters *total,
+					 List **rels, MemoryContext cxt)
+{
+	ElectricScanQuery *q;
+	ListCell   *lc;
+
+	for (q = electric_scan_queries; q != NULL; q = q->next)
+	{
+		if (q->queryDesc == queryDesc)
+			break;
+	}
+	if (q == NULL)
+		return;
+
+	foreach(lc, q->rels)
+	{
+		ElectricRelScanStats *rs = (ElectricRelScanStats *) lfirst(lc);
+
+		/* Scans may be instrumented only to enforce a budget */
+		if (electric_track_scans)
+			electric_rel_record(rs);
+
+		if (total != NULL)
+		{
+			total->heap_pages += rs->counters.heap_pages;
+			total->tuples_examined += rs->counters.tuples_examined;
+			total->tuples_visible += rs->counters.tuples_visible;
+			total->hot_hops += rs->counters.hot_hops;
+		}
+
+		if (rels != NULL)
+		{
+			ElectricRelScanStats *dst = NULL;
+			ListCell   *lc2;
+
+			foreach(lc2, *rels)
+			{
+				if (((ElectricRelScanStats *) lfirst(lc2))->relid == rs->relid)
+				{
+					dst = (ElectricRelScanStats *) lfirst(lc2);
+					break;
+				}
+			}
+			if (dst == NULL)
+			{
+				MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+
+				dst = palloc0(sizeof(ElectricRelScanStats));
+				dst->relid = rs->relid;
+				*rels = lappend(*rels, dst);
+				MemoryContextSwitchTo(oldcxt);
+			}
+			dst->counters.heap_pages += rs->counters.heap_pages;
+			dst->counters.tuples_examined += rs->counters.tuples_examined;
+			dst->counters.tuples_visible += rs->counters.tuples_visible;
+			dst->counters.hot_hops += rs->counters.hot_hops;
+		}
+	}
+
+	/* Never report the same counters twice */
+	list_free(q->rels);
+	q->rels = NIL;
+}
+
+/* ----------------------------------------------------------------
+ * max_tuples_examined budget
+ * ----------------------------------------------------------------
+ */
+
+/* Whether scans must be instrumented to enforce a budget */
+bool
+electric_scan_budget_active(void)
+{
+	return electric_scan_budget.max > 0;
+}
+
+/*
+ * A call starts: it may examine up to max tuples (0 = unlimited), and no more
+ * than its caller has left. The caller's budget is saved in *saved.
+ */
+void
+electric_scan_budget_push(uint64 max, ElectricScanBudget *saved)
+{
+	*saved = electric_scan_budget;
+
+	if (saved->max > 0)
+	{
+		uint64		left = saved->max - Min(saved->examined, saved->max);
+
+		/* 0 would read as unlimited; the caller's next tuple fails anyway */
+		if (left == 0)
+			electric_limit_exceeded(ELECTRIC_LIMIT_TUPLES_EXAMINED, saved->max);
+		if (max == 0 || left < max)
+			max = left;
+	}
+	electric_scan_budget.max = max;
+	electric_scan_budget.examined = 0;
+}
+
+/* The call ends: what it examined counts against its caller */
+void
+electric_scan_budget_pop(const ElectricScanBudget *saved)
+{
+	uint64		examined = electric_scan_budget.examined;
+
+	electric_scan_budget = *saved;
+	electric_scan_budget.examined += examined;
+}
+
+void
+electric_scan_budget_reset(void)
+{
+	electric_scan_budget.max = 0;
+	electric_scan_budget.examined = 0;
+}
+
+/*
+ * SQL: pg_stat_electric_tables() -> one row per relation in this database
+ */
+Datum
+electric_scan_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	HASH_SEQ_STATUS status;
+	ElectricRelEntry *entry;
+
+	if (electric_rel_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	LWLockAcquire(electric_rel_lock, LW_SHARED);
+	hash_seq_init(&status, electric_rel_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		Datum		values[6];
+		bool		nulls[6];
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(entry->key.relid);
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->scans));
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->heap_pages));
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->tuples_examined));
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->tuples_visible));
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->hot_hops));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	LWLockRelease(electric_rel_lock);
+
+	return (Datum) 0;
+}
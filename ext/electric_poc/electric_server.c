@@ -0,0 +1,1126 @@
+/*
+ * electric_server.c - as-of queries over a unix socket (electric.server_socket)
+ *
+ * For checks that run thousands of times a second, libpq, the SQL parser and
+ * electric_exec_as_of()'s JSON result cost more than the query itself. This
+ * background worker accepts connections on a unix socket and answers a small
+ * binary protocol instead: clients register snapshots and prepare queries
+ * once, then execute them by number with binary arguments and get binary
+ * rows back. Plans are kept across requests (SPI_keepplan), and a client may
+ * send any number of requests without waiting for the answers; they are
+ * answered in order, all complete requests read in one go sharing one
+ * transaction.
+ *
+ * Every frame, in both directions, is
+ *
+ *   uint32 length     bytes that follow this field
+ *   uint32 request    chosen by the client, echoed in the response
+ *   uint8  type
+ *   ...    payload
+ *
+ * with integers in network byte order. Requests:
+ *
+ *   'S' snapshot    text xmin:xmax:xip,...           -> 'K' uint32 handle
+ *   'F' forget      uint32 handle                    -> 'K'
+ *   'P' prepare     uint32 query, uint16 nparams,    -> 'K' uint16 ncols,
+ *                   uint32 param type oid[nparams],       uint32 type oid[ncols]
+ *                   text sql (a single SELECT)
+ *   'D' deallocate  uint32 query                     -> 'K'
+ *   'X' execute     uint32 handle, uint32 query,     -> 'R' uint16 ncols,
+ *                   uint16 nargs, then per arg            uint32 nrows, then per
+ *                   int32 length (-1 = NULL) and          row and column int32
+ *                   the value in binary format            length (-1 = NULL) and
+ *                                                         the value in binary
+ *
+ * Any request may instead get 'E': a 5-character SQLSTATE, then the message.
+ * A failed request doesn't affect the ones after it. Snapshot handles and
+ * query numbers belong to the connection.
+ *
+ * Registering a snapshot waits, once, until every xid it treats as finished
+ * has finished here (see electric_wait_for_snapshot()), holding up the
+ * worker's other connections meanwhile. Executions run with
+ * the privileges of electric.server_user, which must be set and must not be
+ * a superuser; the resource limits, admission control and coalescing of
+ * electric_exec_as_of() don't apply.
+ */
+
+#include "postgres.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/pg_bswap.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/snapmgr.h"
+#include "utils/wait_event.h"
+
+#include "electric_poc.h"
+
+PGDLLEXPORT void electric_server_main(Datum main_arg);
+
+/* GUCs */
+char	   *electric_server_socket = NULL;
+int			electric_server_workers = 1;
+char	   *electric_server_database = NULL;
+char	   *electric_server_user = NULL;
+
+/* Connections per worker; more are refused */
+#define ELECTRIC_SERVER_MAX_CLIENTS 64
+
+/* Largest request frame accepted; larger ones close the connection */
+#define ELECTRIC_SERVER_MAX_REQUEST (64 * 1024 * 1024)
+
+/*
+ * Stop reading from a client while this much of its output is unsent, or
+ * this much input is buffered (and holds at least one complete request)
+ */
+#define ELECTRIC_SERVER_MAX_PENDING (4 * 1024 * 1024)
+
+#define ELECTRIC_SERVER_HEADER 9	/* length, request, type */
+
+typedef struct ElectricServerSnapshot
+{
+	uint32		handle;			/* hash key */
+	ElectricParsedSnapshot parsed;	/* xip in the client's context */
+} ElectricServerSnapshot;
+
+typedef struct ElectricServerQuery
+{
+	uint32		id;				/* hash key */
+	SPIPlanPtr	plan;			/* kept, so it outlives the transaction */
+	int			nparams;
+	Oid		   *paramtypes;
+	FmgrInfo   *recv;			/* binary input function per parameter */
+	Oid		   *recv_ioparams;
+	int			ncols;
+	Oid		   *coltypes;
+	FmgrInfo   *send;			/* binary output function per column */
+} ElectricServerQuery;
+
+typedef struct ElectricServerClient
+{
+	pgsocket	sock;
+	bool		closing;		/* dropped at the end of this loop iteration */
+	MemoryContext cxt;			/* everything below lives here */
+	StringInfoData in;			/* received, in.cursor = first unprocessed */
+	StringInfoData out;			/* to send, out.cursor = first unsent */
+	HTAB	   *snapshots;
+	HTAB	   *queries;
+	uint32		next_handle;
+	int			event_pos;		/* in the wait event set */
+	uint32		events;			/* what we wait for there */
+} ElectricServerClient;
+
+/* DestReceiver writing an 'R' frame's rows */
+typedef struct ElectricServerReceiver
+{
+	DestReceiver pub;
+	ElectricServerClient *client;
+	ElectricServerQuery *query;
+	StringInfo	out;
+	int			nrows_at;		/* offset of the row count, -1 before startup */
+	uint32		nrows;
+	MemoryContext row_cxt;
+} ElectricServerReceiver;
+
+static pgsocket listen_sock = PGINVALID_SOCKET;
+static char listen_path[MAXPGPATH];
+static ElectricServerClient *clients[ELECTRIC_SERVER_MAX_CLIENTS];
+static int	nclients = 0;
+static WaitEventSet *wait_set = NULL;
+
+/* Reset after every request */
+static MemoryContext request_cxt = NULL;
+
+/*
+ * Called from _PG_init() while preloading: one worker per socket
+ */
+void
+electric_server_register(void)
+{
+	BackgroundWorker worker;
+	int			i;
+
+	if (electric_server_socket == NULL || electric_server_socket[0] == '\0')
+		return;
+
+	/* Anyone who can open the socket reads as this role */
+	if (electric_server_user == NULL || electric_server_user[0] == '\0')
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("electric.server_socket is set but electric.server_user is not, not starting the as-of query server"),
+				 errhint("Set electric.server_user to a role without superuser privileges.")));
+		return;
+	}
+
+	for (i = 0; i < electric_server_workers; i++)
+	{
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 5;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "electric_poc");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "electric_server_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "electric_server %d", i);
+		snprintf(worker.bgw_type, BGW_MAXLEN, "electric_server");
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+static void
+electric_server_unlink(int code, Datum arg)
+{
+	if (listen_sock != PGINVALID_SOCKET)
+	{
+		closesocket(listen_sock);
+		unlink(listen_path);
+	}
+}
+
+/*
+ * Listen on electric.server_socket, or <electric.server_socket>.<n> when
+ * there are several workers
+ */
+static void
+electric_server_listen(int n)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (electric_server_workers > 1)
+		snprintf(listen_path, sizeof(listen_path), "%s.%d", electric_server_socket, n);
+	else
+		strlcpy(listen_path, electric_server_socket, sizeof(listen_path));
+
+	if (strlen(listen_path) >= sizeof(addr.sun_path))
+		ereport(FATAL,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("electric.server_socket path \"%s\" is too long", listen_path)));
+
+	/* A socket left behind by a crashed worker */
+	if (lstat(listen_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(listen_path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, listen_path, sizeof(addr.sun_path));
+
+	listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_sock == PGINVALID_SOCKET)
+		ereport(FATAL,
+				(errcode_for_socket_access(),
+				 errmsg("could not create electric_server socket: %m")));
+	if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		int			save_errno = errno;
+
+		closesocket(listen_sock);
+		listen_sock = PGINVALID_SOCKET;
+		errno = save_errno;
+		ereport(FATAL,
+				(errcode_for_socket_access(),
+				 errmsg("could not bind electric_server socket \"%s\": %m", listen_path)));
+	}
+	on_proc_exit(electric_server_unlink, (Datum) 0);
+
+	/* The server's OS user and its group; restrict further with the directory */
+	if (chmod(listen_path, 0770) < 0 ||
+		listen(listen_sock, 128) < 0 ||
+		!pg_set_noblock(listen_sock))
+		ereport(FATAL,
+				(errcode_for_socket_access(),
+				 errmsg("could not listen on electric_server socket \"%s\": %m", listen_path)));
+
+	ereport(LOG,
+			(errmsg("electric_server listening on \"%s\"", listen_path)));
+}
+
+/* ----------------------------------------------------------------
+ * Connections
+ * ----------------------------------------------------------------
+ */
+
+static void
+electric_server_accept(void)
+{
+	for (;;)
+	{
+		pgsocket	sock = accept(listen_sock, NULL, NULL);
+		ElectricServerClient *client;
+		MemoryContext cxt;
+		MemoryContext oldcxt;
+		HASHCTL		ctl;
+
+		if (sock == PGINVALID_SOCKET)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				ereport(LOG,
+						(errcode_for_socket_access(),
+						 errmsg("electric_server could not accept connection: %m")));
+			return;
+		}
+		if (nclients >= ELECTRIC_SERVER_MAX_CLIENTS || !pg_set_noblock(sock))
+		{
+			ereport(LOG,
+					(errmsg("electric_server refused a connection (%d open)", nclients)));
+			closesocket(sock);
+			continue;
+		}
+
+		cxt = AllocSetContextCreate(TopMemoryContext, "electric_server client",
+									ALLOCSET_DEFAULT_SIZES);
+		oldcxt = MemoryContextSwitchTo(cxt);
+		client = palloc0(sizeof(ElectricServerClient));
+		client->sock = sock;
+		client->cxt = cxt;
+		client->next_handle = 1;
+		initStringInfo(&client->in);
+		initStringInfo(&client->out);
+
+		ctl.keysize = sizeof(uint32);
+		ctl.entrysize = sizeof(ElectricServerSnapshot);
+		ctl.hcxt = cxt;
+		client->snapshots = hash_create("electric_server snapshots", 16, &ctl,
+										HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		ctl.entrysize = sizeof(ElectricServerQuery);
+		client->queries = hash_create("electric_server queries", 16, &ctl,
+									  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		MemoryContextSwitchTo(oldcxt);
+
+		clients[nclients++] = client;
+		if (wait_set != NULL)
+		{
+			FreeWaitEventSet(wait_set);
+			wait_set = NULL;
+		}
+	}
+}
+
+static void
+electric_server_close(ElectricServerClient *client)
+{
+	HASH_SEQ_STATUS status;
+	ElectricServerQuery *query;
+
+	hash_seq_init(&status, client->queries);
+	while ((query = hash_seq_search(&status)) != NULL)
+		SPI_freeplan(query->plan);
+	closesocket(client->sock);
+	MemoryContextDelete(client->cxt);
+}
+
+/* Enough buffered input to work on; leave the rest in the socket */
+static bool
+electric_server_input_full(ElectricServerClient *client)
+{
+	StringInfo	in = &client->in;
+	uint32		len;
+
+	if (in->len - in->cursor < ELECTRIC_SERVER_MAX_PENDING)
+		return false;
+	memcpy(&len, in->data + in->cursor, 4);
+	len = pg_ntoh32(len);
+	/* An invalid length is complete too: it gets the connection closed */
+	return len > ELECTRIC_SERVER_MAX_REQUEST || (uint32) (in->len - in->cursor - 4) >= len;
+}
+
+/* Read what the client sent. Returns false on EOF or error. */
+static bool
+electric_server_read(ElectricServerClient *client)
+{
+	StringInfo	in = &client->in;
+
+	/* Drop what the last batch consumed */
+	if (in->cursor > 0)
+	{
+		memmove(in->data, in->data + in->cursor, in->len - in->cursor);
+		in->len -= in->cursor;
+		in->cursor = 0;
+	}
+
+	while (!electric_server_input_full(client))
+	{
+		ssize_t		n;
+
+		enlargeStringInfo(in, 65536);
+		n = recv(client->sock, in->data + in->len, in->maxlen - in->len - 1, 0);
+		if (n > 0)
+		{
+			in->len += n;
+			in->data[in->len] = '\0';
+			continue;
+		}
+		if (n == 0)
+			return false;
+		if (errno == EINTR)
+			continue;
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+	return true;
+}
+
+/* Send what we can. Returns false on error. */
+static bool
+electric_server_flush(ElectricServerClient *client)
+{
+	StringInfo	out = &client->out;
+
+	while (out->cursor < out->len)
+	{
+		ssize_t		n = send(client->sock, out->data + out->cursor, out->len - out->cursor, 0);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		out->cursor += n;
+	}
+
+	/* Give back the memory of a large answer */
+	if (out->maxlen > ELECTRIC_SERVER_MAX_PENDING)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(client->cxt);
+
+		pfree(out->data);
+		initStringInfo(out);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	else
+		resetStringInfo(out);
+	return true;
+}
+
+/*
+ * Socket events to wait for: writable while output is pending, readable
+ * unless the client isn't reading its answers. Never none, since a backlog
+ * is pending output.
+ */
+static uint32
+electric_server_events(ElectricServerClient *client)
+{
+	int			pending = client->out.len - client->out.cursor;
+
+	return (pending < ELECTRIC_SERVER_MAX_PENDING ? WL_SOCKET_READABLE : 0) |
+		(pending > 0 ? WL_SOCKET_WRITEABLE : 0);
+}
+
+/* ----------------------------------------------------------------
+ * Frames
+ * ----------------------------------------------------------------
+ */
+
+/* Start a response frame; returns its offset for electric_server_end() */
+static int
+electric_server_begin(StringInfo out, uint32 request, char type)
+{
+	int			start = out->len;
+
+	pq_sendint32(out, 0);
+	pq_sendint32(out, request);
+	pq_sendbyte(out, type);
+	return start;
+}
+
+static void
+electric_server_end(StringInfo out, int start)
+{
+	uint32		len = pg_hton32((uint32) (out->len - start - 4));
+
+	memcpy(out->data + start, &len, 4);
+}
+
+/*
+ * Next complete request in the client's input, as a StringInfo over its
+ * payload. Returns false if there is none yet, or sets *bad if the length is
+ * invalid.
+ */
+static bool
+electric_server_next(ElectricServerClient *client, StringInfo msg, uint32 *request,
+					 char *type, bool *bad)
+{
+	StringInfo	in = &client->in;
+	uint32		len;
+
+	if (in->len - in->cursor < 4)
+		return false;
+	memcpy(&len, in->data + in->cursor, 4);
+	len = pg_ntoh32(len);
+	if (len < ELECTRIC_SERVER_HEADER - 4 || len > ELECTRIC_SERVER_MAX_REQUEST)
+	{
+		*bad = true;
+		return false;
+	}
+	if ((uint32) (in->len - in->cursor - 4) < len)
+		return false;
+
+	memcpy(request, in->data + in->cursor + 4, 4);
+	*request = pg_ntoh32(*request);
+	*type = in->data[in->cursor + 8];
+	msg->data = in->data + in->cursor + ELECTRIC_SERVER_HEADER;
+	msg->len = len - (ELECTRIC_SERVER_HEADER - 4);
+	msg->maxlen = msg->len;
+	msg->cursor = 0;
+	in->cursor += 4 + len;
+	return true;
+}
+
+/* The rest of the payload as a string in the database encoding */
+static char *
+electric_server_getmsgtext(StringInfo msg)
+{
+	int			len = msg->len - msg->cursor;
+	const char *data = pq_getmsgbytes(msg, len);
+
+	(void) pg_verify_mbstr(GetDatabaseEncoding(), data, len, false);
+	return pnstrdup(data, len);
+}
+
+/* ----------------------------------------------------------------
+ * Requests
+ * ----------------------------------------------------------------
+ */
+
+/*
+ * Cache the binary output functions of a query's result columns, unless the
+ * cached ones still match
+ */
+static void
+electric_server_set_columns(ElectricServerClient *client, ElectricServerQuery *query,
+							TupleDesc desc)
+{
+	int			n = desc->natts;
+	Oid		   *coltypes;
+	FmgrInfo   *send;
+	int			i;
+
+	if (query->coltypes != NULL && query->ncols == n)
+	{
+		for (i = 0; i < n; i++)
+			if (query->coltypes[i] != TupleDescAttr(desc, i)->atttypid)
+				break;
+		if (i == n)
+			return;
+	}
+
+	/* Look everything up before replacing anything */
+	coltypes = palloc(Max(n, 1) * sizeof(Oid));
+	send = palloc(Max(n, 1) * sizeof(FmgrInfo));
+	for (i = 0; i < n; i++)
+	{
+		Oid			typsend;
+		bool		typisvarlena;
+
+		coltypes[i] = TupleDescAttr(desc, i)->atttypid;
+		getTypeBinaryOutputInfo(coltypes[i], &typsend, &typisvarlena);
+		fmgr_info_cxt(typsend, &send[i], client->cxt);
+	}
+
+	if (query->coltypes != NULL)
+	{
+		pfree(query->coltypes);
+		pfree(query->send);
+	}
+	query->ncols = n;
+	query->coltypes = MemoryContextAlloc(client->cxt, Max(n, 1) * sizeof(Oid));
+	query->send = MemoryContextAlloc(client->cxt, Max(n, 1) * sizeof(FmgrInfo));
+	memcpy(query->coltypes, coltypes, n * sizeof(Oid));
+	memcpy(query->send, send, n * sizeof(FmgrInfo));
+}
+
+static void
+electric_server_prepare(ElectricServerClient *client, StringInfo msg, uint32 request)
+{
+	uint32		id = pq_getmsgint(msg, 4);
+	int			nparams = pq_getmsgint(msg, 2);
+	Oid		   *paramtypes;
+	char	   *sql;
+	SPIPlanPtr	plan;
+	CachedPlanSource *source;
+	ElectricServerQuery prepared;
+	ElectricServerQuery *query;
+	int			start;
+	int			i;
+
+	paramtypes = palloc(Max(nparams, 1) * sizeof(Oid));
+	for (i = 0; i < nparams; i++)
+		paramtypes[i] = pq_getmsgint(msg, 4);
+	sql = electric_server_getmsgtext(msg);
+
+	if (hash_search(client->queries, &id, HASH_FIND, NULL) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_PSTATEMENT),
+				 errmsg("query %u is already prepared", id)));
+	require_select_query(sql);
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+	plan = SPI_prepare_cursor(sql, nparams, paramtypes, CURSOR_OPT_PARALLEL_OK);
+	PopActiveSnapshot();
+	if (plan == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_prepare failed: %s", SPI_result_code_string(SPI_result))));
+	if (!SPI_is_cursor_plan(plan))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("only SELECT queries are allowed"),
+				 errhint("The query must be a single statement returning rows")));
+	source = (CachedPlanSource *) linitial(SPI_plan_get_plan_sources(plan));
+
+	/* Everything that can fail first; the plan dies with the transaction */
+	memset(&prepared, 0, sizeof(prepared));
+	prepared.id = id;
+	prepared.nparams = nparams;
+	prepared.recv = palloc(Max(nparams, 1) * sizeof(FmgrInfo));
+	prepared.recv_ioparams = palloc(Max(nparams, 1) * sizeof(Oid));
+	for (i = 0; i < nparams; i++)
+	{
+		Oid			typreceive;
+
+		getTypeBinaryInputInfo(paramtypes[i], &typreceive, &prepared.recv_ioparams[i]);
+		fmgr_info_cxt(typreceive, &prepared.recv[i], client->cxt);
+	}
+	electric_server_set_columns(client, &prepared, source->resultDesc);
+
+	prepared.plan = plan;
+	prepared.paramtypes = MemoryContextAlloc(client->cxt, Max(nparams, 1) * sizeof(Oid));
+	memcpy(prepared.paramtypes, paramtypes, nparams * sizeof(Oid));
+	prepared.recv = memcpy(MemoryContextAlloc(client->cxt, Max(nparams, 1) * sizeof(FmgrInfo)),
+						   prepared.recv, nparams * sizeof(FmgrInfo));
+	prepared.recv_ioparams = memcpy(MemoryContextAlloc(client->cxt, Max(nparams, 1) * sizeof(Oid)),
+									prepared.recv_ioparams, nparams * sizeof(Oid));
+	SPI_keepplan(plan);
+
+	query = hash_search(client->queries, &id, HASH_ENTER, NULL);
+	*query = prepared;
+
+	start = electric_server_begin(&client->out, request, 'K');
+	pq_sendint16(&client->out, query->ncols);
+	for (i = 0; i < query->ncols; i++)
+		pq_sendint32(&client->out, query->coltypes[i]);
+	electric_server_end(&client->out, start);
+}
+
+static void
+electric_server_deallocate(ElectricServerClient *client, StringInfo msg, uint32 request)
+{
+	uint32		id = pq_getmsgint(msg, 4);
+	ElectricServerQuery *query;
+
+	pq_getmsgend(msg);
+	query = hash_search(client->queries, &id, HASH_FIND, NULL);
+	if (query == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_PSTATEMENT),
+				 errmsg("query %u is not prepared", id)));
+	SPI_freeplan(query->plan);
+	pfree(query->paramtypes);
+	pfree(query->recv);
+	pfree(query->recv_ioparams);
+	if (query->coltypes != NULL)
+	{
+		pfree(query->coltypes);
+		pfree(query->send);
+	}
+	hash_search(client->queries, &id, HASH_REMOVE, NULL);
+
+	electric_server_end(&client->out, electric_server_begin(&client->out, request, 'K'));
+}
+
+static void
+electric_server_snapshot(ElectricServerClient *client, StringInfo msg, uint32 request)
+{
+	char	   *text = electric_server_getmsgtext(msg);
+	ElectricParsedSnapshot *parsed = electric_parse_snapshot_text(text);
+	ElectricServerSnapshot *entry;
+	uint32		handle;
+	int			start;
+
+	/* Once finished, always finished: no need to wait again per execution */
+	electric_wait_for_snapshot(electric_build_snapshot_from_parts(GetTransactionSnapshot(), parsed));
+
+	do
+		handle = client->next_handle++;
+	while (handle == 0 || hash_search(client->snapshots, &handle, HASH_FIND, NULL) != NULL);
+
+	entry = hash_search(client->snapshots, &handle, HASH_ENTER, NULL);
+	entry->parsed = *parsed;
+	if (parsed->xcnt > 0)
+	{
+		entry->parsed.xip = MemoryContextAlloc(client->cxt, parsed->xcnt * sizeof(TransactionId));
+		memcpy(entry->parsed.xip, parsed->xip, parsed->xcnt * sizeof(TransactionId));
+	}
+
+	start = electric_server_begin(&client->out, request, 'K');
+	pq_sendint32(&client->out, handle);
+	electric_server_end(&client->out, start);
+}
+
+static void
+electric_server_forget(ElectricServerClient *client, StringInfo msg, uint32 request)
+{
+	uint32		handle = pq_getmsgint(msg, 4);
+	ElectricServerSnapshot *entry;
+
+	pq_getmsgend(msg);
+	entry = hash_search(client->snapshots, &handle, HASH_FIND, NULL);
+	if (entry == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("snapshot handle %u does not exist", handle)));
+	if (entry->parsed.xip != NULL)
+		pfree(entry->parsed.xip);
+	hash_search(client->snapshots, &handle, HASH_REMOVE, NULL);
+
+	electric_server_end(&client->out, electric_server_begin(&client->out, request, 'K'));
+}
+
+static void
+electric_server_rows_header(ElectricServerReceiver *r, int ncols)
+{
+	pq_sendint16(r->out, ncols);
+	r->nrows_at = r->out->len;
+	pq_sendint32(r->out, 0);
+}
+
+static void
+electric_server_rows_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	ElectricServerReceiver *r = (ElectricServerReceiver *) self;
+
+	(void) operation;
+
+	/*
+	 * SPI has revalidated the plan by now, so typeinfo has the columns this
+	 * execution really returns, even if DDL changed them since the last one.
+	 */
+	electric_server_set_columns(r->client, r->query, typeinfo);
+	electric_server_rows_header(r, r->query->ncols);
+}
+
+static bool
+electric_server_rows_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	ElectricServerReceiver *r = (ElectricServerReceiver *) self;
+	ElectricServerQuery *query = r->query;
+	MemoryContext oldcxt;
+	int			i;
+
+	slot_getallattrs(slot);
+	oldcxt = MemoryContextSwitchTo(r->row_cxt);
+	for (i = 0; i < query->ncols; i++)
+	{
+		bytea	   *value;
+
+		if (slot->tts_isnull[i])
+		{
+			pq_sendint32(r->out, -1);
+			continue;
+		}
+		value = SendFunctionCall(&query->send[i], slot->tts_values[i]);
+		pq_sendint32(r->out, VARSIZE(value) - VARHDRSZ);
+		pq_sendbytes(r->out, VARDATA(value), VARSIZE(value) - VARHDRSZ);
+	}
+	r->nrows++;
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(r->row_cxt);
+	return true;
+}
+
+static void
+electric_server_rows_shutdown(DestReceiver *self)
+{
+	(void) self;
+}
+
+static void
+electric_server_rows_destroy(DestReceiver *self)
+{
+	(void) self;
+}
+
+static void
+electric_server_execute(ElectricServerClient *client, StringInfo msg, uint32 request)
+{
+	uint32		handle = pq_getmsgint(msg, 4);
+	uint32		id = pq_getmsgint(msg, 4);
+	int			nargs = pq_getmsgint(msg, 2);
+	ElectricServerSnapshot *entry;
+	ElectricServerQuery *query;
+	ParamListInfo params = NULL;
+	ElectricServerReceiver r;
+	SPIExecuteOptions exec_opts;
+	Snapshot	snap;
+	ElectricCallStats cs;
+	instr_time	start_time;
+	instr_time	end_time;
+	uint32		nrows;
+	int			start;
+	int			ret;
+	int			i;
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+	entry = hash_search(client->snapshots, &handle, HASH_FIND, NULL);
+	if (entry == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("snapshot handle %u does not exist", handle)));
+	query = hash_search(client->queries, &id, HASH_FIND, NULL);
+	if (query == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_PSTATEMENT),
+				 errmsg("query %u is not prepared", id)));
+	if (nargs != query->nparams)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROTOCOL_VIOLATION),
+				 errmsg("query %u takes %d arguments, got %d", id, query->nparams, nargs)));
+
+	if (nargs > 0)
+	{
+		StringInfoData value;
+
+		initStringInfo(&value);
+		params = makeParamList(nargs);
+		for (i = 0; i < nargs; i++)
+		{
+			ParamExternData *prm = &params->params[i];
+			int			len = (int) pq_getmsgint(msg, 4);
+
+			prm->ptype = query->paramtypes[i];
+			prm->pflags = PARAM_FLAG_CONST;
+			prm->isnull = (len == -1);
+			if (prm->isnull)
+			{
+				prm->value = ReceiveFunctionCall(&query->recv[i], NULL,
+												 query->recv_ioparams[i], -1);
+				continue;
+			}
+			if (len < 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROTOCOL_VIOLATION),
+						 errmsg("invalid length %d of argument %d", len, i + 1)));
+
+			resetStringInfo(&value);
+			appendBinaryStringInfo(&value, pq_getmsgbytes(msg, len), len);
+			prm->value = ReceiveFunctionCall(&query->recv[i], &value,
+											 query->recv_ioparams[i], -1);
+			if (value.cursor != value.len)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("incorrect binary data format in argument %d", i + 1)));
+		}
+	}
+	pq_getmsgend(msg);
+
+	memset(&r, 0, sizeof(r));
+	r.pub.receiveSlot = electric_server_rows_receive;
+	r.pub.rStartup = electric_server_rows_startup;
+	r.pub.rShutdown = electric_server_rows_shutdown;
+	r.pub.rDestroy = electric_server_rows_destroy;
+	/* Any tuple-accepting destination other than DestNone/DestSPI gets SPI_OK_SELECT */
+	r.pub.mydest = DestTuplestore;
+	r.client = client;
+	r.query = query;
+	r.out = &client->out;
+	r.nrows_at = -1;
+	r.row_cxt = AllocSetContextCreate(CurrentMemoryContext, "electric_server row",
+									  ALLOCSET_SMALL_SIZES);
+
+	snap = electric_build_snapshot_from_parts(GetTransactionSnapshot(), &entry->parsed);
+	start = electric_server_begin(&client->out, request, 'R');
+
+	PushActiveSnapshot(snap);
+	electric_activity_report(ELECTRIC_ACTIVITY_SERVER, snap);
+	electric_prune_check_snapshot(snap);
+
+	memset(&exec_opts, 0, sizeof(exec_opts));
+	exec_opts.params = params;
+	exec_opts.read_only = true;
+	exec_opts.dest = (DestReceiver *) &r;
+	ret = SPI_execute_plan_extended(query->plan, &exec_opts);
+
+	electric_activity_report(ELECTRIC_ACTIVITY_NONE, NULL);
+	PopActiveSnapshot();
+
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+	if (r.nrows_at < 0)
+		electric_server_rows_header(&r, query->ncols);
+	nrows = pg_hton32(r.nrows);
+	memcpy(client->out.data + r.nrows_at, &nrows, 4);
+	electric_server_end(&client->out, start);
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	memset(&cs, 0, sizeof(cs));
+	cs.total = end_time;
+	INSTR_TIME_SUBTRACT(cs.total, start_time);
+	cs.rows = r.nrows;
+	cs.result_bytes = client->out.len - start;
+	cs.xcnt = entry->parsed.xcnt;
+	electric_stats_record(ELECTRIC_ENTRY_SERVER, &cs);
+}
+
+/*
+ * Answer one request inside the batch's transaction. Returns false if it
+ * failed, in which case the transaction has been aborted and the client got
+ * an 'E' frame.
+ */
+static bool
+electric_server_request(ElectricServerClient *client, StringInfo msg, uint32 request,
+						char type)
+{
+	int			out_start = client->out.len;
+	volatile bool ok = true;
+
+	MemoryContextSwitchTo(request_cxt);
+	PG_TRY();
+	{
+		switch (type)
+		{
+			case 'X':
+				electric_server_execute(client, msg, request);
+				break;
+			case 'S':
+				electric_server_snapshot(client, msg, request);
+				break;
+			case 'F':
+				electric_server_forget(client, msg, request);
+				break;
+			case 'P':
+				electric_server_prepare(client, msg, request);
+				break;
+			case 'D':
+				electric_server_deallocate(client, msg, request);
+				break;
+			default:
+				ereport(ERROR,
+						(errcode(ERRCODE_PROTOCOL_VIOLATION),
+						 errmsg("invalid electric_server request type %d", type)));
+		}
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+		int			start;
+
+		MemoryContextSwitchTo(request_cxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		/* Replace whatever part of the response was written */
+		client->out.len = out_start;
+		client->out.data[out_start] = '\0';
+		start = electric_server_begin(&client->out, request, 'E');
+		pq_sendbytes(&client->out, unpack_sql_state(edata->sqlerrcode), 5);
+		pq_sendbytes(&client->out, edata->message, strlen(edata->message));
+		electric_server_end(&client->out, start);
+		ok = false;
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(TopMemoryContext);
+	MemoryContextReset(request_cxt);
+	return ok;
+}
+
+/*
+ * Answer every complete request received so far, in one transaction (a new
+ * one after a request fails)
+ */
+static void
+electric_server_batch(void)
+{
+	bool		in_xact = false;
+	int			i;
+
+	for (i = 0; i < nclients; i++)
+	{
+		ElectricServerClient *client = clients[i];
+		StringInfoData msg;
+		uint32		request;
+		char		type;
+		bool		bad = false;
+
+		while (!client->closing &&
+			   client->out.len - client->out.cursor < ELECTRIC_SERVER_MAX_PENDING &&
+			   electric_server_next(client, &msg, &request, &type, &bad))
+		{
+			if (!in_xact)
+			{
+				SetCurrentStatementStartTimestamp();
+				StartTransactionCommand();
+				/* One base snapshot for the batch, rather than one per request */
+				XactIsoLevel = XACT_REPEATABLE_READ;
+				if (SPI_connect() != SPI_OK_CONNECT)
+					ereport(ERROR,
+							(errcode(ERRCODE_INTERNAL_ERROR),
+							 errmsg("SPI_connect failed")));
+				pgstat_report_activity(STATE_RUNNING, "electric_server");
+				in_xact = true;
+			}
+			in_xact = electric_server_request(client, &msg, request, type);
+		}
+		if (bad)
+		{
+			ereport(LOG,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("electric_server closing a connection that sent an invalid frame length")));
+			client->closing = true;
+		}
+	}
+
+	if (in_xact)
+	{
+		SPI_finish();
+		CommitTransactionCommand();
+	}
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/* ----------------------------------------------------------------
+ * Main loop
+ * ----------------------------------------------------------------
+ */
+
+static void
+electric_server_build_wait_set(void)
+{
+	int			i;
+
+	wait_set = CreateWaitEventSet(TopMemoryContext, 3 + nclients);
+	AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(wait_set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	AddWaitEventToSet(wait_set, WL_SOCKET_READABLE, listen_sock, NULL, NULL);
+	for (i = 0; i < nclients; i++)
+	{
+		clients[i]->events = electric_server_events(clients[i]);
+		clients[i]->event_pos = AddWaitEventToSet(wait_set, clients[i]->events,
+												  clients[i]->sock, NULL, clients[i]);
+	}
+}
+
+void
+electric_server_main(Datum main_arg)
+{
+	WaitEvent	events[ELECTRIC_SERVER_MAX_CLIENTS + 3];
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(electric_server_database, electric_server_user, 0);
+	pgstat_report_appname("electric_server");
+
+	StartTransactionCommand();
+	if (superuser())
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("electric.server_user \"%s\" is a superuser, not starting the as-of query server",
+						electric_server_user),
+				 errhint("Set electric.server_user to a role without superuser privileges.")));
+		/* Exit code 0: the postmaster doesn't restart us */
+		proc_exit(0);
+	}
+	CommitTransactionCommand();
+
+	request_cxt = AllocSetContextCreate(TopMemoryContext, "electric_server request",
+										ALLOCSET_DEFAULT_SIZES);
+	electric_server_listen(DatumGetInt32(main_arg));
+
+	for (;;)
+	{
+		int			nevents;
+		int			i;
+		int			kept;
+
+		if (wait_set == NULL)
+			electric_server_build_wait_set();
+
+		nevents = WaitEventSetWait(wait_set, -1, events, lengthof(events), WAIT_EVENT_EXTENSION);
+		for (i = 0; i < nevents; i++)
+		{
+			ElectricServerClient *client = (ElectricServerClient *) events[i].user_data;
+
+			if (events[i].events & WL_LATCH_SET)
+			{
+				ResetLatch(MyLatch);
+				CHECK_FOR_INTERRUPTS();
+			}
+			else if (client == NULL)
+			{
+				if (events[i].events & WL_SOCKET_READABLE)
+					electric_server_accept();
+			}
+			else
+			{
+				if ((events[i].events & WL_SOCKET_READABLE) && !electric_server_read(client))
+					client->closing = true;
+				if ((events[i].events & WL_SOCKET_WRITEABLE) && !electric_server_flush(client))
+					client->closing = true;
+			}
+		}
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		electric_server_batch();
+
+		/* Send the answers, drop closed connections, update the events */
+		kept = 0;
+		for (i = 0; i < nclients; i++)
+		{
+			ElectricServerClient *client = clients[i];
+
+			if (!client->closing && !electric_server_flush(client))
+				client->closing = true;
+			if (client->closing)
+			{
+				electric_server_close(client);
+				if (wait_set != NULL)
+				{
+					FreeWaitEventSet(wait_set);
+					wait_set = NULL;
+				}
+				continue;
+			}
+			clients[kept++] = client;
+			if (wait_set != NULL && client->events != electric_server_events(client))
+			{
+				client->events = electric_server_events(client);
+				ModifyWaitEvent(wait_set, client->event_pos, client->events, NULL);
+			}
+		}
+		nclients = kept;
+	}
+}
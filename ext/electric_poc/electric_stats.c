@@ -0,0 +1,553 @@
+/*
+ * electric_stats.c - shared-memory statistics for electric_poc (pg_stat_electric)
+ *
+ * Counters live in a fixed shared-memory struct and are updated with plain
+ * atomics, so recording a call never takes a lock. That keeps the overhead
+ * low enough to leave stats on under full load (electric.track_stats).
+ *
+ * Requires electric_poc in shared_preload_libraries; when the library is
+ * only loaded on demand, recording is a no-op and the SQL functions error.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_stats);
+PG_FUNCTION_INFO_V1(electric_stats_reset);
+PG_FUNCTION_INFO_V1(electric_stats_phases);
+PG_FUNCTION_INFO_V1(electric_stats_prometheus);
+
+/*
+ * xcnt distribution buckets: 0, 1-9, 10-99, 100-999, 1000-9999, 10000+
+ */
+#define ELECTRIC_XCNT_BUCKETS 6
+
+typedef struct ElectricEntryCounters
+{
+	pg_atomic_uint64 calls;
+	pg_atomic_uint64 total_ns;
+	pg_atomic_uint64 min_ns;
+	pg_atomic_uint64 max_ns;
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 result_bytes;
+	pg_atomic_uint64 parse_ns;
+	pg_atomic_uint64 xcnt_hist[ELECTRIC_XCNT_BUCKETS];
+	pg_atomic_uint64 heap_pages;
+	pg_atomic_uint64 tuples_examined;
+	pg_atomic_uint64 tuples_visible;
+	pg_atomic_uint64 hot_hops;
+} ElectricEntryCounters;
+
+/*
+ * Latency histogram with log2 buckets in microseconds: bucket 0 holds
+ * [0, 1us), bucket b holds [2^(b-1), 2^b) us, the last bucket is open-ended.
+ */
+#define ELECTRIC_HIST_BUCKETS 32
+
+typedef struct ElectricHistogram
+{
+	pg_atomic_uint64 counts[ELECTRIC_HIST_BUCKETS];
+	pg_atomic_uint64 sum_ns;
+	pg_atomic_uint64 max_ns;
+} ElectricHistogram;
+
+/* One histogram per electric_exec_as_of phase, plus the whole call */
+#define ELECTRIC_PHASE_TOTAL ELECTRIC_NUM_PHASES
+
+/*
+ * electric_exec_as_of() latency is also kept per snapshot age band, where
+ * age = xids assigned since the snapshot's xmax. Bands grow by 16x:
+ * 0, 1-15, 16-255, ..., 16777216+.
+ */
+#define ELECTRIC_AGE_BANDS 8
+
+typedef struct ElectricSharedStats
+{
+	ElectricEntryCounters entries[ELECTRIC_NUM_ENTRY_POINTS];
+	ElectricHistogram phases[ELECTRIC_NUM_PHASES + 1];
+	ElectricHistogram age[ELECTRIC_AGE_BANDS];
+	pg_atomic_uint64 stats_reset;	/* TimestampTz */
+} ElectricSharedStats;
+
+static ElectricSharedStats *electric_stats_shared = NULL;
+
+static const char *const electric_entry_names[ELECTRIC_NUM_ENTRY_POINTS] = {
+	"electric_exec_as_of",
+	"electric_snapshot_assign_hook",
+	"electric_ExecutorStart",
+	"electric_server",
+	"electric_exec_as_of_precomputed",
+	"electric_exec_as_of_coalesced",
+};
+
+const char *const electric_phase_names[ELECTRIC_NUM_PHASES] = {
+	"parse",
+	"plan",
+	"execute",
+	"serialize",
+};
+
+static int
+electric_xcnt_bucket(uint32 xcnt)
+{
+	int			bucket = 0;
+
+	while (xcnt > 0 && bucket < ELECTRIC_XCNT_BUCKETS - 1)
+	{
+		bucket++;
+		xcnt /= 10;
+	}
+	return bucket;
+}
+
+static int
+electric_age_band(uint32 age)
+{
+	if (age == 0)
+		return 0;
+	return Min(1 + pg_leftmost_one_pos32(age) / 4, ELECTRIC_AGE_BANDS - 1);
+}
+
+/* Label for an age band, e.g. "16-255" */
+static void
+electric_age_band_label(int band, char *buf, size_t len)
+{
+	uint64		lo = (band == 0) ? 0 : (UINT64CONST(1) << (4 * (band - 1)));
+	uint64		hi = (UINT64CONST(1) << (4 * band)) - 1;
+
+	if (band == 0)
+		snprintf(buf, len, "0");
+	else if (band == ELECTRIC_AGE_BANDS - 1)
+		snprintf(buf, len, UINT64_FORMAT "+", lo);
+	else
+		snprintf(buf, len, UINT64_FORMAT "-" UINT64_FORMAT, lo, hi);
+}
+
+static inline void
+electric_atomic_min(pg_atomic_uint64 *ptr, uint64 val)
+{
+	uint64		cur = pg_atomic_read_u64(ptr);
+
+	while (val < cur && !pg_atomic_compare_exchange_u64(ptr, &cur, val))
+		;
+}
+
+static inline void
+electric_atomic_max(pg_atomic_uint64 *ptr, uint64 val)
+{
+	uint64		cur = pg_atomic_read_u64(ptr);
+
+	while (val > cur && !pg_atomic_compare_exchange_u64(ptr, &cur, val))
+		;
+}
+
+static int
+electric_hist_bucket(uint64 ns)
+{
+	uint64		us = ns / 1000;
+	int			bucket;
+
+	if (us == 0)
+		return 0;
+	bucket = pg_leftmost_one_pos64(us) + 1;
+	return Min(bucket, ELECTRIC_HIST_BUCKETS - 1);
+}
+
+static void
+electric_hist_init(ElectricHistogram *h)
+{
+	int			i;
+
+	for (i = 0; i < ELECTRIC_HIST_BUCKETS; i++)
+		pg_atomic_init_u64(&h->counts[i], 0);
+	pg_atomic_init_u64(&h->sum_ns, 0);
+	pg_atomic_init_u64(&h->max_ns, 0);
+}
+
+static void
+electric_hist_reset(ElectricHistogram *h)
+{
+	int			i;
+
+	for (i = 0; i < ELECTRIC_HIST_BUCKETS; i++)
+		pg_atomic_write_u64(&h->counts[i], 0);
+	pg_atomic_write_u64(&h->sum_ns, 0);
+	pg_atomic_write_u64(&h->max_ns, 0);
+}
+
+static void
+electric_hist_add(ElectricHistogram *h, uint64 ns)
+{
+	pg_atomic_fetch_add_u64(&h->counts[electric_hist_bucket(ns)], 1);
+	pg_atomic_fetch_add_u64(&h->sum_ns, ns);
+	electric_atomic_max(&h->max_ns, ns);
+}
+
+/*
+ * Estimate the q-quantile (0..1) in milliseconds from a snapshot of bucket
+ * counts, interpolating linearly inside the bucket that crosses the rank.
+ */
+static double
+electric_hist_quantile(const uint64 *counts, uint64 total, double q)
+{
+	double		rank = q * (double) total;
+	uint64		seen = 0;
+	int			b;
+
+	if (total == 0)
+		return 0.0;
+
+	for (b = 0; b < ELECTRIC_HIST_BUCKETS; b++)
+	{
+		double		lo_us = (b == 0) ? 0.0 : (double) (UINT64CONST(1) << (b - 1));
+		double		hi_us = (double) (UINT64CONST(1) << b);
+
+		if (counts[b] == 0)
+			continue;
+		if ((double) (seen + counts[b]) >= rank)
+		{
+			double		frac = (rank - (double) seen) / (double) counts[b];
+
+			return (lo_us + frac * (hi_us - lo_us)) / 1000.0;
+		}
+		seen += counts[b];
+	}
+	return (double) (UINT64CONST(1) << (ELECTRIC_HIST_BUCKETS - 1)) / 1000.0;
+}
+
+static void
+electric_entry_counters_reset(ElectricEntryCounters *c)
+{
+	int			i;
+
+	pg_atomic_write_u64(&c->calls, 0);
+	pg_atomic_write_u64(&c->total_ns, 0);
+	pg_atomic_write_u64(&c->min_ns, PG_UINT64_MAX);
+	pg_atomic_write_u64(&c->max_ns, 0);
+	pg_atomic_write_u64(&c->rows, 0);
+	pg_atomic_write_u64(&c->result_bytes, 0);
+	pg_atomic_write_u64(&c->parse_ns, 0);
+	for (i = 0; i < ELECTRIC_XCNT_BUCKETS; i++)
+		pg_atomic_write_u64(&c->xcnt_hist[i], 0);
+	pg_atomic_write_u64(&c->heap_pages, 0);
+	pg_atomic_write_u64(&c->tuples_examined, 0);
+	pg_atomic_write_u64(&c->tuples_visible, 0);
+	pg_atomic_write_u64(&c->hot_hops, 0);
+}
+
+Size
+electric_stats_shmem_size(void)
+{
+	return MAXALIGN(sizeof(ElectricSharedStats));
+}
+
+/*
+ * Called from the shmem startup hook with AddinShmemInitLock held.
+ */
+void
+electric_stats_shmem_init(void)
+{
+	bool		found;
+	int			i;
+	int			j;
+
+	electric_stats_shared = ShmemInitStruct("electric_poc stats",
+											electric_stats_shmem_size(),
+											&found);
+	if (found)
+		return;
+
+	for (i = 0; i < ELECTRIC_NUM_ENTRY_POINTS; i++)
+	{
+		ElectricEntryCounters *c = &electric_stats_shared->entries[i];
+
+		pg_atomic_init_u64(&c->calls, 0);
+		pg_atomic_init_u64(&c->total_ns, 0);
+		pg_atomic_init_u64(&c->min_ns, PG_UINT64_MAX);
+		pg_atomic_init_u64(&c->max_ns, 0);
+		pg_atomic_init_u64(&c->rows, 0);
+		pg_atomic_init_u64(&c->result_bytes, 0);
+		pg_atomic_init_u64(&c->parse_ns, 0);
+		for (j = 0; j < ELECTRIC_XCNT_BUCKETS; j++)
+			pg_atomic_init_u64(&c->xcnt_hist[j], 0);
+		pg_atomic_init_u64(&c->heap_pages, 0);
+		pg_atomic_init_u64(&c->tuples_examined, 0);
+		pg_atomic_init_u64(&c->tuples_visible, 0);
+		pg_atomic_init_u64(&c->hot_hops, 0);
+	}
+	for (i = 0; i <= ELECTRIC_NUM_PHASES; i++)
+		electric_hist_init(&electric_stats_shared->phases[i]);
+	for (i = 0; i < ELECTRIC_AGE_BANDS; i++)
+		electric_hist_init(&electric_stats_shared->age[i]);
+	pg_atomic_init_u64(&electric_stats_shared->stats_reset,
+					   (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Account one completed call. Lock-free; safe to call from any backend.
+ */
+void
+electric_stats_record(ElectricEntryPoint entry, const ElectricCallStats *cs)
+{
+	ElectricEntryCounters *c;
+	uint64		total_ns;
+
+	if (electric_stats_shared == NULL || !electric_track_stats)
+		return;
+
+	Assert(entry >= 0 && entry < ELECTRIC_NUM_ENTRY_POINTS);
+	c = &electric_stats_shared->entries[entry];
+	total_ns = (uint64) INSTR_TIME_GET_NANOSEC(cs->total);
+
+	pg_atomic_fetch_add_u64(&c->calls, 1);
+	pg_atomic_fetch_add_u64(&c->total_ns, total_ns);
+	electric_atomic_min(&c->min_ns, total_ns);
+	electric_atomic_max(&c->max_ns, total_ns);
+	if (cs->rows > 0)
+		pg_atomic_fetch_add_u64(&c->rows, cs->rows);
+	if (cs->result_bytes > 0)
+		pg_atomic_fetch_add_u64(&c->result_bytes, cs->result_bytes);
+	if (!INSTR_TIME_IS_ZERO(cs->phases[ELECTRIC_PHASE_PARSE]))
+		pg_atomic_fetch_add_u64(&c->parse_ns,
+								(uint64) INSTR_TIME_GET_NANOSEC(cs->phases[ELECTRIC_PHASE_PARSE]));
+	pg_atomic_fetch_add_u64(&c->xcnt_hist[electric_xcnt_bucket(cs->xcnt)], 1);
+	if (cs->scan.heap_pages > 0 || cs->scan.tuples_examined > 0)
+	{
+		pg_atomic_fetch_add_u64(&c->heap_pages, cs->scan.heap_pages);
+		pg_atomic_fetch_add_u64(&c->tuples_examined, cs->scan.tuples_examined);
+		pg_atomic_fetch_add_u64(&c->tuples_visible, cs->scan.tuples_visible);
+		pg_atomic_fetch_add_u64(&c->hot_hops, cs->scan.hot_hops);
+	}
+
+	/* Phase breakdown only exists for electric_exec_as_of() */
+	if (entry == ELECTRIC_ENTRY_EXEC_AS_OF)
+	{
+		int			p;
+
+		for (p = 0; p < ELECTRIC_NUM_PHASES; p++)
+			electric_hist_add(&electric_stats_shared->phases[p],
+							  (uint64) INSTR_TIME_GET_NANOSEC(cs->phases[p]));
+		electric_hist_add(&electric_stats_shared->phases[ELECTRIC_PHASE_TOTAL], total_ns);
+		electric_hist_add(&electric_stats_shared->age[electric_age_band(cs->snapshot_age)],
+						  total_ns);
+	}
+}
+
+static void
+electric_stats_require_shmem(void)
+{
+	if (electric_stats_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("electric_poc must be loaded via shared_preload_libraries")));
+}
+
+#define NS_TO_MS(ns) ((double) (ns) / 1000000.0)
+
+/*
+ * SQL: pg_stat_electric() -> one row per entry point
+ */
+Datum
+electric_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TimestampTz stats_reset;
+	int			i;
+
+	electric_stats_require_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	stats_reset = (TimestampTz) pg_atomic_read_u64(&electric_stats_shared->stats_reset);
+
+	for (i = 0; i < ELECTRIC_NUM_ENTRY_POINTS; i++)
+	{
+		ElectricEntryCounters *c = &electric_stats_shared->entries[i];
+		Datum		values[13 + ELECTRIC_XCNT_BUCKETS];
+		bool		nulls[13 + ELECTRIC_XCNT_BUCKETS];
+		uint64		calls = pg_atomic_read_u64(&c->calls);
+		uint64		min_ns = pg_atomic_read_u64(&c->min_ns);
+		int			col = 0;
+		int			j;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[col++] = CStringGetTextDatum(electric_entry_names[i]);
+		values[col++] = Int64GetDatum((int64) calls);
+		values[col++] = Float8GetDatum(NS_TO_MS(pg_atomic_read_u64(&c->total_ns)));
+		if (calls > 0 && min_ns != PG_UINT64_MAX)
+			values[col++] = Float8GetDatum(NS_TO_MS(min_ns));
+		else
+			nulls[col++] = true;
+		if (calls > 0)
+			values[col++] = Float8GetDatum(NS_TO_MS(pg_atomic_read_u64(&c->max_ns)));
+		else
+			nulls[col++] = true;
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->rows));
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->result_bytes));
+		values[col++] = Float8GetDatum(NS_TO_MS(pg_atomic_read_u64(&c->parse_ns)));
+		for (j = 0; j < ELECTRIC_XCNT_BUCKETS; j++)
+			values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->xcnt_hist[j]));
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->heap_pages));
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->tuples_examined));
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->tuples_visible));
+		values[col++] = Int64GetDatum((int64) pg_atomic_read_u64(&c->hot_hops));
+		values[col++] = TimestampTzGetDatum(stats_reset);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL: pg_stat_electric_reset()
+ */
+Datum
+electric_stats_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	electric_stats_require_shmem();
+
+	for (i = 0; i < ELECTRIC_NUM_ENTRY_POINTS; i++)
+		electric_entry_counters_reset(&electric_stats_shared->entries[i]);
+	for (i = 0; i <= ELECTRIC_NUM_PHASES; i++)
+		electric_hist_reset(&electric_stats_shared->phases[i]);
+	for (i = 0; i < ELECTRIC_AGE_BANDS; i++)
+		electric_hist_reset(&electric_stats_shared->age[i]);
+	electric_scan_stats_reset();
+	electric_admission_stats_reset();
+	electric_coalesce_stats_reset();
+	electric_precompute_stats_reset();
+	pg_atomic_write_u64(&electric_stats_shared->stats_reset,
+						(uint64) GetCurrentTimestamp());
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL: pg_stat_electric_phases() -> per-phase latency percentiles for
+ * electric_exec_as_of(), plus a 'total' row for the whole call
+ */
+Datum
+electric_stats_phases(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int			p;
+
+	electric_stats_require_shmem();
+
+	InitMaterializedSRF(fcinfo, 0);
+
+	for (p = 0; p <= ELECTRIC_NUM_PHASES; p++)
+	{
+		ElectricHistogram *h = &electric_stats_shared->phases[p];
+		uint64		counts[ELECTRIC_HIST_BUCKETS];
+		uint64		calls = 0;
+		uint64		sum_ns;
+		Datum		values[8];
+		bool		nulls[8];
+		int			b;
+
+		for (b = 0; b < ELECTRIC_HIST_BUCKETS; b++)
+		{
+			counts[b] = pg_atomic_read_u64(&h->counts[b]);
+			calls += counts[b];
+		}
+		sum_ns = pg_atomic_read_u64(&h->sum_ns);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(p == ELECTRIC_PHASE_TOTAL ? "total" : electric_phase_names[p]);
+		values[1] = Int64GetDatum((int64) calls);
+		values[2] = Float8GetDatum(NS_TO_MS(sum_ns));
+		if (calls > 0)
+		{
+			values[3] = Float8GetDatum(NS_TO_MS(sum_ns) / (double) calls);
+			values[4] = Float8GetDatum(electric_hist_quantile(counts, calls, 0.50));
+			values[5] = Float8GetDatum(electric_hist_quantile(counts, calls, 0.90));
+			values[6] = Float8GetDatum(electric_hist_quantile(counts, calls, 0.99));
+			values[7] = Float8GetDatum(NS_TO_MS(pg_atomic_read_u64(&h->max_ns)));
+		}
+		else
+		{
+			for (b = 3; b < 8; b++)
+				nulls[b] = true;
+		}
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL: pg_stat_electric_prometheus() -> Prometheus text exposition format
+ *
+ * Emits electric_exec_as_of() latency as one histogram per snapshot age
+ * band, plus per-entry-point call counters. Buckets are cumulative, as
+ * Prometheus expects; upper bounds are in seconds.
+ */
+Datum
+electric_stats_prometheus(PG_FUNCTION_ARGS)
+{
+	StringInfoData buf;
+	int			band;
+	int			i;
+
+	electric_stats_require_shmem();
+
+	initStringInfo(&buf);
+
+	appendStringInfoString(&buf,
+						   "# HELP electric_exec_as_of_duration_seconds electric_exec_as_of() latency by snapshot age (xids since snapshot xmax)\n"
+						   "# TYPE electric_exec_as_of_duration_seconds histogram\n");
+	for (band = 0; band < ELECTRIC_AGE_BANDS; band++)
+	{
+		ElectricHistogram *h = &electric_stats_shared->age[band];
+		char		label[64];
+		uint64		cumulative = 0;
+		int			b;
+
+		electric_age_band_label(band, label, sizeof(label));
+
+		/* The last bucket is open-ended, so it only shows up in +Inf */
+		for (b = 0; b < ELECTRIC_HIST_BUCKETS - 1; b++)
+		{
+			cumulative += pg_atomic_read_u64(&h->counts[b]);
+			appendStringInfo(&buf,
+							 "electric_exec_as_of_duration_seconds_bucket{snapshot_age=\"%s\",le=\"%g\"} " UINT64_FORMAT "\n",
+							 label, (double) (UINT64CONST(1) << b) / 1000000.0, cumulative);
+		}
+		cumulative += pg_atomic_read_u64(&h->counts[ELECTRIC_HIST_BUCKETS - 1]);
+		appendStringInfo(&buf,
+						 "electric_exec_as_of_duration_seconds_bucket{snapshot_age=\"%s\",le=\"+Inf\"} " UINT64_FORMAT "\n",
+						 label, cumulative);
+		appendStringInfo(&buf,
+						 "electric_exec_as_of_duration_seconds_sum{snapshot_age=\"%s\"} %.9f\n",
+						 label, (double) pg_atomic_read_u64(&h->sum_ns) / 1000000000.0);
+		appendStringInfo(&buf,
+						 "electric_exec_as_of_duration_seconds_count{snapshot_age=\"%s\"} " UINT64_FORMAT "\n",
+						 label, cumulative);
+	}
+
+	appendStringInfoString(&buf,
+						   "# HELP electric_calls_total Completed calls per electric_poc entry point\n"
+						   "# TYPE electric_calls_total counter\n");
+	for (i = 0; i < ELECTRIC_NUM_ENTRY_POINTS; i++)
+		appendStringInfo(&buf, "electric_calls_total{entry_point=\"%s\"} " UINT64_FORMAT "\n",
+						 electric_entry_names[i],
+						 pg_atomic_read_u64(&electric_stats_shared->entries[i].calls));
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
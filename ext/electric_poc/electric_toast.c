@@ -0,0 +1,437 @@
+/*
+ * electric_toast.c - detoasted values kept across historical queries
+ *
+ * Permission checks read the same large jsonb and text values at one
+ * snapshot after another, and every read fetches their TOAST chunks and
+ * decompresses them again although the values haven't changed. A TOAST value
+ * is never modified once written, so with electric.toast_cache_size set each
+ * backend keeps the detoasted form of the values its historical queries read,
+ * keyed by toast relation and value id (plus raw and stored size, to be safe
+ * against value id reuse).
+ *
+ * Scan nodes of queries under a synthetic snapshot that output or filter on
+ * varlena columns get a wrapper. It takes the node's qual and projection
+ * over, so it sees each scanned row before they run: toasted values of those
+ * columns are replaced by a copy of the cached value in the node's per-tuple
+ * memory (valid until its next row, like anything else a scan hands out), or
+ * detoasted there and added to the cache. Least recently used values are
+ * evicted past the size limit. Values that are inline, compressed or not,
+ * are left alone.
+ *
+ * A relcache invalidation of a toast relation (TRUNCATE, DROP, rewrites)
+ * drops its values, since its value ids may then be reused.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/detoast.h"
+#include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "executor/executor.h"
+#include "lib/ilist.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/optimizer.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "varatt.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_toast_cache_stats);
+
+/* electric.toast_cache_size, in kB; 0 disables the cache */
+int			electric_toast_cache_size = 0;
+
+typedef struct ElectricToastKey
+{
+	Oid			toastrelid;
+	Oid			valueid;
+	int32		rawsize;
+	uint32		extinfo;		/* stored size and compression method */
+} ElectricToastKey;
+
+typedef struct ElectricToastEntry
+{
+	ElectricToastKey key;
+	struct varlena *value;		/* detoasted, in electric_toast_cxt */
+	Size		size;			/* charged against the limit */
+	dlist_node	lru;			/* most recently used first */
+} ElectricToastEntry;
+
+static MemoryContext electric_toast_cxt = NULL;
+static HTAB *electric_toast_hash = NULL;
+static dlist_head electric_toast_lru = DLIST_STATIC_INIT(electric_toast_lru);
+static Size electric_toast_bytes = 0;
+static uint64 electric_toast_hits = 0;
+static uint64 electric_toast_misses = 0;
+static uint64 electric_toast_evictions = 0;
+
+/* One wrapped scan node */
+typedef struct ElectricToastNode
+{
+	PlanState  *node;
+	ExecProcNodeMtd orig;
+	ExprState  *qual;			/* taken over from the node */
+	ProjectionInfo *projinfo;	/* likewise */
+	Bitmapset  *attrs;			/* varlena attnums the plan reads */
+	AttrNumber	maxattr;
+} ElectricToastNode;
+
+/* All wrapped nodes of one query */
+typedef struct ElectricToastQuery
+{
+	List	   *nodes;			/* ElectricToastNode * */
+	MemoryContextCallback cleanup;
+	struct ElectricToastQuery *next;
+} ElectricToastQuery;
+
+static ElectricToastQuery *electric_toast_queries = NULL;
+static ElectricToastNode *electric_toast_last = NULL;
+
+static Size
+electric_toast_limit(void)
+{
+	return (Size) electric_toast_cache_size * 1024;
+}
+
+static void
+electric_toast_evict(ElectricToastEntry *entry)
+{
+	dlist_delete(&entry->lru);
+	electric_toast_bytes -= entry->size;
+	pfree(entry->value);
+	hash_search(electric_toast_hash, &entry->key, HASH_REMOVE, NULL);
+}
+
+/* Drop the values of one toast relation, or all of them */
+static void
+electric_toast_relcache_callback(Datum arg, Oid relid)
+{
+	dlist_mutable_iter iter;
+
+	if (electric_toast_hash == NULL)
+		return;
+
+	dlist_foreach_modify(iter, &electric_toast_lru)
+	{
+		ElectricToastEntry *entry = dlist_container(ElectricToastEntry, lru, iter.cur);
+
+		if (!OidIsValid(relid) || entry->key.toastrelid == relid)
+			electric_toast_evict(entry);
+	}
+}
+
+static void
+electric_toast_init(void)
+{
+	HASHCTL		ctl;
+
+	electric_toast_cxt = AllocSetContextCreate(TopMemoryContext,
+											   "electric_poc toast cache",
+											   ALLOCSET_DEFAULT_SIZES);
+	ctl.keysize = sizeof(ElectricToastKey);
+	ctl.entrysize = sizeof(ElectricToastEntry);
+	ctl.hcxt = electric_toast_cxt;
+	electric_toast_hash = hash_create("electric_poc toast cache", 256, &ctl,
+									  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	CacheRegisterRelcacheCallback(electric_toast_relcache_callback, (Datum) 0);
+}
+
+/*
+ * The detoasted form of an on-disk TOAST pointer, allocated in cxt
+ */
+static struct varlena *
+electric_toast_fetch(struct varlena *attr, MemoryContext cxt)
+{
+	struct varatt_external toast_pointer;
+	ElectricToastKey key;
+	ElectricToastEntry *entry;
+	struct varlena *value;
+	MemoryContext oldcxt;
+	Size		limit = electric_toast_limit();
+
+	VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+	key.toastrelid = toast_pointer.va_toastrelid;
+	key.valueid = toast_pointer.va_valueid;
+	key.rawsize = toast_pointer.va_rawsize;
+	key.extinfo = toast_pointer.va_extinfo;
+
+	entry = hash_search(electric_toast_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		electric_toast_hits++;
+		dlist_move_head(&electric_toast_lru, &entry->lru);
+		value = MemoryContextAlloc(cxt, VARSIZE(entry->value));
+		memcpy(value, entry->value, VARSIZE(entry->value));
+		return value;
+	}
+
+	electric_toast_misses++;
+	oldcxt = MemoryContextSwitchTo(cxt);
+	value = detoast_attr(attr);
+	MemoryContextSwitchTo(oldcxt);
+
+	/* A value larger than the whole cache would only flush it */
+	if (VARSIZE(value) > limit / 4)
+		return value;
+
+	while (electric_toast_bytes + VARSIZE(value) > limit &&
+		   !dlist_is_empty(&electric_toast_lru))
+	{
+		electric_toast_evict(dlist_tail_element(ElectricToastEntry, lru,
+												&electric_toast_lru));
+		electric_toast_evictions++;
+	}
+
+	entry = hash_search(electric_toast_hash, &key, HASH_ENTER, NULL);
+	entry->value = MemoryContextAlloc(electric_toast_cxt, VARSIZE(value));
+	memcpy(entry->value, value, VARSIZE(value));
+	entry->size = VARSIZE(value) + sizeof(ElectricToastEntry);
+	dlist_push_head(&electric_toast_lru, &entry->lru);
+	electric_toast_bytes += entry->size;
+
+	return value;
+}
+
+/* Replace the toasted values among tn's columns of a scanned row */
+static void
+electric_toast_substitute(ElectricToastNode *tn, TupleTableSlot *slot, MemoryContext cxt)
+{
+	int			attnum = -1;
+
+	slot_getsomeattrs(slot, tn->maxattr);
+	while ((attnum = bms_next_member(tn->attrs, attnum)) >= 0)
+	{
+		int			i = attnum - 1;
+		struct varlena *attr;
+
+		if (slot->tts_isnull[i])
+			continue;
+		attr = (struct varlena *) DatumGetPointer(slot->tts_values[i]);
+		if (VARATT_IS_EXTERNAL_ONDISK(attr))
+			slot->tts_values[i] = PointerGetDatum(electric_toast_fetch(attr, cxt));
+	}
+}
+
+static ElectricToastNode *
+electric_toast_lookup(PlanState *node)
+{
+	ElectricToastQuery *q;
+	ListCell   *lc;
+
+	if (electric_toast_last != NULL && electric_toast_last->node == node)
+		return electric_toast_last;
+
+	for (q = electric_toast_queries; q != NULL; q = q->next)
+	{
+		foreach(lc, q->nodes)
+		{
+			ElectricToastNode *tn = (ElectricToastNode *) lfirst(lc);
+
+			if (tn->node == node)
+			{
+				electric_toast_last = tn;
+				return tn;
+			}
+		}
+	}
+	elog(ERROR, "electric_poc: scan node is not wrapped for the toast cache");
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * ExecScan() for a node whose qual and projection we hold: the node itself
+ * returns every row it fetches
+ */
+static TupleTableSlot *
+electric_exec_toast_scan(PlanState *pstate)
+{
+	ElectricToastNode *tn = electric_toast_lookup(pstate);
+	ExprContext *econtext = pstate->ps_ExprContext;
+
+	for (;;)
+	{
+		TupleTableSlot *slot = tn->orig(pstate);
+
+		if (TupIsNull(slot))
+		{
+			if (tn->projinfo != NULL)
+				return ExecClearTuple(tn->projinfo->pi_state.resultslot);
+			return slot;
+		}
+
+		/* The node reset its per-tuple memory before fetching the row */
+		electric_toast_substitute(tn, slot, econtext->ecxt_per_tuple_memory);
+
+		econtext->ecxt_scantuple = slot;
+		if (tn->qual == NULL || ExecQual(tn->qual, econtext))
+		{
+			if (tn->projinfo != NULL)
+				return ExecProject(tn->projinfo);
+			return slot;
+		}
+		InstrCountFiltered1(pstate, 1);
+	}
+}
+
+static bool
+electric_toast_walker(PlanState *ps, void *context)
+{
+	ElectricToastQuery *q = (ElectricToastQuery *) context;
+	Relation	rel;
+	Bitmapset  *used = NULL;
+	Bitmapset  *attrs = NULL;
+	Index		scanrelid;
+	TupleDesc	tupdesc;
+	AttrNumber	maxattr = 0;
+	int			i;
+
+	if (ps == NULL)
+		return false;
+
+	/* Nodes whose ExecProcNode is ExecScan() over heap-format rows */
+	switch (nodeTag(ps))
+	{
+		case T_SeqScanState:
+		case T_SampleScanState:
+		case T_IndexScanState:
+		case T_BitmapHeapScanState:
+		case T_TidScanState:
+		case T_TidRangeScanState:
+			break;
+		default:
+			return planstate_tree_walker(ps, electric_toast_walker, context);
+	}
+
+	rel = ((ScanState *) ps)->ss_currentRelation;
+	scanrelid = ((Scan *) ps->plan)->scanrelid;
+	if (rel == NULL || !OidIsValid(rel->rd_rel->reltoastrelid))
+		return planstate_tree_walker(ps, electric_toast_walker, context);
+
+	pull_varattnos((Node *) ps->plan->targetlist, scanrelid, &used);
+	pull_varattnos((Node *) ps->plan->qual, scanrelid, &used);
+
+	/* A whole-row reference reads every column */
+	tupdesc = RelationGetDescr(rel);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+		if (att->attisdropped || att->attlen != -1)
+			continue;
+		if (bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, used) ||
+			bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber, used))
+		{
+			attrs = bms_add_member(attrs, att->attnum);
+			maxattr = att->attnum;
+		}
+	}
+
+	if (attrs != NULL)
+	{
+		ElectricToastNode *tn = palloc0(sizeof(ElectricToastNode));
+
+		tn->node = ps;
+		tn->orig = ps->ExecProcNodeReal;
+		tn->qual = ps->qual;
+		tn->projinfo = ps->ps_ProjInfo;
+		tn->attrs = attrs;
+		tn->maxattr = maxattr;
+
+		/* ExecScan() then hands us every row unfiltered and unprojected */
+		ps->qual = NULL;
+		ps->ps_ProjInfo = NULL;
+		ps->ExecProcNodeReal = electric_exec_toast_scan;
+		q->nodes = lappend(q->nodes, tn);
+	}
+
+	return planstate_tree_walker(ps, electric_toast_walker, context);
+}
+
+/* The query's memory is going away (ExecutorEnd or abort): forget it */
+static void
+electric_toast_query_cleanup(void *arg)
+{
+	ElectricToastQuery *q = (ElectricToastQuery *) arg;
+	ElectricToastQuery **prev;
+
+	for (prev = &electric_toast_queries; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == q)
+		{
+			*prev = q->next;
+			break;
+		}
+	}
+	electric_toast_last = NULL;
+}
+
+/*
+ * Wrap the scan nodes of a query that has just been through ExecutorStart.
+ */
+void
+electric_toast_instrument(QueryDesc *queryDesc)
+{
+	EState	   *estate = queryDesc->estate;
+	ElectricToastQuery *q;
+	MemoryContext oldcxt;
+
+	if (queryDesc->planstate == NULL)
+		return;
+
+	if (electric_toast_hash == NULL)
+		electric_toast_init();
+
+	/* The limit may have been lowered since the last query */
+	while (electric_toast_bytes > electric_toast_limit())
+	{
+		electric_toast_evict(dlist_tail_element(ElectricToastEntry, lru,
+												&electric_toast_lru));
+		electric_toast_evictions++;
+	}
+
+	oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+
+	q = palloc0(sizeof(ElectricToastQuery));
+	(void) electric_toast_walker(queryDesc->planstate, q);
+
+	if (q->nodes == NIL)
+	{
+		MemoryContextSwitchTo(oldcxt);
+		return;
+	}
+
+	q->cleanup.func = electric_toast_query_cleanup;
+	q->cleanup.arg = q;
+	MemoryContextRegisterResetCallback(estate->es_query_cxt, &q->cleanup);
+	q->next = electric_toast_queries;
+	electric_toast_queries = q;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * SQL: electric_toast_cache_stats() -> this backend's cache
+ */
+Datum
+electric_toast_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(electric_toast_hash ? (int64) hash_get_num_entries(electric_toast_hash) : 0);
+	values[1] = Int64GetDatum((int64) electric_toast_bytes);
+	values[2] = Int64GetDatum((int64) electric_toast_hits);
+	values[3] = Int64GetDatum((int64) electric_toast_misses);
+	values[4] = Int64GetDatum((int64) electric_toast_evictions);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
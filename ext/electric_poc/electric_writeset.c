@@ -0,0 +1,633 @@
+/*
+ * electric_writeset.c - which primary keys a range of commits may have written
+ *
+ * A client holding results read at snapshot A re-runs them at a later
+ * snapshot B even when none of the rows it read changed. For tables opted in
+ * with electric_track_writes(), a trigger hashes the primary key of every row
+ * a transaction inserts, updates (old and new key) or deletes. At the end of
+ * each writing statement it stores a Bloom filter of the hashes so far in
+ * electric_write_filters, one row per (transaction, table), with the
+ * transaction's own rows so it becomes visible exactly when they do.
+ *
+ * electric_keys_changed_between(rel, keys, a, b) then looks at the filters of
+ * the transactions visible to exactly one of the two snapshots and returns
+ * the keys some filter may contain. A key it leaves out was written by none
+ * of them; a key it returns may be a false positive (about 1% per
+ * transaction that wrote the table).
+ *
+ * Key values are hashed by their text form, so the keys a client passes are
+ * converted to the column types and back before hashing ('01' finds the
+ * integer 1). TRUNCATE, or a transaction writing more than
+ * electric.write_filter_max_keys keys, stores a NULL filter: every key may
+ * have changed. The triggers are ENABLE ALWAYS, so logical replication apply
+ * fires them too; table rewrites by ALTER TABLE fire none and are not seen.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/pg_index.h"
+#include "catalog/pg_type_d.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "lib/qunique.h"
+#include "utils/builtins.h"
+#include "utils/fmgrprotos.h"
+#include "utils/hsearch.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/numeric.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/snapmgr.h"
+#include "utils/xid8.h"
+
+#include "electric_poc.h"
+
+PG_FUNCTION_INFO_V1(electric_write_filter_trigger);
+PG_FUNCTION_INFO_V1(electric_keys_changed_between);
+
+/* About 1% false positives per filter */
+#define ELECTRIC_FILTER_BITS_PER_KEY	10
+#define ELECTRIC_FILTER_HASHES			7
+
+/* electric.write_filter_max_keys */
+int			electric_write_filter_max_keys = 10000;
+
+/* Key columns of a table's primary key, in index order */
+typedef struct ElectricKeyColumns
+{
+	Oid			pkindex;
+	int			natts;
+	AttrNumber	attnums[INDEX_MAX_KEYS];
+	Oid			types[INDEX_MAX_KEYS];
+	int32		typmods[INDEX_MAX_KEYS];
+} ElectricKeyColumns;
+
+/* Keys the current transaction wrote to one table */
+typedef struct ElectricWriteSet
+{
+	Oid			relid;			/* hash key */
+	ElectricKeyColumns cols;
+	FmgrInfo	out[INDEX_MAX_KEYS];
+	uint64	   *hashes;
+	int			nhashes;
+	int			maxhashes;
+	bool		all;			/* every key may have changed */
+	bool		dirty;			/* not yet in electric_write_filters */
+} ElectricWriteSet;
+
+/* Per-transaction, in TopTransactionContext */
+static HTAB *electric_write_sets = NULL;
+
+/*
+ * Primary key columns of rel; pkindex is InvalidOid if it has none
+ */
+static void
+electric_key_columns(Relation rel, ElectricKeyColumns *cols)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	Relation	index;
+	int			i;
+
+	cols->pkindex = RelationGetPrimaryKeyIndex(rel);
+	cols->natts = 0;
+	if (!OidIsValid(cols->pkindex))
+		return;
+
+	index = index_open(cols->pkindex, AccessShareLock);
+	cols->natts = index->rd_index->indnkeyatts;
+	for (i = 0; i < cols->natts; i++)
+	{
+		Form_pg_attribute att;
+
+		cols->attnums[i] = index->rd_index->indkey.values[i];
+		att = TupleDescAttr(tupdesc, cols->attnums[i] - 1);
+		cols->types[i] = att->atttypid;
+		cols->typmods[i] = att->atttypmod;
+	}
+	index_close(index, AccessShareLock);
+}
+
+/* Hash of a key given as the text forms of its columns */
+static uint64
+electric_key_hash(char **values, int natts)
+{
+	uint64		hash = 0;
+	int			i;
+
+	for (i = 0; i < natts; i++)
+		hash = hash_combine64(hash,
+							  hash_bytes_extended((const unsigned char *) values[i],
+												  strlen(values[i]), 0));
+	return hash;
+}
+
+/* Bit positions of a hash, by double hashing */
+static inline uint64
+electric_filter_bit(uint64 hash, int i, uint64 nbits)
+{
+	uint32		h1 = (uint32) hash;
+	uint32		h2 = (uint32) (hash >> 32) | 1;
+
+	return ((uint64) h1 + (uint64) i * h2) % nbits;
+}
+
+static bytea *
+electric_filter_build(const uint64 *hashes, int nhashes)
+{
+	uint64		nbits = Max(64, (uint64) nhashes * ELECTRIC_FILTER_BITS_PER_KEY);
+	Size		nbytes = TYPEALIGN(8, (nbits + 7) / 8);
+	bytea	   *filter = palloc0(VARHDRSZ + nbytes);
+	uint8	   *bits = (uint8 *) VARDATA(filter);
+	int			i;
+	int			j;
+
+	nbits = nbytes * 8;
+	SET_VARSIZE(filter, VARHDRSZ + nbytes);
+	for (i = 0; i < nhashes; i++)
+	{
+		for (j = 0; j < ELECTRIC_FILTER_HASHES; j++)
+		{
+			uint64		bit = electric_filter_bit(hashes[i], j, nbits);
+
+			bits[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+	return filter;
+}
+
+static bool
+electric_filter_may_contain(bytea *filter, uint64 hash)
+{
+	uint64		nbits = (uint64) VARSIZE_ANY_EXHDR(filter) * 8;
+	const uint8 *bits = (const uint8 *) VARDATA_ANY(filter);
+	int			j;
+
+	if (nbits == 0)
+		return true;
+	for (j = 0; j < ELECTRIC_FILTER_HASHES; j++)
+	{
+		uint64		bit = electric_filter_bit(hash, j, nbits);
+
+		if ((bits[bit / 8] & (1 << (bit % 8))) == 0)
+			return false;
+	}
+	return true;
+}
+
+static int
+electric_uint64_cmp(const void *a, const void *b)
+{
+	uint64		x = *(const uint64 *) a;
+	uint64		y = *(const uint64 *) b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Forget the write sets of the transaction that ended (xact callback) */
+void
+electric_writeset_reset(void)
+{
+	electric_write_sets = NULL;
+}
+
+static ElectricWriteSet *
+electric_writeset_get(Relation rel)
+{
+	ElectricWriteSet *ws;
+	Oid			relid = RelationGetRelid(rel);
+	bool		found;
+
+	if (electric_write_sets == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(ElectricWriteSet);
+		ctl.hcxt = TopTransactionContext;
+		electric_write_sets = hash_create("electric_poc write sets", 8, &ctl,
+										  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	ws = hash_search(electric_write_sets, &relid, HASH_ENTER, &found);
+	if (!found)
+	{
+		ws->cols.pkindex = InvalidOid;
+		ws->cols.natts = 0;
+		ws->hashes = NULL;
+		ws->nhashes = 0;
+		ws->maxhashes = 0;
+		ws->all = false;
+		ws->dirty = false;
+	}
+
+	/* The primary key may have been replaced since the last row */
+	if (!ws->all && (ws->cols.natts == 0 ||
+					 ws->cols.pkindex != RelationGetPrimaryKeyIndex(rel)))
+	{
+		int			i;
+
+		electric_key_columns(rel, &ws->cols);
+		if (!OidIsValid(ws->cols.pkindex))
+			ws->all = true;
+		for (i = 0; i < ws->cols.natts; i++)
+		{
+			Oid			typoutput;
+			bool		typisvarlena;
+
+			getTypeOutputInfo(ws->cols.types[i], &typoutput, &typisvarlena);
+			fmgr_info_cxt(typoutput, &ws->out[i], TopTransactionContext);
+		}
+	}
+	return ws;
+}
+
+static void
+electric_writeset_add(ElectricWriteSet *ws, HeapTuple tuple, TupleDesc tupdesc)
+{
+	char	   *values[INDEX_MAX_KEYS];
+	int			i;
+
+	ws->dirty = true;
+	if (ws->all)
+		return;
+
+	for (i = 0; i < ws->cols.natts; i++)
+	{
+		bool		isnull;
+		Datum		value = heap_getattr(tuple, ws->cols.attnums[i], tupdesc, &isnull);
+
+		values[i] = isnull ? pstrdup("") : OutputFunctionCall(&ws->out[i], value);
+	}
+
+	if (ws->nhashes >= ws->maxhashes)
+	{
+		ws->maxhashes = Max(64, ws->maxhashes * 2);
+		if (ws->hashes == NULL)
+			ws->hashes = MemoryContextAlloc(TopTransactionContext,
+											ws->maxhashes * sizeof(uint64));
+		else
+			ws->hashes = repalloc(ws->hashes, ws->maxhashes * sizeof(uint64));
+	}
+	ws->hashes[ws->nhashes++] = electric_key_hash(values, ws->cols.natts);
+
+	for (i = 0; i < ws->cols.natts; i++)
+		pfree(values[i]);
+}
+
+/*
+ * Schema-qualified name of one of the extension's tables. The caller's
+ * search_path need not include the extension's schema; fn_oid is one of the
+ * extension's functions.
+ */
+static char *
+electric_writeset_table(Oid fn_oid, const char *name)
+{
+	return quote_qualified_identifier(get_namespace_name(get_func_namespace(fn_oid)), name);
+}
+
+/*
+ * Store the transaction's filter for one table, replacing the one an earlier
+ * statement stored
+ */
+static void
+electric_writeset_flush(ElectricWriteSet *ws, Oid fn_oid)
+{
+	Oid			argtypes[4] = {XID8OID, REGCLASSOID, INT4OID, BYTEAOID};
+	Datum		values[4];
+	char		nulls[4] = {' ', ' ', ' ', ' '};
+	char	   *query;
+	int			ret;
+
+	if (!ws->dirty)
+		return;
+
+	if (!ws->all && ws->nhashes > 0)
+	{
+		qsort(ws->hashes, ws->nhashes, sizeof(uint64), electric_uint64_cmp);
+		ws->nhashes = qunique(ws->hashes, ws->nhashes, sizeof(uint64), electric_uint64_cmp);
+	}
+	if (ws->nhashes > electric_write_filter_max_keys)
+		ws->all = true;
+
+	values[0] = FullTransactionIdGetDatum(GetTopFullTransactionId());
+	values[1] = ObjectIdGetDatum(ws->relid);
+	if (ws->all)
+	{
+		values[2] = Int32GetDatum(-1);
+		nulls[3] = 'n';
+	}
+	else
+	{
+		values[2] = Int32GetDatum(ws->nhashes);
+		values[3] = PointerGetDatum(electric_filter_build(ws->hashes, ws->nhashes));
+	}
+
+	query = psprintf("INSERT INTO %s (xid, relid, nkeys, filter) "
+					 "VALUES ($1, $2, $3, $4) "
+					 "ON CONFLICT (xid, relid) DO UPDATE "
+					 "SET nkeys = excluded.nkeys, filter = excluded.filter",
+					 electric_writeset_table(fn_oid, "electric_write_filters"));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+	ret = SPI_execute_with_args(query, 4, argtypes, values, nulls, false, 0);
+	if (ret != SPI_OK_INSERT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	SPI_finish();
+
+	ws->dirty = false;
+}
+
+/*
+ * Trigger installed by electric_track_writes(): collects keys per row,
+ * stores the filter per statement
+ */
+Datum
+electric_write_filter_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	TriggerEvent event;
+	ElectricWriteSet *ws;
+	TupleDesc	tupdesc;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("electric_write_filter_trigger() was not called by trigger manager")));
+
+	event = trigdata->tg_event;
+	if (!TRIGGER_FIRED_AFTER(event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("electric_write_filter_trigger() must be fired AFTER")));
+
+	ws = electric_writeset_get(trigdata->tg_relation);
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(event))
+	{
+		ws->all = true;
+		ws->dirty = true;
+	}
+	else if (TRIGGER_FIRED_FOR_ROW(event))
+	{
+		electric_writeset_add(ws, trigdata->tg_trigtuple, tupdesc);
+		if (TRIGGER_FIRED_BY_UPDATE(event))
+			electric_writeset_add(ws, trigdata->tg_newtuple, tupdesc);
+		return PointerGetDatum(NULL);
+	}
+
+	electric_writeset_flush(ws, fcinfo->flinfo->fn_oid);
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Text form of one key column from its JSON value, as the column's output
+ * function would print it
+ */
+static char *
+electric_key_text(JsonbValue *v, Oid type, int32 typmod)
+{
+	char	   *str;
+	Oid			typinput;
+	Oid			typioparam;
+	Oid			typoutput;
+	bool		typisvarlena;
+
+	switch (v->type)
+	{
+		case jbvString:
+			str = pnstrdup(v->val.string.val, v->val.string.len);
+			break;
+		case jbvNumeric:
+			str = DatumGetCString(DirectFunctionCall1(numeric_out,
+													  NumericGetDatum(v->val.numeric)));
+			break;
+		case jbvBool:
+			str = pstrdup(v->val.boolean ? "true" : "false");
+			break;
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("key values must be JSON strings, numbers or booleans")));
+	}
+
+	getTypeInputInfo(type, &typinput, &typioparam);
+	getTypeOutputInfo(type, &typoutput, &typisvarlena);
+	return OidOutputFunctionCall(typoutput,
+								 OidInputFunctionCall(typinput, str, typioparam, typmod));
+}
+
+/* Hash of one element of the keys array */
+static uint64
+electric_key_element_hash(JsonbValue *elem, const ElectricKeyColumns *cols)
+{
+	char	   *values[INDEX_MAX_KEYS];
+	JsonbValue *v;
+	int			i;
+
+	if (elem->type == jbvBinary && JsonContainerIsArray(elem->val.binary.data))
+	{
+		if (JsonContainerSize(elem->val.binary.data) != cols->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("each key must have %d values, one per primary key column",
+							cols->natts)));
+		for (i = 0; i < cols->natts; i++)
+		{
+			v = getIthJsonbValueFromContainer(elem->val.binary.data, i);
+			values[i] = electric_key_text(v, cols->types[i], cols->typmods[i]);
+		}
+	}
+	else
+	{
+		if (cols->natts != 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("keys of a %d-column primary key must be JSON arrays",
+							cols->natts)));
+		values[0] = electric_key_text(elem, cols->types[0], cols->typmods[0]);
+	}
+	return electric_key_hash(values, cols->natts);
+}
+
+/* Visible to exactly one of the two snapshots? */
+static bool
+electric_visible_to_one(TransactionId xid, Snapshot a, Snapshot b)
+{
+	return XidInMVCCSnapshot(xid, a) != XidInMVCCSnapshot(xid, b);
+}
+
+/*
+ * SQL: electric_keys_changed_between(rel regclass, keys jsonb,
+ * snap_a pg_snapshot, snap_b pg_snapshot) -> jsonb
+ *
+ * The elements of keys (one value per key, or an array of values for a
+ * multi-column primary key) that a transaction visible to only one of the
+ * snapshots may have written. All of them if the filters don't reach back
+ * to both snapshots.
+ */
+Datum
+electric_keys_changed_between(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Jsonb	   *keys = PG_GETARG_JSONB_P(1);
+	char	   *str_a = DatumGetCString(DirectFunctionCall1(pg_snapshot_out, PG_GETARG_DATUM(2)));
+	char	   *str_b = DatumGetCString(DirectFunctionCall1(pg_snapshot_out, PG_GETARG_DATUM(3)));
+	ElectricParsedSnapshot *parsed_a;
+	ElectricParsedSnapshot *parsed_b;
+	Snapshot	snap_a;
+	Snapshot	snap_b;
+	ElectricKeyColumns cols;
+	Relation	rel;
+	int			nkeys;
+	uint64	   *hashes;
+	bool	   *changed;
+	bool		all = false;
+	TransactionId lo;
+	Oid			argtypes[2] = {REGCLASSOID, XID8OID};
+	Datum		values[2];
+	JsonbParseState *state = NULL;
+	JsonbValue *result;
+	bool		isnull;
+	uint64		i;
+	int			k;
+	int			ret;
+
+	if (!JB_ROOT_IS_ARRAY(keys) || JB_ROOT_IS_SCALAR(keys))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("keys must be a JSON array")));
+
+	parsed_a = electric_parse_snapshot_text(str_a);
+	parsed_b = electric_parse_snapshot_text(str_b);
+	snap_a = electric_build_snapshot_from_parts(GetTransactionSnapshot(), parsed_a);
+	snap_b = electric_build_snapshot_from_parts(GetTransactionSnapshot(), parsed_b);
+
+	rel = relation_open(relid, AccessShareLock);
+	electric_key_columns(rel, &cols);
+	relation_close(rel, AccessShareLock);
+	if (!OidIsValid(cols.pkindex))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TABLE_DEFINITION),
+				 errmsg("\"%s\" has no primary key", get_rel_name(relid))));
+
+	nkeys = JsonContainerSize(&keys->root);
+	hashes = palloc(sizeof(uint64) * Max(nkeys, 1));
+	changed = palloc0(sizeof(bool) * Max(nkeys, 1));
+	for (k = 0; k < nkeys; k++)
+		hashes[k] = electric_key_element_hash(getIthJsonbValueFromContainer(&keys->root, k),
+											  &cols);
+
+	/*
+	 * Commits that reached the client through replication may not have left
+	 * the ProcArray yet; their filters become visible when they do. Read the
+	 * filters with the latest snapshot, so a REPEATABLE READ caller still
+	 * sees them.
+	 */
+	electric_wait_for_snapshot(snap_a);
+	electric_wait_for_snapshot(snap_b);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_connect failed")));
+	PushActiveSnapshot(GetLatestSnapshot());
+
+	values[0] = ObjectIdGetDatum(relid);
+	ret = SPI_execute_with_args(psprintf("SELECT complete_from FROM %s WHERE relid = $1",
+										 electric_writeset_table(fcinfo->flinfo->fn_oid,
+																 "electric_write_tracked_tables")),
+								1, argtypes, values, NULL, true, 1);
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+	if (SPI_processed == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("\"%s\" is not in electric_write_tracked_tables", get_rel_name(relid)),
+				 errhint("Start tracking it with SELECT electric_track_writes('%s').",
+						 get_rel_name(relid))));
+
+	/*
+	 * Transactions up to complete_from may have written without a filter
+	 * (those that finished before tracking started) or had theirs trimmed.
+	 * Both snapshots must see all of them as finished.
+	 */
+	lo = TransactionIdPrecedes(parsed_a->xmin, parsed_b->xmin) ? parsed_a->xmin : parsed_b->xmin;
+	if (!FullTransactionIdFollows(electric_full_xid(lo),
+								  DatumGetFullTransactionId(SPI_getbinval(SPI_tuptable->vals[0],
+																		  SPI_tuptable->tupdesc,
+																		  1, &isnull))))
+		all = true;
+
+	if (!all)
+	{
+		/* Later ones are running or not yet started for both snapshots */
+		values[1] = FullTransactionIdGetDatum(electric_full_xid(lo));
+		ret = SPI_execute_with_args(psprintf("SELECT xid, filter FROM %s "
+											 "WHERE relid = $1 AND xid >= $2",
+											 electric_writeset_table(fcinfo->flinfo->fn_oid,
+																	 "electric_write_filters")),
+									2, argtypes, values, NULL, true, 0);
+		if (ret != SPI_OK_SELECT)
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("SPI_execute failed: %s", SPI_result_code_string(ret))));
+
+		for (i = 0; i < SPI_processed && !all; i++)
+		{
+			HeapTuple	tuple = SPI_tuptable->vals[i];
+			TransactionId xid;
+			Datum		datum;
+			bytea	   *filter;
+
+			xid = XidFromFullTransactionId(DatumGetFullTransactionId(SPI_getbinval(tuple,
+																				   SPI_tuptable->tupdesc,
+																				   1, &isnull)));
+			if (!electric_visible_to_one(xid, snap_a, snap_b))
+				continue;
+
+			datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull);
+			if (isnull)
+			{
+				all = true;
+				break;
+			}
+			filter = DatumGetByteaPP(datum);
+			for (k = 0; k < nkeys; k++)
+			{
+				if (!changed[k] && electric_filter_may_contain(filter, hashes[k]))
+					changed[k] = true;
+			}
+		}
+	}
+
+	PopActiveSnapshot();
+	SPI_finish();
+
+	if (all)
+		PG_RETURN_JSONB_P(keys);
+
+	pushJsonbValue(&state, WJB_BEGIN_ARRAY, NULL);
+	for (k = 0; k < nkeys; k++)
+	{
+		if (changed[k])
+			pushJsonbValue(&state, WJB_ELEM, getIthJsonbValueFromContainer(&keys->root, k));
+	}
+	result = pushJsonbValue(&state, WJB_END_ARRAY, NULL);
+	PG_RETURN_JSONB_P(JsonbValueToJsonb(result));
+}
@@ -12,6 +12,7 @@ import {
   startReplicationStream,
   stopReplicationStream,
   waitForNthCommit,
+  waitForCommit,
   ReplicationState,
 } from './helpers/replication.js';
 
@@ -418,4 +419,295 @@ describe('electric_exec_as_of', () => {
       await client.query('ROLLBACK');
     });
   });
+
+  describe('Test 6 - electric_explain_as_of', () => {
+    it('should return an EXPLAIN ANALYZE plan for the historical query', async () => {
+      const snapshotResult = await client.query('SELECT pg_current_snapshot()::text as snapshot');
+      const currentSnapshot = snapshotResult.rows[0].snapshot;
+
+      const result = await client.query(
+        `SELECT electric_explain_as_of(
+          $1::pg_snapshot,
+          'SELECT allowed FROM acl WHERE user_id = $1',
+          '["u1"]'::jsonb
+        ) AS plan`,
+        [currentSnapshot]
+      );
+
+      const [explain] = result.rows[0].plan;
+      expect(explain.Plan['Node Type']).toBeDefined();
+      expect(explain.Plan['Actual Rows']).toBeDefined();
+      expect(explain.Plan['Shared Hit Blocks']).toBeDefined();
+      expect(explain['Execution Time']).toBeGreaterThanOrEqual(0);
+    });
+
+    it('should reject data-modifying CTEs', async () => {
+      const snapshotResult = await client.query('SELECT pg_current_snapshot()::text as snapshot');
+      const currentSnapshot = snapshotResult.rows[0].snapshot;
+
+      await expect(
+        client.query(
+          `SELECT electric_explain_as_of($1::pg_snapshot, 'WITH d AS (DELETE FROM acl RETURNING *) SELECT * FROM d', '[]'::jsonb)`,
+          [currentSnapshot]
+        )
+      ).rejects.toThrow(/only SELECT queries are allowed/i);
+
+      const count = await client.query('SELECT count(*)::int AS n FROM acl');
+      expect(count.rows[0].n).toBeGreaterThan(0);
+       });
+
+    it('should apply the per-call limits', async () => {
+      const snapshotResult = await client.query('SELECT pg_current_snapshot()::text as snapshot');
+      const currentSnapshot = snapshotResult.rows[0].snapshot;
+
+      await expect(
+        client.query(
+          `SELECT electric_explain_as_of($1::pg_snapshot, 'SELECT * FROM acl', '[]'::jsonb, '{"max_tuples_examined": 1}'::jsonb)`,
+          [currentSnapshot]
+        )
+      ).rejects.toMatchObject({ code: '54L03' });
+    });
+  });
+  describe('Test 6 - Streamed large transactions', () => {
+    let replicationState: ReplicationState;
+    let bulk: Client;
+    const inserts: Array<{ relation: string; xid: bigint | null }> = [];
+
+    beforeAll(async () => {
+      // Stream anything over 64kB of decoded changes
+      await client.query(`ALTER SYSTEM SET logical_decoding_work_mem = '64kB'`);
+      await client.query('SELECT pg_reload_conf()');
+
+      await client.query('DROP TABLE IF EXISTS bulk_load CASCADE');
+      await client.query('CREATE TABLE bulk_load (id int PRIMARY KEY, payload text NOT NULL)');
+      await setupReplication(client);
+      await client.query('ALTER PUBLICATION pub ADD TABLE bulk_load');
+
+      // Rows are decoded on two worker threads, snapshots on this one
+      replicationState = await startReplicationStream(pgConfig.connectionString, 'slot1', 'pub', 10000, true, {
+        workers: 2,
+        handler: new URL('./helpers/insert-handler.mjs', import.meta.url),
+        onResult: (result) => inserts.push(result as (typeof inserts)[number]),
+      });
+
+      bulk = createClient(pgConfig);
+      await bulk.connect();
+    }, 30000);
+
+    afterAll(async () => {
+      if (bulk) {
+        await bulk.end();
+      }
+      if (replicationState) {
+        await stopReplicationStream(replicationState);
+      }
+      await cleanupReplication(client);
+      await client.query('DROP TABLE IF EXISTS bulk_load CASCADE');
+      await client.query('ALTER SYSTEM RESET logical_decoding_work_mem');
+      await client.query('SELECT pg_reload_conf()');
+    });
+
+    /** Commit a one-row update to acl and return its xid */
+    async function smallCommit(): Promise<bigint> {
+      await client.query('BEGIN');
+      const res = await client.query('SELECT pg_current_xact_id()::text AS xid');
+      await client.query(`UPDATE acl SET allowed = NOT allowed WHERE user_id = 'u1' AND doc_id = 'd1'`);
+      await client.query('COMMIT');
+      return BigInt(res.rows[0].xid);
+    }
+
+    /** Open a transaction on the bulk client, insert ~1MB and return its xid */
+    async function startBulkLoad(): Promise<bigint> {
+      await bulk.query('BEGIN');
+      const res = await bulk.query('SELECT pg_current_xact_id()::text AS xid');
+      await bulk.query(`
+        INSERT INTO bulk_load
+        SELECT g, repeat('x', 200) FROM generate_series(1, 5000) g
+      `);
+      return BigInt(res.rows[0].xid);
+    }
+
+    it('should report a running bulk load as in flight and still emit other commits', async () => {
+      const bulkXid = await startBulkLoad();
+
+      // Commits behind the bulk load are emitted while it is still running,
+      // with the bulk load in xip because it has started streaming
+      const smallXid = await smallCommit();
+      const during = await waitForCommit(replicationState, c => c.xid === smallXid, 15000);
+      const xip = during.snapshotString.split(':')[2].split(',').filter(Boolean);
+      expect(xip).toContain(bulkXid.toString());
+      expect(replicationState.tracker.isInFlight(bulkXid)).toBe(true);
+
+      // The snapshot hides the uncommitted rows even once they commit
+      await bulk.query('COMMIT');
+      const committed = await waitForCommit(replicationState, c => c.xid === bulkXid, 15000);
+      expect(replicationState.tracker.isInFlight(bulkXid)).toBe(false);
+
+      const before = await client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT count(*)::int AS n FROM bulk_load', '[]'::jsonb) AS r`,
+        [during.snapshotString]
+      );
+      expect(before.rows[0].r[0].n).toBe(0);
+
+      const after = await client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT count(*)::int AS n FROM bulk_load', '[]'::jsonb) AS r`,
+        [committed.snapshotString]
+      );
+      expect(after.rows[0].r[0].n).toBe(5000);
+
+      await replicationState.changes!.drained();
+      expect(inserts.filter((r) => r.relation === 'bulk_load' && r.xid === bulkXid)).toHaveLength(5000);
+    });
+
+    it('should forget a streamed transaction that rolls back', async () => {
+      await client.query('TRUNCATE bulk_load');
+      const bulkXid = await startBulkLoad();
+
+      // Wait until the bulk load is known to be in flight, then abort it
+      const startTime = Date.now();
+      while (!replicationState.tracker.isInFlight(bulkXid) && Date.now() - startTime < 15000) {
+        await new Promise(resolve => setTimeout(resolve, 50));
+      }
+      expect(replicationState.tracker.isInFlight(bulkXid)).toBe(true);
+      await bulk.query('ROLLBACK');
+
+      // The abort arrives before the next commit
+      const smallXid = await smallCommit();
+      const after = await waitForCommit(replicationState, c => c.xid === smallXid, 15000);
+      expect(after.snapshotString.split(':')[2].split(',')).not.toContain(bulkXid.toString());
+      expect(replicationState.tracker.isInFlight(bulkXid)).toBe(false);
+    });
+  });
+
+  describe('Test 7 - Snapshot at a stream position', () => {
+    it('should see exactly the commits before the position', async () => {
+      const other = createClient(pgConfig);
+      await other.connect();
+      try {
+        // A transaction running across the position
+        await other.query('BEGIN');
+        const res = await other.query('SELECT pg_current_xact_id()::text AS xid');
+        const runningXid = res.rows[0].xid;
+        await other.query(`INSERT INTO acl VALUES ('u_boot', 'd_boot', true)`);
+
+        const at = (await client.query('SELECT lsn, snapshot FROM electric_snapshot_at_lsn()')).rows[0];
+        expect(at.snapshot.split(':')[2].split(',')).toContain(runningXid);
+
+        await other.query('COMMIT');
+
+        // Asking for the same position later gives the same snapshot
+        const again = await client.query('SELECT snapshot FROM electric_snapshot_at_lsn($1)', [at.lsn]);
+        expect(again.rows[0].snapshot).toBe(at.snapshot);
+
+        const count = `SELECT count(*)::int AS n FROM acl WHERE user_id = 'u_boot'`;
+        const before = await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, $2, '[]'::jsonb) AS r`,
+          [at.snapshot, count]
+        );
+        expect(before.rows[0].r[0].n).toBe(0);
+
+        const now = (await client.query('SELECT snapshot FROM electric_snapshot_at_lsn()')).rows[0];
+        const after = await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, $2, '[]'::jsonb) AS r`,
+          [now.snapshot, count]
+        );
+        expect(after.rows[0].r[0].n).toBe(1);
+      } finally {
+        await other.end();
+        await client.query(`DELETE FROM acl WHERE user_id = 'u_boot'`);
+      }
+    });
+  });
+
+  describe('Test 8 - Changed keys between snapshots', () => {
+    it('should return only the keys written between the snapshots', async () => {
+      const snapshot = async () =>
+        (await client.query('SELECT pg_current_snapshot()::text AS s')).rows[0].s;
+      const keys = [['u_keys1', 'd1'], ['u_keys2', 'd1']];
+      const changed = async (from: string, to: string) =>
+        (await client.query(
+          `SELECT electric_keys_changed_between('acl', $1::jsonb, $2::pg_snapshot, $3::pg_snapshot) AS k`,
+          [JSON.stringify(keys), from, to]
+        )).rows[0].k;
+
+      const untracked = await snapshot();
+      await client.query(`SELECT electric_track_writes('acl')`);
+      try {
+        await client.query(`INSERT INTO acl VALUES ('u_keys1', 'd1', true), ('u_keys2', 'd1', true)`);
+        const a = await snapshot();
+        await client.query(`UPDATE acl SET allowed = false WHERE user_id = 'u_keys1'`);
+        const b = await snapshot();
+
+        expect(await changed(a, b)).toEqual([['u_keys1', 'd1']]);
+        expect(await changed(b, a)).toEqual([['u_keys1', 'd1']]);
+        expect(await changed(b, b)).toEqual([]);
+
+        // Before tracking started nothing can be ruled out
+        expect(await changed(untracked, b)).toEqual(keys);
+
+        // The extension's tables are found without its schema on search_path
+        const ext = (
+          await client.query(`SELECT extnamespace::regnamespace AS nsp FROM pg_extension WHERE extname = 'electric_poc'`)
+        ).rows[0].nsp;
+        await client.query('SET search_path = pg_catalog');
+        try {
+          const trimmed = await client.query(`SELECT ${ext}.electric_trim_write_filters('1') AS n`);
+          expect(Number(trimmed.rows[0].n)).toBe(0);
+        } finally {
+          await client.query('RESET search_path');
+        }
+      } finally {
+        await client.query(`SELECT electric_untrack_writes('acl')`);
+        await client.query(`DELETE FROM acl WHERE user_id IN ('u_keys1', 'u_keys2')`);
+      }
+    });
+  });
+
+  describe('Test 9 - Detoasted value cache (electric.toast_cache_size)', () => {
+    it('should detoast a value once across calls at different snapshots', async () => {
+      await client.query('DROP TABLE IF EXISTS toasted_docs');
+      await client.query('CREATE TABLE toasted_docs (id int PRIMARY KEY, body text, small text)');
+      // Hex digests barely compress, so the body is stored out of line
+      await client.query(`
+        INSERT INTO toasted_docs
+        SELECT 1, string_agg(md5(i::text), ''), 'x' FROM generate_series(1, 400) i
+      `);
+      const snapshot = async () =>
+        (await client.query('SELECT pg_current_snapshot()::text AS s')).rows[0].s;
+      const stats = async () =>
+        (await client.query('SELECT hits::int, misses::int FROM electric_toast_cache_stats()')).rows[0];
+      const digest = async (snap: string) =>
+        (await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, $2, '[]'::jsonb) AS r`,
+          [snap, `SELECT md5(body) AS h FROM toasted_docs WHERE body LIKE '%' || $$c4ca4238$$ || '%'`]
+        )).rows[0].r;
+
+      await client.query(`SET electric.toast_cache_size = '1MB'`);
+      try {
+        const expected = (await client.query('SELECT md5(body) AS h FROM toasted_docs')).rows;
+        const s1 = await snapshot();
+        await client.query(`UPDATE toasted_docs SET small = 'y'`);
+        const s2 = await snapshot();
+
+        const before = await stats();
+        expect(await digest(s1)).toEqual(expected);
+        expect(await digest(s2)).toEqual(expected);
+        const after = await stats();
+
+        // The update kept the toasted value, so the second call finds it
+        expect(after.misses - before.misses).toBe(1);
+        expect(after.hits - before.hits).toBe(1);
+
+        // Columns the query doesn't read are never detoasted
+        await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT small FROM toasted_docs', '[]'::jsonb)`,
+          [s2]
+        );
+        expect((await stats()).misses).toBe(after.misses);
+      } finally {
+        await client.query('RESET electric.toast_cache_size');
+        await client.query('DROP TABLE toasted_docs');
+      }
+    });
+  });
 });
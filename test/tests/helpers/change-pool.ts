@@ -0,0 +1,178 @@
+import { Worker } from 'node:worker_threads';
+import type { RawChange } from './pgoutput-streaming.js';
+
+/**
+ * Decodes and handles row messages on worker threads, so the replication
+ * tracker's thread only sequences BEGIN/COMMIT and emits snapshots.
+ *
+ * Each worker loads `handler`, an ES module whose default export is called
+ * as handler(message, xid) with every decoded message it is sent. Rows are
+ * partitioned by relation, so changes to one table are handled in WAL order
+ * by one worker; Relation and Type messages go to every worker (each has its
+ * own relation cache), and so does Truncate, which may name tables owned by
+ * several workers. Whatever the handler returns (other than undefined) is
+ * passed to onResult on the main thread.
+ *
+ * Changes are packed into one transferable ArrayBuffer per worker and sent
+ * every batchSize changes and on flush(), which the tracker calls at each
+ * commit and stream stop.
+ */
+
+export interface ChangePoolOptions {
+  /** Number of worker threads (at least 1) */
+  workers: number;
+  /** Module the workers import; default export handler(message, xid) */
+  handler: string | URL;
+  /** Changes per worker before a batch is sent (default 256) */
+  batchSize?: number;
+  /** Called on the main thread with each non-undefined handler result */
+  onResult?: (result: unknown) => void;
+}
+
+/** Record header in a batch: u64 xid (0 = none), u32 message length */
+const RECORD_HEADER = 12;
+
+const TAG_RELATION = 0x52; // 'R'
+const TAG_TYPE = 0x59; // 'Y'
+const TAG_INSERT = 0x49; // 'I'
+const TAG_UPDATE = 0x55; // 'U'
+const TAG_DELETE = 0x44; // 'D'
+const TAG_TRUNCATE = 0x54; // 'T'
+
+class Batch {
+  buffer = Buffer.allocUnsafe(64 * 1024);
+  used = 0;
+  count = 0;
+
+  append(change: RawChange, xid: bigint): void {
+    const length = 1 + change.body.length;
+    const needed = this.used + RECORD_HEADER + length;
+    if (needed > this.buffer.length) {
+      const grown = Buffer.allocUnsafe(Math.max(needed, this.buffer.length * 2));
+      this.buffer.copy(grown, 0, 0, this.used);
+      this.buffer = grown;
+    }
+    this.buffer.writeBigUInt64BE(xid, this.used);
+    this.buffer.writeUInt32BE(length, this.used + 8);
+    this.buffer[this.used + RECORD_HEADER] = change.kind;
+    change.body.copy(this.buffer, this.used + RECORD_HEADER + 1);
+    this.used = needed;
+    this.count++;
+  }
+
+  /** Exact-size copy of the records, ready to transfer; resets the batch */
+  take(): ArrayBuffer {
+    const out = new ArrayBuffer(this.used);
+    this.buffer.copy(new Uint8Array(out), 0, 0, this.used);
+    this.used = 0;
+    this.count = 0;
+    return out;
+  }
+}
+
+export class ChangePool {
+  private readonly workers: Worker[];
+  private readonly batches: Batch[];
+  private readonly batchSize: number;
+  private dispatched = 0;
+  private handledCount = 0;
+  private failure: Error | null = null;
+  private waiters: Array<{ resolve: () => void; reject: (err: Error) => void }> = [];
+
+  constructor(options: ChangePoolOptions) {
+    if (!Number.isInteger(options.workers) || options.workers < 1) {
+      throw new Error(`ChangePool needs at least one worker, got ${options.workers}`);
+    }
+    this.batchSize = options.batchSize ?? 256;
+    const handler = options.handler.toString();
+    this.batches = [];
+    this.workers = [];
+    for (let i = 0; i < options.workers; i++) {
+      const worker = new Worker(new URL('./change-worker.mjs', import.meta.url), {
+        workerData: { handler },
+      });
+      worker.on('message', (msg: { handled: number; results?: unknown[] }) => {
+        if (msg.results && options.onResult) {
+          for (const result of msg.results) {
+            options.onResult(result);
+          }
+        }
+        this.handledCount += msg.handled;
+        this.settle();
+      });
+      worker.on('error', (err) => {
+        this.failure ??= err;
+        this.settle();
+      });
+      this.workers.push(worker);
+      this.batches.push(new Batch());
+    }
+  }
+
+  /** Changes handled so far (a broadcast change counts once per worker) */
+  get handled(): number {
+    return this.handledCount;
+  }
+
+  /** Queue a change of transaction xid (null if unknown) for its worker */
+  dispatch(change: RawChange, xid: bigint | null): void {
+    const kind = change.kind;
+    if (kind === TAG_RELATION || kind === TAG_TYPE || kind === TAG_TRUNCATE) {
+      for (let i = 0; i < this.workers.length; i++) {
+        this.queue(i, change, xid);
+      }
+    } else if (kind === TAG_INSERT || kind === TAG_UPDATE || kind === TAG_DELETE) {
+      // Body starts with the relation OID
+      this.queue(change.body.readUInt32BE(0) % this.workers.length, change, xid);
+    } else {
+      this.queue(0, change, xid);
+    }
+  }
+
+  /** Send every partly filled batch */
+  flush(): void {
+    for (let i = 0; i < this.workers.length; i++) {
+      if (this.batches[i].count > 0) {
+        this.send(i);
+      }
+    }
+  }
+
+  /** Resolves once everything dispatched so far has been handled */
+  drained(): Promise<void> {
+    this.flush();
+    return new Promise((resolve, reject) => {
+      this.waiters.push({ resolve, reject });
+      this.settle();
+    });
+  }
+
+  async close(): Promise<void> {
+    await Promise.all(this.workers.map((worker) => worker.terminate()));
+  }
+
+  private queue(i: number, change: RawChange, xid: bigint | null): void {
+    this.batches[i].append(change, xid ?? 0n);
+    this.dispatched++;
+    if (this.batches[i].count >= this.batchSize) {
+      this.send(i);
+    }
+  }
+
+  private send(i: number): void {
+    const records = this.batches[i].take();
+    this.workers[i].postMessage(records, [records]);
+  }
+
+  private settle(): void {
+    if (this.failure) {
+      for (const waiter of this.waiters.splice(0)) {
+        waiter.reject(this.failure);
+      }
+    } else if (this.handledCount === this.dispatched) {
+      for (const waiter of this.waiters.splice(0)) {
+        waiter.resolve();
+      }
+    }
+  }
+}
@@ -0,0 +1,38 @@
+// Worker thread of ChangePool (change-pool.ts). Plain JavaScript because
+// worker threads are started by Node itself, outside vitest's TS transform.
+//
+// Each message is an ArrayBuffer of records: u64 xid (0 = none), u32 length,
+// then a v1 pgoutput message of that length. Every message is decoded with
+// this worker's own parser (which keeps its own relation cache) and passed
+// to the handler module; the reply counts the records and carries the
+// handler's non-undefined results.
+
+import { parentPort, workerData } from 'node:worker_threads';
+import { PgoutputPlugin } from 'pg-logical-replication';
+
+const RECORD_HEADER = 12;
+
+const parser = new PgoutputPlugin({ protoVersion: 1, publicationNames: [] });
+const { default: handle } = await import(workerData.handler);
+
+parentPort.on('message', (records) => {
+  const buffer = Buffer.from(records);
+  const results = [];
+  let handled = 0;
+  let offset = 0;
+
+  while (offset < buffer.length) {
+    const xid = buffer.readBigUInt64BE(offset);
+    const length = buffer.readUInt32BE(offset + 8);
+    const start = offset + RECORD_HEADER;
+    const message = parser.parse(buffer.subarray(start, start + length));
+    const result = handle(message, xid === 0n ? null : xid);
+    if (result !== undefined) {
+      results.push(result);
+    }
+    handled++;
+    offset = start + length;
+  }
+
+  parentPort.postMessage(results.length > 0 ? { handled, results } : { handled });
+});
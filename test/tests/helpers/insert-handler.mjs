@@ -0,0 +1,10 @@
+// ChangePool handler used by the tests: reports every insert as
+// { relation, id, xid }, where id is the row's first column.
+
+export default function handle(message, xid) {
+  if (message.tag === 'insert') {
+    const [id] = Object.values(message.new);
+    return { relation: message.relation.name, id, xid };
+  }
+  return undefined;
+}
@@ -0,0 +1,90 @@
+/**
+ * Hand-built pgoutput messages for tests and benchmarks that exercise the
+ * tracker's parsing without a server. All columns are text.
+ */
+
+function cstring(s: string): Buffer {
+  return Buffer.from(s + '\0', 'utf8');
+}
+
+function u8(v: number): Buffer {
+  return Buffer.from([v]);
+}
+
+function u16(v: number): Buffer {
+  const b = Buffer.alloc(2);
+  b.writeUInt16BE(v);
+  return b;
+}
+
+function u32(v: number): Buffer {
+  const b = Buffer.alloc(4);
+  b.writeUInt32BE(v);
+  return b;
+}
+
+function u64(v: bigint): Buffer {
+  const b = Buffer.alloc(8);
+  b.writeBigUInt64BE(v);
+  return b;
+}
+
+function tag(c: string): Buffer {
+  return Buffer.from(c, 'ascii');
+}
+
+const TEXTOID = 25;
+
+export function beginMessage(xid: number): Buffer {
+  return Buffer.concat([tag('B'), u64(0n), u64(0n), u32(xid)]);
+}
+
+export function commitMessage(): Buffer {
+  return Buffer.concat([tag('C'), u8(0), u64(0n), u64(0n), u64(0n)]);
+}
+
+export function relationMessage(relid: number, schema: string, name: string, columns: string[]): Buffer {
+  return Buffer.concat([
+    tag('R'),
+    u32(relid),
+    cstring(schema),
+    cstring(name),
+    u8(0x64), // replica identity default
+    u16(columns.length),
+    ...columns.flatMap((column, i) => [u8(i === 0 ? 1 : 0), cstring(column), u32(TEXTOID), u32(0xffffffff)]),
+  ]);
+}
+
+export function insertMessage(relid: number, values: string[]): Buffer {
+  return Buffer.concat([
+    tag('I'),
+    u32(relid),
+    tag('N'),
+    u16(values.length),
+    ...values.flatMap((value) => {
+      const bytes = Buffer.from(value, 'utf8');
+      return [tag('t'), u32(bytes.length), bytes];
+    }),
+  ]);
+}
+
+export function streamStartMessage(xid: number, firstSegment: boolean): Buffer {
+  return Buffer.concat([tag('S'), u32(xid), u8(firstSegment ? 1 : 0)]);
+}
+
+export function streamStopMessage(): Buffer {
+  return tag('E');
+}
+
+export function streamCommitMessage(xid: number): Buffer {
+  return Buffer.concat([tag('c'), u32(xid), u8(0), u64(0x16b3748n), u64(0x16b3778n), u64(0n)]);
+}
+
+export function streamAbortMessage(xid: number, subxid: number): Buffer {
+  return Buffer.concat([tag('A'), u32(xid), u32(subxid)]);
+}
+
+/** The same message as sent inside a stream chunk: xid after the tag */
+export function inStream(xid: number, message: Buffer): Buffer {
+  return Buffer.concat([message.subarray(0, 1), u32(xid), message.subarray(1)]);
+}
@@ -0,0 +1,179 @@
+import type { Client } from 'pg';
+import { PgoutputPlugin, Pgoutput } from 'pg-logical-replication';
+
+/**
+ * pgoutput with in-progress transaction streaming (protocol version 2+) and
+ * optional framing-only decoding.
+ *
+ * With `streaming 'on'`, once a transaction's decoded changes exceed
+ * logical_decoding_work_mem the walsender stops buffering it and sends it in
+ * chunks as it runs:
+ *
+ *   S (stream start)  xid, first segment?
+ *     ...changes, each carrying the xid after the tag...
+ *   E (stream stop)
+ *   ... other transactions' BEGIN/COMMIT, more S..E chunks ...
+ *   c (stream commit) xid   or   A (stream abort) xid, subxid
+ *
+ * The stream framing is decoded here; changes inside a chunk have their xid
+ * stripped and are handed to the base parser as ordinary v1 messages, so its
+ * relation cache still sees the Relation messages sent inside streams.
+ *
+ * With decodeChanges = false only the transaction framing (BEGIN, COMMIT and
+ * the stream messages) is decoded. Everything else is returned undecoded as a
+ * RawChange after a look at its tag byte, for a tracker that only needs xids
+ * or hands rows to worker threads (see change-pool.ts).
+ */
+
+export interface MessageStreamStart {
+  tag: 'stream_start';
+  xid: number;
+  firstSegment: boolean;
+}
+
+export interface MessageStreamStop {
+  tag: 'stream_stop';
+}
+
+export interface MessageStreamCommit {
+  tag: 'stream_commit';
+  xid: number;
+  flags: number;
+  commitLsn: string;
+  commitEndLsn: string;
+  commitTime: Date;
+}
+
+export interface MessageStreamAbort {
+  tag: 'stream_abort';
+  /** Top-level xid */
+  xid: number;
+  /** Equal to xid when the whole transaction aborted */
+  subxid: number;
+}
+
+export type StreamMessage =
+  | MessageStreamStart
+  | MessageStreamStop
+  | MessageStreamCommit
+  | MessageStreamAbort;
+
+/** A change sent inside a stream chunk, with the xid it belongs to */
+export type StreamedChange = Pgoutput.Message & { streamXid: number };
+
+/**
+ * An undecoded non-framing message: Relation, Type, Insert, Update, Delete,
+ * Truncate, Origin or logical Message. `kind` is the tag byte and `body` the
+ * bytes after it (after the xid, for changes inside a stream), so
+ * [kind, ...body] is always a plain v1 message.
+ */
+export interface RawChange {
+  tag: 'raw';
+  kind: number;
+  body: Buffer;
+  streamXid?: number;
+}
+
+export interface StreamingPgoutputOptions {
+  publicationNames: string[];
+  /** 2 or later when streaming; streaming needs Postgres 14+ */
+  protoVersion?: number;
+  /** Ask for in-progress transactions to be streamed (default true) */
+  streaming?: boolean;
+  /** Decode row and schema messages, or return them as RawChange (default true) */
+  decodeChanges?: boolean;
+}
+
+/** Microseconds between the Unix and Postgres (2000-01-01) epochs */
+const PG_EPOCH_OFFSET_US = 946684800000000n;
+
+function readLsn(buffer: Buffer, offset: number): string {
+  const upper = buffer.readUInt32BE(offset);
+  const lower = buffer.readUInt32BE(offset + 4);
+  return `${upper.toString(16).toUpperCase()}/${lower.toString(16).toUpperCase()}`;
+}
+
+function readTimestamp(buffer: Buffer, offset: number): Date {
+  const us = buffer.readBigInt64BE(offset) + PG_EPOCH_OFFSET_US;
+  return new Date(Number(us / 1000n));
+}
+
+export class StreamingPgoutputPlugin extends PgoutputPlugin {
+  private readonly streamingOptions: Required<StreamingPgoutputOptions>;
+  /** Between stream start and stop */
+  private inStream = false;
+
+  constructor(options: StreamingPgoutputOptions) {
+    const streaming = options.streaming ?? true;
+    const protoVersion = options.protoVersion ?? (streaming ? 2 : 1);
+    if (streaming && protoVersion < 2) {
+      throw new Error(`pgoutput streaming needs protocol version 2 or later, got ${protoVersion}`);
+    }
+    super({ protoVersion, publicationNames: options.publicationNames } as any);
+    this.streamingOptions = {
+      protoVersion,
+      publicationNames: options.publicationNames,
+      streaming,
+      decodeChanges: options.decodeChanges ?? true,
+    };
+  }
+
+  public start(client: Client, slotName: string, lastLsn: string): Promise<any> {
+    const options = [
+      `proto_version '${this.streamingOptions.protoVersion}'`,
+      `publication_names '${this.streamingOptions.publicationNames.join(',')}'`,
+    ];
+    if (this.streamingOptions.streaming) {
+      options.push(`streaming 'on'`);
+    }
+    return client.query(`START_REPLICATION SLOT "${slotName}" LOGICAL ${lastLsn} (${options.join(', ')})`);
+  }
+
+  public parse(buffer: Buffer): any {
+    switch (buffer[0]) {
+      case 0x53: // 'S'
+        this.inStream = true;
+        return {
+          tag: 'stream_start',
+          xid: buffer.readUInt32BE(1),
+          firstSegment: buffer.readUInt8(5) === 1,
+        } satisfies MessageStreamStart;
+      case 0x45: // 'E'
+        this.inStream = false;
+        return { tag: 'stream_stop' } satisfies MessageStreamStop;
+      case 0x63: // 'c'
+        return {
+          tag: 'stream_commit',
+          xid: buffer.readUInt32BE(1),
+          flags: buffer.readUInt8(5),
+          commitLsn: readLsn(buffer, 6),
+          commitEndLsn: readLsn(buffer, 14),
+          commitTime: readTimestamp(buffer, 22),
+        } satisfies MessageStreamCommit;
+      case 0x41: // 'A'
+        return {
+          tag: 'stream_abort',
+          xid: buffer.readUInt32BE(1),
+          subxid: buffer.readUInt32BE(5),
+        } satisfies MessageStreamAbort;
+      case 0x42: // 'B'
+      case 0x43: // 'C'
+        return super.parse(buffer);
+    }
+
+    if (!this.streamingOptions.decodeChanges) {
+      return this.inStream
+        ? ({ tag: 'raw', kind: buffer[0], body: buffer.subarray(5), streamXid: buffer.readUInt32BE(1) } satisfies RawChange)
+        : ({ tag: 'raw', kind: buffer[0], body: buffer.subarray(1) } satisfies RawChange);
+    }
+
+    if (!this.inStream) {
+      return super.parse(buffer);
+    }
+
+    // Tag, xid, body -> tag, body
+    const streamXid = buffer.readUInt32BE(1);
+    const change = super.parse(Buffer.concat([buffer.subarray(0, 1), buffer.subarray(5)]));
+    return { ...change, streamXid } as StreamedChange;
+  }
+}
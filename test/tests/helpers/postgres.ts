@@ -158,6 +158,7 @@ export async function cleanupReplication(client: Client): Promise<void> {
  *       '-c', 'wal_level=logical',
  *       '-c', 'max_replication_slots=10',
  *       '-c', 'max_wal_senders=10',
+ *       '-c', 'shared_preload_libraries=electric_poc',
  *     ])
  *     .withWaitStrategy(Wait.forLogMessage(/database system is ready to accept connections/, 2))
  *     .start();
@@ -3,6 +3,9 @@ import {
   PgoutputPlugin,
   Pgoutput,
 } from 'pg-logical-replication';
+import { RingBuffer, SnapshotTracker } from './snapshot-tracker.js';
+import { RawChange, StreamingPgoutputPlugin, StreamMessage } from './pgoutput-streaming.js';
+import { ChangePool, ChangePoolOptions } from './change-pool.js';
 
 export interface CommitSnapshot {
   xid: bigint;
@@ -13,56 +16,37 @@ export interface CommitSnapshot {
 export interface ReplicationState {
   service: LogicalReplicationService;
   plugin: PgoutputPlugin;
-  inFlightXids: Set<bigint>;
-  commitSnapshots: CommitSnapshot[];
+  tracker: SnapshotTracker;
+  /** Worker threads handling row messages, if a change handler was given */
+  changes: ChangePool | null;
+  /** The last historySize commits; length counts every commit seen */
+  commitSnapshots: RingBuffer<CommitSnapshot>;
   isRunning: boolean;
   stopPromise: Promise<void> | null;
   currentXid: bigint | null; // Track current transaction's xid
 }
 
 /**
- * Compute an approximate snapshot string after a commit.
- * This represents the database state "just after" the given xid committed.
- */
-export function computeSnapshotAfterCommit(
-  committedXid: bigint,
-  inFlightXids: Set<bigint>
-): string {
-  // Remove the committed xid from in-flight set
-  const inFlightAfter = new Set(inFlightXids);
-  inFlightAfter.delete(committedXid);
-  
-  // Collect all xids we need to consider
-  const allXids = [committedXid, ...inFlightAfter];
-  
-  // xmax = max of all xids + 1
-  const xmax = allXids.reduce((max, x) => x > max ? x : max, 0n) + 1n;
-  
-  // xmin = min of in-flight (if any), otherwise xmax
-  let xmin: bigint;
-  if (inFlightAfter.size > 0) {
-    xmin = [...inFlightAfter].reduce((min, x) => x < min ? x : min, BigInt(Number.MAX_SAFE_INTEGER));
-  } else {
-    xmin = xmax;
-  }
-  
-  // xip = sorted list of in-flight xids where xmin <= xid < xmax
-  const xip = [...inFlightAfter]
-    .filter(x => x >= xmin && x < xmax)
-    .sort((a, b) => (a < b ? -1 : a > b ? 1 : 0));
-  
-  // Format: xmin:xmax:xip1,xip2,...
-  const xipStr = xip.map(x => x.toString()).join(',');
-  return `${xmin}:${xmax}:${xipStr}`;
-}
-
-/**
- * Start a logical replication stream and track transactions
+ * Start a logical replication stream and track transactions.
+ *
+ * With streaming (the default), large transactions are sent while they run
+ * instead of all at once at commit, so they show up as in flight from their
+ * first streamed chunk and never hold up the snapshots of commits behind them.
+ * Needs Postgres 14+; pass streaming = false for protocol v1.
+ *
+ * This thread is the sequencer: it decodes only BEGIN, COMMIT and the stream
+ * messages and emits snapshots in commit order. Row and schema messages are
+ * recognised by their tag byte and never decoded here; given `changes`, they
+ * are decoded and handled on a ChangePool of worker threads, otherwise they
+ * are dropped.
  */
 export async function startReplicationStream(
   connectionString: string,
   slotName: string = 'slot1',
-  publicationName: string = 'pub'
+  publicationName: string = 'pub',
+  historySize: number = 10000,
+  streaming: boolean = true,
+  changes?: ChangePoolOptions
 ): Promise<ReplicationState> {
   const service = new LogicalReplicationService({
     connectionString,
@@ -73,31 +57,39 @@ export async function startReplicationStream(
     },
   });
 
-  const plugin = new PgoutputPlugin({
-    protoVersion: 1,
+  const plugin = new StreamingPgoutputPlugin({
     publicationNames: [publicationName],
+    streaming,
+    decodeChanges: false,
   });
 
   const state: ReplicationState = {
     service,
     plugin,
-    inFlightXids: new Set(),
-    commitSnapshots: [],
+    tracker: new SnapshotTracker(),
+    changes: changes ? new ChangePool(changes) : null,
+    commitSnapshots: new RingBuffer<CommitSnapshot>(historySize),
     isRunning: false,
     stopPromise: null,
     currentXid: null,
   };
 
   // Handle messages
-  service.on('data', (lsn: string, message: Pgoutput.Message) => {
+  service.on('data', (lsn: string, message: Pgoutput.Message | StreamMessage | RawChange) => {
     // console.log('Replication message:', message.tag, message);
     
-    if (message.tag === 'begin') {
+    if (message.tag === 'raw') {
+      // Row or schema message, still undecoded
+      if (state.changes) {
+        const xid = message.streamXid !== undefined ? BigInt(message.streamXid) : state.currentXid;
+        state.changes.dispatch(message, xid);
+      }
+    } else if (message.tag === 'begin') {
       // Transaction started - xid is on the begin message
       const beginMsg = message as Pgoutput.MessageBegin;
       if (beginMsg.xid !== undefined) {
         const xid = BigInt(beginMsg.xid);
-        state.inFlightXids.add(xid);
+        state.tracker.begin(xid);
         state.currentXid = xid;
       }
     } else if (message.tag === 'commit') {
@@ -115,22 +107,37 @@ export async function startReplicationStream(
       }
       
       if (xid !== null) {
-        // Compute snapshot representing "just after this commit"
-        const snapshotString = computeSnapshotAfterCommit(xid, state.inFlightXids);
-        
+        // Snapshot representing "just after this commit"; also forgets xid
+        const snapshotString = state.tracker.commit(xid);
+
         state.commitSnapshots.push({
           xid,
           snapshotString,
           lsn,
         });
-        
-        // Remove from in-flight
-        state.inFlightXids.delete(xid);
       }
       
       state.currentXid = null;
+      state.changes?.flush();
+    } else if (message.tag === 'stream_start') {
+      // A large transaction is being streamed while it runs. Every chunk
+      // re-adds it (a no-op after the first) so attaching mid-stream works.
+      state.tracker.begin(BigInt(message.xid));
+    } else if (message.tag === 'stream_commit') {
+      const xid = BigInt(message.xid);
+      state.commitSnapshots.push({
+        xid,
+        snapshotString: state.tracker.commit(xid),
+        lsn,
+      });
+    } else if (message.tag === 'stream_stop') {
+      state.changes?.flush();
+    } else if (message.tag === 'stream_abort') {
+      // Only a top-level abort ends the transaction; subxacts aren't tracked
+      if (message.xid === message.subxid) {
+        state.tracker.abort(BigInt(message.xid));
+      }
     }
-    // We ignore INSERT/UPDATE/DELETE messages for snapshot tracking
   });
 
   service.on('error', (err: Error) => {
@@ -187,7 +194,11 @@ export async function waitForNthCommit(
   
   while (Date.now() - startTime < timeoutMs) {
     if (state.commitSnapshots.length >= n) {
-      return state.commitSnapshots[n - 1];
+      const snapshot = state.commitSnapshots.at(n - 1);
+      if (snapshot === undefined) {
+        throw new Error(`Commit #${n} has been evicted from the commit history.`);
+      }
+      return snapshot;
     }
     
     // Wait a bit and check again
@@ -219,4 +230,6 @@ export async function stopReplicationStream(state: ReplicationState): Promise<vo
       // Ignore
     }
   }
+
+  await state.changes?.close();
 }
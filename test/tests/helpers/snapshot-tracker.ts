@@ -0,0 +1,191 @@
+/**
+ * Incremental snapshot bookkeeping for the WAL tracker.
+ *
+ * The tracker sees BEGIN and COMMIT for every transaction and, after each
+ * commit, emits the snapshot "just after" it as xmin:xmax:xip. Instead of
+ * rebuilding that from a Set on every commit, the in-flight xids are kept in
+ * a sorted list that begins append to and commits remove from, so a commit
+ * costs a binary search plus O(k) to format the k xids still in flight.
+ */
+
+/**
+ * Sorted list of distinct xids. Xids are assigned in increasing order, so
+ * adding the newest xid and removing the oldest (the usual case) are O(1);
+ * anything else is a binary search and a splice.
+ */
+export class SortedXidList {
+  private xids: bigint[] = [];
+  /** xids[0..head) have been removed and are waiting to be compacted away */
+  private head = 0;
+
+  get size(): number {
+    return this.xids.length - this.head;
+  }
+
+  min(): bigint | undefined {
+    return this.size > 0 ? this.xids[this.head] : undefined;
+  }
+
+  has(xid: bigint): boolean {
+    const i = this.lowerBound(xid);
+    return i < this.xids.length && this.xids[i] === xid;
+  }
+
+  add(xid: bigint): void {
+    const n = this.xids.length;
+    if (n === this.head || xid > this.xids[n - 1]) {
+      this.xids.push(xid);
+      return;
+    }
+    const i = this.lowerBound(xid);
+    if (this.xids[i] !== xid) {
+      this.xids.splice(i, 0, xid);
+    }
+  }
+
+  delete(xid: bigint): boolean {
+    const i = this.lowerBound(xid);
+    if (i >= this.xids.length || this.xids[i] !== xid) {
+      return false;
+    }
+    if (i === this.head) {
+      this.head++;
+      this.compact();
+    } else {
+      this.xids.splice(i, 1);
+    }
+    return true;
+  }
+
+  /** Comma-separated xids in ascending order */
+  join(): string {
+    return this.head === 0 ? this.xids.join(',') : this.xids.slice(this.head).join(',');
+  }
+
+  [Symbol.iterator](): IterableIterator<bigint> {
+    return this.xids.slice(this.head)[Symbol.iterator]();
+  }
+
+  private lowerBound(xid: bigint): number {
+    let lo = this.head;
+    let hi = this.xids.length;
+    while (lo < hi) {
+      const mid = (lo + hi) >>> 1;
+      if (this.xids[mid] < xid) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  private compact(): void {
+    if (this.head === this.xids.length) {
+      this.xids = [];
+      this.head = 0;
+    } else if (this.head >= 1024 && this.head * 2 >= this.xids.length) {
+      this.xids = this.xids.slice(this.head);
+      this.head = 0;
+    }
+  }
+}
+
+/**
+ * In-flight transactions and the snapshot after each commit.
+ */
+export class SnapshotTracker {
+  private inFlight = new SortedXidList();
+  /** Highest xid seen so far; every snapshot's xmax is past it */
+  private maxXid = 0n;
+
+  get inFlightCount(): number {
+    return this.inFlight.size;
+  }
+
+  isInFlight(xid: bigint): boolean {
+    return this.inFlight.has(xid);
+  }
+
+  begin(xid: bigint): void {
+    this.inFlight.add(xid);
+    if (xid > this.maxXid) {
+      this.maxXid = xid;
+    }
+  }
+
+  /** Forget xid and return the snapshot just after it committed */
+  commit(xid: bigint): string {
+    this.inFlight.delete(xid);
+    if (xid > this.maxXid) {
+      this.maxXid = xid;
+    }
+    return this.snapshot();
+  }
+
+  /** Forget xid without emitting a snapshot */
+  abort(xid: bigint): void {
+    this.inFlight.delete(xid);
+  }
+
+  /** xmin:xmax:xip for the current state */
+  snapshot(): string {
+    const xmax = this.maxXid + 1n;
+    const xmin = this.inFlight.min() ?? xmax;
+    return `${xmin}:${xmax}:${this.inFlight.join()}`;
+  }
+}
+
+/**
+ * Fixed-capacity history that keeps the last `capacity` items. Indexes are
+ * absolute (the nth item ever pushed), so callers can keep counting past
+ * evictions; `length` is the number of items ever pushed.
+ */
+export class RingBuffer<T> {
+  private items: T[];
+  private total = 0;
+
+  constructor(readonly capacity: number) {
+    if (!Number.isInteger(capacity) || capacity < 1) {
+      throw new Error(`RingBuffer capacity must be a positive integer, got ${capacity}`);
+    }
+    this.items = new Array<T>(capacity);
+  }
+
+  get length(): number {
+    return this.total;
+  }
+
+  /** Absolute index of the oldest item still held */
+  get firstIndex(): number {
+    return Math.max(0, this.total - this.capacity);
+  }
+
+  push(item: T): void {
+    this.items[this.total % this.capacity] = item;
+    this.total++;
+  }
+
+  /** The item pushed as number `index`, or undefined if evicted or not yet pushed */
+  at(index: number): T | undefined {
+    if (index < this.firstIndex || index >= this.total) {
+      return undefined;
+    }
+    return this.items[index % this.capacity];
+  }
+
+  find(predicate: (item: T) => boolean): T | undefined {
+    for (const item of this) {
+      if (predicate(item)) {
+        return item;
+      }
+    }
+    return undefined;
+  }
+
+  *[Symbol.iterator](): IterableIterator<T> {
+    for (let i = this.firstIndex; i < this.total; i++) {
+      yield this.items[i % this.capacity];
+    }
+  }
+}
@@ -0,0 +1,80 @@
+import { afterAll, bench, describe } from 'vitest';
+import { availableParallelism } from 'node:os';
+import { PgoutputPlugin } from 'pg-logical-replication';
+import { StreamingPgoutputPlugin } from './helpers/pgoutput-streaming.js';
+import { ChangePool } from './helpers/change-pool.js';
+import { beginMessage, commitMessage, insertMessage, relationMessage } from './helpers/pgoutput-fixtures.js';
+
+/**
+ * Tracker message throughput: each iteration parses 1000 transactions of 20
+ * four-column inserts spread over 8 tables, as the WAL tail would see them.
+ *
+ *   - full decode: the old tracker, every message decoded on one thread
+ *   - framing only: the sequencer alone, rows skipped by tag byte
+ *   - N workers: the sequencer plus rows decoded on a ChangePool
+ *
+ *   cd test && npm run bench
+ */
+
+const TRANSACTIONS = 1000;
+const ROWS_PER_TRANSACTION = 20;
+const TABLES = 8;
+
+function buildStream(): Buffer[] {
+  const messages: Buffer[] = [];
+  for (let t = 0; t < TABLES; t++) {
+    messages.push(relationMessage(16384 + t, 'public', `t${t}`, ['id', 'owner', 'doc', 'payload']));
+  }
+  for (let x = 0; x < TRANSACTIONS; x++) {
+    messages.push(beginMessage(1000 + x));
+    for (let r = 0; r < ROWS_PER_TRANSACTION; r++) {
+      const id = x * ROWS_PER_TRANSACTION + r;
+      messages.push(insertMessage(16384 + (id % TABLES), [`${id}`, `user-${id % 97}`, `doc-${id}`, 'x'.repeat(64)]));
+    }
+    messages.push(commitMessage());
+  }
+  return messages;
+}
+
+const stream = buildStream();
+const noopHandler = 'data:text/javascript,export default () => undefined';
+
+describe(`${TRANSACTIONS} transactions x ${ROWS_PER_TRANSACTION} inserts`, () => {
+  bench('full decode (protocol v1 plugin)', () => {
+    const plugin = new PgoutputPlugin({ protoVersion: 1, publicationNames: ['pub'] });
+    for (const message of stream) {
+      plugin.parse(message);
+    }
+  });
+
+  bench('framing only (rows skipped)', () => {
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+    for (const message of stream) {
+      plugin.parse(message);
+    }
+  });
+
+  const pools: ChangePool[] = [];
+  afterAll(async () => {
+    await Promise.all(pools.map((pool) => pool.close()));
+  });
+
+  const maxWorkers = Math.max(1, availableParallelism() - 1);
+  for (const workers of [1, 2, 4, 8].filter((n) => n <= maxWorkers)) {
+    const pool = new ChangePool({ workers, handler: noopHandler });
+    pools.push(pool);
+
+    bench(`framing + ${workers} worker(s) decoding rows`, async () => {
+      const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+      for (const message of stream) {
+        const parsed = plugin.parse(message);
+        if (parsed.tag === 'raw') {
+          pool.dispatch(parsed, null);
+        } else if (parsed.tag === 'commit') {
+          pool.flush();
+        }
+      }
+      await pool.drained();
+    });
+  }
+});
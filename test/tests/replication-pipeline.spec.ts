@@ -0,0 +1,127 @@
+import { describe, it, expect } from 'vitest';
+import { StreamingPgoutputPlugin, RawChange } from './helpers/pgoutput-streaming.js';
+import { ChangePool } from './helpers/change-pool.js';
+import {
+  beginMessage,
+  commitMessage,
+  inStream,
+  insertMessage,
+  relationMessage,
+  streamAbortMessage,
+  streamCommitMessage,
+  streamStartMessage,
+  streamStopMessage,
+} from './helpers/pgoutput-fixtures.js';
+
+/**
+ * Unit tests for the tracker's message pipeline (no database needed):
+ * framing-only parsing on the sequencer and row handling on workers.
+ */
+describe('replication pipeline', () => {
+  const insertHandler = new URL('./helpers/insert-handler.mjs', import.meta.url);
+
+  it('should decode transaction framing and leave rows undecoded', () => {
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+
+    expect(plugin.parse(beginMessage(700))).toMatchObject({ tag: 'begin', xid: 700 });
+
+    const insert = insertMessage(16384, ['1', 'a']);
+    const raw: RawChange = plugin.parse(insert);
+    expect(raw.tag).toBe('raw');
+    expect(String.fromCharCode(raw.kind)).toBe('I');
+    expect(raw.body.equals(insert.subarray(1))).toBe(true);
+    expect(raw.streamXid).toBeUndefined();
+
+    expect(plugin.parse(commitMessage())).toMatchObject({ tag: 'commit' });
+  });
+
+  it('should strip the xid from changes inside a stream', () => {
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+    const insert = insertMessage(16384, ['1', 'a']);
+
+    expect(plugin.parse(streamStartMessage(701, true))).toEqual({
+      tag: 'stream_start',
+      xid: 701,
+      firstSegment: true,
+    });
+    const raw: RawChange = plugin.parse(inStream(701, insert));
+    expect(raw.streamXid).toBe(701);
+    expect(raw.body.equals(insert.subarray(1))).toBe(true);
+    expect(plugin.parse(streamStopMessage())).toEqual({ tag: 'stream_stop' });
+
+    // Outside the stream again, no xid is expected
+    expect(plugin.parse(insert).streamXid).toBeUndefined();
+
+    expect(plugin.parse(streamCommitMessage(701))).toMatchObject({
+      tag: 'stream_commit',
+      xid: 701,
+      commitLsn: '0/16B3748',
+      commitEndLsn: '0/16B3778',
+    });
+    expect(plugin.parse(streamAbortMessage(702, 703))).toEqual({ tag: 'stream_abort', xid: 702, subxid: 703 });
+  });
+
+  it('should fully decode streamed changes when asked to', () => {
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'] });
+
+    plugin.parse(streamStartMessage(704, true));
+    plugin.parse(inStream(704, relationMessage(16384, 'public', 'bulk_load', ['id', 'payload'])));
+    const insert = plugin.parse(inStream(704, insertMessage(16384, ['1', 'a'])));
+    plugin.parse(streamStopMessage());
+
+    expect(insert).toMatchObject({
+      tag: 'insert',
+      streamXid: 704,
+      relation: { name: 'bulk_load' },
+      new: { id: '1', payload: 'a' },
+    });
+  });
+
+  it('should handle rows on workers in per-relation order', async () => {
+    const results: Array<{ relation: string; id: string; xid: bigint | null }> = [];
+    const pool = new ChangePool({
+      workers: 3,
+      handler: insertHandler,
+      batchSize: 7,
+      onResult: (result) => results.push(result as (typeof results)[number]),
+    });
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+
+    try {
+      // Relation messages reach every worker, whichever one owns the table
+      pool.dispatch(plugin.parse(relationMessage(16384, 'public', 'a', ['id'])), null);
+      pool.dispatch(plugin.parse(relationMessage(16385, 'public', 'b', ['id'])), null);
+
+      for (let i = 0; i < 100; i++) {
+        pool.dispatch(plugin.parse(insertMessage(16384, [`${i}`])), 800n);
+        pool.dispatch(plugin.parse(insertMessage(16385, [`${i}`])), 801n);
+      }
+      await pool.drained();
+
+      // 2 relations x 3 workers + 200 inserts
+      expect(pool.handled).toBe(206);
+      for (const [relation, xid] of [['a', 800n], ['b', 801n]] as const) {
+        const rows = results.filter((r) => r.relation === relation);
+        expect(rows.map((r) => r.id)).toEqual(Array.from({ length: 100 }, (_, i) => `${i}`));
+        expect(rows.every((r) => r.xid === xid)).toBe(true);
+      }
+    } finally {
+      await pool.close();
+    }
+  });
+
+  it('should report a failing handler from drained()', async () => {
+    const pool = new ChangePool({
+      workers: 1,
+      handler: 'data:text/javascript,export default () => { throw new Error("handler failed"); }',
+    });
+    const plugin = new StreamingPgoutputPlugin({ publicationNames: ['pub'], decodeChanges: false });
+
+    try {
+      pool.dispatch(plugin.parse(relationMessage(16384, 'public', 'a', ['id'])), null);
+      await expect(pool.drained()).rejects.toThrow(/handler failed/);
+    } finally {
+      await pool.close();
+    }
+  });
+});
@@ -0,0 +1,247 @@
+import { describe, it, expect, beforeAll, afterAll } from 'vitest';
+import { Client } from 'pg';
+import * as net from 'node:net';
+import {
+  getLocalPostgresConfig,
+  createClient,
+  initializeDatabase,
+  PostgresConfig,
+} from './helpers/postgres.js';
+
+const TEXTOID = 25;
+const BOOLOID = 16;
+
+interface Frame {
+  request: number;
+  type: string;
+  payload: Buffer;
+}
+
+/**
+ * Minimal client for the as-of query server protocol (electric_server.c).
+ * Requests may be pipelined; responses come back in order.
+ */
+class ServerConnection {
+  private buf = Buffer.alloc(0);
+  private waiting: ((f: Frame) => void)[] = [];
+  private nextRequest = 1;
+
+  constructor(private sock: net.Socket) {
+    sock.on('data', (chunk) => {
+      this.buf = Buffer.concat([this.buf, chunk]);
+      while (this.buf.length >= 4 && this.buf.length >= 4 + this.buf.readUInt32BE(0)) {
+        const len = this.buf.readUInt32BE(0);
+        const frame = {
+          request: this.buf.readUInt32BE(4),
+          type: String.fromCharCode(this.buf[8]),
+          payload: this.buf.subarray(9, 4 + len),
+        };
+        this.buf = this.buf.subarray(4 + len);
+        this.waiting.shift()!(frame);
+      }
+    });
+  }
+
+  static connect(path: string): Promise<ServerConnection> {
+    return new Promise((resolve, reject) => {
+      const sock = net.createConnection(path, () => resolve(new ServerConnection(sock)));
+      sock.once('error', reject);
+    });
+  }
+
+  send(type: string, payload: Buffer): Promise<Frame> {
+    const header = Buffer.alloc(9);
+    header.writeUInt32BE(5 + payload.length, 0);
+    header.writeUInt32BE(this.nextRequest++, 4);
+    header[8] = type.charCodeAt(0);
+    this.sock.write(Buffer.concat([header, payload]));
+    return new Promise((resolve) => this.waiting.push(resolve));
+  }
+
+  snapshot(text: string) {
+    return this.send('S', Buffer.from(text));
+  }
+
+  prepare(id: number, types: number[], sql: string) {
+    const head = Buffer.alloc(6 + 4 * types.length);
+    head.writeUInt32BE(id, 0);
+    head.writeUInt16BE(types.length, 4);
+    types.forEach((t, i) => head.writeUInt32BE(t, 6 + 4 * i));
+    return this.send('P', Buffer.concat([head, Buffer.from(sql)]));
+  }
+
+  execute(handle: number, id: number, args: (string | null)[]) {
+    const parts = [Buffer.alloc(10)];
+    parts[0].writeUInt32BE(handle, 0);
+    parts[0].writeUInt32BE(id, 4);
+    parts[0].writeUInt16BE(args.length, 8);
+    for (const arg of args) {
+      const len = Buffer.alloc(4);
+      len.writeInt32BE(arg === null ? -1 : Buffer.byteLength(arg), 0);
+      parts.push(len);
+      if (arg !== null) parts.push(Buffer.from(arg));
+    }
+    return this.send('X', Buffer.concat(parts));
+  }
+
+  end() {
+    this.sock.end();
+  }
+}
+
+/** Rows of an 'R' frame, each column as raw bytes or null */
+function rows(frame: Frame): (Buffer | null)[][] {
+  expect(frame.type).toBe('R');
+  const ncols = frame.payload.readUInt16BE(0);
+  const nrows = frame.payload.readUInt32BE(2);
+  const result: (Buffer | null)[][] = [];
+  let pos = 6;
+  for (let r = 0; r < nrows; r++) {
+    const row: (Buffer | null)[] = [];
+    for (let c = 0; c < ncols; c++) {
+      const len = frame.payload.readInt32BE(pos);
+      pos += 4;
+      row.push(len < 0 ? null : frame.payload.subarray(pos, pos + len));
+      pos += Math.max(len, 0);
+    }
+    result.push(row);
+  }
+  expect(pos).toBe(frame.payload.length);
+  return result;
+}
+
+/**
+ * The as-of query server. Needs electric_poc in shared_preload_libraries,
+ * electric.server_socket set and electric.server_database naming the test
+ * database; skipped otherwise.
+ */
+describe('as-of query server (electric.server_socket)', () => {
+  let pgConfig: PostgresConfig;
+  let client: Client;
+  let socketPath = '';
+
+  async function currentSnapshot(): Promise<string> {
+    const result = await client.query('SELECT pg_current_snapshot()::text as snapshot');
+    const parts = result.rows[0].snapshot.split(':');
+    return `${parseInt(parts[0])}:${parseInt(parts[1]) + 1}:`;
+  }
+
+  beforeAll(async () => {
+    pgConfig = getLocalPostgresConfig();
+    client = createClient(pgConfig);
+    await client.connect();
+    await initializeDatabase(client);
+
+    const settings = await client.query(
+      `SELECT current_setting('electric.server_socket') AS socket,
+              current_setting('electric.server_workers')::int AS workers,
+              current_setting('electric.server_database') = current_database() AS same_db`
+    );
+    const { socket, workers, same_db } = settings.rows[0];
+    if (socket !== '' && same_db) {
+      socketPath = workers > 1 ? `${socket}.0` : socket;
+    }
+  }, 30000);
+
+  afterAll(async () => {
+    if (client) {
+      await client.end();
+    }
+  });
+
+  it('should answer pipelined executions at a registered snapshot', async (ctx) => {
+    if (!socketPath) ctx.skip();
+
+    const before = await currentSnapshot();
+    await client.query(`UPDATE acl SET allowed = false WHERE user_id = 'u1' AND doc_id = 'd1'`);
+    const after = await currentSnapshot();
+
+    const conn = await ServerConnection.connect(socketPath);
+    try {
+      const [snapBefore, snapAfter, prepared] = await Promise.all([
+        conn.snapshot(before),
+        conn.snapshot(after),
+        conn.prepare(7, [TEXTOID, TEXTOID], 'SELECT allowed FROM acl WHERE user_id = $1 AND doc_id = $2'),
+      ]);
+      expect(prepared.type).toBe('K');
+      expect(prepared.payload.readUInt16BE(0)).toBe(1);
+      expect(prepared.payload.readUInt32BE(2)).toBe(BOOLOID);
+      const hBefore = snapBefore.payload.readUInt32BE(0);
+      const hAfter = snapAfter.payload.readUInt32BE(0);
+
+      // A bad request in the middle doesn't disturb the others
+      const results = await Promise.all([
+        conn.execute(hBefore, 7, ['u1', 'd1']),
+        conn.execute(hBefore, 99, ['u1', 'd1']),
+        conn.execute(hAfter, 7, ['u1', 'd1']),
+        conn.execute(hAfter, 7, ['u1', 'nope']),
+        conn.execute(hAfter, 7, ['u1', null]),
+      ]);
+
+      results.forEach((f, i) => expect(f.request).toBe(results[0].request + i));
+      expect(rows(results[0])).toEqual([[Buffer.from([1])]]);
+      expect(results[1].type).toBe('E');
+      expect(results[1].payload.subarray(0, 5).toString()).toBe('26000');
+      expect(rows(results[2])).toEqual([[Buffer.from([0])]]);
+      expect(rows(results[3])).toEqual([]);
+      expect(rows(results[4])).toEqual([]);
+    } finally {
+      conn.end();
+      await client.query(`UPDATE acl SET allowed = true WHERE user_id = 'u1' AND doc_id = 'd1'`);
+    }
+  });
+
+  it('should follow result column changes between executions', async (ctx) => {
+    if (!socketPath) ctx.skip();
+
+    await client.query('DROP TABLE IF EXISTS server_ddl');
+    await client.query('CREATE TABLE server_ddl (id int PRIMARY KEY, v int NOT NULL)');
+    await client.query('GRANT SELECT ON server_ddl TO PUBLIC');
+    await client.query('INSERT INTO server_ddl VALUES (1, 42)');
+
+    const conn = await ServerConnection.connect(socketPath);
+    try {
+      const prepared = await conn.prepare(1, [], 'SELECT * FROM server_ddl');
+      expect(prepared.type).toBe('K');
+      const executeNow = async () => {
+        const snap = await conn.snapshot(await currentSnapshot());
+        return conn.execute(snap.payload.readUInt32BE(0), 1, []);
+      };
+
+      const int4 = Buffer.alloc(4);
+      int4.writeInt32BE(42, 0);
+      expect(rows(await executeNow())).toEqual([[Buffer.from([0, 0, 0, 1]), int4]]);
+
+      // The plan is only revalidated inside the execution
+      await client.query('ALTER TABLE server_ddl ALTER COLUMN v TYPE text');
+      expect(rows(await executeNow())).toEqual([[Buffer.from([0, 0, 0, 1]), Buffer.from('42')]]);
+
+      await client.query(`ALTER TABLE server_ddl ADD COLUMN w text NOT NULL DEFAULT 'x'`);
+      expect(rows(await executeNow())).toEqual([
+        [Buffer.from([0, 0, 0, 1]), Buffer.from('42'), Buffer.from('x')],
+      ]);
+    } finally {
+      conn.end();
+      await client.query('DROP TABLE IF EXISTS server_ddl');
+    }
+  });
+
+  it('should only prepare SELECT queries', async (ctx) => {
+    if (!socketPath) ctx.skip();
+
+    const conn = await ServerConnection.connect(socketPath);
+    try {
+      const update = await conn.prepare(1, [], `UPDATE acl SET allowed = true`);
+      expect(update.type).toBe('E');
+      expect(update.payload.subarray(0, 5).toString()).toBe('0A000');
+
+      const ok = await conn.prepare(1, [], 'SELECT 1');
+      expect(ok.type).toBe('K');
+      const again = await conn.prepare(1, [], 'SELECT 1');
+      expect(again.type).toBe('E');
+      expect(again.payload.subarray(0, 5).toString()).toBe('42P05');
+    } finally {
+      conn.end();
+    }
+  });
+});
@@ -0,0 +1,78 @@
+import { bench, describe } from 'vitest';
+import { RingBuffer, SnapshotTracker } from './helpers/snapshot-tracker.js';
+
+/**
+ * Tracker throughput: each iteration replays 20k commits (one second of a
+ * 20k commits/s primary), so iterations/s >= 1 means the tracker keeps up.
+ *
+ *   cd test && npm run bench
+ */
+
+const COMMITS = 20_000;
+
+/** The previous per-commit algorithm: copy the Set, reduce twice, filter, sort */
+function naiveSnapshotAfterCommit(committedXid: bigint, inFlightXids: Set<bigint>): string {
+  const inFlightAfter = new Set(inFlightXids);
+  inFlightAfter.delete(committedXid);
+  const allXids = [committedXid, ...inFlightAfter];
+  const xmax = allXids.reduce((max, x) => (x > max ? x : max), 0n) + 1n;
+  const xmin =
+    inFlightAfter.size > 0
+      ? [...inFlightAfter].reduce((min, x) => (x < min ? x : min), BigInt(Number.MAX_SAFE_INTEGER))
+      : xmax;
+  const xip = [...inFlightAfter]
+    .filter((x) => x >= xmin && x < xmax)
+    .sort((a, b) => (a < b ? -1 : a > b ? 1 : 0));
+  return `${xmin}:${xmax}:${xip.join(',')}`;
+}
+
+/**
+ * Keep `inFlight` transactions open; every step commits one of them (mostly
+ * an old one, sometimes a random one) and begins a new one.
+ */
+function workload(inFlight: number, step: (begin: bigint | null, commit: bigint) => void) {
+  const open: bigint[] = [];
+  let next = 1000n;
+  for (let i = 0; i < inFlight; i++) {
+    open.push(next);
+    step(next++, -1n);
+  }
+  for (let i = 0; i < COMMITS; i++) {
+    const j = i % 4 === 0 ? (i * 7919) % open.length : 0;
+    const xid = open[j];
+    open.splice(j, 1);
+    open.push(next);
+    step(next++, xid);
+  }
+}
+
+for (const inFlight of [10, 100, 500]) {
+  describe(`${COMMITS} commits, ${inFlight} in flight`, () => {
+    bench('SnapshotTracker + RingBuffer', () => {
+      const tracker = new SnapshotTracker();
+      const history = new RingBuffer<string>(10000);
+      workload(inFlight, (begin, commit) => {
+        if (commit >= 0n) {
+          history.push(tracker.commit(commit));
+        }
+        if (begin !== null) {
+          tracker.begin(begin);
+        }
+      });
+    });
+
+    bench('naive Set rebuild per commit', () => {
+      const inFlightXids = new Set<bigint>();
+      const history: string[] = [];
+      workload(inFlight, (begin, commit) => {
+        if (commit >= 0n) {
+          history.push(naiveSnapshotAfterCommit(commit, inFlightXids));
+          inFlightXids.delete(commit);
+        }
+        if (begin !== null) {
+          inFlightXids.add(begin);
+        }
+      });
+    });
+  });
+}
@@ -0,0 +1,112 @@
+import { describe, it, expect } from 'vitest';
+import { RingBuffer, SnapshotTracker, SortedXidList } from './helpers/snapshot-tracker.js';
+
+/**
+ * Unit tests for the WAL tracker's snapshot bookkeeping (no database needed).
+ */
+describe('SnapshotTracker', () => {
+  /** Straightforward reference: rebuild the snapshot from a Set */
+  function referenceSnapshot(inFlight: Set<bigint>, maxXid: bigint): string {
+    const xip = [...inFlight].sort((a, b) => (a < b ? -1 : a > b ? 1 : 0));
+    const xmax = maxXid + 1n;
+    const xmin = xip.length > 0 ? xip[0] : xmax;
+    return `${xmin}:${xmax}:${xip.join(',')}`;
+  }
+
+  it('should emit the snapshot just after each commit', () => {
+    const tracker = new SnapshotTracker();
+    tracker.begin(100n);
+    tracker.begin(101n);
+    tracker.begin(102n);
+
+    expect(tracker.commit(101n)).toBe('100:103:100,102');
+    expect(tracker.commit(100n)).toBe('102:103:102');
+    expect(tracker.commit(102n)).toBe('103:103:');
+    expect(tracker.inFlightCount).toBe(0);
+  });
+
+  it('should keep xmax past commits that are no longer in flight', () => {
+    const tracker = new SnapshotTracker();
+    tracker.begin(10n);
+    tracker.begin(20n);
+    tracker.commit(20n);
+    // 20 committed first: a snapshot after 10 must still see it
+    expect(tracker.commit(10n)).toBe('21:21:');
+  });
+
+  it('should match the reference for random interleavings', () => {
+    let seed = 42;
+    const random = () => {
+      seed = (seed * 1103515245 + 12345) % 2 ** 31;
+      return seed / 2 ** 31;
+    };
+
+    const tracker = new SnapshotTracker();
+    const inFlight = new Set<bigint>();
+    let next = 1000n;
+    let maxXid = 0n;
+
+    for (let step = 0; step < 5000; step++) {
+      if (inFlight.size === 0 || random() < 0.5) {
+        // Occasionally begin out of order, as xids reach the WAL out of order
+        const xid = random() < 0.1 && next > 1010n ? next - BigInt(1 + Math.floor(random() * 5)) : next++;
+        if (inFlight.has(xid) || xid <= maxXid - 10n) {
+          continue;
+        }
+        tracker.begin(xid);
+        inFlight.add(xid);
+        maxXid = xid > maxXid ? xid : maxXid;
+      } else {
+        const xids = [...inFlight];
+        const xid = xids[Math.floor(random() * xids.length)];
+        inFlight.delete(xid);
+        expect(tracker.commit(xid)).toBe(referenceSnapshot(inFlight, maxXid));
+      }
+    }
+  });
+});
+
+describe('SortedXidList', () => {
+  it('should stay sorted and distinct', () => {
+    const list = new SortedXidList();
+    for (const xid of [5n, 1n, 9n, 3n, 9n, 7n]) {
+      list.add(xid);
+    }
+    expect([...list]).toEqual([1n, 3n, 5n, 7n, 9n]);
+    expect(list.delete(1n)).toBe(true);
+    expect(list.delete(7n)).toBe(true);
+    expect(list.delete(8n)).toBe(false);
+    expect(list.min()).toBe(3n);
+    expect(list.join()).toBe('3,5,9');
+  });
+
+  it('should compact after many removals from the front', () => {
+    const list = new SortedXidList();
+    for (let i = 0n; i < 5000n; i++) {
+      list.add(i);
+    }
+    for (let i = 0n; i < 4990n; i++) {
+      list.delete(i);
+    }
+    expect(list.size).toBe(10);
+    expect(list.min()).toBe(4990n);
+    expect(list.has(4995n)).toBe(true);
+  });
+});
+
+describe('RingBuffer', () => {
+  it('should keep the most recent items with absolute indexes', () => {
+    const ring = new RingBuffer<number>(3);
+    for (let i = 0; i < 5; i++) {
+      ring.push(i * 10);
+    }
+    expect(ring.length).toBe(5);
+    expect(ring.firstIndex).toBe(2);
+    expect(ring.at(1)).toBeUndefined();
+    expect(ring.at(2)).toBe(20);
+    expect(ring.at(4)).toBe(40);
+    expect(ring.at(5)).toBeUndefined();
+    expect([...ring]).toEqual([20, 30, 40]);
+    expect(ring.find((x) => x > 25)).toBe(30);
+  });
+});
@@ -0,0 +1,514 @@
+import { describe, it, expect, beforeAll, afterAll } from 'vitest';
+import { Client } from 'pg';
+import {
+  getLocalPostgresConfig,
+  createClient,
+  initializeDatabase,
+  PostgresConfig,
+} from './helpers/postgres.js';
+
+/**
+ * pg_stat_electric and friends.
+ *
+ * These require electric_poc in shared_preload_libraries (see README).
+ */
+describe('pg_stat_electric', () => {
+  let pgConfig: PostgresConfig;
+  let client: Client;
+
+  /** Current snapshot with xmax advanced so committed data is visible */
+  async function currentSnapshot(): Promise<string> {
+    const result = await client.query('SELECT pg_current_snapshot()::text as snapshot');
+    const parts = result.rows[0].snapshot.split(':');
+    return `${parseInt(parts[0])}:${parseInt(parts[1]) + 1}:`;
+  }
+
+  async function entry(name: string) {
+    const result = await client.query(
+      `SELECT * FROM pg_stat_electric WHERE entry_point = $1`,
+      [name]
+    );
+    return result.rows[0];
+  }
+
+  beforeAll(async () => {
+    pgConfig = getLocalPostgresConfig();
+    client = createClient(pgConfig);
+    await client.connect();
+    await initializeDatabase(client);
+  }, 30000);
+
+  afterAll(async () => {
+    if (client) {
+      await client.end();
+    }
+  });
+
+  it('should count electric_exec_as_of calls, rows and bytes', async () => {
+    await client.query('SELECT pg_stat_electric_reset()');
+    const snapshot = await currentSnapshot();
+
+    for (let i = 0; i < 3; i++) {
+      await client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT user_id, doc_id, allowed FROM acl', '[]'::jsonb)`,
+        [snapshot]
+      );
+    }
+
+    const stats = await entry('electric_exec_as_of');
+    expect(Number(stats.calls)).toBe(3);
+    expect(Number(stats.rows)).toBe(3);
+    expect(Number(stats.result_bytes)).toBeGreaterThan(0);
+    expect(Number(stats.xcnt_0)).toBe(3);
+    expect(stats.min_time).toBeLessThanOrEqual(stats.max_time);
+    expect(stats.total_time).toBeGreaterThanOrEqual(stats.max_time);
+  });
+
+  it('should count SET LOCAL electric.snapshot and queries run under it', async () => {
+    await client.query('SELECT pg_stat_electric_reset()');
+    const snapshot = await currentSnapshot();
+
+    await client.query('BEGIN ISOLATION LEVEL REPEATABLE READ');
+    await client.query(`SET LOCAL electric.snapshot = $1`, [snapshot]);
+    await client.query(`SELECT allowed FROM acl`);
+    await client.query('COMMIT');
+
+    const guc = await entry('electric_snapshot_assign_hook');
+    expect(Number(guc.calls)).toBe(1);
+    expect(guc.parse_time).toBeGreaterThan(0);
+
+    const executorStart = await entry('electric_ExecutorStart');
+    expect(Number(executorStart.calls)).toBeGreaterThanOrEqual(1);
+  });
+
+  it('should return per-phase timing in verbose mode', async () => {
+    await client.query('SELECT pg_stat_electric_reset()');
+    const snapshot = await currentSnapshot();
+
+    const result = await client.query(
+      `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT user_id, doc_id, allowed FROM acl', '[]'::jsonb, '{"verbose": true}'::jsonb) AS r`,
+      [snapshot]
+    );
+    const { rows, timing } = result.rows[0].r;
+    expect(rows).toEqual([{ user_id: 'u1', doc_id: 'd1', allowed: true }]);
+    for (const phase of ['parse_ms', 'plan_ms', 'execute_ms', 'serialize_ms', 'total_ms']) {
+      expect(timing[phase]).toBeGreaterThanOrEqual(0);
+    }
+    expect(timing.total_ms).toBeGreaterThanOrEqual(timing.plan_ms);
+
+    const phases = await client.query(`SELECT phase, calls FROM pg_stat_electric_phases`);
+    expect(phases.rows.map((r) => r.phase)).toEqual(['parse', 'plan', 'execute', 'serialize', 'total']);
+    for (const row of phases.rows) {
+      expect(Number(row.calls)).toBe(1);
+    }
+  });
+
+  it('should report the inner statement query id', async () => {
+    const snapshot = await currentSnapshot();
+    const queryId = async (sql: string, args: string) => {
+      const result = await client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, $2, $3::jsonb, '{"verbose": true}'::jsonb) AS r`,
+        [snapshot, sql, args]
+      );
+      return result.rows[0].r.query_id as string;
+    };
+
+    const a = await queryId('SELECT allowed FROM acl WHERE user_id = $1', '["u1"]');
+    const b = await queryId('SELECT allowed FROM acl WHERE user_id = $1', '["u2"]');
+    const c = await queryId('SELECT doc_id FROM acl WHERE user_id = $1', '["u1"]');
+
+    expect(a).not.toBe('0');
+    expect(b).toBe(a);
+    expect(c).not.toBe(a);
+  });
+
+  it('should bucket latency by snapshot age in Prometheus format', async () => {
+    await client.query('SELECT pg_stat_electric_reset()');
+    const snapshot = await currentSnapshot();
+
+    await client.query(
+      `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT allowed FROM acl', '[]'::jsonb)`,
+      [snapshot]
+    );
+
+    const result = await client.query(`SELECT pg_stat_electric_prometheus() AS metrics`);
+    const metrics: string = result.rows[0].metrics;
+    expect(metrics).toContain('# TYPE electric_exec_as_of_duration_seconds histogram');
+
+    // Exactly one call across all age bands
+    const counts = [...metrics.matchAll(/^electric_exec_as_of_duration_seconds_count\{snapshot_age="[^"]+"\} (\d+)$/gm)]
+      .map((m) => Number(m[1]));
+    expect(counts.length).toBe(8);
+    expect(counts.reduce((a, b) => a + b, 0)).toBe(1);
+    expect(metrics).toMatch(/^electric_calls_total\{entry_point="electric_exec_as_of"\} 1$/m);
+  });
+
+  it('should count dead versions stepped over (electric.track_scans)', async () => {
+    await client.query('DROP TABLE IF EXISTS scan_test');
+    await client.query('CREATE TABLE scan_test (id int PRIMARY KEY, v int NOT NULL)');
+    await client.query('ALTER TABLE scan_test SET (autovacuum_enabled = false)');
+    await client.query('INSERT INTO scan_test VALUES (1, 0)');
+    for (let v = 1; v <= 5; v++) {
+      await client.query('UPDATE scan_test SET v = $1 WHERE id = 1', [v]);
+    }
+
+    await client.query('SELECT pg_stat_electric_reset()');
+    await client.query('SET electric.track_scans = on');
+    try {
+      const snapshot = await currentSnapshot();
+      const asOf = async (sql: string) => {
+        const result = await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, $2, '["1"]'::jsonb, '{"verbose": true}'::jsonb) AS r`,
+          [snapshot, sql]
+        );
+        return result.rows[0].r;
+      };
+
+      // Seq scan: six versions of the row on one page, one visible
+      const seq = await asOf('SELECT v FROM scan_test WHERE id::text = $1');
+      expect(seq.rows).toEqual([{ v: 5 }]);
+      expect(seq.scans).toHaveLength(1);
+      expect(seq.scans[0].relation).toBe('public.scan_test');
+      expect(seq.scans[0].heap_pages).toBe(1);
+      expect(seq.scans[0].tuples_visible).toBe(1);
+      expect(seq.scans[0].tuples_examined).toBeGreaterThan(1);
+
+      // Index scan: the index points at the HOT chain root, v = 0, and the
+      // visible version is five updates down the chain
+      await client.query('SET enable_seqscan = off');
+      await client.query('SET enable_bitmapscan = off');
+      const idx = await asOf('SELECT v FROM scan_test WHERE id = $1::int');
+      expect(idx.rows).toEqual([{ v: 5 }]);
+      expect(idx.scans[0].tuples_visible).toBe(1);
+      expect(idx.scans[0].hot_hops).toBe(5);
+
+      const tables = await client.query(
+        `SELECT scans, tuples_invisible FROM pg_stat_electric_tables WHERE relname = 'scan_test'::regclass`
+      );
+      expect(Number(tables.rows[0].scans)).toBe(2);
+      expect(Number(tables.rows[0].tuples_invisible)).toBeGreaterThan(0);
+    } finally {
+      await client.query('RESET enable_seqscan');
+      await client.query('RESET enable_bitmapscan');
+      await client.query('RESET electric.track_scans');
+    }
+  });
+
+  it('should show the synthetic snapshot in pg_stat_electric_activity', async () => {
+    const snapshot = await currentSnapshot();
+    const pid = (await client.query('SELECT pg_backend_pid() AS pid')).rows[0].pid;
+    const activity = async () =>
+      (await client.query(`SELECT * FROM pg_stat_electric_activity WHERE pid = $1`, [pid])).rows;
+
+    await client.query('BEGIN ISOLATION LEVEL REPEATABLE READ');
+    await client.query(`SET LOCAL electric.snapshot = $1`, [snapshot]);
+    const rows = await activity();
+    await client.query('COMMIT');
+
+    expect(rows).toHaveLength(1);
+    expect(rows[0].source).toBe('snapshot_guc');
+    expect(`${rows[0].snapshot_xmin}:${rows[0].snapshot_xmax}:`).toBe(snapshot);
+    expect(Number(rows[0].snapshot_age)).toBeGreaterThanOrEqual(0);
+    expect(rows[0].wait_event).toBeNull();
+
+    expect(await activity()).toEqual([]);
+  });
+
+  it('should capture calls to electric.capture_file', async () => {
+    const file = 'electric_capture_test.bin';
+    const read = async (): Promise<Buffer> =>
+      (await client.query(`SELECT pg_read_binary_file($1, 0, 1 << 30, true) AS data`, [file])).rows[0]
+        .data ?? Buffer.alloc(0);
+    const before = (await read()).length;
+    const snapshot = await currentSnapshot();
+
+    await client.query(`SET electric.capture_file = '${file}'`);
+    try {
+      for (const userId of ['u1', 'nobody']) {
+        await client.query(
+          `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT allowed FROM acl WHERE user_id = $1', $2::jsonb)`,
+          [snapshot, JSON.stringify([userId])]
+        );
+      }
+    } finally {
+      await client.query('RESET electric.capture_file');
+    }
+
+    // Records: magic, length, start, duration_ns, rows, 3 lengths, flags, then the strings
+    const data = (await read()).subarray(before);
+    const records = [];
+    for (let off = 0; off < data.length; off += data.readUInt32BE(off + 4)) {
+      expect(data.readUInt32BE(off)).toBe(0x454c4352);
+      const [snapLen, sqlLen, argsLen] = [32, 36, 40].map((o) => data.readUInt32BE(off + o));
+      const body = off + 48;
+      records.push({
+        flags: data.readUInt32BE(off + 44),
+        durationNs: data.readBigInt64BE(off + 16),
+        rows: Number(data.readBigInt64BE(off + 24)),
+        snapshot: data.toString('utf8', body, body + snapLen),
+        sql: data.toString('utf8', body + snapLen, body + snapLen + sqlLen),
+        args: JSON.parse(data.toString('utf8', body + snapLen + sqlLen, body + snapLen + sqlLen + argsLen)),
+      });
+    }
+
+    expect(records).toHaveLength(2);
+    expect(records.map((r) => r.rows)).toEqual([1, 0]);
+    expect(records.map((r) => r.flags)).toEqual([0, 0]);
+    expect(records.map((r) => r.args)).toEqual([['u1'], ['nobody']]);
+    expect(records[0].snapshot).toBe(snapshot);
+    expect(records[0].sql).toBe('SELECT allowed FROM acl WHERE user_id = $1');
+    expect(records[0].durationNs).toBeGreaterThan(0n);
+  });
+
+  it('should reject unknown options', async () => {
+    const snapshot = await currentSnapshot();
+    await expect(
+      client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT 1', '[]'::jsonb, '{"verbos": true}'::jsonb)`,
+        [snapshot]
+      )
+    ).rejects.toThrow(/unrecognized option/);
+  });
+
+  it('should enforce resource limits with their own SQLSTATEs', async () => {
+    const asOf = (snapshot: string, sql: string, options: object) =>
+      client.query(`SELECT electric_exec_as_of($1::pg_snapshot, $2, '["1"]'::jsonb, $3::jsonb) AS r`, [
+        snapshot,
+        sql,
+        JSON.stringify(options),
+      ]);
+    const tenRows = 'SELECT g FROM generate_series(1, 10) g';
+    let snapshot = await currentSnapshot();
+
+    await expect(asOf(snapshot, tenRows, { max_rows: 5 })).rejects.toMatchObject({ code: '54L01' });
+    expect((await asOf(snapshot, tenRows, { max_rows: 10 })).rows[0].r).toHaveLength(10);
+    await expect(asOf(snapshot, tenRows, { max_result_bytes: 16 })).rejects.toMatchObject({ code: '54L02' });
+    await expect(asOf(snapshot, 'SELECT pg_sleep(5)', { max_elapsed_ms: 50 })).rejects.toMatchObject({
+      code: '57L01',
+    });
+
+    // Six versions of scan_test's row (previous test) are examined by a seq scan
+    await expect(
+      asOf(snapshot, 'SELECT v FROM scan_test WHERE id::text = $1', { max_tuples_examined: 2 })
+    ).rejects.toMatchObject({ code: '54L03' });
+
+    for (let i = 0; i < 3; i++) {
+      await client.query('SELECT pg_current_xact_id()');
+    }
+    await expect(asOf(snapshot, tenRows, { max_snapshot_age: 1 })).rejects.toMatchObject({ code: '54L04' });
+
+    // A setting can't be loosened by the option, and the session is usable after a timeout
+    snapshot = await currentSnapshot();
+    await client.query('SET electric.max_rows = 2');
+    try {
+      await expect(asOf(snapshot, tenRows, { max_rows: 100 })).rejects.toMatchObject({ code: '54L01' });
+      expect((await asOf(snapshot, 'SELECT 1 AS one', {})).rows[0].r).toEqual([{ one: 1 }]);
+    } finally {
+      await client.query('RESET electric.max_rows');
+    }
+
+    await expect(asOf(snapshot, tenRows, { max_rows: -1 })).rejects.toThrow(/must not be negative/);
+  });
+
+  it('should queue calls beyond electric.max_concurrent', async () => {
+    const other = createClient(pgConfig);
+    await other.connect();
+    const setMaxConcurrent = async (sql: string, expected: string) => {
+      await client.query(sql);
+      await client.query('SELECT pg_reload_conf()');
+      for (let i = 0; i < 100; i++) {
+        const values = await Promise.all(
+          [client, other].map(
+            async (cl) => (await cl.query(`SELECT current_setting('electric.max_concurrent') AS v`)).rows[0].v
+          )
+        );
+        if (values.every((v) => v === expected)) return;
+        await new Promise((resolve) => setTimeout(resolve, 50));
+      }
+      throw new Error('electric.max_concurrent was not reloaded');
+    };
+    const running = async () =>
+      Number((await client.query('SELECT coalesce(sum(running), 0) AS n FROM pg_stat_electric_admission')).rows[0].n);
+
+    await setMaxConcurrent('ALTER SYSTEM SET electric.max_concurrent = 1', '1');
+    try {
+      await client.query('SELECT pg_stat_electric_reset()');
+      const snapshot = await currentSnapshot();
+      const asOf = (cl: Client, sql: string) =>
+        cl.query(`SELECT electric_exec_as_of($1::pg_snapshot, $2, '[]'::jsonb) AS r`, [snapshot, sql]);
+
+      // Hold the only slot from another session
+      const holder = asOf(other, 'SELECT pg_sleep(1) IS NULL AS slept');
+      while ((await running()) === 0) {
+        await new Promise((resolve) => setTimeout(resolve, 10));
+      }
+
+      await client.query(`SET electric.admission_timeout = 100`);
+      await expect(asOf(client, 'SELECT 1 AS one')).rejects.toMatchObject({ code: '53L01' });
+      await client.query('RESET electric.admission_timeout');
+
+      // Without a timeout the call waits for the holder to finish
+      const waiter = await asOf(client, 'SELECT 1 AS one');
+      expect(waiter.rows[0].r).toEqual([{ one: 1 }]);
+      expect((await holder).rows[0].r).toEqual([{ slept: true }]);
+
+      const stats = (
+        await client.query(
+          `SELECT sum(running)::int AS running, sum(queued)::int AS queued, sum(admitted)::int AS admitted,
+                  sum(waited)::int AS waited, sum(timed_out)::int AS timed_out, max(max_wait_time) AS max_wait
+           FROM pg_stat_electric_admission`
+        )
+      ).rows[0];
+      expect(stats).toMatchObject({ running: 0, queued: 0, admitted: 2, waited: 1, timed_out: 1 });
+      expect(stats.max_wait).toBeGreaterThan(0);
+    } finally {
+      await client.query('RESET electric.admission_timeout');
+      await setMaxConcurrent('ALTER SYSTEM RESET electric.max_concurrent', '0');
+      await other.end();
+    }
+  });
+
+  it('should stop waiting for a running xid after electric.snapshot_wait_timeout', async () => {
+    const holder = createClient(pgConfig);
+    await holder.connect();
+    try {
+      await holder.query('BEGIN');
+      const xid = Number((await holder.query('SELECT txid_current()::text AS xid')).rows[0].xid);
+
+      // A snapshot that treats the holder's still-running xid as finished
+      await client.query('SET electric.snapshot_wait_timeout = 100');
+      await expect(
+        client.query(`SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT 1 AS one', '[]'::jsonb)`, [
+          `${xid}:${xid + 1}:`,
+        ])
+      ).rejects.toMatchObject({ code: '55L01' });
+    } finally {
+      await client.query('RESET electric.snapshot_wait_timeout');
+      await holder.query('ROLLBACK');
+      await holder.end();
+    }
+  });
+
+  it('should let identical concurrent calls share one execution (electric.coalesce)', async () => {
+    const other = createClient(pgConfig);
+    await other.connect();
+    try {
+      await client.query('SELECT pg_stat_electric_reset()');
+      for (const cl of [client, other]) {
+        await cl.query('SET electric.coalesce = on');
+      }
+      const snapshot = await currentSnapshot();
+      const sql = 'SELECT pg_sleep(0.5) IS NULL AS slept, clock_timestamp() AS at';
+      const asOf = (cl: Client) =>
+        cl.query(`SELECT electric_exec_as_of($1::pg_snapshot, $2, '[]'::jsonb) AS r`, [snapshot, sql]);
+      const coalesce = async () => (await client.query('SELECT * FROM pg_stat_electric_coalesce')).rows[0];
+
+      const leader = asOf(other);
+      while ((await coalesce()).in_flight === 0) {
+        await new Promise((resolve) => setTimeout(resolve, 10));
+      }
+      const follower = await asOf(client);
+
+      // Same clock_timestamp(): the query ran once
+      expect(follower.rows[0].r).toEqual((await leader).rows[0].r);
+      expect(await coalesce()).toMatchObject({ in_flight: 0, waiting: 0 });
+      const stats = await coalesce();
+      expect(Number(stats.executions)).toBe(1);
+      expect(Number(stats.coalesced)).toBe(1);
+      expect(Number((await entry('electric_exec_as_of_coalesced')).calls)).toBe(1);
+      expect(Number((await entry('electric_exec_as_of')).calls)).toBe(1);
+
+      // Done calls are not a cache
+      await asOf(client);
+      expect(Number((await coalesce()).executions)).toBe(2);
+
+      // A follower that waits too long runs the query itself
+      await client.query(`SET electric.coalesce_wait_timeout = '100ms'`);
+      const slowLeader = asOf(other);
+      while ((await coalesce()).in_flight === 0) {
+        await new Promise((resolve) => setTimeout(resolve, 10));
+      }
+      const gaveUp = await asOf(client);
+      expect(gaveUp.rows[0].r).not.toEqual((await slowLeader).rows[0].r);
+      expect(Number((await coalesce()).fallbacks)).toBe(1);
+      expect(await coalesce()).toMatchObject({ in_flight: 0, waiting: 0 });
+    } finally {
+      await client.query('RESET electric.coalesce');
+      await client.query('RESET electric.coalesce_wait_timeout');
+      await other.end();
+    }
+  });
+
+  it('should answer registered queries from precomputed results (electric.precompute_database)', async (ctx) => {
+    const enabled = await client.query(
+      `SELECT current_setting('electric.precompute_database') = current_database() AS on`
+    );
+    if (!enabled.rows[0].on) ctx.skip();
+
+    const sql = 'SELECT allowed FROM acl WHERE user_id = $1 AND doc_id = $2';
+    const args = JSON.stringify(['u1', 'd1']);
+    const id = (
+      await client.query(`SELECT electric_register_query($1, $2::jsonb) AS id`, [sql, args])
+    ).rows[0].id;
+    const stats = async () =>
+      (await client.query('SELECT * FROM pg_stat_electric_precompute WHERE query_id = $1', [id])).rows[0];
+    const asOf = async (snapshot: string) =>
+      (await client.query(`SELECT electric_exec_as_of($1::pg_snapshot, $2, $3::jsonb) AS r`, [snapshot, sql, args]))
+        .rows[0].r;
+    /** Take a snapshot, then finish a few xids so the worker can vouch for it */
+    const settledSnapshot = async () => {
+      const snapshot = await currentSnapshot();
+      for (let i = 0; i < 2; i++) await client.query('SELECT pg_current_xact_id()');
+      return snapshot;
+    };
+    const untilHit = async (snapshot: string) => {
+      for (let i = 0; i < 200; i++) {
+        const before = Number((await stats())?.hits ?? 0);
+        const r = await asOf(snapshot);
+        if (Number((await stats())?.hits ?? 0) > before) return r;
+        await new Promise((resolve) => setTimeout(resolve, 25));
+      }
+      throw new Error('no precomputed result was used');
+    };
+
+    try {
+      const s1 = await settledSnapshot();
+      expect(await untilHit(s1)).toEqual([{ allowed: true }]);
+      const recomputes = Number((await stats()).recomputes);
+
+      // Answered calls are accounted under their own entry point
+      const answered = await entry('electric_exec_as_of_precomputed');
+      const hits = Number((await stats()).hits);
+      await asOf(s1);
+      expect(Number((await stats()).hits)).toBe(hits + 1);
+      const precomputed = await entry('electric_exec_as_of_precomputed');
+      expect(Number(precomputed.calls)).toBe(Number(answered.calls) + 1);
+      expect(Number(precomputed.rows)).toBe(Number(answered.rows) + 1);
+
+      await client.query(`UPDATE acl SET allowed = false WHERE user_id = 'u1' AND doc_id = 'd1'`);
+      const s2 = await settledSnapshot();
+      expect(await untilHit(s2)).toEqual([{ allowed: false }]);
+      expect(Number((await stats()).recomputes)).toBe(recomputes + 1);
+
+      // The older result still answers the older snapshot
+      expect(await untilHit(s1)).toEqual([{ allowed: true }]);
+
+      // A commit elsewhere carries the result forward
+      await client.query('CREATE TEMP TABLE precompute_other (x int)');
+      await client.query('INSERT INTO precompute_other VALUES (1)');
+      const s3 = await settledSnapshot();
+      expect(await untilHit(s3)).toEqual([{ allowed: false }]);
+      expect(Number((await stats()).recomputes)).toBe(recomputes + 1);
+    } finally {
+      await client.query(`UPDATE acl SET allowed = true WHERE user_id = 'u1' AND doc_id = 'd1'`);
+      await client.query('DROP TABLE IF EXISTS precompute_other');
+      await client.query('DELETE FROM electric_registered_queries WHERE id = $1', [id]);
+    }
+  });
+
+  it('should reset counters', async () => {
+    await client.query('SELECT pg_stat_electric_reset()');
+    const result = await client.query(`SELECT sum(calls)::int AS calls FROM pg_stat_electric`);
+    expect(result.rows[0].calls).toBe(0);
+  });
+});
@@ -159,4 +159,116 @@ describe('Vacuum-proof snapshot reads', () => {
     // 2. They haven't been vacuumed away
     // 3. Our as-of queries are reading these actual old tuple versions
   }, 30000);
+
+  it('should estimate versions retained only by a live snapshot', async () => {
+    const holder = createClient(pgConfig);
+    await holder.connect();
+    try {
+      // Pin the horizon with an open repeatable-read snapshot
+      await holder.query('BEGIN ISOLATION LEVEL REPEATABLE READ');
+      await holder.query('SELECT count(*) FROM version_test');
+      const holderPid = (await holder.query('SELECT pg_backend_pid() AS pid')).rows[0].pid;
+
+      for (let i = 0; i < 5; i++) {
+        await client.query(`UPDATE version_test SET version = version + 1 WHERE id = 1`);
+      }
+
+      const sample = await client.query(
+        `SELECT * FROM electric_retention_sample('version_test', 8)`
+      );
+      expect(Number(sample.rows[0].sampled_pages)).toBeGreaterThanOrEqual(1);
+      expect(Number(sample.rows[0].retained_tuples)).toBeGreaterThanOrEqual(5);
+      expect(Number(sample.rows[0].retained_bytes)).toBeGreaterThan(0);
+      expect(Number(sample.rows[0].reclaimable_bytes)).toBeGreaterThanOrEqual(
+        Number(sample.rows[0].retained_bytes)
+      );
+
+      // pgstat flushes n_dead_tup asynchronously; don't depend on it here
+      const report = await client.query(
+        `SELECT * FROM electric_retention_report(8) WHERE relname = 'version_test'::regclass`
+      );
+      if (report.rows.length > 0) {
+        expect(report.rows[0].pinned_by).toMatch(/^(backend|replication slot|prepared transaction)/);
+        console.log('Retention held by', report.rows[0].pinned_by, '- holder pid', holderPid);
+      }
+    } finally {
+      await holder.query('ROLLBACK');
+      await holder.end();
+    }
+  }, 30000);
+
+  it('should prune versions no registered snapshot needs', async () => {
+    const snapshotNow = async (): Promise<string> =>
+      (await client.query('SELECT pg_current_snapshot()::text AS snapshot')).rows[0].snapshot;
+    const versionAt = async (snapshot: string): Promise<number> => {
+      const result = await client.query(
+        `SELECT electric_exec_as_of($1::pg_snapshot, 'SELECT version FROM version_test WHERE id = 1', '[]'::jsonb)`,
+        [snapshot]
+      );
+      return result.rows[0].electric_exec_as_of[0].version;
+    };
+    const register = async (snapshot: string): Promise<string> =>
+      (await client.query('SELECT electric_register_snapshot($1) AS id', [snapshot])).rows[0].id;
+
+    const ids: string[] = [];
+    await client.query(`INSERT INTO electric_pruned_tables (relid) VALUES ('version_test')`);
+    try {
+      await client.query('UPDATE version_test SET version = 100 WHERE id = 1');
+      const keepA = await snapshotNow();
+      ids.push(await register(keepA));
+      for (let v = 101; v <= 103; v++) {
+        await client.query('UPDATE version_test SET version = $1 WHERE id = 1', [v]);
+      }
+      const keepB = await snapshotNow();
+      ids.push(await register(keepB));
+      for (let v = 104; v <= 106; v++) {
+        await client.query('UPDATE version_test SET version = $1 WHERE id = 1', [v]);
+      }
+
+      await client.query(`CALL electric_prune('version_test')`);
+
+      const stats = await client.query(
+        `SELECT * FROM electric_pruned_tables WHERE relid = 'version_test'::regclass`
+      );
+      console.log('Prune pass:', stats.rows[0]);
+      // 101, 102, 104 and 105 at least, plus what the earlier tests left behind
+      expect(
+        Number(stats.rows[0].tuples_removed) + Number(stats.rows[0].tuples_truncated)
+      ).toBeGreaterThanOrEqual(4);
+      expect(Number(stats.rows[0].bytes_freed)).toBeGreaterThan(0);
+
+      // Registered snapshots still read their versions
+      expect(await versionAt(keepA)).toBe(100);
+      expect(await versionAt(keepB)).toBe(103);
+      const current = await client.query('SELECT version FROM version_test WHERE id = 1');
+      expect(current.rows[0].version).toBe(106);
+
+      // keepA's xmin is behind the pass's horizon now
+      await client.query(`DELETE FROM electric_registered_snapshots WHERE id = $1`, [ids[0]]);
+      await expect(register(keepA)).rejects.toMatchObject({ code: '55000' });
+      // ... and reading at it unregistered is refused rather than wrong
+      await expect(versionAt(keepA)).rejects.toMatchObject({ code: '55000' });
+      // SET LOCAL itself succeeds, the transaction's first query is refused
+      await client.query('BEGIN ISOLATION LEVEL REPEATABLE READ');
+      try {
+        await client.query(`SET LOCAL electric.snapshot = $1`, [keepA]);
+        await expect(
+          client.query('SELECT version FROM version_test WHERE id = 1')
+        ).rejects.toMatchObject({ code: '55000' });
+      } finally {
+        await client.query('ROLLBACK');
+      }
+
+      // electric_prune_all() passes over every opted-in table
+      const before = stats.rows[0].last_pruned_at;
+      await client.query('CALL electric_prune_all()');
+      const after = await client.query(
+        `SELECT last_pruned_at FROM electric_pruned_tables WHERE relid = 'version_test'::regclass`
+      );
+      expect(after.rows[0].last_pruned_at.getTime()).toBeGreaterThan(before.getTime());
+    } finally {
+      await client.query('DELETE FROM electric_registered_snapshots WHERE id = ANY($1)', [ids]);
+      await client.query(`DELETE FROM electric_pruned_tables WHERE relid = 'version_test'::regclass`);
+    }
+  }, 30000);
 });